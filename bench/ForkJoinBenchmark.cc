@@ -0,0 +1,144 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * This benchmark measures a recursive fork-join fan-out in which every task
+ * fills a buffer for each of its two children, creates them, and joins them;
+ * each child reads its buffer before forking in turn. It runs the same
+ * workload with localPlacementThreshold disabled and enabled, so the cost of
+ * moving each buffer to another core can be read off the difference.
+ *
+ * Usage: ForkJoinBenchmark [Arachne options] [depth [trees [threshold
+ * [bufferSize]]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+#include "Arachne.h"
+#include "PerfUtils/Cycles.h"
+
+using PerfUtils::Cycles;
+
+namespace {
+
+/// Number of levels below the root of each tree.
+int depth = 8;
+
+/// Number of trees measured with each placement.
+int numTrees = 200;
+
+/// localPlacementThreshold used for the measurement with local placement.
+uint32_t threshold = 8;
+
+/// Number of bytes each task hands to each of its children.
+size_t bufferSize = 8192;
+
+/// Keeps the compiler from discarding the reads of the buffers.
+std::atomic<uint64_t> checksum;
+
+void forkJoin(int level, const char* buffer);
+
+/**
+ * Fill a buffer for a child and run the child as its own thread, or in place
+ * if no thread can be created.
+ */
+Arachne::ThreadId
+fork(int level, std::vector<char>* buffer) {
+    memset(buffer->data(), level, buffer->size());
+    Arachne::ThreadId id =
+        Arachne::createThread(forkJoin, level, buffer->data());
+    if (id == Arachne::NullThread)
+        forkJoin(level, buffer->data());
+    return id;
+}
+
+/**
+ * Read the buffer filled in by the parent, then fork and join two children
+ * unless this is a leaf.
+ */
+void
+forkJoin(int level, const char* buffer) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i + sizeof(uint64_t) <= bufferSize;
+         i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buffer + i, sizeof(word));
+        sum += word;
+    }
+    checksum += sum;
+    if (level == 0)
+        return;
+    std::vector<char> left(bufferSize), right(bufferSize);
+    Arachne::ThreadId leftId = fork(level - 1, &left);
+    Arachne::ThreadId rightId = fork(level - 1, &right);
+    if (leftId != Arachne::NullThread)
+        Arachne::join(leftId);
+    if (rightId != Arachne::NullThread)
+        Arachne::join(rightId);
+}
+
+/**
+ * Run numTrees trees with the given placement threshold and return the
+ * average time per task in nanoseconds.
+ */
+double
+measure(uint32_t placementThreshold) {
+    Arachne::localPlacementThreshold = placementThreshold;
+    std::vector<char> root(bufferSize);
+    uint64_t numTasks = (2UL << depth) - 1;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < numTrees; i++) {
+        memset(root.data(), i, root.size());
+        forkJoin(depth, root.data());
+    }
+    uint64_t elapsed = Cycles::rdtsc() - start;
+    return static_cast<double>(Cycles::toNanoseconds(elapsed)) /
+           static_cast<double>(numTasks * static_cast<uint64_t>(numTrees));
+}
+
+void
+benchmarkMain() {
+    // Touch the stacks on every core before measuring.
+    measure(0);
+    printf("depth %d, %d trees, %lu-byte buffers\n", depth, numTrees,
+           bufferSize);
+    printf("two random choices:          %8.1f ns per task\n", measure(0));
+    printf("localPlacementThreshold %3u: %8.1f ns per task\n", threshold,
+           measure(threshold));
+    printf("checksum %lu\n", checksum.load());
+    Arachne::shutDown();
+}
+
+}  // namespace
+
+int
+main(int argc, const char** argv) {
+    Arachne::init(&argc, argv);
+    if (argc > 1)
+        depth = atoi(argv[1]);
+    if (argc > 2)
+        numTrees = atoi(argv[2]);
+    if (argc > 3)
+        threshold = static_cast<uint32_t>(atoi(argv[3]));
+    if (argc > 4)
+        bufferSize = static_cast<size_t>(atol(argv[4]));
+    Arachne::createThread(benchmarkMain);
+    Arachne::waitForTermination();
+    return 0;
+}
@@ -0,0 +1,404 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * This benchmark measures the latency of the operations on Arachne's hot
+ * paths: thread creation, signal() until the signaled thread runs, a yield()
+ * round trip, join(), SleepLock hand-off, ConditionVariable ping-pong, and
+ * migrating the threads off a core that is being released. Each operation is
+ * measured on one core and, where it makes sense, from one core to another,
+ * while every core also runs a varying number of yielding background threads.
+ * It reports percentiles of each latency in nanoseconds.
+ *
+ * It uses cores 0 and 1, and keeps the number of cores fixed.
+ *
+ * Usage: MicroBenchmark [Arachne options] [samples]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "Arachne.h"
+#include "PerfUtils/Cycles.h"
+
+using PerfUtils::Cycles;
+
+namespace Arachne {
+// Not part of the API; the benchmark drives a core's ramp-down directly.
+void removeThreadsFromCore(CoreList* outputCores);
+}
+
+namespace {
+
+/// Number of measurements of each operation.
+int numSamples = 10000;
+
+/// Numbers of yielding background threads per core to measure with.
+const int backgroundLoads[] = {0, 4, 16};
+
+/// Numbers of threads per core to migrate during ramp-down measurements.
+const int rampDownSizes[] = {1, 8, 32};
+
+/// Time given to a thread on another core to block after announcing that
+/// it is about to, so that it is measured from the blocked state.
+const uint64_t SETTLE_NS = 2000;
+
+/// Set to stop the background threads, and the threads of some benchmarks.
+std::atomic<bool> stop;
+
+/// Number of helper threads that have finished.
+std::atomic<int> numFinished;
+
+/// Timestamps and handshakes shared with the threads being measured. In
+/// round i the helper thread sets ready to 2i + 1 just before it waits, and
+/// to 2i + 2 once it has been woken.
+std::atomic<uint64_t> timestamp;
+std::atomic<int> ready;
+std::atomic<int> round;
+
+Arachne::SleepLock sleepLock;
+Arachne::SpinLock pingPongLock("pingpong", false);
+Arachne::ConditionVariable pingPongCondition;
+int turn;
+
+/**
+ * Print the percentiles of a latency distribution.
+ *
+ * \param name
+ *     What was measured.
+ * \param samples
+ *     The latencies in cycles; sorted by this function.
+ */
+void
+report(const char* name, std::vector<uint64_t>* samples) {
+    std::sort(samples->begin(), samples->end());
+    auto ns = [samples](double fraction) {
+        size_t index = static_cast<size_t>(
+            fraction * static_cast<double>(samples->size() - 1));
+        return Cycles::toNanoseconds((*samples)[index]);
+    };
+    printf("%-36s %8lu %8lu %8lu %8lu %8lu %8lu\n", name, samples->size(),
+           ns(0), ns(0.5), ns(0.9), ns(0.99), ns(1));
+    fflush(stdout);
+}
+
+/**
+ * Wait until pred returns true, letting the other threads on this core run.
+ */
+template <typename Pred>
+void
+yieldUntil(Pred pred) {
+    while (!pred())
+        Arachne::yield();
+}
+
+/**
+ * Spin for the given number of nanoseconds without giving up the core.
+ */
+void
+spinFor(uint64_t ns) {
+    uint64_t end = Cycles::rdtsc() + Cycles::fromNanoseconds(ns);
+    while (Cycles::rdtsc() < end) {
+    }
+}
+
+void
+backgroundThread() {
+    while (!stop)
+        Arachne::yield();
+    numFinished++;
+}
+
+void
+recordTimestamp() {
+    timestamp = Cycles::rdtsc();
+}
+
+/**
+ * Measure the time from calling createThreadOnCore until the new thread
+ * runs.
+ */
+void
+benchCreate(const char* name, int coreId) {
+    std::vector<uint64_t> samples;
+    for (int i = 0; i < numSamples; i++) {
+        uint64_t start = Cycles::rdtsc();
+        Arachne::ThreadId id =
+            Arachne::createThreadOnCore(coreId, recordTimestamp);
+        Arachne::join(id);
+        samples.push_back(timestamp - start);
+    }
+    report(name, &samples);
+}
+
+/**
+ * Measure the time from calling join() on a thread that is about to exit
+ * until join() returns.
+ */
+void
+benchJoin(const char* name, int coreId) {
+    std::vector<uint64_t> samples;
+    for (int i = 0; i < numSamples; i++) {
+        Arachne::ThreadId id =
+            Arachne::createThreadOnCore(coreId, recordTimestamp);
+        Arachne::join(id);
+        samples.push_back(Cycles::rdtsc() - timestamp);
+    }
+    report(name, &samples);
+}
+
+std::vector<uint64_t> wakeups;
+
+void
+signaledThread() {
+    for (int i = 0; i < numSamples; i++) {
+        ready = 2 * i + 1;
+        Arachne::block();
+        wakeups[i] = Cycles::rdtsc();
+        ready = 2 * i + 2;
+    }
+    numFinished++;
+}
+
+/**
+ * Measure the time from signal() until the signaled thread runs.
+ */
+void
+benchSignal(const char* name, int coreId, bool crossCore) {
+    wakeups.assign(numSamples, 0);
+    std::vector<uint64_t> samples;
+    numFinished = 0;
+    ready = 0;
+    Arachne::ThreadId waiter =
+        Arachne::createThreadOnCore(coreId, signaledThread);
+    for (int i = 0; i < numSamples; i++) {
+        yieldUntil([i]() { return ready == 2 * i + 1; });
+        if (crossCore)
+            spinFor(SETTLE_NS);
+        uint64_t start = Cycles::rdtsc();
+        Arachne::signal(waiter);
+        yieldUntil([i]() { return ready >= 2 * i + 2; });
+        samples.push_back(wakeups[i] - start);
+    }
+    yieldUntil([]() { return numFinished == 1; });
+    report(name, &samples);
+}
+
+/**
+ * Measure a yield() round trip on a core that runs the background threads.
+ */
+void
+benchYield(const char* name) {
+    std::vector<uint64_t> samples;
+    for (int i = 0; i < numSamples; i++) {
+        uint64_t start = Cycles::rdtsc();
+        Arachne::yield();
+        samples.push_back(Cycles::rdtsc() - start);
+    }
+    report(name, &samples);
+}
+
+void
+sleepLockContender() {
+    for (int i = 0; i < numSamples; i++) {
+        yieldUntil([i]() { return round == i + 1; });
+        ready = 2 * i + 1;
+        sleepLock.lock();
+        wakeups[i] = Cycles::rdtsc();
+        sleepLock.unlock();
+        ready = 2 * i + 2;
+    }
+    numFinished++;
+}
+
+/**
+ * Measure the time from releasing a SleepLock until a thread waiting for it
+ * holds it.
+ */
+void
+benchSleepLock(const char* name, int coreId, bool crossCore) {
+    wakeups.assign(numSamples, 0);
+    std::vector<uint64_t> samples;
+    numFinished = 0;
+    ready = 0;
+    round = 0;
+    Arachne::createThreadOnCore(coreId, sleepLockContender);
+    for (int i = 0; i < numSamples; i++) {
+        sleepLock.lock();
+        round = i + 1;
+        yieldUntil([i]() { return ready == 2 * i + 1; });
+        if (crossCore)
+            spinFor(SETTLE_NS);
+        uint64_t start = Cycles::rdtsc();
+        sleepLock.unlock();
+        yieldUntil([i]() { return ready == 2 * i + 2; });
+        samples.push_back(wakeups[i] - start);
+    }
+    yieldUntil([]() { return numFinished == 1; });
+    report(name, &samples);
+}
+
+void
+pingPongPartner() {
+    std::unique_lock<Arachne::SpinLock> guard(pingPongLock);
+    for (int i = 0; i < numSamples; i++) {
+        while (turn != 1)
+            pingPongCondition.wait(guard);
+        turn = 0;
+        pingPongCondition.notifyOne();
+    }
+    guard.unlock();
+    numFinished++;
+}
+
+/**
+ * Measure a round trip between two threads that take turns through a
+ * ConditionVariable.
+ */
+void
+benchConditionVariable(const char* name, int coreId) {
+    std::vector<uint64_t> samples;
+    numFinished = 0;
+    turn = 0;
+    Arachne::createThreadOnCore(coreId, pingPongPartner);
+    std::unique_lock<Arachne::SpinLock> guard(pingPongLock);
+    for (int i = 0; i < numSamples; i++) {
+        uint64_t start = Cycles::rdtsc();
+        turn = 1;
+        pingPongCondition.notifyOne();
+        while (turn != 0)
+            pingPongCondition.wait(guard);
+        samples.push_back(Cycles::rdtsc() - start);
+    }
+    guard.unlock();
+    yieldUntil([]() { return numFinished == 1; });
+    report(name, &samples);
+}
+
+std::vector<uint64_t> rampDownSamples;
+
+void
+waitForStop() {
+    while (!ready)
+        Arachne::yield();
+    numFinished++;
+}
+
+/**
+ * Runs on core 1: create threads on this core, then migrate them all to core
+ * 0 as a core release would.
+ */
+void
+rampDownCore(int numThreads) {
+    for (int i = 0; i < numThreads; i++)
+        Arachne::createThreadOnCore(1, waitForStop);
+    Arachne::CoreList outputCores(1);
+    outputCores.add(0);
+    uint64_t start = Cycles::rdtsc();
+    Arachne::removeThreadsFromCore(&outputCores);
+    rampDownSamples.push_back(Cycles::rdtsc() - start);
+
+    // Let creations onto this core resume; the release was not real.
+    for (int g = 0; g < Arachne::numContextGroups; g++) {
+        Arachne::MaskAndCount slotMap =
+            Arachne::core.localOccupiedAndCount[g];
+        slotMap.numOccupied =
+            static_cast<uint8_t>(__builtin_popcountll(slotMap.occupied));
+        Arachne::core.localOccupiedAndCount[g] = slotMap;
+    }
+}
+
+/**
+ * Measure how long removeThreadsFromCore takes to move the given number of
+ * threads off a core.
+ */
+void
+benchRampDown(const char* name, int numThreads) {
+    rampDownSamples.clear();
+    int numRounds = std::max(1, numSamples / 100);
+    for (int i = 0; i < numRounds; i++) {
+        ready = 0;
+        numFinished = 0;
+        Arachne::join(Arachne::createThreadOnCore(1, rampDownCore, numThreads));
+        ready = 1;
+        yieldUntil(
+            [numThreads]() { return numFinished == numThreads; });
+    }
+    report(name, &rampDownSamples);
+}
+
+void
+benchmarkMain() {
+    printf("%-36s %8s %8s %8s %8s %8s %8s\n", "latency in ns", "samples",
+           "min", "p50", "p90", "p99", "max");
+    for (int load : backgroundLoads) {
+        printf("-- %d yielding background threads per core\n", load);
+        stop = false;
+        numFinished = 0;
+        for (int coreId = 0; coreId < 2; coreId++)
+            for (int i = 0; i < load; i++)
+                Arachne::createThreadOnCore(coreId, backgroundThread);
+
+        benchCreate("createThread, same core", 0);
+        benchCreate("createThread, cross core", 1);
+        benchSignal("signal to run, same core", 0, false);
+        benchSignal("signal to run, cross core", 1, true);
+        benchYield("yield round trip");
+        benchJoin("join, same core", 0);
+        benchJoin("join, cross core", 1);
+        benchSleepLock("SleepLock hand-off, same core", 0, false);
+        benchSleepLock("SleepLock hand-off, cross core", 1, true);
+        benchConditionVariable("ConditionVariable ping-pong, same", 0);
+        benchConditionVariable("ConditionVariable ping-pong, cross", 1);
+
+        numFinished = 0;
+        stop = true;
+        yieldUntil([load]() { return numFinished == 2 * load; });
+    }
+
+    // A ramp-down would move the background threads too, so it is measured
+    // on its own, with the number of threads on the core varied instead.
+    printf("-- no background threads\n");
+    for (int size : rampDownSizes) {
+        char name[64];
+        snprintf(name, sizeof(name), "ramp-down, %d threads", size);
+        benchRampDown(name, size);
+    }
+    Arachne::shutDown();
+}
+
+}  // namespace
+
+int
+main(int argc, const char** argv) {
+    // Measure on a fixed pair of cores unless told otherwise.
+    Arachne::minNumCores = 2;
+    Arachne::maxNumCores = 2;
+    Arachne::disableLoadEstimation = true;
+    Arachne::init(&argc, argv);
+    if (argc > 1)
+        numSamples = atoi(argv[1]);
+    if (Arachne::maxNumCores < 2) {
+        fprintf(stderr, "MicroBenchmark needs at least two cores\n");
+        return 1;
+    }
+    Arachne::createThreadOnCore(0, benchmarkMain);
+    Arachne::waitForTermination();
+    return 0;
+}
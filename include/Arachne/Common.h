@@ -0,0 +1,271 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ARACHNE_COMMON_H
+#define ARACHNE_COMMON_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include "PriorityScheduler.h"
+#include "TimerWheel.h"
+
+namespace Arachne {
+
+#define CACHE_LINE_SIZE 64
+#define PAGE_SIZE 4096
+
+// The following macros issue hints to the compiler that a particular branch is
+// more likely than another.
+#ifdef __GNUC__
+// Note that the double negation here is used for coercion to the boolean type.
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define likely(x) (x)
+#define unlikely(x) (x)
+#endif
+
+#ifndef ARACHNE_MAX_THREADS_PER_CORE
+#define ARACHNE_MAX_THREADS_PER_CORE 56
+#endif
+
+// Largest number of Arachne threads that can be simultaneously created on each
+// core. Arachne and all code that includes its headers must be built with the
+// same value of ARACHNE_MAX_THREADS_PER_CORE to change it.
+const int maxThreadsPerCore = ARACHNE_MAX_THREADS_PER_CORE;
+static_assert(maxThreadsPerCore > 0 && maxThreadsPerCore < 256,
+              "ThreadContext::idInCore must fit in a uint8_t");
+
+// The contexts on each core are divided into groups of this many, which is
+// the number that fit in the occupied mask of a MaskAndCount. Each group is
+// tracked by a single word in every per-core mask, so that with the default
+// maxThreadsPerCore all of them remain single words updated with one atomic
+// operation.
+const int threadsPerContextGroup = 56;
+
+// Number of context groups on each core.
+const int numContextGroups =
+    (maxThreadsPerCore + threadsPerContextGroup - 1) / threadsPerContextGroup;
+
+/**
+ * Return the context group holding the context with the given idInCore.
+ */
+inline int
+contextGroupOf(int idInCore) {
+    return numContextGroups == 1 ? 0 : idInCore / threadsPerContextGroup;
+}
+
+/**
+ * Return the position of the context with the given idInCore within its
+ * context group.
+ */
+inline uint8_t
+indexInGroup(int idInCore) {
+    return static_cast<uint8_t>(numContextGroups == 1
+                                    ? idInCore
+                                    : idInCore % threadsPerContextGroup);
+}
+
+/**
+ * Return the bit standing for the context with the given idInCore in the
+ * masks of its context group.
+ */
+inline uint64_t
+contextBit(int idInCore) {
+    return 1UL << indexInGroup(idInCore);
+}
+
+/**
+ * Return the idInCore of the first context in the given group.
+ */
+inline int
+firstContextInGroup(int group) {
+    return group * threadsPerContextGroup;
+}
+
+/**
+ * Return the number of contexts in the given group; only the last group can
+ * hold fewer than threadsPerContextGroup.
+ */
+inline int
+contextGroupSize(int group) {
+    return group == numContextGroups - 1
+               ? maxThreadsPerCore - firstContextInGroup(group)
+               : threadsPerContextGroup;
+}
+
+struct ThreadContext;
+struct MaskAndCount;
+
+/**
+ * The scheduling state that a core keeps for one of its context groups. Bit
+ * i of each mask stands for the context with indexInGroup i, and the timer
+ * wheel and priority scheduler identify contexts the same way.
+ */
+struct ContextGroup {
+    /**
+     * This represents the group's local copy of the high-priority mask. Each
+     * call to dispatch() will first examine this bitmask. It will clear the
+     * first set bit and switch to that context. If there are no set bits, it
+     * will copy the current value of publicPriorityMasks for the group to
+     * here, and then atomically clear those bits using an atomic OR.
+     *
+     * When ramping down cores, this value (if nonzero) should be cleared,
+     * since all non-terminated threads on this core will be migrated away
+     * from this thread.
+     */
+    uint64_t privatePriorityMask;
+
+    /**
+     * The contexts that dispatch() still has to check in the current pass.
+     * Bits are moved here from the group's word of localRunnableMask once per
+     * pass; a set bit only means that the context may be runnable, so
+     * dispatch() verifies wakeupTimeInCycles before switching to it.
+     */
+    uint64_t privateRunnableMask;
+
+    /**
+     * The contexts that are sleeping until a deadline in their
+     * wakeupTimeInCycles. dispatch() advances this wheel once per pass and
+     * moves the contexts whose deadline has passed to privateRunnableMask.
+     */
+    TimerWheel timerWheel;
+
+    /**
+     * Tracks the priority level of each context in the group; the level
+     * served by each pass of dispatch() is chosen for all of the core's
+     * groups at once by Core::priorityScheduler. Only consulted once some
+     * thread has been given a priority other than 0.
+     */
+    PriorityScheduler priorityScheduler;
+
+    /**
+     * The contexts that belong to the level served by the current pass of
+     * dispatch(); only meaningful while priorityLevelsInUse is set.
+     */
+    uint64_t passMask = ~0UL;
+
+    /**
+     * Each bit corresponds to a context whose thread has exited but whose
+     * stack pages are still resident. Used to decide when an exiting thread
+     * should return its stack memory to the kernel.
+     */
+    uint64_t residentIdleStacks;
+};
+
+/**
+ * This class holds all the state associated with a particular core in Arachne.
+ */
+struct Core {
+    /**
+     * Alert the kernel thread that cleanup is complete and it should block for
+     * ramp-down.
+     */
+    bool threadShouldYield;
+
+    /**
+     * This pointer allows fast access to the current kernel thread's
+     * localThreadContexts without computing an offset from the global
+     * allThreadContexts vector on each access.
+     */
+    ThreadContext** localThreadContexts;
+
+    /**
+     * Holds the identifier for the thread in which it is stored: allows each
+     * kernel thread to identify itself. This should eventually become a
+     * coreId, when we support multiple kernel threads per core to handle
+     * blocking system calls.
+     */
+    int kernelThreadId = -1;
+
+    /**
+     * This is the context that a given kernel thread is currently executing.
+     */
+    ThreadContext* loadedContext;
+
+    /**
+     * Points at this core's element of occupiedAndCount, which holds one
+     * MaskAndCount for each context group.
+     */
+    std::atomic<MaskAndCount>* localOccupiedAndCount;
+
+    /**
+     * A bit is set to prevent migration; this should be set before the
+     * occupied flag is cleared. Holds one word for each context group.
+     */
+    std::atomic<uint64_t>* localPinnedContexts;
+
+    /**
+     * Points at this core's element of runnableMasks, which holds one word
+     * for each context group. Other cores set a bit here when they make one
+     * of this core's contexts runnable.
+     */
+    std::atomic<uint64_t>* localRunnableMask;
+
+    /**
+     * Points at this core's element of quiescentEpochs, which dispatch()
+     * updates once per pass.
+     */
+    std::atomic<uint64_t>* localQuiescentEpoch;
+
+    /**
+     * The time in cycles at which dispatch() last found no runnable thread
+     * after finding some, or 0 if its last pass found one; see
+     * parkAfterIdleNs.
+     */
+    uint64_t idleSinceCycles;
+
+    /**
+     * The scheduling state of each of this core's context groups.
+     */
+    ContextGroup groups[numContextGroups];
+
+    /**
+     * Chooses the priority level served by each pass of dispatch(), which is
+     * the same in every context group, so that a pass never runs threads of
+     * a less important level in one group while threads of a more important
+     * level wait in another.
+     */
+    PriorityScheduler priorityScheduler;
+
+    /**
+     * The context group and the index within it of the context that this
+     * kernel thread will check first the next time it looks for a thread to
+     * run. They are used to implement round-robin scheduling of Arachne
+     * threads; each pass visits the groups in order.
+     */
+    uint8_t nextCandidateGroup = 0;
+    uint8_t nextCandidateIndex = 0;
+
+    /**
+     * The core this core has asked for work while work stealing is enabled,
+     * or -1 if it has no outstanding request.
+     */
+    int stealVictim = -1;
+
+    /**
+     * The time in cycles at which the outstanding steal request was made.
+     */
+    uint64_t stealRequestTime;
+};
+
+void* alignedAlloc(size_t size, size_t alignment = CACHE_LINE_SIZE);
+void* allocateStack(size_t size);
+void releaseStack(void* stack, size_t size);
+void trimStack(void* stack, void* end);
+}  // namespace Arachne
+
+#endif
@@ -0,0 +1,311 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FUTURE_H_
+#define FUTURE_H_
+
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include "Arachne.h"
+
+namespace Arachne {
+
+/**
+ * Storage for a value that is produced once and consumed once, constructed
+ * in place so that T need not be default-constructible.
+ */
+template <typename T>
+class FutureValue {
+  public:
+    FutureValue() : storage(), hasValue(false) {}
+    ~FutureValue() {
+        if (hasValue)
+            get()->~T();
+    }
+
+    /**
+     * Construct the value from the given arguments.
+     */
+    template <typename... Args>
+    void
+    emplace(Args&&... args) {
+        new (&storage) T(std::forward<Args>(args)...);
+        hasValue = true;
+    }
+
+    /**
+     * Construct the value from the result of invoking f with args.
+     */
+    template <typename Callable, typename... Args>
+    void
+    emplaceResult(Callable& f, Args&... args) {
+        new (&storage) T(f(args...));
+        hasValue = true;
+    }
+
+    /**
+     * Move the value out, leaving this object empty.
+     */
+    T
+    take() {
+        T value(std::move(*get()));
+        get()->~T();
+        hasValue = false;
+        return value;
+    }
+
+  private:
+    T*
+    get() {
+        return reinterpret_cast<T*>(&storage);
+    }
+
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    bool hasValue;
+    DISALLOW_COPY_AND_ASSIGN(FutureValue);
+};
+
+template <>
+class FutureValue<void> {
+  public:
+    FutureValue() {}
+    void
+    emplace() {}
+    template <typename Callable, typename... Args>
+    void
+    emplaceResult(Callable& f, Args&... args) {
+        f(args...);
+    }
+    void
+    take() {}
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(FutureValue);
+};
+
+/**
+ * The state shared by a Promise and its Future. It is freed by whichever of
+ * the two lets go of it last.
+ */
+template <typename T>
+struct FutureState {
+    FutureState()
+        : lock("future", false), readyCondition(), ready(false), value(),
+          refs(1) {}
+
+    /// Protects ready and readyCondition.
+    SpinLock lock;
+
+    /// Threads waiting for ready to be set.
+    ConditionVariable readyCondition;
+
+    /// Set once value holds the result.
+    bool ready;
+
+    /// The result, once ready is set.
+    FutureValue<T> value;
+
+    /// The number of Promise and Future objects referring to this state.
+    std::atomic<int> refs;
+
+    /**
+     * Drop a reference, freeing the state if it was the last one.
+     */
+    void
+    release() {
+        if (--refs == 0)
+            delete this;
+    }
+};
+
+template <typename T>
+class Promise;
+
+/**
+ * A value that another thread will produce; obtained from a Promise.
+ * Waiting for the value blocks only the calling Arachne thread.
+ *
+ * \tparam T
+ *     The type of the value, or void if the future only signals that some
+ *     work has finished.
+ */
+template <typename T>
+class Future {
+  public:
+    /// Construct a Future that refers to no value.
+    Future() : state(NULL) {}
+
+    Future(Future&& other) : state(other.state) { other.state = NULL; }
+
+    Future&
+    operator=(Future&& other) {
+        if (this != &other) {
+            if (state != NULL)
+                state->release();
+            state = other.state;
+            other.state = NULL;
+        }
+        return *this;
+    }
+
+    ~Future() {
+        if (state != NULL)
+            state->release();
+    }
+
+    /**
+     * Return true if this Future refers to a value that has not been
+     * retrieved with get().
+     */
+    bool
+    valid() const {
+        return state != NULL;
+    }
+
+    /**
+     * Return true if the value is available, so that get() will not block.
+     */
+    bool
+    isReady() {
+        std::lock_guard<SpinLock> guard(state->lock);
+        return state->ready;
+    }
+
+    /**
+     * Block the current thread until the value is available.
+     */
+    void
+    wait() {
+        std::unique_lock<SpinLock> guard(state->lock);
+        while (!state->ready)
+            state->readyCondition.wait(guard);
+    }
+
+    /**
+     * Block the current thread until the value is available or ns nanoseconds
+     * have passed.
+     *
+     * \return
+     *     True if the value is available.
+     */
+    bool
+    waitFor(uint64_t ns) {
+        uint64_t deadline = Cycles::rdtsc() + Cycles::fromNanoseconds(ns);
+        std::unique_lock<SpinLock> guard(state->lock);
+        while (!state->ready && Cycles::rdtsc() < deadline)
+            state->readyCondition.waitUntil(guard, deadline);
+        return state->ready;
+    }
+
+    /**
+     * Block the current thread until the value is available, then return it.
+     * This may be called only once; afterwards the Future is no longer
+     * valid().
+     */
+    T
+    get() {
+        wait();
+        FutureState<T>* current = state;
+        state = NULL;
+        // The state is released once the value has been moved out, which
+        // also works when T is void.
+        struct Releaser {
+            FutureState<T>* state;
+            ~Releaser() { state->release(); }
+        } releaser = {current};
+        return current->value.take();
+    }
+
+  private:
+    explicit Future(FutureState<T>* state) : state(state) {}
+
+    /// The state shared with the Promise, or NULL.
+    FutureState<T>* state;
+
+    friend class Promise<T>;
+    DISALLOW_COPY_AND_ASSIGN(Future);
+};
+
+/**
+ * The producing end of a Future: a thread sets the value of a Promise
+ * exactly once, and this wakes the threads waiting on its Future. A typical
+ * use is to create a Promise, hand it to a new thread with std::ref, and
+ * wait on its Future.
+ *
+ * \tparam T
+ *     The type of the value, or void.
+ */
+template <typename T>
+class Promise {
+  public:
+    Promise() : state(new FutureState<T>()), futureRetrieved(false) {}
+
+    Promise(Promise&& other)
+        : state(other.state), futureRetrieved(other.futureRetrieved) {
+        other.state = NULL;
+    }
+
+    ~Promise() {
+        if (state != NULL)
+            state->release();
+    }
+
+    /**
+     * Return the Future for this Promise; may be called only once.
+     */
+    Future<T>
+    getFuture() {
+        if (futureRetrieved) {
+            ARACHNE_LOG(ERROR, "Promise::getFuture called more than once\n");
+            abort();
+        }
+        futureRetrieved = true;
+        state->refs++;
+        return Future<T>(state);
+    }
+
+    /**
+     * Provide the value and wake the threads waiting for it; may be called
+     * only once.
+     *
+     * \param args
+     *     The arguments for the constructor of the value; none for void.
+     */
+    template <typename... Args>
+    void
+    setValue(Args&&... args) {
+        std::lock_guard<SpinLock> guard(state->lock);
+        if (state->ready) {
+            ARACHNE_LOG(ERROR, "Promise::setValue called more than once\n");
+            abort();
+        }
+        state->value.emplace(std::forward<Args>(args)...);
+        state->ready = true;
+        state->readyCondition.notifyAll();
+    }
+
+  private:
+    /// The state shared with the Future, or NULL after a move.
+    FutureState<T>* state;
+
+    /// Set once getFuture has been called.
+    bool futureRetrieved;
+    DISALLOW_COPY_AND_ASSIGN(Promise);
+};
+
+}  // namespace Arachne
+#endif  // FUTURE_H_
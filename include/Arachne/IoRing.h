@@ -0,0 +1,118 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IORING_H_
+#define IORING_H_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Arachne {
+
+/**
+ * A minimal io_uring instance, driven through the raw system calls so that
+ * Arachne needs no extra library. Operations are queued with prepare(),
+ * handed to the kernel in batches with submit(), and their completions are
+ * read from shared memory with reap(), which makes no system call.
+ *
+ * This class is not thread-safe; its users must serialize access.
+ */
+class IoRing {
+  public:
+    static IoRing* create(uint32_t entries);
+    ~IoRing();
+    bool prepare(uint8_t opcode, int fd, uint64_t addr, uint32_t len,
+                 uint64_t offset, uint64_t userData);
+    int submit();
+
+    /**
+     * Remove every completion that the kernel has posted and pass it to
+     * handler.
+     *
+     * \param handler
+     *     Invoked as handler(userData, result) for each completion, where
+     *     result is the return value of the operation or a negated errno.
+     * \return
+     *     The number of completions removed.
+     */
+    template <typename Handler>
+    uint32_t
+    reap(Handler handler) {
+        uint32_t head = *cqHead;
+        uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        uint32_t count = tail - head;
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = cqes[head & cqMask];
+            handler(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        numInFlight -= count;
+        return count;
+    }
+
+    /**
+     * Return the number of operations that have been prepared but not yet
+     * completed.
+     */
+    uint32_t
+    inFlight() {
+        return numInFlight;
+    }
+
+    /**
+     * Return true if some prepared operations have not been submitted.
+     */
+    bool
+    hasUnsubmitted() {
+        return numUnsubmitted != 0;
+    }
+
+  private:
+    IoRing();
+
+    /// The file descriptor of the io_uring.
+    int fd;
+
+    /// The mappings shared with the kernel, and their sizes.
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    /// Fields of the submission queue ring.
+    uint32_t* sqHead;
+    uint32_t* sqTail;
+    uint32_t sqMask;
+    uint32_t sqEntries;
+    uint32_t* sqArray;
+
+    /// Fields of the completion queue ring.
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t cqMask;
+    io_uring_cqe* cqes;
+
+    /// Operations prepared since the last successful submit().
+    uint32_t numUnsubmitted;
+
+    /// Operations prepared and not yet reaped.
+    uint32_t numInFlight;
+};
+
+}  // namespace Arachne
+#endif  // IORING_H_
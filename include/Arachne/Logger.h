@@ -0,0 +1,123 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ARACHNE_LOGGER_H
+#define ARACHNE_LOGGER_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+/**
+ * Messages below this level are removed at compile time, so that their
+ * arguments are not even evaluated. Release builds drop VERBOSE messages
+ * unless this is overridden on the command line.
+ */
+#ifndef ARACHNE_COMPILED_LOG_LEVEL
+#ifdef NDEBUG
+#define ARACHNE_COMPILED_LOG_LEVEL ::Arachne::DEBUG
+#else
+#define ARACHNE_COMPILED_LOG_LEVEL ::Arachne::VERBOSE
+#endif
+#endif
+
+#define ARACHNE_LOG(level, ...)                                 \
+    do {                                                        \
+        if ((level) >= ARACHNE_COMPILED_LOG_LEVEL &&            \
+            ::Arachne::Logger::isEnabled(level))                \
+            ::Arachne::Logger::log((level), __VA_ARGS__);       \
+    } while (0)
+#define ARACHNE_BACKTRACE Logger::logBacktrace
+
+namespace Arachne {
+
+/**
+ * Log levels from most to least inclusive.
+ */
+enum LogLevel { VERBOSE, DEBUG, NOTICE, WARNING, ERROR, SILENT };
+
+/**
+ * Messages are written to errorStream. While the drain thread is running,
+ * messages below ERROR are not formatted by the caller: the calling kernel
+ * thread copies the format string pointer and the binary values of the
+ * arguments into its own ring buffer, and a background thread formats and
+ * writes them. Callers never block on I/O or on other loggers; if a ring is
+ * full, the message is dropped and counted. ERROR messages, and all
+ * messages when the drain thread is not running, are written synchronously
+ * after the buffered messages.
+ */
+class Logger {
+  public:
+    /**
+     * Used to set the minimum severity to print out.
+     */
+    static void setLogLevel(LogLevel level) { displayMinLevel = level; }
+
+    /**
+     * Return true if messages at the given level are currently printed.
+     */
+    static bool isEnabled(LogLevel level) { return level >= displayMinLevel; }
+
+    /**
+     * Print a message to the console at a given severity level. Accepts
+     * printf-style format strings. The format string must remain valid until
+     * the message is written, which string literals always do; %n is not
+     * supported.
+     *
+     * \param level
+     *     The severity level of this message.
+     * \param fmt
+     *     A format string, followed by its arguments.
+     */
+    static void log(LogLevel level, const char* fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+    static void logBacktrace(LogLevel level);
+    static void startDrainThread();
+    static void stopDrainThread();
+    static void flush();
+    static uint64_t getNumDroppedMessages();
+
+    /// Per-thread buffer of binary messages; defined in Logger.cc.
+    struct Ring;
+
+  private:
+    static Ring* getRing();
+    static void drainRings();
+    static void drainThreadMain();
+
+    // The minimum severity level to print.
+    static LogLevel displayMinLevel;
+
+    // Serializes writing to errorStream and consuming the rings, since
+    // Arachne is multithreaded.
+    typedef std::unique_lock<std::mutex> Lock;
+    static std::mutex mutex;
+
+    // True while the drain thread is running and messages may be buffered.
+    static std::atomic<bool> asynchronous;
+
+    // Formats and writes buffered messages in the background.
+    static std::thread drainThread;
+
+    // Number of messages discarded because their ring was full.
+    static std::atomic<uint64_t> numDroppedMessages;
+};
+
+}  // namespace Arachne
+
+#endif
@@ -0,0 +1,303 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <atomic>
+#include <vector>
+#include "Arachne.h"
+
+namespace Arachne {
+
+/**
+ * The chunks of a parallelFor or parallelReduce loop still running on other
+ * threads, and the thread waiting for them. It lives on the waiting thread's
+ * stack.
+ */
+struct ParallelLoop {
+    ParallelLoop() : remaining(0), waiter(getThreadId()) {}
+
+    /**
+     * Record that a chunk has finished, waking the waiting thread if it was
+     * the last one.
+     */
+    void
+    finishChunk() {
+        // The loop may end, and this object go away, as soon as remaining
+        // reaches zero, so nothing is read from it afterwards.
+        ThreadId waiterId = waiter;
+        if (--remaining == 0 && waiterId != NullThread)
+            signal(waiterId);
+    }
+
+    /**
+     * Block the current thread until every chunk run by another thread has
+     * finished. Outside Arachne threads this spins.
+     */
+    void
+    wait() {
+        while (remaining.load(std::memory_order_acquire) != 0) {
+            if (waiter != NullThread)
+                block();
+        }
+    }
+
+    /// The number of chunks that were handed to other threads and have not
+    /// finished yet.
+    std::atomic<uint32_t> remaining;
+
+    /// The thread that runs the loop.
+    ThreadId waiter;
+};
+
+/**
+ * Decide how to split a loop into chunks, and on which cores to run them.
+ *
+ * \param numIterations
+ *     The number of iterations of the loop.
+ * \param grain
+ *     The smallest number of iterations worth running on a thread of its own.
+ * \param[out] coreIds
+ *     Filled in with the core for each chunk after the first, which the
+ *     calling thread runs itself. The cores are taken round-robin from the
+ *     cores for threads of class 0, starting after the calling thread's core
+ *     so that each chunk gets a core of its own as long as there are enough.
+ * \return
+ *     The number of chunks, which is at most the number of cores Arachne may
+ *     use: when cores can still be added, a long loop queues several chunks
+ *     on some cores, so that the load estimator sees the backlog and asks for
+ *     more cores, which then take the queued chunks by work stealing.
+ */
+inline uint32_t
+planParallelLoop(uint64_t numIterations, uint64_t grain,
+                 std::vector<int>* coreIds) {
+    coreIds->clear();
+    if (grain == 0)
+        grain = 1;
+    uint64_t numChunks = (numIterations + grain - 1) / grain;
+    if (numChunks <= 1)
+        return static_cast<uint32_t>(numChunks);
+
+    // The list cannot be held across dispatch(), which the chunks may call,
+    // so the core ids are copied out.
+    CoreListReader reader;
+    CoreList* cores = coreManager->getCores(0);
+    if (cores == NULL || cores->size() == 0) {
+        if (cores != NULL)
+            cores->free();
+        return 1;
+    }
+    uint64_t maxChunks = cores->size();
+    if (!disableLoadEstimation && maxNumCores > maxChunks)
+        maxChunks = maxNumCores;
+    if (numChunks > maxChunks)
+        numChunks = maxChunks;
+    uint32_t start = 0;
+    for (uint32_t i = 0; i < cores->size(); i++)
+        if (cores->get(i) == core.kernelThreadId)
+            start = i;
+    for (uint32_t i = 1; i < numChunks; i++)
+        coreIds->push_back(cores->get((start + i) % cores->size()));
+    cores->free();
+    return static_cast<uint32_t>(numChunks);
+}
+
+/**
+ * Return the first iteration of the given chunk when numIterations are split
+ * into numChunks chunks whose sizes differ by at most one.
+ */
+inline uint64_t
+chunkBegin(uint64_t begin, uint64_t numIterations, uint32_t numChunks,
+           uint32_t chunk) {
+    return begin + numIterations * chunk / numChunks;
+}
+
+/**
+ * The main function of the threads that run chunks of a parallelFor.
+ */
+template <typename _Body>
+void
+runParallelForChunk(ParallelLoop* loop, const _Body* body, uint64_t begin,
+                    uint64_t end) {
+    for (uint64_t i = begin; i < end; i++)
+        (*body)(i);
+    loop->finishChunk();
+}
+
+/**
+ * Invoke body(i) for every i in [begin, end), in parallel on the cores
+ * Arachne is using. The iterations are split into chunks of at least grain
+ * iterations; each chunk but the first runs on an Arachne thread of its own,
+ * placed on a different core, while the calling thread runs the first chunk
+ * itself and then waits, without spinning, for the others to finish.
+ *
+ * \param begin
+ *     The first iteration.
+ * \param end
+ *     One past the last iteration.
+ * \param grain
+ *     The smallest number of iterations worth running on a thread of its
+ *     own; it should take at least a few microseconds.
+ * \param body
+ *     Invoked with the number of each iteration; it may run concurrently
+ *     with itself on several cores. It is not copied, and it must not throw.
+ *
+ * \ingroup api
+ */
+template <typename _Body>
+void
+parallelFor(uint64_t begin, uint64_t end, uint64_t grain, const _Body& body) {
+    if (end <= begin)
+        return;
+    uint64_t numIterations = end - begin;
+    std::vector<int> coreIds;
+    uint32_t numChunks = planParallelLoop(numIterations, grain, &coreIds);
+    ParallelLoop loop;
+    loop.remaining = numChunks - 1;
+    for (uint32_t chunk = 1; chunk < numChunks; chunk++) {
+        uint64_t first = chunkBegin(begin, numIterations, numChunks, chunk);
+        uint64_t last = chunkBegin(begin, numIterations, numChunks, chunk + 1);
+        if (createThreadOnCore(static_cast<uint32_t>(coreIds[chunk - 1]),
+                               runParallelForChunk<_Body>, &loop, &body, first,
+                               last) == NullThread) {
+            // The core is full; run the chunk here instead.
+            for (uint64_t i = first; i < last; i++)
+                body(i);
+            loop.remaining--;
+        }
+    }
+    uint64_t last = chunkBegin(begin, numIterations, numChunks, 1);
+    for (uint64_t i = begin; i < last; i++)
+        body(i);
+    loop.wait();
+}
+
+/**
+ * The partial results of the chunks of a parallelReduce, each on cache lines
+ * of its own, so that the threads storing them do not share lines. Unlike a
+ * std::vector, this works for any copy-constructible _Result, bool included.
+ */
+template <typename _Result>
+class ParallelReducePartials {
+  public:
+    ParallelReducePartials(uint32_t numChunks, const _Result& identity)
+        : numChunks(numChunks),
+          slots(static_cast<Slot*>(alignedAlloc(sizeof(Slot) * numChunks))) {
+        for (uint32_t i = 0; i < numChunks; i++)
+            new (&slots[i]) Slot(identity);
+    }
+
+    ~ParallelReducePartials() {
+        for (uint32_t i = 0; i < numChunks; i++)
+            slots[i].~Slot();
+        free(slots);
+    }
+
+    /// Return the partial result of a chunk.
+    _Result& operator[](uint32_t chunk) { return slots[chunk].value; }
+
+  private:
+    struct alignas(CACHE_LINE_SIZE) Slot {
+        explicit Slot(const _Result& value) : value(value) {}
+        _Result value;
+    };
+
+    /// The number of slots.
+    const uint32_t numChunks;
+
+    /// One slot per chunk.
+    Slot* const slots;
+    DISALLOW_COPY_AND_ASSIGN(ParallelReducePartials);
+};
+
+/**
+ * The main function of the threads that run chunks of a parallelReduce.
+ */
+template <typename _Result, typename _Map, typename _Combine>
+void
+runParallelReduceChunk(ParallelLoop* loop, const _Map* map,
+                       const _Combine* combine, _Result* partial,
+                       uint64_t begin, uint64_t end) {
+    // Fold into a local, which can stay in a register while the chunk runs.
+    _Result result = *partial;
+    for (uint64_t i = begin; i < end; i++)
+        result = (*combine)(result, (*map)(i));
+    *partial = result;
+    loop->finishChunk();
+}
+
+/**
+ * Compute combine(...combine(combine(identity, map(begin)), map(begin + 1))
+ * ..., map(end - 1)) in parallel, splitting the iterations into chunks as
+ * parallelFor does. Each chunk folds its own iterations starting from
+ * identity, and the partial results are then combined in the order of the
+ * chunks, so the result is deterministic for an associative combine.
+ *
+ * \param begin
+ *     The first iteration.
+ * \param end
+ *     One past the last iteration.
+ * \param grain
+ *     The smallest number of iterations worth running on a thread of its
+ *     own.
+ * \param identity
+ *     The identity of combine; the result of an empty loop.
+ * \param map
+ *     Invoked with the number of each iteration; returns its contribution.
+ * \param combine
+ *     Combines two partial results; it must be associative.
+ * \return
+ *     The combined result of every iteration.
+ *
+ * \ingroup api
+ */
+template <typename _Result, typename _Map, typename _Combine>
+_Result
+parallelReduce(uint64_t begin, uint64_t end, uint64_t grain,
+               const _Result& identity, const _Map& map,
+               const _Combine& combine) {
+    if (end <= begin)
+        return identity;
+    uint64_t numIterations = end - begin;
+    std::vector<int> coreIds;
+    uint32_t numChunks = planParallelLoop(numIterations, grain, &coreIds);
+    ParallelReducePartials<_Result> partials(numChunks, identity);
+    ParallelLoop loop;
+    loop.remaining = numChunks - 1;
+    for (uint32_t chunk = 1; chunk < numChunks; chunk++) {
+        uint64_t first = chunkBegin(begin, numIterations, numChunks, chunk);
+        uint64_t last = chunkBegin(begin, numIterations, numChunks, chunk + 1);
+        if (createThreadOnCore(
+                static_cast<uint32_t>(coreIds[chunk - 1]),
+                runParallelReduceChunk<_Result, _Map, _Combine>, &loop, &map,
+                &combine, &partials[chunk], first, last) == NullThread) {
+            for (uint64_t i = first; i < last; i++)
+                partials[chunk] = combine(partials[chunk], map(i));
+            loop.remaining--;
+        }
+    }
+    uint64_t last = chunkBegin(begin, numIterations, numChunks, 1);
+    for (uint64_t i = begin; i < last; i++)
+        partials[0] = combine(partials[0], map(i));
+    loop.wait();
+    _Result result = partials[0];
+    for (uint32_t chunk = 1; chunk < numChunks; chunk++)
+        result = combine(result, partials[chunk]);
+    return result;
+}
+
+}  // namespace Arachne
+#endif  // PARALLEL_H_
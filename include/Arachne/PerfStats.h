@@ -0,0 +1,275 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ARACHNE_PERFSTATS_H
+#define ARACHNE_PERFSTATS_H
+
+#include <atomic>
+#include <vector>
+
+#include "SpinLock.h"
+
+namespace Arachne {
+/**
+ * A histogram of 64-bit values with logarithmically sized groups of linearly
+ * sized buckets: each power of two is split into 2^SUB_BUCKET_BITS buckets,
+ * so every recorded value is known to within 1/2^SUB_BUCKET_BITS of itself
+ * while the whole 64-bit range fits in a few hundred buckets. Values below
+ * 2^SUB_BUCKET_BITS are recorded exactly.
+ */
+struct LogLinearHistogram {
+    static const int SUB_BUCKET_BITS = 3;
+    static const int NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1)
+                                   << SUB_BUCKET_BITS;
+
+    /// Number of values recorded in each bucket.
+    uint64_t buckets[NUM_BUCKETS];
+
+    /// Number of values recorded.
+    uint64_t count;
+
+    /// Sum of all values recorded, for computing the mean.
+    uint64_t sum;
+
+    /**
+     * Return the index of the bucket that holds value.
+     */
+    static int
+    bucketOf(uint64_t value) {
+        if (value < (1UL << SUB_BUCKET_BITS))
+            return static_cast<int>(value);
+        int exponent = 63 - __builtin_clzll(value);
+        uint64_t leadingBits = value >> (exponent - SUB_BUCKET_BITS);
+        int subBucket =
+            static_cast<int>(leadingBits & ((1 << SUB_BUCKET_BITS) - 1));
+        return ((exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) |
+               subBucket;
+    }
+
+    /**
+     * Return the smallest value that falls into the given bucket.
+     */
+    static uint64_t
+    lowerBound(int bucket) {
+        if (bucket < (1 << SUB_BUCKET_BITS))
+            return static_cast<uint64_t>(bucket);
+        int exponent = (bucket >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+        uint64_t subBucket =
+            static_cast<uint64_t>(bucket & ((1 << SUB_BUCKET_BITS) - 1));
+        return (1UL << exponent) | (subBucket << (exponent - SUB_BUCKET_BITS));
+    }
+
+    /**
+     * Add one value to this histogram.
+     */
+    void
+    record(uint64_t value) {
+        buckets[bucketOf(value)]++;
+        count++;
+        sum += value;
+    }
+
+    void add(const LogLinearHistogram& other);
+    void subtract(const LogLinearHistogram& other);
+    uint64_t percentile(double fraction) const;
+};
+
+/**
+ * An object of this class records various performance-related information.
+ * Each kernel thread has a private instance of this object, which
+ * eliminates cache conflicts when updating statistics and makes the class
+ * thread-safe.  In addition, an object of this class is returned by
+ * collectStats, which aggregates the statistics from all of the individual
+ * threads.
+ *
+ * If you add a new metric, be sure to update all of the relevant methods
+ * in PerfStats.cc. For example, search for all of the places where
+ * "collectionTime" appears and add appropriate lines for the new metric.
+ */
+struct PerfStats {
+    /// Time (in cycles) when the statistics were gathered (only
+    /// present in aggregate statistics, not in thread-local instances).
+    uint64_t collectionTime;
+
+    /// Conversion factor from collectionTime to seconds (only present
+    /// in aggregate statistics, not in thread-local instances).
+    double cyclesPerSecond;
+
+    // Number of cycles spent in the dispatch() loop.
+    uint64_t idleCycles;
+
+    // Total number of cycles actively executing on a core, including both
+    // useful work and idle time.
+    uint64_t totalCycles;
+
+    // Number of threads run in one pass through a dispatch cycle
+    // multiplied by the number of cycles that dispatch cycle took.
+    uint64_t weightedLoadedCycles;
+
+    // Number of times this core created a thread.
+    uint64_t numThreadsCreated;
+
+    // Number of times a thread finished running on this core.
+    uint64_t numThreadsFinished;
+
+    // Number of times the number of cores increased.
+    uint64_t numCoreIncrements;
+
+    // Number of times the number of cores decreased.
+    uint64_t numCoreDecrements;
+
+    // Number of createThread calls which had to be retried at least once
+    // because of a CAS failure resulting from a conflict on the occupied
+    // bitmask.
+    uint64_t numContendedCreations;
+
+    // Number of threads this core handed to idle cores that asked for work.
+    uint64_t numThreadsStolen;
+
+    // Number of times this core parked its kernel thread for lack of
+    // runnable threads.
+    uint64_t numCoreParks;
+
+    // Number of threads moved off this core while it was being released.
+    uint64_t numThreadsMigrated;
+
+    // Number of threads waiting in this core's pending queue for a free
+    // context, as of its last pass through the dispatch loop.
+    uint64_t numPendingThreads;
+
+    // Number of calls this core made with blockingCall.
+    uint64_t numBlockingCalls;
+
+    // Number of kernel threads running calls made with blockingCall; only
+    // present in aggregate statistics.
+    uint64_t blockingCallThreads;
+
+    // Number of calls made with blockingCall waiting for a kernel thread;
+    // only present in aggregate statistics.
+    uint64_t blockingCallQueueDepth;
+
+    // Number of times this core polled for the completion of I/O operations
+    // started with ioRead, ioWrite or ioAccept.
+    uint64_t numIoPolls;
+
+    // Number of I/O operations whose completion this core reaped.
+    uint64_t numIoCompletions;
+
+    // Cycles this core spent submitting I/O operations and reaping their
+    // completions.
+    uint64_t ioPollCycles;
+
+    // Number of SleepLock and SharedSleepLock acquisitions that found the
+    // lock unavailable.
+    uint64_t numContendedSleepLocks;
+
+    // Number of contended SleepLock acquisitions that succeeded while
+    // spinning, without parking the thread.
+    uint64_t numSleepLockSpinAcquisitions;
+
+    // Number of times a thread parked to wait for a SleepLock or
+    // SharedSleepLock.
+    uint64_t numSleepLockParks;
+
+    // Cycles from entering dispatch() to handing the core to a thread.
+    LogLinearHistogram dispatchLatencyCycles;
+
+    // Cycles from the creation of a thread to its exit.
+    LogLinearHistogram threadLifetimeCycles;
+
+    // Number of failed CAS attempts on the occupied bitmask per thread
+    // creation call.
+    LogLinearHistogram creationRetries;
+
+    // Cycles spent moving the threads off a core that is being released.
+    LogLinearHistogram coreRampDownCycles;
+
+    // Cycles from making a call with blockingCall until the caller resumes.
+    LogLinearHistogram blockingCallCycles;
+
+    /// Number of thread classes with a separate wakeupLatencyCyclesByClass
+    /// histogram; threads of higher classes share the last one.
+    static const int NUM_THREAD_CLASSES = 4;
+
+    // Cycles from signal() making a thread runnable until its core switches
+    // to it. Only recorded when Arachne is built with WAKEUP_LATENCY_STATS.
+    LogLinearHistogram wakeupLatencyCycles;
+
+    // wakeupLatencyCycles broken down by the threadClass of the thread.
+    LogLinearHistogram wakeupLatencyCyclesByClass[NUM_THREAD_CLASSES];
+
+    /// Odd while the owning thread is updating several related fields at
+    /// once; bumped before and after each such update so that collectStats
+    /// can take a consistent copy without ever blocking the owner. Fields
+    /// that are updated on their own are single aligned words and need no
+    /// protection.
+    uint64_t updateSequence;
+
+    /// Begin an update of several fields that must be read together; only
+    /// the thread that owns this structure may call this.
+    void
+    beginUpdate() {
+        __atomic_store_n(&updateSequence, updateSequence + 1,
+                         __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    /// End an update started with beginUpdate().
+    void
+    endUpdate() {
+        __atomic_store_n(&updateSequence, updateSequence + 1,
+                         __ATOMIC_RELEASE);
+    }
+
+    /// Add a value to one of the histograms in this structure; only the
+    /// thread that owns this structure may call this.
+    void
+    record(LogLinearHistogram* histogram, uint64_t value) {
+        beginUpdate();
+        histogram->record(value);
+        endUpdate();
+    }
+
+    /// Used to serialize registerStats and deregisterStats.
+    static SpinLock mutex;
+
+    /// Largest number of PerfStats structures that can be registered at once.
+    static const int MAX_REGISTERED_STATS = 256;
+
+    /// Keeps track of all the PerfStat structures that have been passed
+    /// to registerStats (e.g. the different thread-local structures for
+    /// each thread). This allows us to find all of the structures to
+    /// aggregate their statistics in collectStats, which reads it without
+    /// taking mutex; empty slots are NULL.
+    static std::atomic<PerfStats*> registeredStats[MAX_REGISTERED_STATS];
+
+    /// Number of collectStats calls in progress. deregisterStats waits for
+    /// this to drop to zero before the structure it removed may be freed.
+    static std::atomic<int> numActiveCollectors;
+
+    /// The following thread-local variable is used to access the
+    /// statistics for the current thread.
+    static thread_local PerfStats threadStats;
+
+    explicit PerfStats(bool shouldRegister = false);
+    static void registerStats(PerfStats* stats);
+    static void deregisterStats(PerfStats* stats);
+    static void collectStats(PerfStats* total);
+    static void snapshot(const PerfStats* stats, PerfStats* copy);
+    static void collectCoreStats(std::vector<PerfStats>* perThread);
+};
+}  // namespace Arachne
+
+#endif  // ARACHNE_PERFSTATS_H
@@ -0,0 +1,155 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PRIORITYSCHEDULER_H_
+#define PRIORITYSCHEDULER_H_
+
+#include <stdint.h>
+
+namespace Arachne {
+
+/**
+ * Decides which priority level each pass of a core's dispatch loop serves.
+ * Each context on the core belongs to one level, identified by its index in
+ * the core's localThreadContexts; level 0 is the most important and is where
+ * every context starts out.
+ *
+ * A pass is one round-robin sweep over the runnable contexts of the chosen
+ * level. How levels are chosen is determined by the policy shared by all
+ * cores:
+ *  - STRICT_PRIORITY serves the most important level with runnable contexts,
+ *    except that a level that has been kept waiting for longer than
+ *    starvationLimitNs is given one pass.
+ *  - WEIGHTED gives each level with runnable contexts a number of passes in
+ *    proportion to its weight.
+ *
+ * Instances are not thread-safe and are meant to be used only by the core
+ * that owns them; the policy is configured with the static methods below.
+ */
+class PriorityScheduler {
+  public:
+    /**
+     * Number of distinct priority levels.
+     */
+    static const int NUM_PRIORITY_LEVELS = 4;
+
+    /**
+     * The ways in which the levels of runnable contexts can share a core.
+     */
+    enum Policy { STRICT_PRIORITY = 0, WEIGHTED = 1 };
+
+    PriorityScheduler() { reset(0); }
+    void reset(uint64_t nowInCycles);
+    uint64_t startPass(uint64_t runnable, uint64_t nowInCycles);
+    int chooseLevel(uint32_t runnableLevels, uint64_t nowInCycles);
+
+    static void useStrictPriorities(uint64_t starvationLimitNs);
+    static void useWeightedPriorities(const uint32_t* weights);
+
+    /**
+     * Record that the context at index now belongs to the given level.
+     *
+     * \param index
+     *     Identifies the context; must be less than 64.
+     * \param level
+     *     The context's priority level; must be less than
+     *     NUM_PRIORITY_LEVELS.
+     */
+    void
+    setLevel(uint8_t index, int level) {
+        uint64_t bit = 1UL << index;
+        for (int i = 0; i < NUM_PRIORITY_LEVELS; i++)
+            levelMasks[i] &= ~bit;
+        levelMasks[level] |= bit;
+    }
+
+    /**
+     * Return the levels that have some of the given contexts.
+     *
+     * \param runnable
+     *     The contexts that may be runnable.
+     * \return
+     *     Bit i is set if level i has one of the contexts in runnable.
+     */
+    uint32_t
+    getRunnableLevels(uint64_t runnable) {
+        uint32_t runnableLevels = 0;
+        for (int i = 0; i < NUM_PRIORITY_LEVELS; i++) {
+            if (runnable & levelMasks[i])
+                runnableLevels |= 1U << i;
+        }
+        return runnableLevels;
+    }
+
+    /**
+     * Return the contexts that belong to a level.
+     */
+    uint64_t
+    getLevelMask(int level) {
+        return levelMasks[level];
+    }
+
+    /**
+     * Return the level that the current pass serves.
+     */
+    int
+    getCurrentLevel() {
+        return currentLevel;
+    }
+
+  private:
+    /**
+     * levelMasks[level] is the set of contexts that belong to that level.
+     */
+    uint64_t levelMasks[NUM_PRIORITY_LEVELS];
+
+    /**
+     * The time in cycles at which each level was last given a pass, or was
+     * last seen without runnable contexts.
+     */
+    uint64_t lastServedCycles[NUM_PRIORITY_LEVELS];
+
+    /**
+     * Passes each level may still take before the WEIGHTED policy starts a
+     * new round.
+     */
+    uint32_t credits[NUM_PRIORITY_LEVELS];
+
+    /**
+     * The level served by the current pass.
+     */
+    int currentLevel;
+
+    /**
+     * The policy used by all cores.
+     */
+    static Policy policy;
+
+    /**
+     * Under STRICT_PRIORITY, a level with runnable contexts that has not
+     * been served for this many nanoseconds gets one pass ahead of more
+     * important levels.
+     */
+    static uint64_t starvationLimitNs;
+
+    /**
+     * Under WEIGHTED, the number of passes each level gets per round.
+     */
+    static uint32_t weights[NUM_PRIORITY_LEVELS];
+};
+
+}  // namespace Arachne
+
+#endif  // PRIORITYSCHEDULER_H_
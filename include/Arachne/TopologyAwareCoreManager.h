@@ -0,0 +1,193 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TOPOLOGYAWARECOREMANAGER_H_
+#define TOPOLOGYAWARECOREMANAGER_H_
+
+#include <vector>
+#include "Arachne.h"
+#include "DefaultCoreManager.h"
+
+namespace Arachne {
+
+/**
+ * Where a core sits in the machine. Each field is -1 if it is not known.
+ */
+struct CpuTopology {
+    /// The id of the CPU, as used by the kernel.
+    int cpu;
+
+    /// The physical package (socket) that the CPU belongs to.
+    int socket;
+
+    /// Identifies the CPUs that share the CPU's last-level cache; this is the
+    /// lowest-numbered CPU among them.
+    int cacheDomain;
+
+    /// Identifies the hyperthreads of the CPU's physical core; this is the
+    /// lowest-numbered CPU among them.
+    int physicalCore;
+};
+
+/**
+ * A CoreManager that learns the socket, last-level cache and hyperthread
+ * topology of the cores it is granted, and uses it to keep threads close to
+ * their data. In addition to the thread classes of DefaultCoreManager, it
+ * supports the classes returned by onSocket(), which place threads on the
+ * given socket, and nearCore(), which prefer cores sharing a last-level
+ * cache with the given core, then cores on its socket, then any core.
+ *
+ * When a core must be released, it gives up cores outside the preferred
+ * socket first, then cores whose hyperthread sibling it also holds, and it
+ * migrates the released core's threads to cores on the same socket.
+ */
+class TopologyAwareCoreManager : public DefaultCoreManager {
+  public:
+    /**
+     * Sockets with ids at least this large are treated as unknown.
+     */
+    static const int MAX_SOCKETS = 16;
+
+    TopologyAwareCoreManager(int minNumCores, int maxNumCores,
+                             bool estimateLoad = true,
+                             const char* sysfsCpuRoot =
+                                 "/sys/devices/system/cpu");
+    virtual ~TopologyAwareCoreManager();
+    virtual void coreAvailable(int myCoreId);
+    void coreAvailable(int myCoreId, const CpuTopology& topology);
+    virtual int coreUnavailable();
+    virtual CoreList* getCores(int threadClass);
+    virtual CoreList* getMigrationTargets();
+    void setPreferredSocket(int socket);
+    CpuTopology getTopology(int coreId);
+    static CpuTopology readCpuTopology(const char* sysfsCpuRoot, int cpu);
+
+    /**
+     * Return the thread class for threads that must run on the given socket.
+     */
+    static int
+    onSocket(int socket) {
+        return ON_SOCKET + socket;
+    }
+
+    /**
+     * Return the thread class for threads that should run as close as
+     * possible to the core with the given id.
+     */
+    static int
+    nearCore(int coreId) {
+        return NEAR_CORE + coreId;
+    }
+
+  private:
+    virtual void sharedCoresChanged();
+
+    /**
+     * The first thread class in each range of topology-based classes; both
+     * are well above the classes of DefaultCoreManager.
+     */
+    enum { ON_SOCKET = 1 << 8, NEAR_CORE = 1 << 16 };
+
+    /**
+     * The directory in which the kernel describes each CPU, normally
+     * /sys/devices/system/cpu.
+     */
+    const char* sysfsCpuRoot;
+
+    /**
+     * The topology of each core, indexed by coreId.
+     */
+    std::vector<CpuTopology> topologies;
+
+    /**
+     * socketCores[s] holds the shared cores on socket s. It is changed in
+     * place and only handed out as migration targets.
+     */
+    std::vector<CoreList*> socketCores;
+
+    /**
+     * socketSnapshots[s] is an immutable copy of socketCores[s], returned by
+     * getCores(onSocket(s)).
+     */
+    std::vector<std::atomic<CoreList*>> socketSnapshots;
+
+    /**
+     * nearSnapshots[c] is an immutable list of the shared cores that share a
+     * last-level cache with core c.
+     */
+    std::vector<std::atomic<CoreList*>> nearSnapshots;
+
+    /**
+     * The socket whose cores are released last, or -1 if there is none.
+     */
+    int preferredSocket;
+
+    /**
+     * The socket of the core most recently returned by coreUnavailable, or
+     * -1 if it is not known.
+     */
+    int lastReleasedSocket;
+};
+
+/**
+ * Spawn a new thread on the given socket with a function and arguments. This
+ * requires a TopologyAwareCoreManager.
+ *
+ * \param socket
+ *     The socket that the new thread must run on.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f; see createThreadWithClass for restrictions.
+ * \return
+ *     The return value is an identifier for the newly created thread. If the
+ *     socket has no cores, or there are insufficient resources for creating
+ *     a new thread, then NullThread will be returned.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadOnSocket(int socket, _Callable&& __f, _Args&&... __args) {
+    return createThreadWithClass(TopologyAwareCoreManager::onSocket(socket),
+                                 __f, __args...);
+}
+
+/**
+ * Spawn a new thread as close as possible to the given core with a function
+ * and arguments. This requires a TopologyAwareCoreManager.
+ *
+ * \param coreId
+ *     The id of the core that the new thread should be close to.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f; see createThreadWithClass for restrictions.
+ * \return
+ *     The return value is an identifier for the newly created thread. If
+ *     there are insufficient resources for creating a new thread, then
+ *     NullThread will be returned.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadNearCore(int coreId, _Callable&& __f, _Args&&... __args) {
+    return createThreadWithClass(TopologyAwareCoreManager::nearCore(coreId),
+                                 __f, __args...);
+}
+
+}  // namespace Arachne
+#endif  // TOPOLOGYAWARECOREMANAGER_H_
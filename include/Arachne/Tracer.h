@@ -0,0 +1,108 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ARACHNE_TRACER_H_
+#define ARACHNE_TRACER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+#include "Common.h"
+
+namespace Arachne {
+
+/**
+ * The kinds of scheduler events that the tracer records.
+ */
+enum TraceEventType : uint8_t {
+    /// A core started running a thread; arg is unused.
+    TRACE_SWITCH,
+    /// A thread was created; arg is the core it was created on.
+    TRACE_CREATE,
+    /// A thread was signaled; arg is the core it lives on.
+    TRACE_SIGNAL,
+    /// The running thread blocked or went to sleep; arg is unused.
+    TRACE_BLOCK,
+    /// The running thread's main function returned; arg is unused.
+    TRACE_EXIT,
+    /// A thread was moved to another core; arg is the new core.
+    TRACE_MIGRATE,
+    /// A core started running Arachne threads; arg is the new core count.
+    TRACE_CORE_INCREMENT,
+    /// A core was given up; arg is the new core count.
+    TRACE_CORE_DECREMENT
+};
+
+/**
+ * One scheduler event, as stored in a trace ring.
+ */
+struct TraceEvent {
+    /// When the event happened, in cycles.
+    uint64_t timestamp;
+    /// The thread that the event is about, if any.
+    ThreadContext* context;
+    /// The generation of context when the event happened; together with
+    /// context it identifies the thread.
+    uint32_t generation;
+    /// See TraceEventType.
+    uint8_t type;
+    /// The core that recorded the event, or NO_TRACE_CORE if it was recorded
+    /// outside Arachne's cores.
+    uint8_t coreId;
+    /// Depends on type.
+    uint16_t arg;
+};
+
+/// The coreId of events recorded by threads that are not Arachne threads.
+const uint8_t NO_TRACE_CORE = static_cast<uint8_t>(~0);
+
+/// Set while startTracing is in effect; checked before recording each event.
+extern std::atomic<bool> tracingEnabled;
+
+void recordTraceEvent(TraceEventType type, ThreadContext* context,
+                      uint32_t generation, uint32_t arg);
+
+/**
+ * Record a scheduler event if tracing is enabled. The event goes into the
+ * trace ring of the calling core, so recording takes no locks except on
+ * threads that are not Arachne threads.
+ *
+ * \param type
+ *     The kind of event.
+ * \param context
+ *     The thread that the event is about, or NULL.
+ * \param generation
+ *     The generation of context.
+ * \param arg
+ *     Depends on type; see TraceEventType.
+ */
+inline void
+traceEvent(TraceEventType type, ThreadContext* context, uint32_t generation,
+           uint32_t arg = 0) {
+    if (unlikely(tracingEnabled.load(std::memory_order_relaxed)))
+        recordTraceEvent(type, context, generation, arg);
+}
+
+void startTracing();
+void stopTracing();
+bool dumpTrace(const char* path);
+void writeTrace(FILE* output);
+void collectTraceEvents(std::vector<TraceEvent>* events);
+void dumpTraceOnAbort(const char* path);
+
+}  // namespace Arachne
+
+#endif  // ARACHNE_TRACER_H_
@@ -13,11 +13,19 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <linux/futex.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
 #include <thread>
+#include "BlockingCallPool.h"
 #include "CoreArbiter/CoreArbiterClient.h"
 #include "CoreManager.h"
 #include "DefaultCoreManager.h"
+#include "IoRing.h"
 #include "PerfUtils/TimeTrace.h"
 #include "PerfUtils/Util.h"
 
@@ -47,6 +55,13 @@ FILE* errorStream = stderr;
 
 std::function<void()> initCore = nullptr;
 
+/**
+ * If set, incrementCoreCount calls this with the total number of cores it
+ * wants instead of asking the core arbiter for them. Unit tests use it to
+ * hold back the arbiter's grant.
+ */
+std::function<void(uint32_t)> requestCoresForIncrease = nullptr;
+
 // The following configuration options can be passed into init.
 
 /**
@@ -97,6 +112,55 @@ SpinLock coreChangeMutex(false);
  */
 std::atomic<bool> coreChangeActive;
 
+/**
+ * Number of cores that the core increase in progress is still waiting for.
+ * Protected by coreChangeMutex.
+ */
+uint32_t numPendingCoreIncrements = 0;
+
+/**
+ * The number of kernel threads that wait on a futex as warm spare cores
+ * instead of blocking in the core arbiter. incrementCoreCount starts them
+ * right away, while it waits for cores from the arbiter, which then take
+ * their places. At most maxNumCores - minNumCores; disabled by default.
+ *
+ * The warm spares are kernel threads beyond the maxNumCores that block in the
+ * arbiter, with the core ids from maxNumCores up, so they do not lower the
+ * number of cores the arbiter can grant. A warm spare only stands in for a
+ * core that the arbiter can still grant; until that core arrives and the warm
+ * spare has stopped, Arachne runs on more kernel threads than the arbiter has
+ * granted cores.
+ */
+uint32_t numWarmSpareCores = 0;
+
+/**
+ * The number of kernel threads that run Arachne cores, and the number of
+ * elements of each per-core array: maxNumCores that get cores from the core
+ * arbiter, followed by numWarmSpareCores warm spares.
+ */
+uint32_t numKernelThreads = 0;
+
+/**
+ * The largest number of warm spare cores that may run at once. The
+ * CoreLoadEstimator adapts it to how often and by how much the load calls
+ * for more cores.
+ */
+std::atomic<uint32_t> warmSpareBudget(0);
+
+/**
+ * The warm spare cores that are waiting to be started. Protected by
+ * coreChangeMutex.
+ */
+std::vector<int> parkedWarmSpares;
+
+/**
+ * The ith element is set while core i runs as a warm spare core, and
+ * numActiveWarmSpares counts the elements that are set. Protected by
+ * coreChangeMutex.
+ */
+std::vector<bool> warmSpareActive;
+uint32_t numActiveWarmSpares = 0;
+
 /**
  * Used to ensure that only one thread attempts to become exclusive or shared
  * at a time. This protects against a thread being migrated while it is
@@ -110,6 +174,146 @@ SleepLock coreExclusionMutex;
  */
 int stackSize = 1024 * 1024;
 
+/**
+ * The number of idle stacks each core keeps resident. When a thread exits on
+ * a core that already has this many idle contexts with resident stacks, the
+ * pages of the exiting thread's stack are returned to the kernel. By default
+ * every stack stays resident once it has been touched.
+ */
+int stackPoolHighWaterMark = maxThreadsPerCore;
+
+/**
+ * When set, a core whose dispatch loop makes a full pass without finding a
+ * runnable thread asks a busier core to hand some of its runnable threads
+ * over. Disabled by default.
+ */
+bool enableWorkStealing = false;
+
+/**
+ * When nonzero, a thread created by an Arachne thread is placed on its
+ * creator's core as long as that core has fewer than this many occupied
+ * contexts and serves the new thread's class; otherwise the least loaded of
+ * two random cores is used. Disabled by default.
+ */
+uint32_t localPlacementThreshold = 0;
+
+/**
+ * When nonzero, a core whose dispatch loop has found no runnable thread for
+ * this many nanoseconds parks its kernel thread in the kernel until one of
+ * its threads is created or signaled, or a sleeping thread is due. Disabled
+ * by default.
+ */
+uint64_t parkAfterIdleNs = 0;
+
+/**
+ * When nonzero, createThreadOrQueue and createThreadOnCoreOrQueue queue up to
+ * this many threads on each core whose contexts are all in use; the core
+ * starts them as its contexts become free. Disabled by default.
+ */
+uint32_t pendingThreadQueueDepth = 0;
+
+/**
+ * The longest time a parked core sleeps before it looks for requests from
+ * the core arbiter and other cores again.
+ */
+const uint64_t MAX_PARK_NS = 1000000;
+
+/**
+ * The largest number of kernel threads that run calls made with
+ * blockingCall, and so the largest number of such calls that run at once.
+ */
+uint32_t maxBlockingCallThreads = 8;
+
+/**
+ * Runs calls made with blockingCall; created by init.
+ */
+BlockingCallPool* blockingCallPool = NULL;
+
+/**
+ * The number of entries in the submission queue of each core's io_uring,
+ * which is also the largest number of I/O operations a core keeps in flight.
+ */
+const uint32_t IO_RING_ENTRIES = 256;
+
+/**
+ * The io_uring through which the threads of one core perform I/O. The
+ * core's dispatch loop submits their operations and reaps the completions
+ * once per pass. A core that is released with operations still in flight
+ * leaves its ring orphaned, and other cores poll it until they finish.
+ */
+struct CoreIoRing {
+    CoreIoRing() : lock("ioRing", false), ring(NULL), unavailable(false),
+                   orphaned(false) {}
+
+    /// Serializes the use of ring.
+    SpinLock lock;
+
+    /// Created the first time a thread on the core starts an operation.
+    IoRing* ring;
+
+    /// Set if the ring could not be created, for instance because the
+    /// kernel lacks io_uring; I/O is then done with ordinary system calls.
+    bool unavailable;
+
+    /// Set while the core is released with operations in flight.
+    bool orphaned;
+};
+
+/**
+ * An I/O operation started by a thread, which blocks until result is set.
+ */
+struct IoRequest {
+    /// The thread to signal when the operation completes.
+    ThreadId waiter;
+
+    /// The return value of the operation, or a negated errno.
+    int32_t result;
+
+    /// Set once result is valid.
+    std::atomic<bool> done;
+};
+
+/**
+ * The ith element is the CoreIoRing of core i.
+ */
+std::vector<CoreIoRing*> ioRings;
+
+/**
+ * Set once any core has created an io_uring; until then the dispatch loop
+ * does not poll for completions.
+ */
+volatile bool ioRingsInUse = false;
+
+/**
+ * The number of elements of ioRings that are orphaned.
+ */
+std::atomic<int> numOrphanedIoRings(0);
+
+/**
+ * The threads waiting for a free context on one core, oldest first. Any
+ * thread may add to the queue, but only the core itself removes threads from
+ * it: an exiting thread hands its context to the oldest one, and dispatch()
+ * starts them in contexts that were freed some other way.
+ */
+struct PendingThreadQueue {
+    PendingThreadQueue() : lock("pendingThreads", false), size(0), threads() {}
+
+    /// Serializes the use of threads.
+    SpinLock lock;
+
+    /// The number of elements of threads, which the core reads without the
+    /// lock to see whether there is anything to start.
+    std::atomic<uint32_t> size;
+
+    /// The queued threads.
+    std::deque<PendingThread> threads;
+};
+
+/**
+ * The ith element is the PendingThreadQueue of core i.
+ */
+std::vector<PendingThreadQueue*> pendingThreadQueues;
+
 /**
  * Keep track of the kernel threads we are running so that we can join them on
  * destruction. Also, store a pointer to the original stacks to facilitate
@@ -130,13 +334,15 @@ volatile bool shutdown;
 std::vector<ThreadContext**> allThreadContexts;
 
 /**
- * See documentation for MaskAndCount.
+ * The ith element points at one MaskAndCount for each context group of core
+ * i; see documentation for MaskAndCount.
  */
 std::vector<std::atomic<MaskAndCount>*> occupiedAndCount;
 
 /**
  * This is a per-core bitmask that represents which contexts are pinned to the
- * core and cannot be targeted during migration.
+ * core and cannot be targeted during migration. Like the other per-core masks
+ * below, each element points at one word for each context group.
  */
 std::vector<std::atomic<uint64_t>*> pinnedContexts;
 
@@ -147,11 +353,91 @@ std::vector<std::atomic<uint64_t>*> pinnedContexts;
 std::vector<uint64_t*> lastTotalCollectionTime;
 
 /**
- * Setting a jth bit in the ith element of this vector indicates that the
- * priority of the thread living at index j on core i is temporarily raised.
+ * Setting a jth bit in word g of the ith element of this vector indicates
+ * that the priority of the thread at index j of context group g on core i is
+ * temporarily raised.
  */
 std::vector<std::atomic<uint64_t>*> publicPriorityMasks;
 
+/**
+ * Setting the jth bit in word g of the ith element of this vector tells core
+ * i that the thread at index j of its context group g may have become
+ * runnable. Bits are set by whoever makes a context runnable from outside the
+ * core's dispatch loop: thread creation, signal(), and migration.
+ */
+std::vector<std::atomic<uint64_t>*> runnableMasks;
+
+/**
+ * The ith element holds the kernel thread id of an idle core which has asked
+ * core i for work, NO_STEAL_REQUEST if no core has, or STEAL_IN_PROGRESS while
+ * core i is handing threads over. Only core i itself moves its threads, since
+ * only it knows which of its contexts are not running.
+ */
+std::vector<std::atomic<int>*> stealRequests;
+const int NO_STEAL_REQUEST = -1;
+const int STEAL_IN_PROGRESS = -2;
+
+/**
+ * The ith element is nonzero while core i is parked in dispatch(), or about
+ * to park; it is the futex the core waits on. See parkCoreIfIdle.
+ */
+std::vector<std::atomic<uint32_t>*> parkedFlags;
+
+/**
+ * The ith element is the futex that core i waits on while it is a warm spare
+ * core that has not been started; it is set to start the core.
+ */
+std::vector<std::atomic<uint32_t>*> warmSpareWakeups;
+
+/**
+ * Incremented each time a CoreManager retires a CoreList; see
+ * retireCoreList.
+ */
+std::atomic<uint64_t> coreListEpoch(0);
+
+/**
+ * The ith element holds the value of coreListEpoch that core i saw at its
+ * most recent quiescent point, which is a point where none of its threads can
+ * hold a CoreList returned by CoreManager::getCores. Cores that are not
+ * running Arachne threads hold OFFLINE_EPOCH.
+ */
+std::vector<std::atomic<uint64_t>*> quiescentEpochs;
+const uint64_t OFFLINE_EPOCH = ~0UL;
+
+/**
+ * The number of threads outside Arachne that may hold a CoreList returned by
+ * CoreManager::getCores; see CoreListReader.
+ */
+std::atomic<int> numExternalCoreListReaders(0);
+
+/**
+ * CoreLists that have been retired but may still be in use, with the value
+ * of coreListEpoch at which each was retired. Protected by
+ * retiredCoreListsLock.
+ */
+std::vector<std::pair<CoreList*, uint64_t>> retiredCoreLists;
+SpinLock retiredCoreListsLock(false);
+
+/**
+ * Record that no thread on the current core holds a CoreList returned by
+ * CoreManager::getCores before this point.
+ */
+static inline void
+passQuiescentPoint() {
+    uint64_t epoch = coreListEpoch.load(std::memory_order_acquire);
+    if (core.localQuiescentEpoch->load(std::memory_order_relaxed) != epoch)
+        // Sequentially consistent, so that a core coming back online cannot
+        // read a CoreList before the reclaimer sees its new epoch.
+        core.localQuiescentEpoch->store(epoch);
+}
+
+/**
+ * An idle core withdraws a steal request that has not been served within
+ * this many nanoseconds, so that a victim which stops dispatching does not
+ * stall it forever.
+ */
+const uint64_t STEAL_REQUEST_TIMEOUT_NS = 100000;
+
 /* Which cores are idled? */
 std::atomic<bool>* isIdledArray;
 
@@ -169,6 +455,8 @@ thread_local Core core;
 bool disableLoadEstimation;
 // END   Testing-Specific Flags
 
+volatile bool priorityLevelsInUse = false;
+
 // Allocate storage for load-tracking pointers.
 thread_local uint64_t DispatchTimeKeeper::lastTotalCollectionTime;
 thread_local uint64_t DispatchTimeKeeper::dispatchStartCycles;
@@ -185,6 +473,13 @@ thread_local bool NestedDispatchDetector::dispatchRunning;
 bool useCoreArbiter = true;
 
 std::string coreArbiterSocketPath = PROD_SOCKET;
+
+/**
+ * When nonempty, scheduler events are traced from init onwards and written
+ * to this file by waitForTermination, or when the process aborts; see
+ * startTracing.
+ */
+std::string traceFile;
 CoreArbiterClient* coreArbiter = NULL;
 
 /*
@@ -195,6 +490,7 @@ CoreManager* coreManager = NULL;
 
 void releaseCore(CoreList* outputCores);
 void descheduleCore();
+void checkForArbiterRequest();
 
 /**
  * Allocate a block of memory aligned at the beginning of a cache line.
@@ -214,6 +510,213 @@ alignedAlloc(size_t size, size_t alignment) {
     return temp;
 }
 
+/**
+ * Reserve memory for a user stack, with an inaccessible guard page below it
+ * to catch stack overflows. Physical memory is committed by the kernel only
+ * as the stack is touched.
+ *
+ * \param size
+ *     The usable size of the stack; it is rounded up to a whole page.
+ * \return
+ *     The lowest usable address of the stack, immediately above the guard
+ *     page.
+ */
+void*
+allocateStack(size_t size) {
+    size = (size + PAGE_SIZE - 1) & ~static_cast<size_t>(PAGE_SIZE - 1);
+    void* base = mmap(NULL, size + PAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        ARACHNE_LOG(ERROR, "mmap of stack returned %s", strerror(errno));
+        exit(1);
+    }
+    if (mprotect(base, PAGE_SIZE, PROT_NONE) != 0) {
+        ARACHNE_LOG(ERROR, "mprotect of stack guard page returned %s",
+                    strerror(errno));
+        exit(1);
+    }
+    return reinterpret_cast<char*>(base) + PAGE_SIZE;
+}
+
+/**
+ * Release a stack obtained from allocateStack, including its guard page.
+ *
+ * \param stack
+ *     The value returned by allocateStack; NULL is ignored.
+ * \param size
+ *     The size that was passed to allocateStack.
+ */
+void
+releaseStack(void* stack, size_t size) {
+    if (stack == NULL)
+        return;
+    size = (size + PAGE_SIZE - 1) & ~static_cast<size_t>(PAGE_SIZE - 1);
+    munmap(reinterpret_cast<char*>(stack) - PAGE_SIZE, size + PAGE_SIZE);
+}
+
+/**
+ * Return the physical pages backing the unused portion of a stack to the
+ * kernel, while keeping the address range reserved. The lowest page, which
+ * holds the stack canary, and the page immediately below end are kept.
+ *
+ * \param stack
+ *     The value returned by allocateStack.
+ * \param end
+ *     An address in the live part of the stack; nothing at or above the page
+ *     below it is released.
+ */
+void
+trimStack(void* stack, void* end) {
+    uintptr_t start = reinterpret_cast<uintptr_t>(stack) + PAGE_SIZE;
+    uintptr_t limit = (reinterpret_cast<uintptr_t>(end) &
+                       ~static_cast<uintptr_t>(PAGE_SIZE - 1)) -
+                      PAGE_SIZE;
+    if (limit <= start)
+        return;
+#ifdef MADV_FREE
+    int advice = MADV_FREE;
+#else
+    int advice = MADV_DONTNEED;
+#endif
+    madvise(reinterpret_cast<void*>(start), limit - start, advice);
+}
+
+/**
+ * Leave this core's io_uring to be polled by the other cores if operations
+ * are still in flight as the core is released, or take it back as the core
+ * is granted again.
+ *
+ * \param orphaned
+ *     True if the core is being released.
+ */
+static void
+setIoRingOrphaned(bool orphaned) {
+    CoreIoRing* ioRing = ioRings[core.kernelThreadId];
+    if (ioRing->ring == NULL)
+        return;
+    std::lock_guard<SpinLock> _(ioRing->lock);
+    if (orphaned && ioRing->ring->inFlight() != 0 && !ioRing->orphaned) {
+        ioRing->ring->submit();
+        ioRing->orphaned = true;
+        numOrphanedIoRings++;
+    } else if (!orphaned && ioRing->orphaned) {
+        ioRing->orphaned = false;
+        numOrphanedIoRings--;
+    }
+}
+
+/**
+ * Wait as a warm spare core until incrementCoreCount starts this core, or
+ * Arachne shuts down.
+ */
+static void
+waitAsWarmSpare() {
+    std::atomic<uint32_t>* wakeup = warmSpareWakeups[core.kernelThreadId];
+    {
+        std::lock_guard<SpinLock> _(coreChangeMutex);
+        wakeup->store(0);
+        parkedWarmSpares.push_back(core.kernelThreadId);
+    }
+    while (wakeup->load() == 0 && !shutdown)
+        syscall(SYS_futex, wakeup, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+}
+
+/**
+ * Wake up a warm spare core that waits in waitAsWarmSpare.
+ *
+ * \param coreId
+ *     The core to wake up.
+ */
+static void
+wakeWarmSpare(int coreId) {
+    warmSpareWakeups[coreId]->store(1);
+    syscall(SYS_futex, warmSpareWakeups[coreId], FUTEX_WAKE_PRIVATE, 1, NULL,
+            NULL, 0);
+}
+
+/**
+ * Start one of the warm spare cores that are waiting, unless warmSpareBudget
+ * of them already run. Must be called with coreChangeMutex held.
+ *
+ * \return
+ *     True if a warm spare core was started.
+ */
+static bool
+startWarmSpare() {
+    if (parkedWarmSpares.empty() || numActiveWarmSpares >= warmSpareBudget)
+        return false;
+    int coreId = parkedWarmSpares.back();
+    parkedWarmSpares.pop_back();
+    warmSpareActive[coreId] = true;
+    numActiveWarmSpares++;
+    wakeWarmSpare(coreId);
+    return true;
+}
+
+/**
+ * Take a core out of the pool of the CoreManager so that it can be released:
+ * a running warm spare core if warmSpare is set, or a core from the core
+ * arbiter otherwise. Cores of the other kind that the CoreManager offers on
+ * the way are handed back to it. Must be called with coreChangeMutex held.
+ *
+ * \param warmSpare
+ *     Which kind of core to take.
+ * \return
+ *     The id of the core, or -1 if the CoreManager has none of that kind.
+ */
+static int
+takeCoreForRelease(bool warmSpare) {
+    std::vector<int> skippedCores;
+    int coreId;
+    while ((coreId = coreManager->coreUnavailable()) != -1 &&
+           warmSpareActive[coreId] != warmSpare)
+        skippedCores.push_back(coreId);
+    for (int skippedCore : skippedCores)
+        coreManager->coreAvailable(skippedCore);
+    return coreId;
+}
+
+/**
+ * Release one of the running warm spare cores. Its threads move to the other
+ * cores, and it goes back to waiting; the release is a core change that ends
+ * once the core has stopped. Must be called with coreChangeMutex held.
+ *
+ * \return
+ *     True if a warm spare core is being released.
+ */
+static bool
+releaseWarmSpare() {
+    if (numActiveWarmSpares == 0)
+        return false;
+    int coreId = takeCoreForRelease(true);
+    if (coreId == -1)
+        return false;
+    CoreList* outputCores = coreManager->getMigrationTargets();
+    bool released =
+        createThreadOnCore(coreId, releaseCore, outputCores) != NullThread;
+    outputCores->free();
+    if (!released) {
+        coreManager->coreAvailable(coreId);
+        ARACHNE_LOG(WARNING,
+                    "Release core thread creation failed to warm spare %d!\n",
+                    coreId);
+        return false;
+    }
+    coreChangeActive = true;
+    return true;
+}
+
+/**
+ * Release a running warm spare core for decrementCoreCount, which cannot do
+ * it itself because its callers may hold the lock of the CoreManager.
+ */
+static void
+releaseWarmSpareForDecrease() {
+    std::lock_guard<SpinLock> _(coreChangeMutex);
+    if (!releaseWarmSpare())
+        coreChangeActive = false;
+}
+
 /**
  * Main function for a kernel thread, which roughly corresponds to a core in the
  * current design of the system.
@@ -234,48 +737,106 @@ threadMain() {
     // with a global index.
     lastTotalCollectionTime[core.kernelThreadId] =
         &DispatchTimeKeeper::lastTotalCollectionTime;
+
+    // The kernel threads past maxNumCores are the warm spare cores. They
+    // never hold a core from the arbiter, and keep the stack that the
+    // dispatcher first runs on ready.
+    bool warmSpare = static_cast<uint32_t>(core.kernelThreadId) >= maxNumCores;
+    if (warmSpare)
+        allThreadContexts[core.kernelThreadId][0]->initializeStack();
+
     for (;;) {
-        coreArbiter->blockUntilCoreAvailable();
+        if (warmSpare)
+            waitAsWarmSpare();
+        else
+            coreArbiter->blockUntilCoreAvailable();
         // Prevent the use of abandoned ThreadContext which occurred as a
         // result of a shutdown request.
         if (shutdown)
             break;
         {
             std::lock_guard<SpinLock> _(coreChangeMutex);
+            // The cores from the arbiter may all have arrived before this
+            // warm spare got to run.
+            if (warmSpare && numPendingCoreIncrements == 0) {
+                warmSpareActive[core.kernelThreadId] = false;
+                numActiveWarmSpares--;
+                continue;
+            }
             core.localOccupiedAndCount = occupiedAndCount[core.kernelThreadId];
             core.localPinnedContexts = pinnedContexts[core.kernelThreadId];
             core.localThreadContexts = allThreadContexts[core.kernelThreadId];
+            core.localRunnableMask = runnableMasks[core.kernelThreadId];
+            core.localQuiescentEpoch = quiescentEpochs[core.kernelThreadId];
+            passQuiescentPoint();
+
+            // Correct the ThreadContext.coreId() here to match the existing
+            // core, and reset the stacks that have already been allocated.
+            // This must finish before the core is made available, since
+            // thread creations allocate stacks for contexts that lack one.
+            // Context 0 always needs a stack, because the dispatcher first
+            // runs on it.
+            for (int g = 0; g < numContextGroups; g++)
+                core.groups[g].residentIdleStacks = 0;
+            for (uint8_t k = 0; k < maxThreadsPerCore; k++) {
+                ThreadContext* context = core.localThreadContexts[k];
+                context->coreId = static_cast<uint8_t>(core.kernelThreadId);
+                if (k == 0 || context->stack != NULL) {
+                    context->initializeStack();
+                    core.groups[contextGroupOf(k)].residentIdleStacks |=
+                        contextBit(k);
+                }
+            }
 
             DispatchTimeKeeper::lastTotalCollectionTime = 0;
             // Clean up state from the previous thread that was using this data
             // structure.
-            *core.localOccupiedAndCount = {0, 0};
-            *publicPriorityMasks[core.kernelThreadId] = 0;
-            core.privatePriorityMask = 0;
+            uint64_t now = Cycles::rdtsc();
+            for (int g = 0; g < numContextGroups; g++) {
+                ContextGroup& group = core.groups[g];
+                core.localOccupiedAndCount[g] = {0, 0};
+                publicPriorityMasks[core.kernelThreadId][g] = 0;
+                group.privatePriorityMask = 0;
+                core.localRunnableMask[g] = 0;
+                group.privateRunnableMask = 0;
+                group.timerWheel.reset(now);
+                group.priorityScheduler.reset(now);
+                group.passMask = ~0UL;
+                // The dispatcher first runs on context 0, so it must not be
+                // chosen as a migration target by other cores.
+                core.localPinnedContexts[g] = g == 0 ? 1 : 0;
+            }
+            core.priorityScheduler.reset(now);
+            core.nextCandidateGroup = 0;
+            core.nextCandidateIndex = 0;
+            core.idleSinceCycles = 0;
+            setIoRingOrphaned(false);
+            *stealRequests[core.kernelThreadId] = NO_STEAL_REQUEST;
+            core.stealVictim = NO_STEAL_REQUEST;
             coreManager->coreAvailable(core.kernelThreadId);
 
             // This marks the point at which new thread creations may begin.
             numActiveCores++;
             ARACHNE_LOG(DEBUG, "Number of cores increased from %d to %d\n",
                         numActiveCores - 1, numActiveCores.load());
+            traceEvent(TRACE_CORE_INCREMENT, NULL, 0, numActiveCores.load());
 #if TIME_TRACE
             TimeTrace::record("Core Count %d --> %d", numActiveCores - 1,
                               numActiveCores.load());
 #endif
-            if (coreChangeActive)
+            // A core from the arbiter that arrives after a warm spare took
+            // its place takes that place back.
+            bool releasingWarmSpare = false;
+            if (numPendingCoreIncrements > 0)
+                numPendingCoreIncrements--;
+            else if (!warmSpare && !coreChangeActive)
+                releasingWarmSpare = releaseWarmSpare();
+            if (coreChangeActive && numPendingCoreIncrements == 0 &&
+                !releasingWarmSpare)
                 coreChangeActive = false;
             PerfStats::threadStats.numCoreIncrements++;
         }
 
-        // Correct the ThreadContext.coreId() here to match the existing core.
-        // It is valid to initialize this after incrementing numActiveCores
-        // because thread creations do not touch these variables.
-        for (uint8_t k = 0; k < maxThreadsPerCore; k++) {
-            core.localThreadContexts[k]->coreId =
-                static_cast<uint8_t>(core.kernelThreadId);
-            core.localThreadContexts[k]->initializeStack();
-        }
-
         // Correct statistics
         DispatchTimeKeeper::numThreadsRan = 0;
         DispatchTimeKeeper::lastDispatchIterationStart = Cycles::rdtsc();
@@ -288,8 +849,25 @@ threadMain() {
         swapcontext(&core.loadedContext->sp,
                     &kernelThreadStacks[core.kernelThreadId]);
         numActiveCores--;
+        traceEvent(TRACE_CORE_DECREMENT, NULL, 0, numActiveCores.load());
+        core.localQuiescentEpoch->store(OFFLINE_EPOCH);
+        setIoRingOrphaned(true);
+        // Drop any request that idle cores made of this core while it was
+        // being released.
+        *stealRequests[core.kernelThreadId] = NO_STEAL_REQUEST;
         if (shutdown)
             break;
+        if (warmSpare) {
+            // Only releaseWarmSpare stops warm spare cores, and the arbiter
+            // has no part in it.
+            std::lock_guard<SpinLock> _(coreChangeMutex);
+            ARACHNE_LOG(DEBUG, "Number of cores decreased from %d to %d\n",
+                        numActiveCores + 1, numActiveCores.load());
+            warmSpareActive[core.kernelThreadId] = false;
+            numActiveWarmSpares--;
+            coreChangeActive = false;
+            continue;
+        }
         {
             std::lock_guard<SpinLock> _(coreChangeMutex);
             ARACHNE_LOG(DEBUG, "Number of cores decreased from %d to %d\n",
@@ -299,6 +877,8 @@ threadMain() {
                               numActiveCores.load());
 #endif
             coreChangeActive = false;
+            // A release ends any increase that was still waiting for cores.
+            numPendingCoreIncrements = 0;
 
             // Cleanup is completed, so we can carry on with the next core
             // release if needed.
@@ -356,6 +936,352 @@ void __attribute__((noinline)) swapcontext(void** saved, void** target) {
         "popq %r12");
 }
 
+/**
+ * Switch back to the kernel-provided stack of the current core if the core is
+ * being ramped down, so that the kernel thread can block in the Core Arbiter.
+ *
+ * This function and the two that follow it are kept out of line so that they
+ * read the per-core state of the core they run on. A context can resume on a
+ * different core than the one it was switched out on, and compilers are free
+ * to keep the address of thread-local storage in a register across calls.
+ */
+static void __attribute__((noinline)) yieldCoreIfRequested() {
+    if (core.threadShouldYield) {
+        // Switch back to our kernel-provided stack to block in the Core
+        // Arbiter, since the next time this thread unblocks, it may not
+        // live on the same core, and will use a different set of user
+        // contexts.
+        core.threadShouldYield = false;
+        swapcontext(&kernelThreadStacks[core.kernelThreadId],
+                    &core.loadedContext->sp);
+    }
+}
+
+/**
+ * Add a thread to the pending queue of a core, and wake the core in case it
+ * is parked with a context that has become free.
+ *
+ * \param coreId
+ *     The core on which the thread should run.
+ * \param pending
+ *     The thread to queue.
+ * \return
+ *     True if the thread was queued; false if the queue already holds
+ *     pendingThreadQueueDepth threads, or the core no longer accepts new
+ *     threads because it is being released.
+ */
+bool
+queuePendingThread(uint32_t coreId, const PendingThread& pending) {
+    PendingThreadQueue* queue = pendingThreadQueues[coreId];
+    {
+        std::lock_guard<SpinLock> _(queue->lock);
+        // Once creations are blocked, movePendingThreads may already have
+        // emptied the queue for the last time.
+        if (queue->threads.size() >= pendingThreadQueueDepth ||
+            occupiedAndCount[coreId][0].load().numOccupied >
+                contextGroupSize(0))
+            return false;
+        queue->threads.push_back(pending);
+        queue->size = static_cast<uint32_t>(queue->threads.size());
+    }
+    wakeCoreIfParked(static_cast<int>(coreId));
+    return true;
+}
+
+/**
+ * Remove the oldest thread from the pending queue of the current core.
+ *
+ * \param[out] pending
+ *     Filled in with the thread.
+ * \return
+ *     False if the queue was empty.
+ */
+static bool
+takePendingThread(PendingThread* pending) {
+    PendingThreadQueue* queue = pendingThreadQueues[core.kernelThreadId];
+    if (queue->size.load(std::memory_order_relaxed) == 0)
+        return false;
+    std::lock_guard<SpinLock> _(queue->lock);
+    if (queue->threads.empty())
+        return false;
+    *pending = queue->threads.front();
+    queue->threads.pop_front();
+    queue->size = static_cast<uint32_t>(queue->threads.size());
+    return true;
+}
+
+/**
+ * Start a thread taken from the pending queue of the current core in one of
+ * its contexts, which the caller has already marked occupied. The thread is
+ * runnable once the caller has set its bit in runnableMasks, unless it is
+ * started in the current context.
+ */
+static void
+startPendingThread(const PendingThread& pending, ThreadContext* threadContext) {
+    if (unlikely(threadContext->stack == NULL))
+        threadContext->initializeStack();
+    pending.place(pending.invocation, threadContext);
+    threadContext->threadClass = 0;
+    threadContext->priority = 0;
+    threadContext->creationTimeInCycles = Cycles::rdtsc();
+    traceEvent(TRACE_CREATE, threadContext, threadContext->generation,
+               core.kernelThreadId);
+    threadContext->wakeupTimeInCycles = 0;
+    PerfStats::threadStats.numThreadsCreated++;
+}
+
+/**
+ * Return true if the current core has pending threads and a free context to
+ * start one in.
+ */
+static inline bool
+canStartPendingThreads() {
+    return pendingThreadQueueDepth != 0 &&
+           pendingThreadQueues[core.kernelThreadId]->size.load() != 0 &&
+           numOccupiedContexts(core.localOccupiedAndCount) <
+               static_cast<uint32_t>(maxThreadsPerCore);
+}
+
+/**
+ * Start pending threads in the free contexts of the current core. Pending
+ * threads usually take over the contexts of exiting threads, but contexts
+ * also become free when threads are stolen or migrated away, or if the queue
+ * was filled while a context was free. Called by dispatch() once per pass.
+ */
+static void
+startPendingThreads() {
+    PendingThreadQueue* queue = pendingThreadQueues[core.kernelThreadId];
+    uint32_t coreId = static_cast<uint32_t>(core.kernelThreadId);
+    for (int group = 0; group < numContextGroups && canStartPendingThreads();
+         group++) {
+        // No other core removes threads from this queue, so each of the
+        // reserved contexts gets a thread.
+        int failureCount = 0;
+        uint64_t reserved = reserveSlotsOnCore(
+            coreId, group, queue->size.load(), &failureCount);
+        ThreadContext** contexts =
+            core.localThreadContexts + firstContextInGroup(group);
+        for (uint64_t slots = reserved; slots != 0; slots &= slots - 1) {
+            PendingThread pending;
+            takePendingThread(&pending);
+            startPendingThread(pending, contexts[__builtin_ctzll(slots)]);
+        }
+        runnableMasks[coreId][group] |= reserved;
+    }
+    PerfStats::threadStats.numPendingThreads = queue->size.load();
+}
+
+/**
+ * Hand the pending threads of the current core, which is being released, to
+ * the pending queues of the given cores. Creations on the current core must
+ * already be blocked, so that no more threads are queued on it.
+ */
+static void
+movePendingThreads(CoreList* outputCores) {
+    if (pendingThreadQueueDepth == 0 || outputCores->size() == 0)
+        return;
+    PendingThreadQueue* queue = pendingThreadQueues[core.kernelThreadId];
+    std::deque<PendingThread> threads;
+    {
+        std::lock_guard<SpinLock> _(queue->lock);
+        threads.swap(queue->threads);
+        queue->size = 0;
+    }
+    // The threads were already admitted, so the targets take them even
+    // beyond pendingThreadQueueDepth.
+    for (size_t i = 0; i < threads.size(); i++) {
+        int coreId = outputCores->get(static_cast<uint32_t>(
+            i % outputCores->size()));
+        PendingThreadQueue* target = pendingThreadQueues[coreId];
+        {
+            std::lock_guard<SpinLock> _(target->lock);
+            target->threads.push_back(threads[i]);
+            target->size = static_cast<uint32_t>(target->threads.size());
+        }
+        wakeCoreIfParked(coreId);
+    }
+    PerfStats::threadStats.numPendingThreads = 0;
+}
+
+/**
+ * Run the main function of the thread that dispatch() placed in the current
+ * context.
+ */
+static void __attribute__((noinline)) runLoadedThread() {
+    uint8_t idInCore = core.loadedContext->idInCore;
+    core.groups[contextGroupOf(idInCore)].residentIdleStacks &=
+        ~contextBit(idInCore);
+    void* invocation = &core.loadedContext->threadInvocation;
+    (*reinterpret_cast<ThreadTrampoline*>(invocation))(invocation);
+}
+
+/**
+ * Clear the occupied bit of the current context, whose thread has exited.
+ *
+ * \param selfGroup
+ *     The context group of the current context.
+ * \param selfMask
+ *     The bit of the current context in the masks of its group.
+ */
+static inline void
+releaseLoadedContext(int selfGroup, uint64_t selfMask) {
+    // Pin the current context before clearing the occupied bit.
+    for (int g = 0; g < numContextGroups; g++)
+        core.localPinnedContexts[g] = g == selfGroup ? selfMask : 0;
+
+    // The code below clears the occupied flag for the current
+    // ThreadContext.
+    //
+    // While this logically comes before dispatch(), it is here to prevent
+    // it from racing against thread creations that come before the start
+    // of the outer loop, since the occupied flags for such creations would
+    // get wiped out by this code.
+    bool success;
+    MaskAndCount slotMap;
+    std::atomic<MaskAndCount>* groupSlotMap =
+        &core.localOccupiedAndCount[selfGroup];
+    do {
+        slotMap = *groupSlotMap;
+        MaskAndCount oldSlotMap = slotMap;
+        if (slotMap.numOccupied == 0)
+            abort();
+        slotMap.numOccupied--;
+
+        slotMap.occupied =
+            slotMap.occupied & ~selfMask & 0x00FFFFFFFFFFFFFF;
+        success = groupSlotMap->compare_exchange_strong(oldSlotMap, slotMap);
+    } while (!success);
+}
+
+static inline void recordDispatch(ThreadContext* target,
+                                  uint64_t dispatchEntryCycles, uint64_t now);
+
+/**
+ * Return true if a thread that was just started in the current context can
+ * run right away, because a pass of dispatch() would find no other work on
+ * this core: no other runnable contexts, no expired timers and no I/O to
+ * poll.
+ */
+static bool
+canRunHandedOffThread() {
+    checkForArbiterRequest();
+    if (shutdown || core.threadShouldYield || ioRingsInUse)
+        return false;
+    uint64_t now = Cycles::rdtsc();
+    for (int g = 0; g < numContextGroups; g++) {
+        ContextGroup& group = core.groups[g];
+        if (group.privateRunnableMask || group.privatePriorityMask ||
+            core.localRunnableMask[g].load(std::memory_order_relaxed) ||
+            publicPriorityMasks[core.kernelThreadId][g].load(
+                std::memory_order_relaxed) ||
+            group.timerWheel.nextExpiryInCycles() <= now)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Release the current context after its thread's main function has returned,
+ * or hand it to a pending thread, and wake up the threads joining it.
+ *
+ * \return
+ *     True if a pending thread took over the current context and should run
+ *     immediately, as if dispatch() had picked it.
+ */
+static bool __attribute__((noinline)) finishLoadedThread() {
+    // Cancel any wakeups the thread may have scheduled for itself before
+    // exiting.
+    core.loadedContext->wakeupTimeInCycles = UNOCCUPIED;
+    traceEvent(TRACE_EXIT, core.loadedContext, core.loadedContext->generation);
+    PerfStats::threadStats.record(
+        &PerfStats::threadStats.threadLifetimeCycles,
+        Cycles::rdtsc() - core.loadedContext->creationTimeInCycles);
+
+    uint8_t idInCore = core.loadedContext->idInCore;
+    int selfGroup = contextGroupOf(idInCore);
+    ContextGroup& group = core.groups[selfGroup];
+    uint64_t selfMask = contextBit(idInCore);
+
+    // A thread waiting for a context on this core takes over this one, so
+    // that its slot is neither released nor reserved again, and its stack
+    // stays in use.
+    PendingThread pending;
+    bool handOff = pendingThreadQueueDepth != 0 && takePendingThread(&pending);
+
+    // Otherwise keep this stack resident for the next thread in this
+    // context, unless the core already holds enough idle stacks. Only the
+    // pages below the current frame are dead, so only those are released.
+    if (!handOff) {
+        int numResidentIdleStacks =
+            __builtin_popcountll(group.residentIdleStacks & ~selfMask);
+        for (int g = 0; g < numContextGroups; g++) {
+            if (g != selfGroup)
+                numResidentIdleStacks +=
+                    __builtin_popcountll(core.groups[g].residentIdleStacks);
+        }
+        if (numResidentIdleStacks >= stackPoolHighWaterMark) {
+            trimStack(core.loadedContext->stack, __builtin_frame_address(0));
+        } else {
+            group.residentIdleStacks |= selfMask;
+        }
+    }
+
+    // The positioning of this lock is rather subtle, and makes the
+    // following three operations atomic.
+    //   1. Bumping the generation number.
+    //   2. Clearing the occupied bit for this context.
+    //   3. Notifying joiners that this thread has fully exited.
+
+    // It is important to notify joiners only after we have cleared our
+    // occupied bit, because thread creations by the joiner will fail
+    // even if this thread has logically exited. However, this context
+    // cannot contend for a lock after its occupied bit has been cleared,
+    // because it would never awaken once it started to spin. Thus, the
+    // lock must be taken and held throughout the process of clearing the
+    // occupied bit and notifying threads attempting to join this thread.
+    ThreadContext* context = core.loadedContext;
+    {
+        std::lock_guard<SpinLock> joinGuard(context->joinLock);
+
+        // Bump the generation number for the next newborn thread. This must
+        // be done under the joinLock, since any joiner that observed the new
+        // generation number might assume that the occupied bit for this
+        // context is already cleared.
+        context->generation++;
+
+        // A context that is handed off stays occupied.
+        if (!handOff)
+            releaseLoadedContext(selfGroup, selfMask);
+
+        // Threads that nobody joins, which are most short-lived ones, skip
+        // the pass over joinCV.
+        if (context->joinerWaiting) {
+            context->joinerWaiting = false;
+            context->joinCV.notifyAll();
+        }
+    }
+
+    // Newborn threads should not have elevated priority, even if the
+    // predecessors had leftover priority
+    group.privatePriorityMask &= ~selfMask;
+    publicPriorityMasks[core.kernelThreadId][selfGroup] &= ~selfMask;
+    PerfStats::threadStats.numThreadsFinished++;
+
+    if (!handOff)
+        return false;
+    startPendingThread(pending, context);
+
+    // The new thread runs without a pass of dispatch() when such a pass
+    // would find nothing else to run; otherwise it waits for its turn.
+    if (!canRunHandedOffThread())
+        return false;
+    context->wakeupTimeInCycles = BLOCKED;
+    DispatchTimeKeeper::numThreadsRan++;
+    uint64_t now = Cycles::rdtsc();
+    recordDispatch(context, now, now);
+    return true;
+}
+
 /**
  * This is the top level method executed by each thread context. It is never
  * directly invoked. Instead, the thread's context is set up to "return" to
@@ -373,92 +1299,16 @@ schedulerMainLoop() {
     while (true) {
         // Check for whether this thread should exit, for the purposes of
         // ramping down.
-        if (core.threadShouldYield) {
-            // Switch back to our kernel-provided stack to block in the Core
-            // Arbiter, since the next time this thread unblocks, it may not
-            // live on the same core, and will use a different set of user
-            // contexts.
-            core.threadShouldYield = false;
-            swapcontext(&kernelThreadStacks[core.kernelThreadId],
-                        &core.loadedContext->sp);
-        }
+        yieldCoreIfRequested();
         // No thread to execute yet. This call will not return until we have
         // been assigned a new Arachne thread.
         dispatch();
-        reinterpret_cast<ThreadInvocationEnabler*>(
-            &core.loadedContext->threadInvocation)
-            ->runThread();
-        // The thread has exited.
-        // Cancel any wakeups the thread may have scheduled for itself before
-        // exiting.
-        core.loadedContext->wakeupTimeInCycles = UNOCCUPIED;
-
-        // The positioning of this lock is rather subtle, and makes the
-        // following three operations atomic.
-        //   1. Bumping the generation number.
-        //   2. Clearing the occupied bit for this context.
-        //   3. Notifying joiners that this thread has fully exited.
-
-        // It is important to notify joiners only after we have cleared our
-        // occupied bit, because thread creations by the joiner will fail
-        // even if this thread has logically exited. However, this context
-        // cannot contend for a lock after its occupied bit has been cleared,
-        // because it would never awaken once it started to spin. Thus, the
-        // lock must be taken and held throughout the process of clearing the
-        // occupied bit and notifying threads attempting to join this thread.
-        std::lock_guard<SpinLock> joinGuard(core.loadedContext->joinLock);
-
-        // Bump the generation number for the next newborn thread. This must be
-        // done under the joinLock, since any joiner that observed the new
-        // generation number might assume that the occupied bit for this
-        // context is already cleared.
-        core.loadedContext->generation++;
-
-        // Pin the current context before clearing the occupied bit.
-        *core.localPinnedContexts = 1 << core.loadedContext->idInCore;
-
-        // The code below clears the occupied flag for the current
-        // ThreadContext.
-        //
-        // While this logically comes before dispatch(), it is here to prevent
-        // it from racing against thread creations that come before the start
-        // of the outer loop, since the occupied flags for such creations would
-        // get wiped out by this code.
-        bool success;
-        MaskAndCount slotMap;
+        // Threads that take over this context from an exiting thread may
+        // run on its stack back to back.
         do {
-            slotMap = *core.localOccupiedAndCount;
-            MaskAndCount oldSlotMap = slotMap;
-            if (slotMap.numOccupied == 0)
-                abort();
-            slotMap.numOccupied--;
-
-            slotMap.occupied = slotMap.occupied &
-                               ~(1L << core.loadedContext->idInCore) &
-                               0x00FFFFFFFFFFFFFF;
-            success = core.localOccupiedAndCount->compare_exchange_strong(
-                oldSlotMap, slotMap);
-        } while (!success);
-
-        // Reset highestOccupiedContext based on value of occupied flag, which
-        // we just CASed in.
-        uint64_t occupied = slotMap.occupied;
-        // The result of __builtin_clzll is undefined if occupied is 0.
-        // The function __builtin_clzll returns the number leading 0-bits,
-        // so subtract the return value of 63 to get a zero-based bit index
-        core.highestOccupiedContext =
-            occupied == 0
-                ? 0
-                : static_cast<uint8_t>(63 - __builtin_clzll(occupied));
-
-        // Newborn threads should not have elevated priority, even if the
-        // predecessors had leftover priority
-        core.privatePriorityMask &= ~(1L << (core.loadedContext->idInCore));
-        *publicPriorityMasks[core.kernelThreadId] &=
-            ~(1L << (core.loadedContext->idInCore));
-        PerfStats::threadStats.numThreadsFinished++;
-
-        core.loadedContext->joinCV.notifyAll();
+            runLoadedThread();
+            // The thread has exited.
+        } while (finishLoadedThread());
     }
 }
 
@@ -471,7 +1321,7 @@ void
 yield() {
     if (!core.loadedContext)
         return;
-    if (core.localOccupiedAndCount->load().numOccupied == 1 && !shutdown &&
+    if (numOccupiedContexts(core.localOccupiedAndCount) == 1 && !shutdown &&
         !core.threadShouldYield)
         return;
     // This thread is still runnable since it is merely yielding.
@@ -485,8 +1335,22 @@ yield() {
  */
 void
 sleep(uint64_t ns) {
-    core.loadedContext->wakeupTimeInCycles =
-        Cycles::rdtsc() + Cycles::fromNanoseconds(ns);
+    sleepUntil(Cycles::rdtsc() + Cycles::fromNanoseconds(ns));
+}
+
+/**
+ * Sleep until the cycle counter reaches at least wakeupTimeInCycles. The
+ * thread waits in its core's timer wheel, so it costs nothing to dispatch()
+ * until its deadline is near. A signal() ends the sleep early and cancels
+ * the timer.
+ *
+ * \param wakeupTimeInCycles
+ *     The value of Cycles::rdtsc() after which this thread should resume.
+ *     Times in the past cause this call to behave like yield().
+ */
+void
+sleepUntil(uint64_t wakeupTimeInCycles) {
+    core.loadedContext->wakeupTimeInCycles = wakeupTimeInCycles;
     dispatch();
 }
 
@@ -504,6 +1368,455 @@ getThreadId() {
                : Arachne::NullThread;
 }
 
+/**
+ * Run a call on a kernel thread of blockingCallPool, blocking the current
+ * Arachne thread until it returns; see blockingCall.
+ *
+ * \param call
+ *     The call to run.
+ */
+void
+runBlockingCall(const std::function<void()>& call) {
+    if (!core.loadedContext || blockingCallPool == NULL) {
+        call();
+        return;
+    }
+    uint64_t startTime = Cycles::rdtsc();
+    blockingCallPool->run(call);
+    PerfStats& stats = PerfStats::threadStats;
+    stats.beginUpdate();
+    stats.numBlockingCalls++;
+    stats.blockingCallCycles.record(Cycles::rdtsc() - startTime);
+    stats.endUpdate();
+}
+
+/**
+ * Change the priority level of the current thread. The new level takes effect
+ * the next time the thread becomes runnable; see PriorityScheduler. Levels are
+ * chosen for each core as a whole, so they hold across all of its context
+ * groups when the core has more than 56 threads.
+ *
+ * \param priority
+ *     The new priority level; must be less than
+ *     PriorityScheduler::NUM_PRIORITY_LEVELS.
+ * \return
+ *     False if priority is out of range or this is not an Arachne thread, in
+ *     which case nothing is changed.
+ */
+bool
+setPriority(int priority) {
+    if (!core.loadedContext || priority < 0 ||
+        priority >= PriorityScheduler::NUM_PRIORITY_LEVELS)
+        return false;
+    core.loadedContext->priority = static_cast<uint8_t>(priority);
+    if (priority != 0)
+        priorityLevelsInUse = true;
+    return true;
+}
+
+/**
+ * Gather the contexts on the current core that may have become runnable since
+ * the previous pass of dispatch(): those that other cores marked in
+ * core.localRunnableMask, and sleepers whose deadline has passed.
+ *
+ * \param now
+ *     The current time in cycles.
+ */
+static inline void
+collectRunnableContexts(uint64_t now) {
+    for (int g = 0; g < numContextGroups; g++) {
+        ContextGroup& group = core.groups[g];
+        std::atomic<uint64_t>& runnableMask = core.localRunnableMask[g];
+        if (runnableMask.load(std::memory_order_relaxed))
+            group.privateRunnableMask |= runnableMask.exchange(0);
+
+        ThreadContext** contexts =
+            core.localThreadContexts + firstContextInGroup(g);
+        uint64_t expired = group.timerWheel.advance(now);
+        while (expired) {
+            // ffsll returns a 1-based index.
+            uint8_t index = static_cast<uint8_t>(ffsll(expired) - 1);
+            expired &= expired - 1;
+            uint64_t wakeupTime = contexts[index]->wakeupTimeInCycles;
+            if (wakeupTime <= now)
+                group.privateRunnableMask |= 1L << index;
+            else if (wakeupTime < UNOCCUPIED)
+                // Came out of a coarse bucket before its deadline.
+                group.timerWheel.insert(index, wakeupTime);
+            // Otherwise the sleeper was signaled and has blocked again, or has
+            // exited.
+        }
+    }
+}
+
+/**
+ * Return true if some context of the current core is left for dispatch() to
+ * check in the current pass.
+ */
+static inline bool
+havePrivateRunnableContexts() {
+    for (int g = 0; g < numContextGroups; g++)
+        if (core.groups[g].privateRunnableMask)
+            return true;
+    return false;
+}
+
+/**
+ * Choose the priority level served by the next pass of dispatch() over the
+ * contexts in the privateRunnableMask of each context group, and restrict the
+ * pass to that level. The level is the same in every group.
+ *
+ * \param now
+ *     The current time in cycles.
+ */
+static void
+startPriorityPass(uint64_t now) {
+    uint32_t runnableLevels = 0;
+    for (int g = 0; g < numContextGroups; g++) {
+        ContextGroup& group = core.groups[g];
+        ThreadContext** contexts =
+            core.localThreadContexts + firstContextInGroup(g);
+        // Levels are refreshed on every pass, so that new threads and calls
+        // to setPriority are seen without any coordination with other cores.
+        uint64_t runnable = group.privateRunnableMask;
+        while (runnable) {
+            // ffsll returns a 1-based index.
+            uint8_t index = static_cast<uint8_t>(ffsll(runnable) - 1);
+            runnable &= runnable - 1;
+            group.priorityScheduler.setLevel(index, contexts[index]->priority);
+        }
+        uint64_t groupRunnable = group.privateRunnableMask;
+        runnableLevels |=
+            group.priorityScheduler.getRunnableLevels(groupRunnable);
+    }
+    int level = core.priorityScheduler.chooseLevel(runnableLevels, now);
+    for (int g = 0; g < numContextGroups; g++)
+        core.groups[g].passMask =
+            core.groups[g].priorityScheduler.getLevelMask(level);
+}
+
+/**
+ * Called by dispatch() once per pass; once the core has found no runnable
+ * thread for parkAfterIdleNs, block its kernel thread until another core
+ * makes one of its contexts runnable, its next sleeping thread may be due,
+ * or MAX_PARK_NS has passed.
+ *
+ * \param now
+ *     The current time in cycles.
+ */
+static void
+parkCoreIfIdle(uint64_t now, bool ioInFlight) {
+    // Completions are only noticed by polling, so the core stays awake while
+    // I/O is in flight.
+    if (havePrivateRunnableContexts() || ioInFlight) {
+        core.idleSinceCycles = 0;
+        return;
+    }
+    if (core.idleSinceCycles == 0) {
+        core.idleSinceCycles = now;
+        return;
+    }
+    if (now - core.idleSinceCycles < Cycles::fromNanoseconds(parkAfterIdleNs))
+        return;
+    uint64_t deadline = now + Cycles::fromNanoseconds(MAX_PARK_NS);
+    for (int g = 0; g < numContextGroups; g++)
+        deadline =
+            std::min(deadline, core.groups[g].timerWheel.nextExpiryInCycles());
+    if (deadline <= now)
+        return;
+
+    // Announce the park before checking for work one last time; whoever
+    // makes a context runnable or queues a thread sets its bit or adds the
+    // thread before checking the flag, so either the work is seen here or
+    // the flag is seen by wakeCoreIfParked.
+    std::atomic<uint32_t>* parked = parkedFlags[core.kernelThreadId];
+    parked->store(1);
+    bool runnable = canStartPendingThreads();
+    for (int g = 0; g < numContextGroups; g++)
+        runnable = runnable || core.localRunnableMask[g].load();
+    if (!runnable && !shutdown) {
+        // A parked core holds no CoreList.
+        core.localQuiescentEpoch->store(OFFLINE_EPOCH);
+        uint64_t timeoutNs = Cycles::toNanoseconds(deadline - now);
+        struct timespec timeout;
+        timeout.tv_sec = static_cast<time_t>(timeoutNs / 1000000000);
+        timeout.tv_nsec = static_cast<long>(timeoutNs % 1000000000);
+        syscall(SYS_futex, parked, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0);
+        passQuiescentPoint();
+        PerfStats::threadStats.numCoreParks++;
+    }
+    parked->store(0);
+}
+
+/**
+ * Submit the I/O operations that threads on this core have started since the
+ * last pass, and signal the threads whose operations have completed. Cores
+ * also poll the rings of released cores until their operations finish.
+ * Called by dispatch() once per pass while ioRingsInUse is set.
+ *
+ * \return
+ *     True if some of the polled operations are still in flight.
+ */
+static bool
+pollIoRings() {
+    auto complete = [](uint64_t userData, int32_t result) {
+        IoRequest* request = reinterpret_cast<IoRequest*>(userData);
+        request->result = result;
+        ThreadId waiter = request->waiter;
+        // The request lives on the waiter's stack, so it must not be
+        // touched once done is set.
+        request->done.store(true, std::memory_order_release);
+        signal(waiter);
+    };
+    uint64_t startTime = Cycles::rdtsc();
+    uint32_t numCompletions = 0;
+    bool inFlight = false;
+    CoreIoRing* own = ioRings[core.kernelThreadId];
+    if (own->ring != NULL && own->lock.try_lock()) {
+        own->ring->submit();
+        numCompletions += own->ring->reap(complete);
+        inFlight = own->ring->inFlight() != 0;
+        own->lock.unlock();
+    }
+    if (numOrphanedIoRings.load(std::memory_order_relaxed) != 0) {
+        inFlight = true;
+        for (CoreIoRing* orphan : ioRings) {
+            if (!orphan->orphaned || !orphan->lock.try_lock())
+                continue;
+            if (orphan->orphaned) {
+                orphan->ring->submit();
+                numCompletions += orphan->ring->reap(complete);
+                if (orphan->ring->inFlight() == 0) {
+                    orphan->orphaned = false;
+                    numOrphanedIoRings--;
+                }
+            }
+            orphan->lock.unlock();
+        }
+    }
+    PerfStats& stats = PerfStats::threadStats;
+    stats.numIoPolls++;
+    stats.numIoCompletions += numCompletions;
+    stats.ioPollCycles += Cycles::rdtsc() - startTime;
+    return inFlight;
+}
+
+/**
+ * Perform an I/O operation through the io_uring of the current core, blocking
+ * the calling thread until it completes. The operation is submitted to the
+ * kernel at the end of the core's current pass, together with those of the
+ * other threads on the core.
+ *
+ * \param opcode
+ *     The IORING_OP_* code of the operation.
+ * \param fd
+ *     The file descriptor to operate on.
+ * \param addr
+ *     The address of the buffer, or the operation-specific pointer.
+ * \param len
+ *     The length of the buffer.
+ * \param offset
+ *     The file offset, or the operation-specific value.
+ * \param[out] result
+ *     Set to the return value of the operation, or a negated errno.
+ * \return
+ *     False, without starting the operation, if it cannot be done through an
+ *     io_uring because the caller is not an Arachne thread or the kernel
+ *     lacks io_uring; the caller must then make an ordinary system call.
+ */
+static bool
+ringIo(uint8_t opcode, int fd, uint64_t addr, uint32_t len, uint64_t offset,
+       int32_t* result) {
+    if (!core.loadedContext || ioRings.empty())
+        return false;
+    IoRequest request;
+    request.waiter = getThreadId();
+    request.result = 0;
+    request.done = false;
+    for (;;) {
+        CoreIoRing* ioRing = ioRings[core.kernelThreadId];
+        ioRing->lock.lock();
+        if (ioRing->ring == NULL && !ioRing->unavailable) {
+            ioRing->ring = IoRing::create(IO_RING_ENTRIES);
+            if (ioRing->ring == NULL) {
+                ioRing->unavailable = true;
+                ARACHNE_LOG(WARNING,
+                            "Unable to create an io_uring on core %d; using "
+                            "blocking system calls for I/O\n",
+                            core.kernelThreadId);
+            } else {
+                ioRingsInUse = true;
+            }
+        }
+        if (ioRing->unavailable) {
+            ioRing->lock.unlock();
+            return false;
+        }
+        // Leave room in the completion queue for every operation in flight.
+        if (ioRing->ring->inFlight() < IO_RING_ENTRIES &&
+            ioRing->ring->prepare(opcode, fd, addr, len, offset,
+                                  reinterpret_cast<uint64_t>(&request))) {
+            ioRing->lock.unlock();
+            break;
+        }
+        ioRing->ring->submit();
+        ioRing->lock.unlock();
+        yield();
+    }
+    while (!request.done.load(std::memory_order_acquire))
+        block();
+    *result = request.result;
+    return true;
+}
+
+/**
+ * Convert the result of an io_uring operation to the return convention of the
+ * corresponding system call.
+ */
+static ssize_t
+ioResult(int32_t result) {
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    return result;
+}
+
+/**
+ * Read from a file descriptor without blocking the other threads on the
+ * current core: the read is performed through the core's io_uring, and
+ * only the calling thread waits for its completion. Outside of Arachne
+ * threads, or if the kernel does not support io_uring, this is an ordinary
+ * read or pread.
+ *
+ * \param fd
+ *     The file descriptor to read from.
+ * \param buf
+ *     The buffer to read into.
+ * \param count
+ *     The maximum number of bytes to read.
+ * \param offset
+ *     The offset in the file to read at, or -1 to read at the current file
+ *     position.
+ * \return
+ *     The number of bytes read, or -1 with errno set on error, as for read.
+ *
+ * \ingroup api
+ */
+ssize_t
+ioRead(int fd, void* buf, size_t count, off_t offset) {
+    int32_t result;
+    uint32_t length = static_cast<uint32_t>(std::min<size_t>(count, INT32_MAX));
+    if (ringIo(IORING_OP_READ, fd, reinterpret_cast<uint64_t>(buf), length,
+               static_cast<uint64_t>(offset), &result))
+        return ioResult(result);
+    return offset < 0 ? read(fd, buf, count) : pread(fd, buf, count, offset);
+}
+
+/**
+ * Write to a file descriptor without blocking the other threads on the
+ * current core; see ioRead.
+ *
+ * \param fd
+ *     The file descriptor to write to.
+ * \param buf
+ *     The bytes to write.
+ * \param count
+ *     The number of bytes to write.
+ * \param offset
+ *     The offset in the file to write at, or -1 to write at the current file
+ *     position.
+ * \return
+ *     The number of bytes written, or -1 with errno set on error, as for
+ *     write.
+ *
+ * \ingroup api
+ */
+ssize_t
+ioWrite(int fd, const void* buf, size_t count, off_t offset) {
+    int32_t result;
+    uint32_t length = static_cast<uint32_t>(std::min<size_t>(count, INT32_MAX));
+    if (ringIo(IORING_OP_WRITE, fd, reinterpret_cast<uint64_t>(buf), length,
+               static_cast<uint64_t>(offset), &result))
+        return ioResult(result);
+    return offset < 0 ? write(fd, buf, count) : pwrite(fd, buf, count, offset);
+}
+
+/**
+ * Accept a connection on a listening socket without blocking the other
+ * threads on the current core; see ioRead.
+ *
+ * \param fd
+ *     The listening socket.
+ * \param addr
+ *     Filled in with the address of the peer; may be NULL.
+ * \param addrlen
+ *     The size of addr, updated to the size of the peer's address; may be
+ *     NULL if addr is.
+ * \return
+ *     The file descriptor of the new connection, or -1 with errno set on
+ *     error, as for accept.
+ *
+ * \ingroup api
+ */
+int
+ioAccept(int fd, sockaddr* addr, socklen_t* addrlen) {
+    int32_t result;
+    // The kernel takes the address of addrlen in place of a file offset.
+    if (ringIo(IORING_OP_ACCEPT, fd, reinterpret_cast<uint64_t>(addr), 0,
+               reinterpret_cast<uint64_t>(addrlen), &result))
+        return static_cast<int>(ioResult(result));
+    return accept(fd, addr, addrlen);
+}
+
+/**
+ * Wake a core that is parked in dispatch(); see parkCoreIfIdle. This can be
+ * invoked from any thread.
+ *
+ * \param coreId
+ *     The core to wake.
+ */
+void
+unparkCore(int coreId) {
+    if (parkedFlags[coreId]->exchange(0) != 0)
+        syscall(SYS_futex, parkedFlags[coreId], FUTEX_WAKE_PRIVATE, 1, NULL,
+                NULL, 0);
+}
+
+/**
+ * Record the statistics for a dispatch() call handing its core to a thread.
+ *
+ * \param target
+ *     The context that is about to run.
+ * \param dispatchEntryCycles
+ *     The time in cycles at which the dispatch() call started.
+ * \param now
+ *     The current time in cycles.
+ */
+static inline void
+recordDispatch(ThreadContext* target, uint64_t dispatchEntryCycles,
+               uint64_t now) {
+    traceEvent(TRACE_SWITCH, target, target->generation);
+    PerfStats& stats = PerfStats::threadStats;
+    stats.beginUpdate();
+    stats.dispatchLatencyCycles.record(now - dispatchEntryCycles);
+#if WAKEUP_LATENCY_STATS
+    uint64_t signalTime = target->signalTimeInCycles;
+    if (signalTime != 0) {
+        target->signalTimeInCycles = 0;
+        // The signal may have come from a core whose clock is slightly
+        // ahead of this one.
+        uint64_t latency = now > signalTime ? now - signalTime : 0;
+        stats.wakeupLatencyCycles.record(latency);
+        int threadClass = target->threadClass;
+        if (threadClass < 0 || threadClass >= PerfStats::NUM_THREAD_CLASSES)
+            threadClass = PerfStats::NUM_THREAD_CLASSES - 1;
+        stats.wakeupLatencyCyclesByClass[threadClass].record(latency);
+    }
+#endif
+    stats.endUpdate();
+}
+
 /**
  * Deschedule the current thread until its wakeup time is reached (which may
  * have already happened) and find another thread to run. All direct and
@@ -536,42 +1849,70 @@ dispatch() {
     checkForArbiterRequest();
 
     uint64_t dispatchIterationStartCycles = Cycles::rdtsc();
-
-    // Check for high priority threads.
-    if (!core.privatePriorityMask) {
-        // Copy & paste from the public list.
-        core.privatePriorityMask = *publicPriorityMasks[core.kernelThreadId];
-        if (core.privatePriorityMask)
-            *publicPriorityMasks[core.kernelThreadId] &=
-                ~core.privatePriorityMask;
+    uint64_t dispatchEntryCycles = dispatchIterationStartCycles;
+
+    // Make sure that the scan below comes back to the calling thread if it is
+    // still runnable, or once its sleep is over.
+    uint64_t selfWakeupTime = originalContext->wakeupTimeInCycles;
+#if WAKEUP_LATENCY_STATS
+    // A signal that arrived while this thread was running did not make it
+    // wait; if it is still runnable, its wait starts now.
+    if (originalContext->signalTimeInCycles != 0)
+        originalContext->signalTimeInCycles =
+            selfWakeupTime == 0 ? dispatchIterationStartCycles : 0;
+#endif
+    if (unlikely(tracingEnabled.load(std::memory_order_relaxed)) &&
+        selfWakeupTime > dispatchIterationStartCycles &&
+        selfWakeupTime != UNOCCUPIED)
+        recordTraceEvent(TRACE_BLOCK, originalContext,
+                         originalContext->generation, 0);
+    uint8_t selfIndex = originalContext->idInCore;
+    ContextGroup& selfGroup = core.groups[contextGroupOf(selfIndex)];
+    if (selfWakeupTime <= dispatchIterationStartCycles)
+        selfGroup.privateRunnableMask |= contextBit(selfIndex);
+    else if (selfWakeupTime < UNOCCUPIED)
+        selfGroup.timerWheel.insert(indexInGroup(selfIndex), selfWakeupTime);
+
+    // Check for high priority threads, in the first context group that has
+    // any.
+    int priorityGroup = 0;
+    for (; priorityGroup < numContextGroups; priorityGroup++) {
+        ContextGroup& group = core.groups[priorityGroup];
+        if (!group.privatePriorityMask) {
+            // Copy & paste from the public list.
+            std::atomic<uint64_t>& publicPriorityMask =
+                publicPriorityMasks[core.kernelThreadId][priorityGroup];
+            group.privatePriorityMask = publicPriorityMask;
+            if (group.privatePriorityMask)
+                publicPriorityMask &= ~group.privatePriorityMask;
+        }
+        if (group.privatePriorityMask)
+            break;
     }
 
-    if (core.privatePriorityMask) {
+    if (priorityGroup < numContextGroups) {
+        ContextGroup& group = core.groups[priorityGroup];
         // This position is one-indexed with zero meaning that no bits were
         // set.
-        int firstSetBit = ffsll(core.privatePriorityMask);
+        int firstSetBit = ffsll(group.privatePriorityMask);
         if (firstSetBit) {
             firstSetBit--;
-            core.privatePriorityMask &= ~(1L << (firstSetBit));
+            group.privatePriorityMask &= ~(1L << (firstSetBit));
 
             ThreadContext* targetContext =
-                core.localThreadContexts[firstSetBit];
-
-            // Verify wakeup and occupied.
-            if (targetContext->wakeupTimeInCycles == 0) {
+                core.localThreadContexts[firstContextInGroup(priorityGroup) +
+                                         firstSetBit];
+
+            // Verify wakeup and occupied. Once priorities are in use, only
+            // threads at the top level may jump ahead of the current pass.
+            if (targetContext->wakeupTimeInCycles == 0 &&
+                (!priorityLevelsInUse || targetContext->priority == 0)) {
+                group.timerWheel.cancel(static_cast<uint8_t>(firstSetBit));
                 if (targetContext == core.loadedContext) {
                     core.loadedContext->wakeupTimeInCycles = BLOCKED;
                     DispatchTimeKeeper::numThreadsRan++;
-
-                    // It is necessary to update core.highestOccupiedContext
-                    // here because two simultaneous returns from these
-                    // priority checks (the higher index blocking and the lower
-                    // index exiting) can result in a gap that cannot be
-                    // bridged by the core.highestOccupiedContext increment
-                    // mechanism below.
-                    core.highestOccupiedContext =
-                        std::max(core.highestOccupiedContext,
-                                 core.loadedContext->idInCore);
+                    recordDispatch(targetContext, dispatchEntryCycles,
+                                   Cycles::rdtsc());
                     return;
                 }
                 void** saved = &core.loadedContext->sp;
@@ -583,42 +1924,49 @@ dispatch() {
                 // invocation returns. This is problematic because it resets
                 // dispatchStartCycles (used for computing idle cycles) but not
                 // lastTotalCollectionTime (used for computing total cycles).
-                dispatchTimeTracker.flush();
+                recordDispatch(targetContext, dispatchEntryCycles,
+                               dispatchTimeTracker.flush());
                 swapcontext(&core.loadedContext->sp, saved);
                 originalContext->wakeupTimeInCycles = BLOCKED;
                 DispatchTimeKeeper::numThreadsRan++;
-                Arachne::core.highestOccupiedContext = std::max(
-                    core.highestOccupiedContext, core.loadedContext->idInCore);
                 return;
             }
         }
     }
-    // Find a thread to switch to
-    uint8_t currentIndex = core.nextCandidateIndex;
-
-    for (;; currentIndex++) {
-        // Ensure that we do not go out of bounds.
-        if (currentIndex == maxThreadsPerCore) {
-            currentIndex = 0;
-        }
-
-        // At this point, it is guaranteed that it is safe to read the context
-        // information.
-        ThreadContext* currentContext = core.localThreadContexts[currentIndex];
-        if (currentIndex == core.highestOccupiedContext + 1) {
-            // Check whether we need to increment core.highestOccupiedContext or
-            // reset currentIndex.
-            if (currentContext->wakeupTimeInCycles != UNOCCUPIED) {
-                core.highestOccupiedContext++;
-            } else {
-                currentIndex = 0;
-                // Reload the currentContext since we have reset currentIndex.
-                currentContext = core.localThreadContexts[currentIndex];
+    // Find a thread to switch to. Only contexts whose bits are set in
+    // core.privateRunnableMask are examined, so the cost of a switch does not
+    // depend on the number of blocked threads on this core.
+    for (;;) {
+        // Round-robin among the candidates after the last thread that ran.
+        int groupId = numContextGroups == 1 ? 0 : core.nextCandidateGroup;
+        ContextGroup& group = core.groups[groupId];
+        uint64_t candidates =
+            group.privateRunnableMask & (~0UL << core.nextCandidateIndex);
+        if (priorityLevelsInUse) {
+            candidates &= group.passMask;
+            // Once a pass over a lower level has run a thread, cut it short
+            // as soon as another thread in any group may have become
+            // runnable, in case it belongs to a higher level.
+            if (core.priorityScheduler.getCurrentLevel() != 0 &&
+                (core.nextCandidateIndex != 0 || groupId != 0)) {
+                for (int g = 0; g < numContextGroups; g++) {
+                    if (core.localRunnableMask[g].load(
+                            std::memory_order_relaxed)) {
+                        candidates = 0;
+                        break;
+                    }
+                }
             }
         }
-        if (currentIndex == 0) {
+        if (!candidates && groupId + 1 < numContextGroups) {
+            // The pass goes on with the next context group.
+            core.nextCandidateGroup = static_cast<uint8_t>(groupId + 1);
+            core.nextCandidateIndex = 0;
+            continue;
+        }
+        if (!candidates) {
             // Update stats and check for arbiter preemption; done once per
-            // cycle over all contexts on this core.
+            // pass over the runnable contexts on this core.
             checkForArbiterRequest();
             dispatchIterationStartCycles = Cycles::rdtsc();
             // Flush counters to keep times up to date
@@ -630,6 +1978,14 @@ dispatch() {
                             &core.loadedContext->sp);
             }
 
+            if (enableWorkStealing) {
+                void handleStealRequest();
+                void requestWorkFromBusyCore();
+                handleStealRequest();
+                if (DispatchTimeKeeper::numThreadsRan == 0)
+                    requestWorkFromBusyCore();
+            }
+
             PerfStats::threadStats.weightedLoadedCycles +=
                 DispatchTimeKeeper::numThreadsRan *
                 (dispatchIterationStartCycles -
@@ -638,35 +1994,70 @@ dispatch() {
             DispatchTimeKeeper::numThreadsRan = 0;
             DispatchTimeKeeper::lastDispatchIterationStart =
                 dispatchIterationStartCycles;
+
+            bool ioInFlight = ioRingsInUse && pollIoRings();
+            if (pendingThreadQueueDepth != 0)
+                startPendingThreads();
+            collectRunnableContexts(dispatchIterationStartCycles);
+            // Contexts that do not live in allThreadContexts, such as the one
+            // set up by testInit, are never marked in runnableMasks.
+            if (!havePrivateRunnableContexts() &&
+                originalContext->wakeupTimeInCycles == 0)
+                selfGroup.privateRunnableMask = contextBit(selfIndex);
+            if (priorityLevelsInUse)
+                startPriorityPass(dispatchIterationStartCycles);
+            if (parkAfterIdleNs != 0)
+                parkCoreIfIdle(dispatchIterationStartCycles, ioInFlight);
+            passQuiescentPoint();
+            core.nextCandidateGroup = 0;
+            core.nextCandidateIndex = 0;
+            continue;
         }
 
-        // Decide whether we can run the current thread.
-        if (dispatchIterationStartCycles >=
-            currentContext->wakeupTimeInCycles) {
-            core.nextCandidateIndex = static_cast<uint8_t>(currentIndex + 1);
+        // ffsll returns a 1-based index.
+        uint8_t currentIndex = static_cast<uint8_t>(ffsll(candidates) - 1);
+        group.privateRunnableMask &= ~(1L << currentIndex);
+        ThreadContext* currentContext =
+            core.localThreadContexts[firstContextInGroup(groupId) +
+                                     currentIndex];
+        uint64_t wakeupTime = currentContext->wakeupTimeInCycles;
+        if (dispatchIterationStartCycles < wakeupTime) {
+            // Threads that are blocked or gone drop out of the runnable set
+            // until they are signaled or created.
+            if (wakeupTime < UNOCCUPIED)
+                group.timerWheel.insert(currentIndex, wakeupTime);
+            continue;
+        }
+        // A sleeper that was signaled before its deadline no longer needs
+        // its timer.
+        group.timerWheel.cancel(currentIndex);
 
-            if (currentContext == core.loadedContext) {
-                core.loadedContext->wakeupTimeInCycles = BLOCKED;
-                DispatchTimeKeeper::numThreadsRan++;
-                return;
-            }
-            void** saved = &core.loadedContext->sp;
-            core.loadedContext = currentContext;
-
-            // Flush the idle cycle counter before a context switch because
-            // switching to a fresh (previously unused) context will cause
-            // dispatch to be called from the top again before this
-            // invocation returns. This is problematic because it resets
-            // dispatchStartCycles (used for computing idle cycles) but not
-            // lastTotalCollectionTime (used for computing total cycles).
-            dispatchTimeTracker.flush();
-            swapcontext(&core.loadedContext->sp, saved);
-            // After the old context is swapped out above, this line executes
-            // in the new context.
-            originalContext->wakeupTimeInCycles = BLOCKED;
+        core.nextCandidateIndex = static_cast<uint8_t>(currentIndex + 1);
+
+        if (currentContext == core.loadedContext) {
+            core.loadedContext->wakeupTimeInCycles = BLOCKED;
             DispatchTimeKeeper::numThreadsRan++;
+            recordDispatch(currentContext, dispatchEntryCycles,
+                           Cycles::rdtsc());
             return;
         }
+        void** saved = &core.loadedContext->sp;
+        core.loadedContext = currentContext;
+
+        // Flush the idle cycle counter before a context switch because
+        // switching to a fresh (previously unused) context will cause
+        // dispatch to be called from the top again before this
+        // invocation returns. This is problematic because it resets
+        // dispatchStartCycles (used for computing idle cycles) but not
+        // lastTotalCollectionTime (used for computing total cycles).
+        recordDispatch(currentContext, dispatchEntryCycles,
+                       dispatchTimeTracker.flush());
+        swapcontext(&core.loadedContext->sp, saved);
+        // After the old context is swapped out above, this line executes
+        // in the new context.
+        originalContext->wakeupTimeInCycles = BLOCKED;
+        DispatchTimeKeeper::numThreadsRan++;
+        return;
     }
 }
 
@@ -684,6 +2075,15 @@ void
 signal(ThreadId id) {
     uint64_t oldWakeupTime = id.context->wakeupTimeInCycles;
     if (oldWakeupTime != UNOCCUPIED) {
+        traceEvent(TRACE_SIGNAL, id.context, id.generation,
+                   id.context->coreId);
+#if WAKEUP_LATENCY_STATS
+        // The timestamp is stored before the thread becomes runnable, so
+        // dispatch() cannot run the thread without seeing it. A thread that
+        // is already runnable keeps the time of its first signal.
+        if (oldWakeupTime != 0)
+            id.context->signalTimeInCycles = Cycles::rdtsc();
+#endif
         // We do the CAS in assembly because we do not want to pay for the
         // extra memory fences for ordinary stores that std::atomic adds.
         uint64_t newValue = 0L;
@@ -693,10 +2093,18 @@ signal(ThreadId id) {
                                "=a"(oldWakeupTime)
                              : "0"(newValue), "2"(oldWakeupTime));
 
-        // Raise the priority of the newly awakened thread.
-        if (id.context->coreId != static_cast<uint8_t>(~0))
-            *publicPriorityMasks[id.context->coreId] |=
-                (1L << id.context->idInCore);
+        // Make the thread visible to its core's dispatch loop and raise its
+        // priority. The coreId is read after the wakeup time is written, so a
+        // concurrent migration either sees the new wakeup time or this signal
+        // sees the new coreId.
+        if (id.context->coreId != static_cast<uint8_t>(~0)) {
+            uint8_t idInCore = id.context->idInCore;
+            int group = contextGroupOf(idInCore);
+            uint64_t slotMask = contextBit(idInCore);
+            runnableMasks[id.context->coreId][group] |= slotMask;
+            publicPriorityMasks[id.context->coreId][group] |= slotMask;
+            wakeCoreIfParked(id.context->coreId);
+        }
     }
 }
 
@@ -713,9 +2121,52 @@ join(ThreadId id) {
     // Thread has already exited.
     if (id.generation != id.context->generation)
         return;
+    id.context->joinerWaiting = true;
     id.context->joinCV.wait(joinGuard);
 }
 
+/**
+ * Block the current thread until the thread identified by id finishes its
+ * execution, or until ns nanoseconds have passed.
+ *
+ * \param id
+ *     The id of the thread to join.
+ * \param ns
+ *     The longest time in nanoseconds to wait for the thread to finish.
+ * \return
+ *     True if the thread has finished, false if the wait timed out.
+ */
+bool
+joinFor(ThreadId id, uint64_t ns) {
+    uint64_t deadline = Cycles::rdtsc() + Cycles::fromNanoseconds(ns);
+    std::unique_lock<SpinLock> joinGuard(id.context->joinLock);
+    while (id.generation == id.context->generation) {
+        if (Cycles::rdtsc() >= deadline)
+            return false;
+        id.context->joinerWaiting = true;
+        id.context->joinCV.waitUntil(joinGuard, deadline);
+    }
+    return true;
+}
+
+/**
+ * Block the current thread until all of the given threads finish their
+ * execution, for instance those started by createThreads.
+ *
+ * \param ids
+ *     The ids of the threads to join; entries equal to NullThread are
+ *     skipped.
+ * \param numThreads
+ *     The number of entries in ids.
+ */
+void
+joinAll(const ThreadId* ids, uint32_t numThreads) {
+    for (uint32_t i = 0; i < numThreads; i++) {
+        if (ids[i] != NullThread)
+            join(ids[i]);
+    }
+}
+
 /**
  * This function must be called by the main application thread and will block
  * until Arachne is terminated via a call to shutDown().
@@ -732,13 +2183,15 @@ waitForTermination() {
 
     // We now assume that all threads are done executing.
     PerfUtils::Util::serialize();
+    if (!traceFile.empty())
+        dumpTrace(traceFile.c_str());
 
     kernelThreads.clear();
     kernelThreadStacks.clear();
 
-    for (size_t i = 0; i < maxNumCores; i++) {
+    for (size_t i = 0; i < numKernelThreads; i++) {
         for (int k = 0; k < maxThreadsPerCore; k++) {
-            free(allThreadContexts[i][k]->stack);
+            releaseStack(allThreadContexts[i][k]->stack, stackSize);
             allThreadContexts[i][k]->joinLock.~SpinLock();
             allThreadContexts[i][k]->joinCV.~ConditionVariable();
             free(allThreadContexts[i][k]);
@@ -747,17 +2200,42 @@ waitForTermination() {
         free(occupiedAndCount[i]);
         free(pinnedContexts[i]);
         free(publicPriorityMasks[i]);
+        free(runnableMasks[i]);
+        free(stealRequests[i]);
+        free(parkedFlags[i]);
+        free(warmSpareWakeups[i]);
+        free(quiescentEpochs[i]);
+        delete ioRings[i]->ring;
+        delete ioRings[i];
+        delete pendingThreadQueues[i];
     }
     delete[] isIdledArray;
     allThreadContexts.clear();
     occupiedAndCount.clear();
     pinnedContexts.clear();
     publicPriorityMasks.clear();
+    runnableMasks.clear();
+    stealRequests.clear();
+    parkedFlags.clear();
+    warmSpareWakeups.clear();
+    parkedWarmSpares.clear();
+    warmSpareActive.clear();
+    numActiveWarmSpares = 0;
+    quiescentEpochs.clear();
+    ioRings.clear();
+    pendingThreadQueues.clear();
+    ioRingsInUse = false;
+    numOrphanedIoRings = 0;
     PerfUtils::Util::serialize();
     coreArbiter->reset();
     delete coreManager;
     coreManager = NULL;
+    delete blockingCallPool;
+    blockingCallPool = NULL;
+    // No core is running, so every retired CoreList can go.
+    reclaimCoreLists();
     initialized = false;
+    Logger::stopDrainThread();
 }
 
 /**
@@ -782,9 +2260,17 @@ parseOptions(int* argcp, const char** argv) {
     } optionSpecifiers[] = {{"minNumCores", 'c', true},
                             {"maxNumCores", 'm', true},
                             {"stackSize", 's', true},
+                            {"stackPoolHighWaterMark", 'w', true},
+                            {"enableWorkStealing", 't', false},
                             {"enableArbiter", 'a', true},
                             {"disableLoadEstimation", 'd', false},
-                            {"coreArbiterSocketPath", 'p', true}};
+                            {"coreArbiterSocketPath", 'p', true},
+                            {"localPlacementThreshold", 'l', true},
+                            {"parkAfterIdleNs", 'k', true},
+                            {"maxBlockingCallThreads", 'b', true},
+                            {"pendingThreadQueueDepth", 'q', true},
+                            {"warmSpareCores", 'o', true},
+                            {"traceFile", 'r', true}};
     const int UNRECOGNIZED = ~0;
 
     int i = 1;
@@ -831,12 +2317,39 @@ parseOptions(int* argcp, const char** argv) {
             case 's':
                 stackSize = atoi(optionArgument);
                 break;
+            case 'w':
+                stackPoolHighWaterMark = atoi(optionArgument);
+                break;
+            case 't':
+                enableWorkStealing = true;
+                break;
             case 'd':
                 disableLoadEstimation = true;
                 break;
             case 'a':
                 useCoreArbiter = (0 != atoi(optionArgument));
                 break;
+            case 'l':
+                localPlacementThreshold =
+                    static_cast<uint32_t>(atoi(optionArgument));
+                break;
+            case 'k':
+                parkAfterIdleNs = strtoull(optionArgument, NULL, 10);
+                break;
+            case 'b':
+                maxBlockingCallThreads =
+                    static_cast<uint32_t>(atoi(optionArgument));
+                break;
+            case 'q':
+                pendingThreadQueueDepth =
+                    static_cast<uint32_t>(atoi(optionArgument));
+                break;
+            case 'o':
+                numWarmSpareCores = static_cast<uint32_t>(atoi(optionArgument));
+                break;
+            case 'r':
+                traceFile = optionArgument;
+                break;
             case 'p':
                 coreArbiterSocketPath = optionArgument;
             case UNRECOGNIZED:
@@ -852,24 +2365,28 @@ ThreadContext::ThreadContext(uint8_t coreId, uint8_t idInCore)
       generation(1),
       joinLock(),
       joinCV(),
+      joinerWaiting(false),
       coreId(coreId),
+      nextWaiter(NULL),
+      prevWaiter(NULL),
+      waitQueue(NULL),
       idInCore(idInCore),
       threadInvocation(),
       wakeupTimeInCycles(threadInvocation.wakeupTimeInCycles) {
     wakeupTimeInCycles = UNOCCUPIED;
-    // Allocate memory here so we can error-check the return value of malloc.
-    stack = alignedAlloc(stackSize, PAGE_SIZE);
-    if (stack == NULL) {
-        abort();
-    }
 }
 
 /**
- * This method initialize all stacks to point at the schedulerMainLoop.
+ * This method initializes the stack of this context to point at the
+ * schedulerMainLoop, allocating the stack first if this context does not have
+ * one yet.
  */
 void
 ThreadContext::initializeStack() {
-    sp = reinterpret_cast<char*>(stack) + stackSize - 2 * sizeof(void*);
+    if (stack == NULL)
+        stack = allocateStack(stackSize);
+    // The stack begins below the space reserved for large invocations.
+    sp = reinterpret_cast<char*>(largeInvocationSpace()) - 2 * sizeof(void*);
 
     // Immediately before schedulerMainLoop gains control, we want the
     // stack to look like this, so that the swapcontext call will
@@ -950,6 +2467,32 @@ getCoreManagerForTest() {
  *        The largest number of core the appliation may use
  *     --stackSize
  *        The size of each user stack.
+ *     --stackPoolHighWaterMark
+ *        The number of idle stacks each core keeps resident before returning
+ *        the memory of exiting threads' stacks to the kernel.
+ *     --enableWorkStealing
+ *        Let cores that run out of runnable threads take runnable threads
+ *        from busier cores.
+ *     --localPlacementThreshold
+ *        Place threads created by Arachne threads on their creator's core
+ *        while it has fewer than this many occupied contexts.
+ *     --parkAfterIdleNs
+ *        Let a core that has had no runnable thread for this many
+ *        nanoseconds sleep in the kernel until it has work again, without
+ *        returning it to the core arbiter.
+ *     --maxBlockingCallThreads
+ *        The largest number of kernel threads that run calls made with
+ *        blockingCall.
+ *     --pendingThreadQueueDepth
+ *        The number of threads createThreadOrQueue may queue on each core
+ *        whose contexts are all in use.
+ *     --warmSpareCores
+ *        The number of kernel threads that wait as warm spare cores, which
+ *        start running Arachne threads as soon as more cores are needed and
+ *        give way to the cores from the core arbiter once those arrive.
+ *        They are in addition to the maxNumCores kernel threads that get
+ *        cores from the arbiter; a CoreManager passed to setCoreManager must
+ *        have room for all of them.
  *
  * \param argcp
  *    The pointer to argc, the number of arguments passed to the application.
@@ -965,6 +2508,11 @@ init(int* argcp, const char** argv) {
         return;
 
     parseOptions(argcp, argv);
+    Logger::startDrainThread();
+    if (!traceFile.empty()) {
+        startTracing();
+        dumpTraceOnAbort(traceFile.c_str());
+    }
 
     coreArbiter = (useCoreArbiter)
                       ? CoreArbiterClient::getInstance(coreArbiterSocketPath)
@@ -988,34 +2536,74 @@ init(int* argcp, const char** argv) {
                     maxNumCores, hardwareCoresAvailable);
     }
 
+    // Warm spare cores only stand in for cores that the arbiter may still
+    // grant, of which there are at most maxNumCores - minNumCores.
+    numWarmSpareCores = std::min(numWarmSpareCores, maxNumCores - minNumCores);
+    numKernelThreads = maxNumCores + numWarmSpareCores;
+    warmSpareBudget = numWarmSpareCores;
+    warmSpareActive.assign(numKernelThreads, false);
+
+    // Running warm spare cores are in the pool of the CoreManager, alongside
+    // the cores from the arbiter.
     if (coreManager == NULL) {
-        coreManager = new DefaultCoreManager(minNumCores, maxNumCores,
+        coreManager = new DefaultCoreManager(minNumCores, numKernelThreads,
                                              !disableLoadEstimation);
     }
+    blockingCallPool = new BlockingCallPool(maxBlockingCallThreads);
 
     std::vector<uint32_t> coreRequest({minNumCores, 0, 0, 0, 0, 0, 0, 0});
     coreArbiter->setRequestedCores(coreRequest);
     coreReleaseRequestCount = 0;
-    lastTotalCollectionTime.resize(maxNumCores);
+    lastTotalCollectionTime.resize(numKernelThreads);
 
-    // We assume that maxNumCores will not be exceeded in the lifetime of this
-    // application.
-    isIdledArray = new std::atomic<bool>[maxNumCores];
-    for (unsigned int i = 0; i < maxNumCores; i++) {
+    // We assume that numKernelThreads will not be exceeded in the lifetime of
+    // this application.
+    isIdledArray = new std::atomic<bool>[numKernelThreads];
+    for (unsigned int i = 0; i < numKernelThreads; i++) {
+        // The per-core masks hold one word for each context group.
         occupiedAndCount.push_back(
             reinterpret_cast<std::atomic<Arachne::MaskAndCount>*>(
-                alignedAlloc(sizeof(MaskAndCount))));
-        memset(occupiedAndCount.back(), 0, sizeof(std::atomic<MaskAndCount>));
+                alignedAlloc(sizeof(MaskAndCount) * numContextGroups)));
+        memset(occupiedAndCount.back(), 0,
+               sizeof(std::atomic<MaskAndCount>) * numContextGroups);
 
         pinnedContexts.push_back(reinterpret_cast<std::atomic<uint64_t>*>(
-            alignedAlloc(sizeof(uint64_t))));
+            alignedAlloc(sizeof(uint64_t) * numContextGroups)));
         // Initialized to pin context 0.
+        memset(pinnedContexts.back(), 0,
+               sizeof(std::atomic<uint64_t>) * numContextGroups);
         pinnedContexts.back()->store(1U);
 
         publicPriorityMasks.push_back(reinterpret_cast<std::atomic<uint64_t>*>(
+            alignedAlloc(sizeof(std::atomic<uint64_t>) * numContextGroups)));
+        memset(publicPriorityMasks.back(), 0,
+               sizeof(std::atomic<uint64_t>) * numContextGroups);
+
+        runnableMasks.push_back(reinterpret_cast<std::atomic<uint64_t>*>(
+            alignedAlloc(sizeof(std::atomic<uint64_t>) * numContextGroups)));
+        memset(runnableMasks.back(), 0,
+               sizeof(std::atomic<uint64_t>) * numContextGroups);
+
+        stealRequests.push_back(reinterpret_cast<std::atomic<int>*>(
+            alignedAlloc(sizeof(std::atomic<int>))));
+        stealRequests.back()->store(NO_STEAL_REQUEST);
+
+        parkedFlags.push_back(reinterpret_cast<std::atomic<uint32_t>*>(
+            alignedAlloc(sizeof(std::atomic<uint32_t>))));
+        parkedFlags.back()->store(0);
+
+        warmSpareWakeups.push_back(reinterpret_cast<std::atomic<uint32_t>*>(
+            alignedAlloc(sizeof(std::atomic<uint32_t>))));
+        warmSpareWakeups.back()->store(0);
+
+        ioRings.push_back(new CoreIoRing());
+        pendingThreadQueues.push_back(new PendingThreadQueue());
+
+        quiescentEpochs.push_back(reinterpret_cast<std::atomic<uint64_t>*>(
             alignedAlloc(sizeof(std::atomic<uint64_t>))));
-        memset(publicPriorityMasks.back(), 0, sizeof(std::atomic<uint64_t>));
-        // Here we will allocate all the thread contexts and stacks
+        quiescentEpochs.back()->store(OFFLINE_EPOCH);
+        // Here we will allocate all the thread contexts; stacks are allocated
+        // when a context is first used.
         ThreadContext** contexts = new ThreadContext*[maxThreadsPerCore];
         for (uint8_t k = 0; k < maxThreadsPerCore; k++) {
             contexts[k] = reinterpret_cast<ThreadContext*>(
@@ -1028,7 +2616,7 @@ init(int* argcp, const char** argv) {
     }
 
     // Allocate space to store all the original kernel pointers
-    kernelThreadStacks.resize(maxNumCores);
+    kernelThreadStacks.resize(numKernelThreads);
     shutdown = false;
 
     // Reset the nextKernelThreadId so that a de-initialization followed by a
@@ -1040,7 +2628,7 @@ init(int* argcp, const char** argv) {
     PerfUtils::Util::serialize();
 
     // Note that the main thread is not part of the thread pool.
-    for (unsigned int i = 0; i < maxNumCores; i++) {
+    for (unsigned int i = 0; i < numKernelThreads; i++) {
         // These threads are started with threadMain instead of
         // schedulerMainLoop because we want schedulerMainLoop to run on a user
         // stack rather than a kernel-provided stack. This enables us to run
@@ -1071,11 +2659,30 @@ testInit() {
     // NB: This technically leads to sharing memory with the highest index of
     // publicPriorityMasks, as well any other place where core.kernelThreadId is
     // used as an index.
-    core.kernelThreadId = maxNumCores - 1;
+    core.kernelThreadId = numKernelThreads - 1;
     core.localOccupiedAndCount =
         reinterpret_cast<std::atomic<Arachne::MaskAndCount>*>(
-            alignedAlloc(sizeof(MaskAndCount)));
-    memset(core.localOccupiedAndCount, 0, sizeof(MaskAndCount));
+            alignedAlloc(sizeof(MaskAndCount) * numContextGroups));
+    memset(core.localOccupiedAndCount, 0,
+           sizeof(MaskAndCount) * numContextGroups);
+    core.localRunnableMask = reinterpret_cast<std::atomic<uint64_t>*>(
+        alignedAlloc(sizeof(std::atomic<uint64_t>) * numContextGroups));
+    memset(core.localRunnableMask, 0,
+           sizeof(std::atomic<uint64_t>) * numContextGroups);
+    core.localQuiescentEpoch = reinterpret_cast<std::atomic<uint64_t>*>(
+        alignedAlloc(sizeof(std::atomic<uint64_t>)));
+    core.localQuiescentEpoch->store(OFFLINE_EPOCH);
+    for (int g = 0; g < numContextGroups; g++) {
+        ContextGroup& group = core.groups[g];
+        group.privateRunnableMask = 0;
+        group.timerWheel.reset(Cycles::rdtsc());
+        group.priorityScheduler.reset(Cycles::rdtsc());
+        group.passMask = ~0UL;
+    }
+    core.priorityScheduler.reset(Cycles::rdtsc());
+    core.nextCandidateGroup = 0;
+    core.nextCandidateIndex = 0;
+    core.idleSinceCycles = 0;
 
     core.localThreadContexts = new ThreadContext*[maxThreadsPerCore];
     for (uint8_t k = 0; k < maxThreadsPerCore; k++) {
@@ -1103,9 +2710,13 @@ testInit() {
  */
 void
 testDestroy() {
+    for (int g = 0; g < numContextGroups; g++)
+        core.localOccupiedAndCount[g] = {0, 0};
     free(core.localOccupiedAndCount);
+    free(core.localRunnableMask);
+    free(core.localQuiescentEpoch);
     for (int k = 0; k < maxThreadsPerCore; k++) {
-        free(core.localThreadContexts[k]->stack);
+        releaseStack(core.localThreadContexts[k]->stack, stackSize);
         core.localThreadContexts[k]->joinLock.~SpinLock();
         core.localThreadContexts[k]->joinCV.~ConditionVariable();
 
@@ -1114,7 +2725,9 @@ testDestroy() {
     delete[] core.localThreadContexts;
     core.kernelThreadId = -1;
     core.loadedContext = NULL;
-    *core.localOccupiedAndCount = {0, 0};
+    core.localOccupiedAndCount = NULL;
+    core.localRunnableMask = NULL;
+    core.localQuiescentEpoch = NULL;
 }
 
 /**
@@ -1131,30 +2744,97 @@ void
 shutDown() {
     // Tell all the kernel threads to terminate at the first opportunity.
     shutdown = true;
+    for (size_t i = 0; i < parkedFlags.size(); i++)
+        unparkCore(static_cast<int>(i));
+    for (size_t i = 0; i < warmSpareWakeups.size(); i++)
+        wakeWarmSpare(static_cast<int>(i));
 
     // Unblock all cores so they can shut down and be joined.
     std::vector<uint32_t> coreRequest({maxNumCores, 0, 0, 0, 0, 0, 0, 0});
     coreArbiter->setRequestedCores(coreRequest);
 }
 
+const uint64_t SleepLock::MIN_SPIN_CYCLES;
+const uint64_t SleepLock::MAX_SPIN_CYCLES;
+const uint64_t SleepLock::INITIAL_SPIN_CYCLES;
+
+/**
+ * Spin while the owner of this lock is running on another core, in the hope
+ * that it releases the lock before it is worth parking. Successful spins pull
+ * the spin budget towards twice the time they took, so that locks with short
+ * critical sections are acquired without parking; unsuccessful ones shrink
+ * it.
+ *
+ * \param self
+ *     The context of the calling thread.
+ * \param budget
+ *     The longest time, in cycles, to spin.
+ * \return
+ *     Whether or not the calling thread acquired the lock.
+ */
+bool
+SleepLock::spinForOwnership(ThreadContext* self, uint64_t budget) {
+    uint64_t start = Cycles::rdtsc();
+    uint64_t now = start;
+    int64_t tuned = static_cast<int64_t>(spinCycles.load(
+        std::memory_order_relaxed));
+    while (now - start < budget) {
+        ThreadContext* holder = owner;
+        if (holder == NULL) {
+            std::lock_guard<SpinLock> guard(blockedThreadsLock);
+            if (owner == NULL) {
+                owner = self;
+                int64_t target = static_cast<int64_t>(std::min(
+                    MAX_SPIN_CYCLES, 2 * (now - start) + MIN_SPIN_CYCLES));
+                spinCycles.store(
+                    static_cast<uint64_t>(tuned + (target - tuned) / 8),
+                    std::memory_order_relaxed);
+                PerfStats::threadStats.numSleepLockSpinAcquisitions++;
+                return true;
+            }
+        } else if (holder->coreId == self->coreId) {
+            // The owner cannot run until this thread gives up the core.
+            return false;
+        }
+        now = Cycles::rdtsc();
+    }
+    spinCycles.store(static_cast<uint64_t>(std::max(
+                         static_cast<int64_t>(MIN_SPIN_CYCLES),
+                         tuned - tuned / 8)),
+                     std::memory_order_relaxed);
+    return false;
+}
+
 /**
  * Attempt to acquire this resource and block if it is not available.
  */
 void
 SleepLock::lock() {
+    ThreadContext* self = core.loadedContext;
     std::unique_lock<SpinLock> guard(blockedThreadsLock);
     if (owner == NULL) {
-        owner = core.loadedContext;
+        owner = self;
+        return;
+    }
+    PerfStats::threadStats.numContendedSleepLocks++;
+    guard.unlock();
+    if (spinForOwnership(self, spinCycles.load(std::memory_order_relaxed)))
+        return;
+
+    guard.lock();
+    if (owner == NULL) {
+        owner = self;
         return;
     }
-    blockedThreads.push_back(getThreadId());
+    blockedThreads.push(self);
+    PerfStats::threadStats.numSleepLockParks++;
     guard.unlock();
     while (true) {
         // Spurious wake-ups can happen due to signalers of past inhabitants of
-        // this core.loadedContext.
+        // this context.
         dispatch();
         blockedThreadsLock.lock();
-        if (owner == core.loadedContext) {
+        if (owner == self) {
             blockedThreadsLock.unlock();
             break;
         }
@@ -1162,6 +2842,56 @@ SleepLock::lock() {
     }
 }
 
+/**
+ * Acquire this resource, giving up if it is not available within ns
+ * nanoseconds.
+ *
+ * \param ns
+ *     The longest time in nanoseconds to wait for the resource.
+ * \return
+ *     Whether or not the acquisition succeeded.
+ */
+bool
+SleepLock::lockFor(uint64_t ns) {
+    uint64_t timeout = Cycles::fromNanoseconds(ns);
+    uint64_t deadline = Cycles::rdtsc() + timeout;
+    ThreadContext* self = core.loadedContext;
+    std::unique_lock<SpinLock> guard(blockedThreadsLock);
+    if (owner == NULL) {
+        owner = self;
+        return true;
+    }
+    PerfStats::threadStats.numContendedSleepLocks++;
+    guard.unlock();
+    uint64_t budget = spinCycles.load(std::memory_order_relaxed);
+    if (spinForOwnership(self, std::min(timeout, budget)))
+        return true;
+
+    guard.lock();
+    if (owner == NULL) {
+        owner = self;
+        return true;
+    }
+    blockedThreads.push(self);
+    PerfStats::threadStats.numSleepLockParks++;
+    while (true) {
+        // The deadline is set while holding blockedThreadsLock so that it
+        // cannot overwrite the signal from an unlock() handing us ownership.
+        self->wakeupTimeInCycles = deadline;
+        guard.unlock();
+        dispatch();
+        guard.lock();
+        if (owner == self)
+            return true;
+        if (Cycles::rdtsc() >= deadline) {
+            // Leave the queue so that unlock() does not hand the resource to
+            // a thread that stopped waiting for it.
+            blockedThreads.remove(self);
+            return false;
+        }
+    }
+}
+
 /**
  * Attempt to acquire this resource once.
  * \return
@@ -1186,13 +2916,126 @@ SleepLock::unlock() {
         blockedThreadsLock.unlock();
         return;
     }
-    owner = blockedThreads.front().context;
-    signal(blockedThreads.front());
-    blockedThreads.pop_front();
+    owner = blockedThreads.pop();
+    signal(ThreadId(owner, owner->generation));
     blockedThreadsLock.unlock();
 }
 
-ConditionVariable::ConditionVariable() : blockedThreads() {}
+/**
+ * Acquire this lock in exclusive mode, blocking until no other thread holds
+ * it in either mode.
+ */
+void
+SharedSleepLock::lock() {
+    ThreadContext* self = core.loadedContext;
+    std::unique_lock<SpinLock> guard(stateLock);
+    if (writer == NULL && numReaders == 0) {
+        writer = self;
+        return;
+    }
+    PerfStats::threadStats.numContendedSleepLocks++;
+    PerfStats::threadStats.numSleepLockParks++;
+    waitingWriters.push(self);
+    while (writer != self) {
+        guard.unlock();
+        dispatch();
+        guard.lock();
+    }
+}
+
+/**
+ * Attempt to acquire this lock in exclusive mode once.
+ * \return
+ *    Whether or not the acquisition succeeded.
+ */
+bool
+SharedSleepLock::try_lock() {
+    ThreadContext* self = core.loadedContext;
+    std::lock_guard<SpinLock> guard(stateLock);
+    if (writer == NULL && numReaders == 0) {
+        writer = self;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Release this lock from exclusive mode. All readers that queued up while it
+ * was held are admitted as one batch; if there are none, the next writer
+ * takes over.
+ */
+void
+SharedSleepLock::unlock() {
+    std::lock_guard<SpinLock> guard(stateLock);
+    writer = NULL;
+    if (!waitingReaders.empty()) {
+        while (ThreadContext* reader = waitingReaders.pop()) {
+            numReaders++;
+            signal(ThreadId(reader, reader->generation));
+        }
+        return;
+    }
+    writer = waitingWriters.pop();
+    if (writer)
+        signal(ThreadId(writer, writer->generation));
+}
+
+/**
+ * Acquire this lock in shared mode, blocking while a writer holds it or is
+ * waiting for it.
+ */
+void
+SharedSleepLock::lock_shared() {
+    ThreadContext* self = core.loadedContext;
+    std::unique_lock<SpinLock> guard(stateLock);
+    // Queued writers go first, so that readers cannot starve them.
+    if (writer == NULL && waitingWriters.empty()) {
+        numReaders++;
+        return;
+    }
+    PerfStats::threadStats.numContendedSleepLocks++;
+    PerfStats::threadStats.numSleepLockParks++;
+    waitingReaders.push(self);
+    // The releasing writer counts this thread in numReaders when it takes
+    // it off the queue.
+    while (waitingReaders.contains(self)) {
+        guard.unlock();
+        dispatch();
+        guard.lock();
+    }
+}
+
+/**
+ * Attempt to acquire this lock in shared mode once.
+ * \return
+ *    Whether or not the acquisition succeeded.
+ */
+bool
+SharedSleepLock::try_lock_shared() {
+    std::lock_guard<SpinLock> guard(stateLock);
+    if (writer == NULL && waitingWriters.empty()) {
+        numReaders++;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Release this lock from shared mode, handing it to the next writer once the
+ * last reader leaves.
+ */
+void
+SharedSleepLock::unlock_shared() {
+    std::lock_guard<SpinLock> guard(stateLock);
+    if (--numReaders > 0)
+        return;
+    writer = waitingWriters.pop();
+    if (writer)
+        signal(ThreadId(writer, writer->generation));
+}
+
+ConditionVariable::ConditionVariable()
+    : blockedThreads(), blockedThreadsLock("blockedthreadslock", false) {}
 
 ConditionVariable::~ConditionVariable() {}
 
@@ -1203,11 +3046,12 @@ ConditionVariable::~ConditionVariable() {}
  */
 void
 ConditionVariable::notifyOne() {
-    if (blockedThreads.empty())
+    blockedThreadsLock.lock();
+    ThreadContext* awakened = blockedThreads.pop();
+    blockedThreadsLock.unlock();
+    if (awakened == NULL)
         return;
-    ThreadId awakenedThread = blockedThreads.front();
-    blockedThreads.pop_front();
-    signal(awakenedThread);
+    signal(ThreadId(awakened, awakened->generation));
 }
 
 /**
@@ -1217,8 +3061,14 @@ ConditionVariable::notifyOne() {
  */
 void
 ConditionVariable::notifyAll() {
-    while (!blockedThreads.empty())
-        notifyOne();
+    for (;;) {
+        blockedThreadsLock.lock();
+        ThreadContext* awakened = blockedThreads.pop();
+        blockedThreadsLock.unlock();
+        if (awakened == NULL)
+            return;
+        signal(ThreadId(awakened, awakened->generation));
+    }
 }
 
 /**
@@ -1227,9 +3077,60 @@ ConditionVariable::notifyAll() {
  */
 void
 setErrorStream(FILE* stream) {
+    // Messages logged so far go to the old stream.
+    Logger::flush();
     errorStream = stream;
 }
 
+/**
+ * Delete the retired CoreLists that no thread can still be reading. The
+ * caller must hold retiredCoreListsLock.
+ */
+static void
+reclaimCoreListsLocked() {
+    if (numExternalCoreListReaders.load() != 0)
+        return;
+    uint64_t oldestEpoch = OFFLINE_EPOCH;
+    for (size_t i = 0; i < quiescentEpochs.size(); i++)
+        oldestEpoch = std::min(oldestEpoch, quiescentEpochs[i]->load());
+    size_t numKept = 0;
+    for (size_t i = 0; i < retiredCoreLists.size(); i++) {
+        if (retiredCoreLists[i].second <= oldestEpoch)
+            delete retiredCoreLists[i].first;
+        else
+            retiredCoreLists[numKept++] = retiredCoreLists[i];
+    }
+    retiredCoreLists.resize(numKept);
+}
+
+/**
+ * Hand a CoreList that a CoreManager no longer returns from getCores over to
+ * be deleted once no thread can still be reading it. Threads on Arachne cores
+ * cannot hold such a list across a call to dispatch(), so the list is safe to
+ * delete once every running core has passed a quiescent point in dispatch()
+ * and no thread outside Arachne is reading a list.
+ *
+ * \param list
+ *     The list to delete; it must have been replaced before this call, so
+ *     that new readers cannot find it.
+ */
+void
+retireCoreList(CoreList* list) {
+    uint64_t epoch = coreListEpoch.fetch_add(1) + 1;
+    std::lock_guard<SpinLock> _(retiredCoreListsLock);
+    retiredCoreLists.push_back(std::make_pair(list, epoch));
+    reclaimCoreListsLocked();
+}
+
+/**
+ * Delete the retired CoreLists that no thread can still be reading.
+ */
+void
+reclaimCoreLists() {
+    std::lock_guard<SpinLock> _(retiredCoreListsLock);
+    reclaimCoreListsLocked();
+}
+
 /*
  * If the Core Arbiter asks the Arachne runtime to yield a core, this function
  * shall begin the process of descheduling a core.
@@ -1242,8 +3143,9 @@ descheduleCore() {
     // since we are currently borrowing an arbitrary context and should not
     // hold it for too long.
     // If this creation fails, it would implies that we are overloaded and
-    // should not ramp down.
-    int coreId = coreManager->coreUnavailable();
+    // should not ramp down. Warm spare cores hold no core from the arbiter,
+    // so they cannot answer its requests.
+    int coreId = takeCoreForRelease(false);
     if (coreId == -1) {
         coreChangeActive = false;
         ARACHNE_LOG(
@@ -1263,24 +3165,50 @@ descheduleCore() {
 
 /**
  * This function can be called from any thread to increase the number of cores
- * used by Arachne.
+ * used by Arachne by up to numCores at once. The core change stays active
+ * until all of the new cores have arrived.
+ *
+ * \param numCores
+ *     The number of cores to add; the total is capped at maxNumCores, which
+ *     running warm spare cores count against until the cores from the core
+ *     arbiter that they stand in for arrive.
  */
 void
-incrementCoreCount() {
+incrementCoreCount(uint32_t numCores) {
     std::lock_guard<SpinLock> _(coreChangeMutex);
     if (coreChangeActive)
         return;
-    if (numActiveCores >= maxNumCores)
+    if (numActiveCores >= maxNumCores || numCores == 0)
         return;
+    uint32_t targetNumCores =
+        std::min(numActiveCores + numCores, static_cast<uint32_t>(maxNumCores));
 
     coreChangeActive = true;
+    numPendingCoreIncrements = targetNumCores - numActiveCores;
     ARACHNE_LOG(NOTICE, "Attempting to increase number of cores %u --> %u\n",
-                numActiveCores.load(), numActiveCores + 1);
-    std::vector<uint32_t> coreRequest(
-        {numActiveCores + 1, 0, 0, 0, 0, 0, 0, 0});
+                numActiveCores.load(), targetNumCores);
+    // Warm spare cores start right away, while the request below still asks
+    // the arbiter for all of the new cores.
+    uint32_t numWarmSparesStarted = 0;
+    while (numWarmSparesStarted < numPendingCoreIncrements && startWarmSpare())
+        numWarmSparesStarted++;
+    if (requestCoresForIncrease) {
+        requestCoresForIncrease(targetNumCores);
+        return;
+    }
+    std::vector<uint32_t> coreRequest({targetNumCores, 0, 0, 0, 0, 0, 0, 0});
     coreArbiter->setRequestedCores(coreRequest);
 }
 
+/**
+ * This function can be called from any thread to increase the number of cores
+ * used by Arachne.
+ */
+void
+incrementCoreCount() {
+    incrementCoreCount(1);
+}
+
 /**
  * This function can be called from any thread to attempt to decrease the
  * number of cores used by Arachne. It may return before a core is actually
@@ -1300,6 +3228,11 @@ decrementCoreCount() {
     std::vector<uint32_t> coreRequest(
         {numActiveCores - 1, 0, 0, 0, 0, 0, 0, 0});
     coreArbiter->setRequestedCores(coreRequest);
+    // Running warm spare cores go first. The arbiter then has no core to take
+    // back, so the decrease ends once the warm spare stops.
+    if (numActiveWarmSpares > 0 &&
+        createThread(releaseWarmSpareForDecrease) == NullThread)
+        coreChangeActive = false;
 }
 
 /**
@@ -1332,45 +3265,191 @@ checkForArbiterRequest() {
  */
 void
 preventCreationsToCore(int coreId) {
-    // Read our current context out to make sure we don't migrate ourselves
-    // while running. Note that depending on the caller, the pointer may not
-    // point to anything reasonable, so we should not dereference it.
-    MaskAndCount originalMask = *occupiedAndCount[coreId];
+    // Each context group is blocked in turn; a creation that slips into a
+    // group before it is blocked is waited out below.
+    for (int group = 0; group < numContextGroups; group++) {
+        std::atomic<MaskAndCount>* groupSlotMap =
+            &occupiedAndCount[coreId][group];
+        // Read our current context out to make sure we don't migrate
+        // ourselves while running. Note that depending on the caller, the
+        // pointer may not point to anything reasonable, so we should not
+        // dereference it.
+        MaskAndCount originalMask = *groupSlotMap;
+
+        // It is an error if the core we are migrating to is already
+        // exclusive.
+        if (originalMask.numOccupied > contextGroupSize(group)) {
+            abort();
+        }
 
-    // It is an error if the core we are migrating to is already exclusive.
-    if (originalMask.numOccupied > maxThreadsPerCore) {
-        abort();
+        // Block future creations in this group
+        MaskAndCount targetOccupiedAndCount;
+        MaskAndCount blockedOccupiedAndCount;
+        bool success = false;
+        do {
+            targetOccupiedAndCount = *groupSlotMap;
+            blockedOccupiedAndCount = targetOccupiedAndCount;
+            blockedOccupiedAndCount.numOccupied = EXCLUSIVE;
+            success = groupSlotMap->compare_exchange_strong(
+                targetOccupiedAndCount, blockedOccupiedAndCount);
+        } while (!success);
+
+        // Wait out creations that finished CASing before we blocked
+        // creations. It is safe to use targetOccupiedAndCount here, because
+        // the success of the CAS indicates that all subsequent attempts to
+        // CAS should have failed. There is no race with completions here
+        // because no other thread can be running on this core since we are
+        // running, so a slot stops being watched once its creation has
+        // finished.
+        ThreadContext** contexts =
+            core.localThreadContexts + firstContextInGroup(group);
+        uint64_t pendingCreations = targetOccupiedAndCount.occupied;
+        while (pendingCreations != 0) {
+            for (uint64_t slots = pendingCreations; slots != 0;
+                 slots &= slots - 1) {
+                int i = __builtin_ctzll(slots);
+                if (contexts[i]->wakeupTimeInCycles != UNOCCUPIED)
+                    pendingCreations &= ~(1L << i);
+            }
+        }
     }
+}
 
-    // Block future creations on core
-    MaskAndCount targetOccupiedAndCount;
-    MaskAndCount blockedOccupiedAndCount;
-    bool success = false;
-    do {
-        targetOccupiedAndCount = *occupiedAndCount[coreId];
-        blockedOccupiedAndCount = targetOccupiedAndCount;
-        blockedOccupiedAndCount.numOccupied = EXCLUSIVE;
-        success = occupiedAndCount[coreId]->compare_exchange_strong(
-            targetOccupiedAndCount, blockedOccupiedAndCount);
-    } while (!success);
+/**
+ * Move the thread in slot index of the current core into slot targetIndex of
+ * another core, which the caller has already reserved, and swap the target's
+ * idle context into this core's slot. The caller is responsible for making
+ * the thread runnable on the target.
+ */
+static void
+swapContextWithCore(uint8_t index, int coreId, uint8_t targetIndex) {
+    ThreadContext* contextToMigrate = allThreadContexts[coreId][targetIndex];
+    allThreadContexts[coreId][targetIndex] = core.localThreadContexts[index];
+    core.localThreadContexts[index] = contextToMigrate;
+    ThreadContext* migrated = allThreadContexts[coreId][targetIndex];
+    traceEvent(TRACE_MIGRATE, migrated, migrated->generation,
+               static_cast<uint32_t>(coreId));
+
+    // Update idInCore to a consistent value
+    allThreadContexts[coreId][targetIndex]->idInCore = targetIndex;
+    core.localThreadContexts[index]->idInCore = index;
+
+    allThreadContexts[coreId][targetIndex]->coreId =
+        static_cast<uint8_t>(coreId);
+    core.localThreadContexts[index]->coreId =
+        static_cast<uint8_t>(core.kernelThreadId);
+}
 
-    // Wait out creations that finished CASing before we blocked creations
-    bool pendingCreation;
-    do {
-        pendingCreation = false;
-        for (int i = 0; i < maxThreadsPerCore; i++) {
-            // It is safe to use targetOccupiedAndCount here, because the
-            // success of the CAS indicates that all subsequent attempts to CAS
-            // should have failed.
-            // There is no race with completions here because no other thread
-            // can be running on this core since we are running.
-            if (((targetOccupiedAndCount.occupied >> i) & 1) &&
-                core.localThreadContexts[i]->wakeupTimeInCycles == UNOCCUPIED) {
-                pendingCreation = true;
-                break;
-            }
+/**
+ * Move the thread in slot index of the current core into a free slot on
+ * another core, swapping the target's idle context into this core's slot.
+ * The caller must ensure that the thread is not running and is responsible
+ * for clearing its own occupied bit afterwards. This function can only be
+ * run from the core that owns the thread.
+ *
+ * \param index
+ *     The slot on the current core holding the thread to move.
+ * \param coreId
+ *     The core to move the thread to.
+ * \return
+ *     The slot on the target core now holding the thread, or -1 if the target
+ *     is exclusive or has no room.
+ */
+int
+migrateContextToCore(uint8_t index, int coreId) {
+    for (int group = 0; group < numContextGroups; group++) {
+        uint64_t reserved =
+            reserveSlotsOnCore(static_cast<uint32_t>(coreId), group, 1, NULL,
+                               &pinnedContexts[coreId][group]);
+        if (reserved == 0)
+            continue;
+        uint8_t targetIndex = static_cast<uint8_t>(
+            firstContextInGroup(group) + __builtin_ctzll(reserved));
+        swapContextWithCore(index, coreId, targetIndex);
+
+        // The target's dispatch loop decides whether the thread is runnable,
+        // sleeping, or blocked.
+        runnableMasks[coreId][group] |= reserved;
+        wakeCoreIfParked(coreId);
+        return targetIndex;
+    }
+    return -1;
+}
+
+/**
+ * Move as many as possible of the given threads on the current core to
+ * another core, reserving their slots in each context group of the target
+ * all at once. The same restrictions apply as for migrateContextToCore.
+ *
+ * \param group
+ *     The context group of the current core holding the threads to move.
+ * \param indices
+ *     The slots of that group holding the threads to move, as given by
+ *     contextBit.
+ * \param coreId
+ *     The core to move the threads to.
+ * \return
+ *     The subset of indices whose threads now live on the target.
+ */
+uint64_t
+migrateContextsToCore(int group, uint64_t indices, int coreId) {
+    uint64_t migrated = 0;
+    for (int targetGroup = 0; targetGroup < numContextGroups && indices != 0;
+         targetGroup++) {
+        uint64_t reserved = reserveSlotsOnCore(
+            static_cast<uint32_t>(coreId), targetGroup,
+            static_cast<uint32_t>(__builtin_popcountll(indices)), NULL,
+            &pinnedContexts[coreId][targetGroup]);
+        for (uint64_t slots = reserved; slots != 0; slots &= slots - 1) {
+            int index = __builtin_ctzll(indices);
+            indices &= indices - 1;
+            swapContextWithCore(
+                static_cast<uint8_t>(firstContextInGroup(group) + index),
+                coreId,
+                static_cast<uint8_t>(firstContextInGroup(targetGroup) +
+                                     __builtin_ctzll(slots)));
+            migrated |= 1L << index;
+        }
+        if (reserved != 0)
+            runnableMasks[coreId][targetGroup] |= reserved;
+    }
+    if (migrated != 0)
+        wakeCoreIfParked(coreId);
+    return migrated;
+}
+
+/**
+ * Decide how many threads each of a set of cores should receive so that
+ * their loads end up as even as possible.
+ *
+ * \param numThreads
+ *     The number of threads to place.
+ * \param occupancy
+ *     The number of threads that each core already holds; cores holding
+ *     maxThreadsPerCore or more receive nothing.
+ * \param[out] plan
+ *     Filled in with the number of threads to give each core; it has as
+ *     many elements as occupancy.
+ * \return
+ *     The number of threads that could not be placed for lack of room.
+ */
+uint32_t
+planMigration(uint32_t numThreads, const std::vector<uint32_t>& occupancy,
+              std::vector<uint32_t>* plan) {
+    plan->assign(occupancy.size(), 0);
+    for (; numThreads > 0; numThreads--) {
+        int target = -1;
+        for (size_t i = 0; i < occupancy.size(); i++) {
+            uint32_t load = occupancy[i] + (*plan)[i];
+            if (load < static_cast<uint32_t>(maxThreadsPerCore) &&
+                (target < 0 || load < occupancy[target] + (*plan)[target]))
+                target = static_cast<int>(i);
         }
-    } while (pendingCreation);
+        if (target < 0)
+            break;
+        (*plan)[target]++;
+    }
+    return numThreads;
 }
 
 /**
@@ -1381,108 +3460,80 @@ preventCreationsToCore(int coreId) {
  */
 void
 removeThreadsFromCore(CoreList* outputCores) {
+    uint64_t startTime = Cycles::rdtsc();
     preventCreationsToCore(core.kernelThreadId);
 
     std::lock_guard<SleepLock> _(coreExclusionMutex);
 
     // Start migration of remaining threads.
-    MaskAndCount blockedOccupiedAndCount = *core.localOccupiedAndCount;
-
-    // Migrate off all threads other than the current one.  Round robin among
-    // cores because these are likely long-running threads.
-
-    int nextMigrationTarget = 0;
-    uint32_t numFailures = 0;
-    for (uint8_t i = 0; i < maxThreadsPerCore; i++) {
-        if (core.localThreadContexts[i] == core.loadedContext) {
-            // Skip over ourselves
-            continue;
-        }
-        // Choose a victim core that we will pawn our work on.
-        if ((blockedOccupiedAndCount.occupied >> i) & 1) {
-            if (outputCores->size() == 0) {
-                ARACHNE_LOG(ERROR, "No available cores to migrate threads to.");
-                exit(1);
-            }
-            nextMigrationTarget =
-                (nextMigrationTarget + 1) % outputCores->size();
-            int coreId = outputCores->get(nextMigrationTarget);
-
-            bool success = false;
-            uint8_t index;
-            do {
-                // Each iteration through this loop makes one attempt to
-                // enqueue the task to the specified core. Multiple iterations
-                // are required only if there is contention for the core's
-                // state variables.
-                MaskAndCount slotMap = *occupiedAndCount[coreId];
-                MaskAndCount oldSlotMap = slotMap;
-
-                // Skip this core since it might be an exclusive or fully
-                // loaded.
-                if (slotMap.numOccupied >= maxThreadsPerCore) {
-                    success = false;
-                    break;
-                }
+    uint8_t selfIndex = core.loadedContext->idInCore;
+    MaskAndCount blockedOccupiedAndCount[numContextGroups];
+    uint64_t toMigrate[numContextGroups];
+    uint32_t numToMigrate = 0;
+    for (int g = 0; g < numContextGroups; g++) {
+        blockedOccupiedAndCount[g] = core.localOccupiedAndCount[g];
+        toMigrate[g] = blockedOccupiedAndCount[g].occupied;
+        if (g == contextGroupOf(selfIndex))
+            toMigrate[g] &= ~contextBit(selfIndex);
+        numToMigrate += __builtin_popcountll(toMigrate[g]);
+    }
+    if (numToMigrate != 0 && outputCores->size() == 0) {
+        ARACHNE_LOG(ERROR, "No available cores to migrate threads to.");
+        exit(1);
+    }
 
-                // Search for a non-occupied slot and attempt to reserve the
-                // slot
-                index = 0;
-                while (((slotMap.occupied | *pinnedContexts[coreId]) &
-                        (1L << index)) &&
-                       index < maxThreadsPerCore)
-                    index++;
-
-                slotMap.occupied =
-                    (slotMap.occupied | (1L << index)) & 0x00FFFFFFFFFFFFFF;
-                slotMap.numOccupied++;
-                success = occupiedAndCount[coreId]->compare_exchange_strong(
-                    oldSlotMap, slotMap);
-            } while (!success);
-
-            if (success) {
-                // Now that we have found a slot, we can clear our bit.
-                blockedOccupiedAndCount.occupied &=
-                    ~(1 << i) & 0x00FFFFFFFFFFFFFF;
-                // At this point we've reserved a spot on the target, and now
-                // we swap.
-                ThreadContext* contextToMigrate =
-                    allThreadContexts[coreId][index];
-                allThreadContexts[coreId][index] = core.localThreadContexts[i];
-                core.localThreadContexts[i] = contextToMigrate;
-
-                // Update idInCore to a consistent value
-                allThreadContexts[coreId][index]->idInCore = index;
-                core.localThreadContexts[i]->idInCore = i;
-
-                allThreadContexts[coreId][index]->coreId =
-                    static_cast<uint8_t>(coreId);
-                core.localThreadContexts[i]->coreId =
-                    static_cast<uint8_t>(core.kernelThreadId);
-                // Reset the failure count once we successfully place a thread.
-                numFailures = 0;
-            } else {
-                // Try again if we failed to find a slot to pawn our work onto.
-                i--;
-                numFailures++;
-                if (numFailures > outputCores->size()) {
-                    ARACHNE_LOG(ERROR,
-                                "Number of failures %u exceeds number of "
-                                "available cores %u.",
-                                numFailures, outputCores->size());
-                    abort();
+    // Plan where every thread goes from one look at the targets' loads, then
+    // move each target's share with a single reservation per context group.
+    // Threads that do not fit because the targets filled up meanwhile are
+    // planned again. Locality is up to the CoreManager, which chooses
+    // outputCores.
+    std::vector<uint32_t> occupancy(outputCores->size());
+    std::vector<uint32_t> plan;
+    uint32_t numMigrated = 0;
+    while (numToMigrate != 0) {
+        for (uint32_t i = 0; i < outputCores->size(); i++)
+            occupancy[i] =
+                numOccupiedContexts(occupiedAndCount[outputCores->get(i)]);
+        planMigration(numToMigrate, occupancy, &plan);
+        uint32_t migratedThisRound = 0;
+        for (uint32_t i = 0; i < outputCores->size(); i++) {
+            uint32_t shareLeft = plan[i];
+            for (int g = 0; g < numContextGroups && shareLeft > 0; g++) {
+                uint64_t share = 0;
+                uint64_t remaining = toMigrate[g];
+                for (; shareLeft > 0 && remaining != 0; shareLeft--) {
+                    share |= remaining & -remaining;
+                    remaining &= remaining - 1;
                 }
+                if (share == 0)
+                    continue;
+                uint64_t migrated =
+                    migrateContextsToCore(g, share, outputCores->get(i));
+                toMigrate[g] &= ~migrated;
+                // Now that the threads live on their target, we can clear
+                // our bits.
+                blockedOccupiedAndCount[g].occupied &=
+                    ~migrated & 0x00FFFFFFFFFFFFFF;
+                migratedThisRound += __builtin_popcountll(migrated);
             }
         }
+        if (migratedThisRound == 0) {
+            ARACHNE_LOG(ERROR,
+                        "Failed to place %u threads on %u available cores.",
+                        numToMigrate, outputCores->size());
+            abort();
+        }
+        numToMigrate -= migratedThisRound;
+        numMigrated += migratedThisRound;
     }
+    movePendingThreads(outputCores);
 
     outputCores->free();
 
     // Sanity checking that we are the only thread left on this core.
     int count = 0;
-    for (int i = 0; i < maxThreadsPerCore; i++)
-        if (blockedOccupiedAndCount.occupied & (1L << i))
-            count++;
+    for (int g = 0; g < numContextGroups; g++)
+        count += __builtin_popcountll(blockedOccupiedAndCount[g].occupied);
     if (count != 1) {
         ARACHNE_LOG(ERROR,
                     "Failed to migrate threads off core; number of threads "
@@ -1495,7 +3546,179 @@ removeThreadsFromCore(CoreList* outputCores) {
     // At this point, creations should have already been blocked, and
     // completions cannot occur because we are running, so we can just directly
     // assign.
-    *core.localOccupiedAndCount = blockedOccupiedAndCount;
+    for (int g = 0; g < numContextGroups; g++)
+        core.localOccupiedAndCount[g] = blockedOccupiedAndCount[g];
+
+    PerfStats& stats = PerfStats::threadStats;
+    stats.beginUpdate();
+    stats.numThreadsMigrated += numMigrated;
+    stats.coreRampDownCycles.record(Cycles::rdtsc() - startTime);
+    stats.endUpdate();
+}
+
+/**
+ * Check whether the steal request this core made is still outstanding, and
+ * forget it once the victim has served it.
+ *
+ * \param mayWithdraw
+ *     If true, a request that has waited longer than STEAL_REQUEST_TIMEOUT_NS
+ *     without being served is withdrawn.
+ * \return
+ *     True if the victim may still place threads on this core.
+ */
+bool
+stealRequestPending(bool mayWithdraw) {
+    if (core.stealVictim == NO_STEAL_REQUEST)
+        return false;
+    std::atomic<int>* request = stealRequests[core.stealVictim];
+    int state = request->load();
+    if (state == STEAL_IN_PROGRESS)
+        return true;
+    if (state == core.kernelThreadId) {
+        if (!mayWithdraw || Cycles::rdtsc() - core.stealRequestTime <
+                                Cycles::fromNanoseconds(
+                                    STEAL_REQUEST_TIMEOUT_NS))
+            return true;
+        // Failing to withdraw means that the victim has begun to serve the
+        // request.
+        if (!request->compare_exchange_strong(state, NO_STEAL_REQUEST))
+            return true;
+    }
+    core.stealVictim = NO_STEAL_REQUEST;
+    return false;
+}
+
+/**
+ * Hand some of this core's runnable threads to an idle core that asked for
+ * them. Threads that are running, pinned, or blocked stay on this core. This
+ * function is called from dispatch once per pass over this core's contexts.
+ */
+void
+handleStealRequest() {
+    std::atomic<int>* request = stealRequests[core.kernelThreadId];
+    int thiefId = request->load(std::memory_order_relaxed);
+    if (thiefId < 0)
+        return;
+    // Threads that a victim is still placing on this core must not be passed
+    // on before the victim is done with them.
+    if (stealRequestPending(/*mayWithdraw=*/false))
+        return;
+    // Claim the request so that the thief cannot withdraw it while its slots
+    // are being filled.
+    if (!request->compare_exchange_strong(thiefId, STEAL_IN_PROGRESS))
+        return;
+
+    // A core whose creations are blocked, or which holds an exclusive thread,
+    // reports more occupants than it has threads; such a core keeps its
+    // threads.
+    bool keepThreads = false;
+    for (int g = 0; g < numContextGroups; g++) {
+        MaskAndCount slotMap = core.localOccupiedAndCount[g];
+        if (slotMap.numOccupied != __builtin_popcountll(slotMap.occupied))
+            keepThreads = true;
+    }
+    uint64_t candidates[numContextGroups];
+    int numCandidates = 0;
+    for (int g = 0; g < numContextGroups; g++) {
+        candidates[g] = 0;
+        if (keepThreads)
+            continue;
+        MaskAndCount slotMap = core.localOccupiedAndCount[g];
+        uint64_t stealable = slotMap.occupied & ~core.localPinnedContexts[g];
+        ThreadContext** contexts =
+            core.localThreadContexts + firstContextInGroup(g);
+        for (; stealable != 0; stealable &= stealable - 1) {
+            int i = __builtin_ctzll(stealable);
+            ThreadContext* context = contexts[i];
+            // Contexts still being placed here by another core's migration
+            // have not had their coreId updated yet.
+            if (context != core.loadedContext &&
+                context->coreId == core.kernelThreadId &&
+                context->wakeupTimeInCycles == 0) {
+                candidates[g] |= 1L << i;
+                numCandidates++;
+            }
+        }
+    }
+
+    // Give away half of the runnable threads, rounding up, starting from the
+    // ones this core would reach last.
+    int numToSteal = (numCandidates + 1) / 2;
+    for (int g = numContextGroups - 1; g >= 0 && numToSteal > 0; g--) {
+        for (; numToSteal > 0 && candidates[g] != 0; numToSteal--) {
+            int i = 63 - __builtin_clzll(candidates[g]);
+            candidates[g] &= ~(1L << i);
+            if (migrateContextToCore(
+                    static_cast<uint8_t>(firstContextInGroup(g) + i),
+                    thiefId) < 0) {
+                numToSteal = 0;
+                break;
+            }
+
+            std::atomic<MaskAndCount>* groupSlotMap =
+                &core.localOccupiedAndCount[g];
+            MaskAndCount oldSlotMap = *groupSlotMap;
+            MaskAndCount newSlotMap;
+            do {
+                newSlotMap = oldSlotMap;
+                newSlotMap.occupied =
+                    newSlotMap.occupied & ~(1L << i) & 0x00FFFFFFFFFFFFFF;
+                newSlotMap.numOccupied--;
+            } while (!groupSlotMap->compare_exchange_weak(oldSlotMap,
+                                                          newSlotMap));
+
+            PerfStats::threadStats.numThreadsStolen++;
+        }
+    }
+    request->store(NO_STEAL_REQUEST);
+}
+
+/**
+ * Ask a busy shared core to hand over some of its runnable threads. This
+ * function is called from dispatch on a core that made a full pass over its
+ * contexts without running a thread. At most one request per core is
+ * outstanding at a time.
+ */
+void
+requestWorkFromBusyCore() {
+    if (stealRequestPending(/*mayWithdraw=*/true))
+        return;
+
+    // Cores that are exclusive, full, or being released take no work.
+    if (numOccupiedContexts(core.localOccupiedAndCount) >=
+        static_cast<uint32_t>(maxThreadsPerCore))
+        return;
+
+    CoreList* coreList = coreManager->getCores(0);
+    if (coreList == NULL)
+        return;
+    // Pick the busier of two random shared cores; a victim needs at least one
+    // thread besides the one it is running.
+    int victim = NO_STEAL_REQUEST;
+    uint32_t victimLoad = 1;
+    uint32_t numCores = coreList->size();
+    for (int i = 0; i < 2 && numCores > 1; i++) {
+        int candidate = coreList->get(random() % numCores);
+        if (candidate == core.kernelThreadId)
+            continue;
+        uint32_t candidateLoad =
+            numOccupiedContexts(occupiedAndCount[candidate]);
+        if (candidateLoad > victimLoad &&
+            candidateLoad <= static_cast<uint32_t>(maxThreadsPerCore)) {
+            victim = candidate;
+            victimLoad = candidateLoad;
+        }
+    }
+    coreList->free();
+    if (victim == NO_STEAL_REQUEST)
+        return;
+
+    int expected = NO_STEAL_REQUEST;
+    if (stealRequests[victim]->compare_exchange_strong(expected,
+                                                       core.kernelThreadId)) {
+        core.stealVictim = victim;
+        core.stealRequestTime = Cycles::rdtsc();
+    }
 }
 
 /**
@@ -1536,7 +3759,9 @@ idleCore(int coreId) {
  */
 void
 idleCorePrivate() {
+    core.localQuiescentEpoch->store(OFFLINE_EPOCH);
     coreIdleSemaphores[core.kernelThreadId]->wait();
+    passQuiescentPoint();
     isIdledArray[core.kernelThreadId] = false;
 }
 
@@ -19,12 +19,17 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 #include <atomic>
 #include <deque>
 #include <functional>
 #include <mutex>
 #include <queue>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "Common.h"
@@ -33,6 +38,7 @@
 #include "PerfStats.h"
 #include "PerfUtils/Cycles.h"
 #include "PerfUtils/Util.h"
+#include "Tracer.h"
 
 namespace Arachne {
 
@@ -66,6 +72,13 @@ extern volatile uint32_t minNumCores;
 extern volatile uint32_t maxNumCores;
 
 extern int stackSize;
+extern int stackPoolHighWaterMark;
+extern bool enableWorkStealing;
+extern uint32_t localPlacementThreshold;
+extern uint32_t pendingThreadQueueDepth;
+extern uint32_t numWarmSpareCores;
+extern std::atomic<uint32_t> warmSpareBudget;
+extern uint32_t maxBlockingCallThreads;
 
 // Used in inline functions.
 extern FILE* errorStream;
@@ -86,6 +99,10 @@ extern std::atomic<bool>* isIdledArray;
  */
 extern bool disableLoadEstimation;
 
+// Set once any thread has been given a priority other than 0; until then the
+// dispatch loop ignores priorities entirely.
+extern volatile bool priorityLevelsInUse;
+
 /**
  * \addtogroup api Arachne Public API
  * Most of the functions in this API, with the exception of Arachne::init(),
@@ -136,6 +153,7 @@ void shutDown();
 void waitForTermination();
 void yield();
 void sleep(uint64_t ns);
+void sleepUntil(uint64_t wakeupTimeInCycles);
 
 void idleCore(int coreId);
 void unidleCore(int coreId);
@@ -156,15 +174,106 @@ block() {
 }
 void signal(ThreadId id);
 void join(ThreadId id);
+bool joinFor(ThreadId id, uint64_t ns);
+void joinAll(const ThreadId* ids, uint32_t numThreads);
 ThreadId getThreadId();
+bool setPriority(int priority);
+void runBlockingCall(const std::function<void()>& call);
+
+/**
+ * Holds the result of a call made with blockingCall until the caller
+ * collects it; the call runs on another kernel thread, which constructs the
+ * result in place.
+ */
+template <typename _Result>
+struct BlockingCallResult {
+    template <typename _Callable>
+    static _Result
+    run(_Callable& __f) {
+        typename std::aligned_storage<sizeof(_Result),
+                                      alignof(_Result)>::type storage;
+        runBlockingCall([&__f, &storage]() { new (&storage) _Result(__f()); });
+        _Result* result = reinterpret_cast<_Result*>(&storage);
+        _Result value(std::move(*result));
+        result->~_Result();
+        return value;
+    }
+};
+
+template <>
+struct BlockingCallResult<void> {
+    template <typename _Callable>
+    static void
+    run(_Callable& __f) {
+        runBlockingCall([&__f]() { __f(); });
+    }
+};
+
+/**
+ * Run a function that may block in the kernel, such as read, fsync or
+ * getaddrinfo, without stalling the other threads on the caller's core. The
+ * function runs on a kernel thread from a pool outside Arachne's cores while
+ * the calling thread is blocked, and the caller resumes once it returns.
+ * When invoked from a non-Arachne thread, the function runs directly.
+ *
+ * \param __f
+ *     The function to run; it must not throw, and it must not call Arachne
+ *     functions meant for Arachne threads, since it does not run in one.
+ * \return
+ *     A copy of the value returned by __f.
+ *
+ * \ingroup api
+ */
+template <typename _Callable>
+typename std::decay<decltype(std::declval<_Callable&>()())>::type
+blockingCall(_Callable&& __f) {
+    typedef typename std::decay<decltype(__f())>::type Result;
+    return BlockingCallResult<Result>::run(__f);
+}
+
+ssize_t ioRead(int fd, void* buf, size_t count, off_t offset = -1);
+ssize_t ioWrite(int fd, const void* buf, size_t count, off_t offset = -1);
+int ioAccept(int fd, sockaddr* addr, socklen_t* addrlen);
 
 void setErrorStream(FILE* ptr);
 void testInit();
 void testDestroy();
 
+/**
+ * An intrusive FIFO of threads blocked on a synchronization object. The links
+ * live in the ThreadContext of each waiter, which can only wait on one queue
+ * at a time, so adding and removing waiters never allocates memory.
+ *
+ * This class is not thread-safe; every operation must be protected by the
+ * lock of the object that owns the queue.
+ */
+class WaitQueue {
+  public:
+    WaitQueue() : head(NULL), tail(NULL) {}
+    /// Return true if no threads are waiting on this queue.
+    bool empty() const { return head == NULL; }
+    /// Return the longest-waiting thread without removing it, or NULL.
+    ThreadContext* front() const { return head; }
+    inline void push(ThreadContext* context);
+    inline ThreadContext* pop();
+    inline bool remove(ThreadContext* context);
+    inline bool contains(ThreadContext* context) const;
+
+  private:
+    // Oldest and newest waiters; both are NULL when the queue is empty.
+    ThreadContext* head;
+    ThreadContext* tail;
+    DISALLOW_COPY_AND_ASSIGN(WaitQueue);
+};
+
 /**
  * A resource which blocks the current thread until it is available.
  * This resources should not be acquired from non-Arachne threads.
+ *
+ * When the lock is held by a thread running on another core, an acquiring
+ * thread first spins for a short time in case the lock is released soon, and
+ * only then parks. The spin budget adapts to how long recent successful spins
+ * took.
  */
 class SleepLock {
   public:
@@ -172,24 +281,79 @@ class SleepLock {
     SleepLock()
         : blockedThreads(),
           blockedThreadsLock("blockedthreadslock", false),
-          owner(NULL) {}
+          owner(NULL),
+          spinCycles(INITIAL_SPIN_CYCLES) {}
     ~SleepLock() {}
     void lock();
+    bool lockFor(uint64_t ns);
     bool try_lock();
     void unlock();
 
+    /// Lower and upper bounds on the number of cycles to spin before parking.
+    static const uint64_t MIN_SPIN_CYCLES = 200;
+    static const uint64_t MAX_SPIN_CYCLES = 20000;
+    static const uint64_t INITIAL_SPIN_CYCLES = 2000;
+
   private:
-    // Ordered collection of threads that are waiting on this condition
-    // variable. Threads are processed from this list in FIFO order when a
-    // notifyOne() is called.
-    std::deque<ThreadId> blockedThreads;
+    bool spinForOwnership(ThreadContext* self, uint64_t budget);
+
+    // Threads that are waiting for this lock, in the order in which they
+    // will be given ownership of it.
+    WaitQueue blockedThreads;
 
     // A SpinLock to protect the blockedThreads data structure.
     SpinLock blockedThreadsLock;
 
     // Used to identify the owning context for this lock, and also indicates
-    // whether the lock is held or not.
-    ThreadContext* owner;
+    // whether the lock is held or not. It is read without blockedThreadsLock
+    // while spinning.
+    ThreadContext* volatile owner;
+
+    // Number of cycles a contending thread spins before parking; tuned by
+    // spinForOwnership(). Races between spinners only perturb the estimate.
+    std::atomic<uint64_t> spinCycles;
+};
+
+/**
+ * A reader-writer lock which blocks the current thread until it is available.
+ * Any number of readers may hold the lock at once, or a single writer.
+ *
+ * Readers that arrive while a writer holds or is waiting for the lock queue
+ * up and are all admitted together when the writer releases it, so readers
+ * are not starved by a stream of writers and vice versa. This lock should not
+ * be acquired from non-Arachne threads.
+ */
+class SharedSleepLock {
+  public:
+    SharedSleepLock()
+        : stateLock("sharedsleeplock", false),
+          numReaders(0),
+          writer(NULL),
+          waitingReaders(),
+          waitingWriters() {}
+    ~SharedSleepLock() {}
+    void lock();
+    bool try_lock();
+    void unlock();
+    void lock_shared();
+    bool try_lock_shared();
+    void unlock_shared();
+
+  private:
+    // Protects all of the state below.
+    SpinLock stateLock;
+
+    // Number of threads holding the lock in shared mode.
+    uint32_t numReaders;
+
+    // The thread holding the lock in exclusive mode, or NULL.
+    ThreadContext* writer;
+
+    // Readers waiting for the current or a queued writer to finish.
+    WaitQueue waitingReaders;
+
+    // Writers waiting for exclusive access, in FIFO order.
+    WaitQueue waitingWriters;
 };
 
 /**
@@ -206,12 +370,19 @@ class ConditionVariable {
     void wait(LockType& lock);
     template <typename LockType>
     void waitFor(LockType& lock, uint64_t ns);
+    template <typename LockType>
+    void waitUntil(LockType& lock, uint64_t wakeupTimeInCycles);
 
   private:
     // Ordered collection of threads that are waiting on this condition
     // variable. Threads are processed from this list in FIFO order when a
     // notifyOne() is called.
-    std::deque<ThreadId> blockedThreads;
+    WaitQueue blockedThreads;
+
+    // Protects blockedThreads. Waiters leave blockedThreads under this lock
+    // before they reacquire the lock passed to wait(), since a thread can
+    // only wait on one queue at a time.
+    SpinLock blockedThreadsLock;
     DISALLOW_COPY_AND_ASSIGN(ConditionVariable);
 };
 
@@ -284,48 +455,186 @@ const Arachne::ThreadId NullThread;
 ////////////////////////////////////////////////////////////////////////////////
 
 /**
- * We need to invoke a ThreadInvocation with unknown template types, which has
- * been stored in a character array, and this class enables us to do this.
+ * The function that starts a new thread, stored first in the invocation in
+ * its context. It runs the thread's main function with its arguments and then
+ * destroys them.
+ */
+typedef void (*ThreadTrampoline)(void* invocation);
+
+/**
+ * A list of tuple indices, used to expand a tuple into the arguments of a
+ * call; a stand-in for std::index_sequence, which C++11 lacks.
  */
-struct ThreadInvocationEnabler {
-    /// This function allows us to invoke the templated subtype, without
-    /// casting to a pointer of unknown type.
-    virtual void runThread() = 0;
-    virtual ~ThreadInvocationEnabler() {}
+template <size_t... Indices>
+struct IndexSequence {};
+
+/// MakeIndexSequence<N>::type is IndexSequence<0, 1, ..., N - 1>.
+template <size_t N, size_t... Indices>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Indices...> {};
+
+template <size_t... Indices>
+struct MakeIndexSequence<0, Indices...> {
+    typedef IndexSequence<Indices...> type;
 };
 
+/**
+ * Pass a stored argument to the main function of a thread: an argument
+ * wrapped with std::ref is passed as the reference it holds, as std::bind
+ * would do.
+ */
+template <typename T>
+T&
+unwrapArgument(T& argument) {
+    return argument;
+}
+
+template <typename T>
+T&
+unwrapArgument(std::reference_wrapper<T>& argument) {
+    return argument.get();
+}
+
+/**
+ * Return the object that a member function given to createThread is invoked
+ * on, which may be passed as a pointer or a reference.
+ */
+template <typename T>
+T&
+targetObject(T* object) {
+    return *object;
+}
+
+template <typename T>
+T&
+targetObject(T& object) {
+    return object;
+}
+
+/**
+ * Invoke the main function of a thread with its arguments.
+ */
+template <typename F, typename... Args>
+void
+invokeThreadMain(std::false_type isMemberFunction, F& function,
+                 Args&... args) {
+    function(args...);
+}
+
+/**
+ * Invoke a member function as the main function of a thread; the first
+ * argument is the object to invoke it on.
+ */
+template <typename F, typename Object, typename... Args>
+void
+invokeThreadMain(std::true_type isMemberFunction, F& function,
+                 Object& object, Args&... args) {
+    (targetObject(object).*function)(args...);
+}
+
 /**
  * This structure is used during thread creation to pass the function and
  * arguments for the new thread's top-level function from a creating thread to
- * the core that runs the new thread. It also ensures that the arguments will
- * fit in a single cache line, since they will be stored in a single cache
- * line.
+ * the core that runs the new thread. The function and the decayed arguments
+ * are kept in one tuple, so that an empty function object such as a lambda
+ * without captures takes no space, and the thread is started through a plain
+ * function pointer to a trampoline that is specific to their types, so that
+ * the call to the main function can be inlined.
  *
  * \tparam F
- *     The type of the return value of std::bind, which is a value type of
- *     unspecified class.
+ *     The decayed type of the main function.
+ * \tparam Args
+ *     The decayed types of its arguments.
  *
  * This wrapper enables us to bypass the dynamic memory allocation that is
  * sometimes performed by std::function.
  */
-template <typename F>
-struct ThreadInvocation : public ThreadInvocationEnabler {
-    /// The top-level function of the Arachne thread.
-    F mainFunction;
+template <typename F, typename... Args>
+struct ThreadInvocation {
+    /// Starts the thread; must be the first member, since the dispatcher
+    /// finds it at the start of the invocation.
+    ThreadTrampoline trampoline;
+
+    /// The top-level function of the Arachne thread, followed by its
+    /// arguments.
+    std::tuple<F, Args...> mainFunction;
+
+    /// Construct a ThreadInvocation from the main function and arguments
+    /// given to createThread.
+    template <typename Callable, typename... Arguments>
+    explicit ThreadInvocation(Callable&& function, Arguments&&... args)
+        : trampoline(&ThreadInvocation::run),
+          mainFunction(std::forward<Callable>(function),
+                       std::forward<Arguments>(args)...) {}
+
+    /// This is invoked exactly once for each Arachne thread to begin its
+    /// execution. The invocation is destroyed afterwards, since a later
+    /// thread in the same context will reuse its storage.
+    static void
+    run(void* invocation) {
+        ThreadInvocation* self = static_cast<ThreadInvocation*>(invocation);
+        self->invoke(typename MakeIndexSequence<sizeof...(Args)>::type());
+        self->~ThreadInvocation();
+    }
+
+  private:
+    template <size_t... Indices>
+    void
+    invoke(IndexSequence<Indices...>) {
+        invokeThreadMain(
+            std::is_member_function_pointer<F>(), std::get<0>(mainFunction),
+            unwrapArgument(std::get<Indices + 1>(mainFunction))...);
+    }
+};
+
+/**
+ * The ThreadInvocation that holds the given main function and arguments.
+ */
+template <typename _Callable, typename... _Args>
+using ThreadInvocationFor =
+    ThreadInvocation<typename std::decay<_Callable>::type,
+                     typename std::decay<_Args>::type...>;
+
+/**
+ * This is the amount of space reserved at the top of each thread's stack for
+ * the function and arguments of a new thread, when they do not fit in the
+ * cache line that ThreadContext provides for them.
+ */
+const size_t LargeInvocationSpace = 512;
 
-    /// Construct a threadInvocation from the type that is returned by
-    /// std::bind.
-    explicit ThreadInvocation(F&& mainFunction)
-        : mainFunction(std::move(mainFunction)) {
+/**
+ * This structure is stored in place of a ThreadInvocation when the function
+ * and arguments for a new thread are too large for a cache line. It refers to
+ * the ThreadInvocation, which lives in the space reserved at the top of the
+ * new thread's stack, so that creation still does not allocate memory.
+ *
+ * \tparam Invocation
+ *     The type of the ThreadInvocation.
+ */
+template <typename Invocation>
+struct LargeThreadInvocation {
+    /// Starts the thread; see ThreadInvocation.
+    ThreadTrampoline trampoline;
+
+    /// The invocation at the top of the thread's stack.
+    Invocation* invocation;
+
+    /// Construct a LargeThreadInvocation referring to an invocation that has
+    /// already been placed at the top of the stack.
+    explicit LargeThreadInvocation(Invocation* invocation)
+        : trampoline(&LargeThreadInvocation::run), invocation(invocation) {
         static_assert(
-            sizeof(ThreadInvocation<F>) <= CACHE_LINE_SIZE - 8,
+            sizeof(Invocation) <= LargeInvocationSpace,
             "Arachne requires the function and arguments for a thread to "
-            "fit within one cache line.");
+            "fit within the space reserved for them at the top of its stack.");
     }
 
     /// This is invoked exactly once for each Arachne thread to begin its
     /// execution.
-    void runThread() { mainFunction(); }
+    static void
+    run(void* invocation) {
+        Invocation::run(
+            static_cast<LargeThreadInvocation*>(invocation)->invocation);
+    }
 };
 
 /**
@@ -334,6 +643,7 @@ struct ThreadInvocation : public ThreadInvocationEnabler {
 struct ThreadContext {
     /// Keep a reference to the original memory allocation for the stack used by
     /// this threadContext so that we can release the memory in shutDown.
+    /// This is NULL until the first thread is created in this context.
     void* stack;
 
     /// This holds the value that rsp, the stack pointer register, will be set
@@ -353,6 +663,11 @@ struct ThreadContext {
     /// context shall wait on this CV.
     ConditionVariable joinCV;
 
+    /// Set by threads before they wait on joinCV, so that threads which
+    /// nobody joins can exit without notifying joinCV. Cleared when the
+    /// thread in this context exits. Protected by joinLock.
+    bool joinerWaiting;
+
     /// Unique identifier for the core that this thread currently lives on.
     /// This will only change if a ThreadContext is migrated when scaling down
     /// the number of cores.
@@ -361,8 +676,30 @@ struct ThreadContext {
     /// Thread class of this thread, used for thread migration.
     int threadClass = 0;
 
+    /// Priority level of this thread; see PriorityScheduler. Changes take
+    /// effect the next time the thread becomes runnable.
+    uint8_t priority = 0;
+
+    /// Value of the cycle counter when the current thread in this context
+    /// was created, for measuring thread lifetimes.
+    uint64_t creationTimeInCycles = 0;
+
+    /// Value of the cycle counter when this thread was last made runnable by
+    /// signal(), or 0 if it has run since. Only maintained when Arachne is
+    /// built with WAKEUP_LATENCY_STATS.
+    uint64_t signalTimeInCycles = 0;
+
+    /// Links to the neighbours of this context in the WaitQueue it is
+    /// blocked on; only meaningful while waitQueue is not NULL.
+    ThreadContext* nextWaiter;
+    ThreadContext* prevWaiter;
+
+    /// The WaitQueue this context is blocked on, or NULL.
+    WaitQueue* waitQueue;
+
     /// Unique identifier for this thread among those on the same core.
-    /// Used to index into various core-specific arrays.
+    /// Used to index into various core-specific arrays; contextGroupOf and
+    /// contextBit give its place in the per-core masks.
     /// This will only change if a ThreadContext is migrated when scaling down
     /// the number of cores.
     uint8_t idInCore;
@@ -391,12 +728,87 @@ struct ThreadContext {
     volatile uint64_t& wakeupTimeInCycles;
 
     void initializeStack();
+
+    /// Return the start of the space reserved at the top of this context's
+    /// stack for the function and arguments of a LargeThreadInvocation.
+    void* largeInvocationSpace() {
+        uintptr_t top = reinterpret_cast<uintptr_t>(stack) + stackSize;
+        return reinterpret_cast<void*>((top - LargeInvocationSpace) &
+                                       ~static_cast<uintptr_t>(
+                                           CACHE_LINE_SIZE - 1));
+    }
+
     ThreadContext() = delete;
     ThreadContext(ThreadContext&) = delete;
 
     explicit ThreadContext(uint8_t coreId, uint8_t idInCore);
 };
 
+/**
+ * Append a thread to the end of this queue.
+ *
+ * \param context
+ *     The context of the waiting thread; it must not be on any queue.
+ */
+void
+WaitQueue::push(ThreadContext* context) {
+    assert(context->waitQueue == NULL);
+    context->waitQueue = this;
+    context->nextWaiter = NULL;
+    context->prevWaiter = tail;
+    if (tail)
+        tail->nextWaiter = context;
+    else
+        head = context;
+    tail = context;
+}
+
+/**
+ * Remove and return the longest-waiting thread.
+ *
+ * \return
+ *     The context of the removed thread, or NULL if the queue is empty.
+ */
+ThreadContext*
+WaitQueue::pop() {
+    ThreadContext* context = head;
+    if (context)
+        remove(context);
+    return context;
+}
+
+/**
+ * Remove a thread from this queue, wherever it is in the queue.
+ *
+ * \param context
+ *     The context of the thread to remove.
+ * \return
+ *     True if the thread was on this queue.
+ */
+bool
+WaitQueue::remove(ThreadContext* context) {
+    if (context->waitQueue != this)
+        return false;
+    if (context->prevWaiter)
+        context->prevWaiter->nextWaiter = context->nextWaiter;
+    else
+        head = context->nextWaiter;
+    if (context->nextWaiter)
+        context->nextWaiter->prevWaiter = context->prevWaiter;
+    else
+        tail = context->prevWaiter;
+    context->waitQueue = NULL;
+    return true;
+}
+
+/**
+ * Return true if the given thread is waiting on this queue.
+ */
+bool
+WaitQueue::contains(ThreadContext* context) const {
+    return context->waitQueue == this;
+}
+
 /**
  * This is the number of bytes needed on the stack to store the callee-saved
  * registers that are defined by the current processor and operating system's
@@ -430,18 +842,68 @@ const uint64_t COMPLETION_WAIT_TIME = 100000;
 /**
  * Initial value of numOccupied for cores that are exclusive to a thread.
  * This value is sufficiently high that when other threads exit and decrement
- * numOccupied, creation will continue to be blocked on the target core.
+ * numOccupied, creation will continue to be blocked on the target core. It
+ * is set in every context group of the core.
  */
-const uint8_t EXCLUSIVE = maxThreadsPerCore * 2 + 1;
+const uint8_t EXCLUSIVE = threadsPerContextGroup * 2 + 1;
+
+/**
+ * Construct the invocation for a new thread in its context, when it fits
+ * within the cache line reserved for it.
+ */
+template <typename Invocation, typename... Arguments>
+void
+placeInvocation(ThreadContext* threadContext, std::true_type fitsInCacheLine,
+                Arguments&&... args) {
+    new (&threadContext->threadInvocation.data)
+        Invocation(std::forward<Arguments>(args)...);
+}
+
+/**
+ * Construct the invocation for a new thread at the top of its stack, when it
+ * does not fit within its context.
+ */
+template <typename Invocation, typename... Arguments>
+void
+placeInvocation(ThreadContext* threadContext, std::false_type fitsInCacheLine,
+                Arguments&&... args) {
+    Invocation* invocation = new (threadContext->largeInvocationSpace())
+        Invocation(std::forward<Arguments>(args)...);
+    new (&threadContext->threadInvocation.data)
+        Arachne::LargeThreadInvocation<Invocation>(invocation);
+}
+
+/**
+ * Construct the invocation for a new thread wherever it fits. The context's
+ * stack must already be allocated.
+ *
+ * \tparam Invocation
+ *     The ThreadInvocation to construct.
+ * \param threadContext
+ *     The context of the new thread.
+ * \param args
+ *     The arguments for the constructor of Invocation: either the main
+ *     function and its arguments, or another Invocation to copy.
+ */
+template <typename Invocation, typename... Arguments>
+void
+placeInvocation(ThreadContext* threadContext, Arguments&&... args) {
+    placeInvocation<Invocation>(
+        threadContext,
+        std::integral_constant<bool, sizeof(Invocation) <=
+                                         CACHE_LINE_SIZE - 8>(),
+        std::forward<Arguments>(args)...);
+}
 
 void schedulerMainLoop();
 void swapcontext(void** saved, void** target);
 void threadMain();
 
-/// This structure tracks the live threads on a single core.
+/// This structure tracks the live threads in one context group of a core, so
+/// that a thread can be created there with a single CAS.
 struct MaskAndCount {
-    /// Each bit corresponds to a particular ThreadContext which has the
-    /// idInCore corresponding to its index.
+    /// Each bit corresponds to a particular ThreadContext in the group; see
+    /// contextBit.
     /// 0 means this context is available for a new thread.
     /// 1 means this context is in use by a live thread.
     uint64_t occupied : 56;
@@ -451,8 +913,63 @@ struct MaskAndCount {
 
 extern std::vector<std::atomic<MaskAndCount>*> occupiedAndCount;
 
+/**
+ * Return the number of occupied contexts on a core, summed over its context
+ * groups. Groups whose creations are blocked count more than they hold, so
+ * that such cores look full.
+ *
+ * \param slotMaps
+ *     The core's element of occupiedAndCount.
+ */
+inline uint32_t
+numOccupiedContexts(const std::atomic<MaskAndCount>* slotMaps) {
+    uint32_t numOccupied = 0;
+    for (int group = 0; group < numContextGroups; group++)
+        numOccupied += slotMaps[group].load().numOccupied;
+    return numOccupied;
+}
+
 extern std::vector<std::atomic<uint64_t>*> publicPriorityMasks;
 
+extern std::vector<std::atomic<uint64_t>*> runnableMasks;
+
+extern std::vector<std::atomic<uint32_t>*> parkedFlags;
+void unparkCore(int coreId);
+
+/**
+ * Wake the given core if it is parked in dispatch(). This must be called
+ * after making one of its contexts runnable through runnableMasks.
+ */
+inline void
+wakeCoreIfParked(int coreId) {
+    if (parkedFlags[coreId]->load())
+        unparkCore(coreId);
+}
+
+extern std::atomic<int> numExternalCoreListReaders;
+void retireCoreList(CoreList* list);
+void reclaimCoreLists();
+
+/**
+ * Objects of this class bracket the use of a CoreList returned by
+ * CoreManager::getCores. Arachne threads cannot hold such a list across a
+ * call to dispatch(), which is how retired lists are known to be unused, so
+ * this only counts threads outside Arachne, which never call dispatch().
+ */
+struct CoreListReader {
+    CoreListReader() : external(core.kernelThreadId < 0) {
+        if (external)
+            numExternalCoreListReaders++;
+    }
+    ~CoreListReader() {
+        if (external)
+            numExternalCoreListReaders--;
+    }
+
+    /// True if the current thread is not an Arachne thread.
+    bool external;
+};
+
 #ifdef TEST
 static std::deque<uint64_t> mockRandomValues;
 #endif
@@ -490,13 +1007,16 @@ random(void) {
 }
 
 /**
- * Spawn a thread with main function f invoked with the given args on the
- * kernel thread with id = coreId
+ * Spawn a thread at the given priority level, with main function f invoked
+ * with the given args, on the kernel thread with id = coreId.
  * This function should usually only be invoked directly in tests, since it
  * does not perform load balancing.
  *
  * \param coreId
  *     The id for the kernel thread to put the new Arachne thread on.
+ * \param priority
+ *     The priority level of the new thread; must be less than
+ *     PriorityScheduler::NUM_PRIORITY_LEVELS.
  * \param __f
  *     The main function for the new thread.
  * \param __args
@@ -508,26 +1028,31 @@ random(void) {
  */
 template <typename _Callable, typename... _Args>
 ThreadId
-createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
-    auto task =
-        std::bind(std::forward<_Callable>(__f), std::forward<_Args>(__args)...);
-
+createThreadOnCoreWithPriority(uint32_t coreId, int priority, _Callable&& __f,
+                               _Args&&... __args) {
+    typedef ThreadInvocationFor<_Callable, _Args...> Invocation;
     ThreadContext* threadContext;
-    bool success;
+    bool success = false;
     uint32_t index;
+    int group = 0;
     int failureCount = 0;
     do {
         // Each iteration through this loop makes one attempt to enqueue the
         // task to the specified core. Multiple iterations are required only if
-        // there is contention for the core's state variables.
-        MaskAndCount slotMap = *occupiedAndCount[coreId];
+        // there is contention for the core's state variables, or if the core
+        // has several context groups and the first ones are full.
+        MaskAndCount slotMap = occupiedAndCount[coreId][group];
         MaskAndCount oldSlotMap = slotMap;
 
-        if (slotMap.numOccupied >= maxThreadsPerCore) {
+        if (slotMap.numOccupied >= contextGroupSize(group)) {
+            if (group + 1 < numContextGroups) {
+                group++;
+                continue;
+            }
             ARACHNE_LOG(VERBOSE,
                         "createThread failure, coreId = %u, "
-                        "numOccupied = %d\n",
-                        coreId, slotMap.numOccupied);
+                        "numOccupied = %u\n",
+                        coreId, numOccupiedContexts(occupiedAndCount[coreId]));
             return NullThread;
         }
 
@@ -548,36 +1073,397 @@ createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
         slotMap.occupied =
             (slotMap.occupied | (1L << index)) & 0x00FFFFFFFFFFFFFF;
         slotMap.numOccupied++;
-        threadContext = allThreadContexts[coreId][index];
-        success = occupiedAndCount[coreId]->compare_exchange_strong(oldSlotMap,
-                                                                    slotMap);
+        threadContext =
+            allThreadContexts[coreId][firstContextInGroup(group) + index];
+        success = occupiedAndCount[coreId][group].compare_exchange_strong(
+            oldSlotMap, slotMap);
         if (!success) {
             failureCount++;
         }
     } while (!success);
 
-    // Copy the thread invocation into the byte array.
-    new (&threadContext->threadInvocation.data)
-        Arachne::ThreadInvocation<decltype(task)>(std::move(task));
+    // Stacks are allocated on the first use of each context rather than in
+    // init, so that memory use scales with the number of threads created.
+    if (unlikely(threadContext->stack == NULL))
+        threadContext->initializeStack();
+
+    // Construct the thread invocation in the byte array, or the top of the
+    // stack if it is too large.
+    placeInvocation<Invocation>(threadContext, std::forward<_Callable>(__f),
+                                std::forward<_Args>(__args)...);
 
     // Read the generation number *before* waking up the thread, to avoid a
     // race where the thread finishes executing so fast that we read the next
     // generation number instead of the current one.
-    uint32_t generation = allThreadContexts[coreId][index]->generation;
+    uint32_t generation = threadContext->generation;
     threadContext->threadClass = 0;
+    threadContext->priority = static_cast<uint8_t>(priority);
+    if (priority != 0)
+        priorityLevelsInUse = true;
+    threadContext->creationTimeInCycles = Cycles::rdtsc();
+    traceEvent(TRACE_CREATE, threadContext, generation, coreId);
     threadContext->wakeupTimeInCycles = 0;
+    runnableMasks[coreId][group] |= 1L << index;
+    wakeCoreIfParked(coreId);
 
     PerfStats::threadStats.numThreadsCreated++;
     if (failureCount)
         PerfStats::threadStats.numContendedCreations++;
+    PerfStats::threadStats.record(
+        &PerfStats::threadStats.creationRetries,
+        static_cast<uint64_t>(failureCount));
 
     return ThreadId(threadContext, generation);
 }
 
+/**
+ * Spawn a thread with main function f invoked with the given args on the
+ * kernel thread with id = coreId
+ * This function should usually only be invoked directly in tests, since it
+ * does not perform load balancing.
+ *
+ * \param coreId
+ *     The id for the kernel thread to put the new Arachne thread on.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f.
+ * \return
+ *     The return value is an identifier for the newly created thread. If
+ *     there are insufficient resources for creating a new thread, then
+ *     NullThread will be returned.
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
+    return createThreadOnCoreWithPriority(coreId, 0,
+                                          std::forward<_Callable>(__f),
+                                          std::forward<_Args>(__args)...);
+}
+
+/**
+ * A thread waiting in the pending queue of a core for one of its contexts to
+ * become free; see createThreadOnCoreOrQueue.
+ */
+struct PendingThread {
+    /// Moves the invocation into the context that will run the thread, which
+    /// must already have a stack, and frees it.
+    void (*place)(void* invocation, ThreadContext* threadContext);
+
+    /// The ThreadInvocation of the thread, allocated on the heap, since the
+    /// queue holds threads for which there was no context.
+    void* invocation;
+};
+
+/**
+ * Move the invocation of a pending thread into the context that will run it;
+ * this is the place function of PendingThread.
+ *
+ * \tparam Invocation
+ *     The type of the ThreadInvocation.
+ */
+template <typename Invocation>
+void
+placePendingInvocation(void* invocation, ThreadContext* threadContext) {
+    Invocation* pending = static_cast<Invocation*>(invocation);
+    placeInvocation<Invocation>(threadContext, std::move(*pending));
+    delete pending;
+}
+
+bool queuePendingThread(uint32_t coreId, const PendingThread& pending);
+
+/**
+ * Spawn a thread with main function f invoked with the given args on the
+ * kernel thread with id = coreId, as createThreadOnCore does; if every context
+ * of the core is in use, queue the thread on the core instead, so that it
+ * starts in the first context to become free there.
+ *
+ * \param coreId
+ *     The id for the kernel thread to put the new Arachne thread on.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f.
+ * \return
+ *     True if the thread was created or queued; false if it was neither, for
+ *     instance because the core's pending queue already holds
+ *     pendingThreadQueueDepth threads.
+ */
+template <typename _Callable, typename... _Args>
+bool
+createThreadOnCoreOrQueue(uint32_t coreId, _Callable&& __f,
+                          _Args&&... __args) {
+    if (createThreadOnCore(coreId, __f, __args...) != NullThread)
+        return true;
+    if (pendingThreadQueueDepth == 0)
+        return false;
+    typedef ThreadInvocationFor<_Callable, _Args...> Invocation;
+    Invocation* invocation = new Invocation(std::forward<_Callable>(__f),
+                                            std::forward<_Args>(__args)...);
+    PendingThread pending;
+    pending.place = &placePendingInvocation<Invocation>;
+    pending.invocation = invocation;
+    if (queuePendingThread(coreId, pending))
+        return true;
+    delete invocation;
+    return false;
+}
+
+/**
+ * Reserve up to numSlots unoccupied ThreadContexts in one context group of the
+ * given core, using a single successful CAS on the group's MaskAndCount for
+ * all of them.
+ *
+ * \param coreId
+ *     The id for the kernel thread to reserve contexts on.
+ * \param group
+ *     The context group to reserve contexts in.
+ * \param numSlots
+ *     The largest number of contexts to reserve.
+ * \param[out] failureCount
+ *     If not NULL, incremented once for each failed CAS.
+ * \param excludeMask
+ *     If not NULL, the contexts of the group that must not be reserved even
+ *     if they are unoccupied, as given by contextBit. It is read after the
+ *     occupied mask on each attempt, so contexts may be added to it before
+ *     their occupied bits are cleared.
+ * \return
+ *     A bitmask with one bit set for each reserved context, as given by
+ *     contextBit; 0 if the group is exclusive or has no room.
+ */
+inline uint64_t
+reserveSlotsOnCore(uint32_t coreId, int group, uint32_t numSlots,
+                   int* failureCount = NULL,
+                   const std::atomic<uint64_t>* excludeMask = NULL) {
+    std::atomic<MaskAndCount>* groupSlotMap = &occupiedAndCount[coreId][group];
+    int groupSize = contextGroupSize(group);
+    uint64_t groupMask = (1UL << groupSize) - 1;
+    uint64_t reserved;
+    bool success;
+    do {
+        MaskAndCount slotMap = *groupSlotMap;
+        MaskAndCount oldSlotMap = slotMap;
+
+        // Exclusive and fully loaded groups have numOccupied >= groupSize.
+        if (slotMap.numOccupied >= groupSize)
+            return 0;
+
+        // Take the lowest-indexed free slots, since the dispatcher only scans
+        // up to the highest occupied context.
+        uint32_t available =
+            static_cast<uint32_t>(groupSize - slotMap.numOccupied);
+        uint64_t excluded = excludeMask ? excludeMask->load() : 0;
+        uint64_t freeSlots = ~(slotMap.occupied | excluded) & groupMask;
+        reserved = 0;
+        for (uint32_t i = 0; i < std::min(numSlots, available) && freeSlots;
+             i++) {
+            uint64_t lowestFree = freeSlots & -freeSlots;
+            reserved |= lowestFree;
+            freeSlots &= ~lowestFree;
+        }
+        if (!reserved)
+            return 0;
+
+        slotMap.occupied = (slotMap.occupied | reserved) & 0x00FFFFFFFFFFFFFF;
+        slotMap.numOccupied = static_cast<uint8_t>(
+            slotMap.numOccupied + __builtin_popcountll(reserved));
+        success = groupSlotMap->compare_exchange_strong(oldSlotMap, slotMap);
+        if (!success && failureCount)
+            (*failureCount)++;
+    } while (!success);
+    return reserved;
+}
+
+/**
+ * Start one thread running a copy of task in each of the contexts reserved by
+ * reserveSlotsOnCore.
+ *
+ * \param coreId
+ *     The core that the contexts were reserved on.
+ * \param group
+ *     The context group that the contexts were reserved in.
+ * \param reserved
+ *     The bitmask returned by reserveSlotsOnCore.
+ * \param invocation
+ *     The ThreadInvocation that is copied into each context.
+ * \param[out] ids
+ *     Filled in with one ThreadId per bit in reserved, in increasing order of
+ *     idInCore.
+ */
+template <typename Invocation>
+void
+launchOnReservedSlots(uint32_t coreId, int group, uint64_t reserved,
+                      const Invocation& invocation, ThreadId* ids) {
+    uint64_t launched = reserved;
+    uint64_t creationTime = Cycles::rdtsc();
+    ThreadContext** contexts =
+        allThreadContexts[coreId] + firstContextInGroup(group);
+    while (reserved) {
+        // ffsll returns a 1-based index.
+        int index = ffsll(reserved) - 1;
+        reserved &= ~(1L << index);
+        ThreadContext* threadContext = contexts[index];
+        if (unlikely(threadContext->stack == NULL))
+            threadContext->initializeStack();
+        placeInvocation<Invocation>(threadContext, invocation);
+        *ids++ = ThreadId(threadContext, threadContext->generation);
+        threadContext->threadClass = 0;
+        threadContext->priority = 0;
+        threadContext->creationTimeInCycles = creationTime;
+        traceEvent(TRACE_CREATE, threadContext, threadContext->generation,
+                   coreId);
+        threadContext->wakeupTimeInCycles = 0;
+    }
+    runnableMasks[coreId][group] |= launched;
+    wakeCoreIfParked(coreId);
+}
+
+/**
+ * Start up to numThreads threads running copies of invocation on the given
+ * core, reserving the contexts of each context group with a single CAS
+ * unless there is contention.
+ *
+ * \param coreId
+ *     The core to start the threads on.
+ * \param numThreads
+ *     The largest number of threads to start.
+ * \param invocation
+ *     The ThreadInvocation that is copied into each context.
+ * \param[out] ids
+ *     Filled in with the identifiers of the threads started.
+ * \param[out] failureCount
+ *     Incremented once for each failed CAS.
+ * \return
+ *     The number of threads started.
+ */
+template <typename Invocation>
+uint32_t
+launchOnCore(uint32_t coreId, uint32_t numThreads,
+             const Invocation& invocation, ThreadId* ids, int* failureCount) {
+    uint32_t numLaunched = 0;
+    for (int group = 0; group < numContextGroups && numLaunched < numThreads;
+         group++) {
+        uint64_t reserved = reserveSlotsOnCore(
+            coreId, group, numThreads - numLaunched, failureCount);
+        launchOnReservedSlots(coreId, group, reserved, invocation,
+                              ids + numLaunched);
+        numLaunched += __builtin_popcountll(reserved);
+    }
+    return numLaunched;
+}
+
+/**
+ * Spawn up to numThreads threads on the kernel thread with id = coreId, all
+ * running main function f with copies of the given args. All the contexts are
+ * reserved with a single CAS unless there is contention.
+ * This function should usually only be invoked directly in tests, since it
+ * does not perform load balancing.
+ *
+ * \param coreId
+ *     The id for the kernel thread to put the new Arachne threads on.
+ * \param numThreads
+ *     The number of threads to create.
+ * \param[out] ids
+ *     An array of at least numThreads entries. The first entries are filled
+ *     in with identifiers for the created threads, and the rest with
+ *     NullThread.
+ * \param __f
+ *     The main function for the new threads.
+ * \param __args
+ *     The arguments for __f.
+ * \return
+ *     The number of threads created, which is smaller than numThreads if the
+ *     core does not have enough free contexts.
+ */
+template <typename _Callable, typename... _Args>
+uint32_t
+createThreadsOnCore(uint32_t coreId, uint32_t numThreads, ThreadId* ids,
+                    _Callable&& __f, _Args&&... __args) {
+    ThreadInvocationFor<_Callable, _Args...> invocation(
+        std::forward<_Callable>(__f), std::forward<_Args>(__args)...);
+    int failureCount = 0;
+    uint32_t numCreated =
+        launchOnCore(coreId, numThreads, invocation, ids, &failureCount);
+    for (uint32_t i = numCreated; i < numThreads; i++)
+        ids[i] = NullThread;
+
+    PerfStats::threadStats.numThreadsCreated += numCreated;
+    if (failureCount)
+        PerfStats::threadStats.numContendedCreations++;
+    PerfStats::threadStats.record(
+        &PerfStats::threadStats.creationRetries,
+        static_cast<uint64_t>(failureCount));
+    return numCreated;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // The ends the private section of the thread library.
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Return true if the given core is in coreList.
+ */
+inline bool
+coreListContains(CoreList* coreList, int coreId) {
+    for (uint32_t i = 0; i < coreList->size(); i++)
+        if (coreList->get(i) == coreId)
+            return true;
+    return false;
+}
+
+/**
+ * Choose the core of coreList to create a new thread on: the creator's own
+ * core while localPlacementThreshold allows it, and otherwise the one of two
+ * random cores with the fewest Arachne threads.
+ *
+ * \param coreList
+ *     The cores that serve the class of the new thread; must not be empty.
+ */
+inline uint32_t
+chooseCoreForThread(CoreList* coreList) {
+    if (localPlacementThreshold != 0 && core.kernelThreadId >= 0 &&
+        numOccupiedContexts(occupiedAndCount[core.kernelThreadId]) <
+            localPlacementThreshold &&
+        coreListContains(coreList, core.kernelThreadId)) {
+        // The creating core is lightly loaded, so keep the new thread next
+        // to the data its creator has just touched.
+        return core.kernelThreadId;
+    }
+    uint32_t index1 = static_cast<uint32_t>(random()) % coreList->size();
+    uint32_t index2 = static_cast<uint32_t>(random()) % coreList->size();
+    while (index2 == index1 && coreList->size() > 1)
+        index2 = static_cast<uint32_t>(random()) % coreList->size();
+
+    int choice1 = coreList->get(index1);
+    int choice2 = coreList->get(index2);
+
+    if (numOccupiedContexts(occupiedAndCount[choice1]) <
+        numOccupiedContexts(occupiedAndCount[choice2]))
+        return choice1;
+    return choice2;
+}
+
+/**
+ * Spawn a new thread with the given threadClass, priority level, function and
+ * arguments; see createThreadWithClass and createThreadWithPriority.
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadWithClassAndPriority(int threadClass, int priority, _Callable&& __f,
+                                 _Args&&... __args) {
+    if (priority < 0 || priority >= PriorityScheduler::NUM_PRIORITY_LEVELS)
+        return Arachne::NullThread;
+    CoreListReader reader;
+    CoreList* coreList = coreManager->getCores(threadClass);
+    if ((coreList == NULL) || (coreList->size() == 0))
+        return Arachne::NullThread;
+    uint32_t kId = chooseCoreForThread(coreList);
+    auto threadId =
+        createThreadOnCoreWithPriority(kId, priority, __f, __args...);
+    coreList->free();
+    return threadId;
+}
+
 /**
  * Spawn a new thread with the given threadClass, function and arguments.
  *
@@ -587,9 +1473,10 @@ createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
  * \param __f
  *     The main function for the new thread.
  * \param __args
- *     The arguments for __f. The total size of the arguments cannot exceed 48
- *     bytes, and arguments are taken by value, so any reference must be
- *     wrapped with std::ref.
+ *     The arguments for __f. Arguments that occupy more than about 48 bytes
+ *     are stored at the top of the new thread's stack, and their total size
+ *     cannot exceed LargeInvocationSpace. Arguments are taken by value, so
+ *     any reference must be wrapped with std::ref.
  * \return
  *     The return value is an identifier for the newly created thread. If
  *     there are insufficient resources for creating a new thread, then
@@ -600,28 +1487,34 @@ createThreadOnCore(uint32_t coreId, _Callable&& __f, _Args&&... __args) {
 template <typename _Callable, typename... _Args>
 ThreadId
 createThreadWithClass(int threadClass, _Callable&& __f, _Args&&... __args) {
-    // Find a kernel thread to enqueue to by picking two at random and choosing
-    // the one with the fewest Arachne threads.
-    uint32_t kId;
-    CoreList* coreList = coreManager->getCores(threadClass);
-    if ((coreList == NULL) || (coreList->size() == 0))
-        return Arachne::NullThread;
-    uint32_t index1 = static_cast<uint32_t>(random()) % coreList->size();
-    uint32_t index2 = static_cast<uint32_t>(random()) % coreList->size();
-    while (index2 == index1 && coreList->size() > 1)
-        index2 = static_cast<uint32_t>(random()) % coreList->size();
-
-    int choice1 = coreList->get(index1);
-    int choice2 = coreList->get(index2);
+    return createThreadWithClassAndPriority(threadClass, 0, __f, __args...);
+}
 
-    if (occupiedAndCount[choice1]->load().numOccupied <
-        occupiedAndCount[choice2]->load().numOccupied)
-        kId = choice1;
-    else
-        kId = choice2;
-    auto threadId = createThreadOnCore(kId, __f, __args...);
-    coreList->free();
-    return threadId;
+/**
+ * Spawn a new thread at the given priority level with a function and
+ * arguments. Level 0 is the most important and is the level of threads
+ * created with createThread; how the levels share a core is determined by
+ * PriorityScheduler::useStrictPriorities and
+ * PriorityScheduler::useWeightedPriorities.
+ *
+ * \param priority
+ *     The priority level of the new thread; must be less than
+ *     PriorityScheduler::NUM_PRIORITY_LEVELS.
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f; see createThreadWithClass for restrictions.
+ * \return
+ *     The return value is an identifier for the newly created thread. If
+ *     there are insufficient resources for creating a new thread, or the
+ *     priority is out of range, then NullThread will be returned.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+ThreadId
+createThreadWithPriority(int priority, _Callable&& __f, _Args&&... __args) {
+    return createThreadWithClassAndPriority(0, priority, __f, __args...);
 }
 
 /**
@@ -630,9 +1523,7 @@ createThreadWithClass(int threadClass, _Callable&& __f, _Args&&... __args) {
  * \param __f
  *     The main function for the new thread.
  * \param __args
- *     The arguments for __f. The total size of the arguments cannot exceed 48
- *     bytes, and arguments are taken by value, so any reference must be
- *     wrapped with std::ref.
+ *     The arguments for __f; see createThreadWithClass for restrictions.
  * \return
  *     The return value is an identifier for the newly created thread. If
  *     there are insufficient resources for creating a new thread, then
@@ -646,6 +1537,119 @@ createThread(_Callable&& __f, _Args&&... __args) {
     return createThreadWithClass(0, __f, __args...);
 }
 
+/**
+ * Spawn a new thread with a function and arguments, as createThread does, but
+ * rather than fail when the chosen core has no free context, queue the thread
+ * there to start as soon as one of the core's threads exits, so that callers
+ * need not retry. Since it is not known which context a queued thread will
+ * run in, no identifier is returned and the thread cannot be joined; wait for
+ * it through its own synchronization instead, such as a TaskGroup. Threads
+ * are only queued while pendingThreadQueueDepth is nonzero.
+ *
+ * \param __f
+ *     The main function for the new thread.
+ * \param __args
+ *     The arguments for __f; see createThreadWithClass for restrictions.
+ * \return
+ *     True if the thread was created or queued; false if there are
+ *     insufficient resources for either.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+bool
+createThreadOrQueue(_Callable&& __f, _Args&&... __args) {
+    CoreListReader reader;
+    CoreList* coreList = coreManager->getCores(0);
+    if ((coreList == NULL) || (coreList->size() == 0))
+        return false;
+    uint32_t kId = chooseCoreForThread(coreList);
+    bool success = createThreadOnCoreOrQueue(kId, __f, __args...);
+    coreList->free();
+    return success;
+}
+
+/**
+ * Spawn numThreads new threads with the given threadClass, all running the
+ * same function with copies of the same arguments. This is cheaper than
+ * repeated calls to createThreadWithClass: target cores are chosen once, the
+ * threads are spread evenly over them, and each core's contexts are reserved
+ * with a single CAS.
+ *
+ * \param threadClass
+ *     The class of the threads being created; its meaning is determined by
+ *     the currently running CoreManager.
+ * \param numThreads
+ *     The number of threads to create.
+ * \param[out] ids
+ *     An array of at least numThreads entries. The first entries are filled
+ *     in with identifiers for the created threads, and the rest with
+ *     NullThread.
+ * \param __f
+ *     The main function for the new threads.
+ * \param __args
+ *     The arguments for __f, subject to the same restrictions as for
+ *     createThread.
+ * \return
+ *     The number of threads created, which is smaller than numThreads if
+ *     there are insufficient resources.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+uint32_t
+createThreadsWithClass(int threadClass, uint32_t numThreads, ThreadId* ids,
+                       _Callable&& __f, _Args&&... __args) {
+    for (uint32_t i = 0; i < numThreads; i++)
+        ids[i] = NullThread;
+    CoreListReader reader;
+    CoreList* coreList = coreManager->getCores(threadClass);
+    if ((coreList == NULL) || (coreList->size() == 0))
+        return 0;
+    ThreadInvocationFor<_Callable, _Args...> invocation(
+        std::forward<_Callable>(__f), std::forward<_Args>(__args)...);
+
+    uint32_t numCores = coreList->size();
+    uint32_t start = static_cast<uint32_t>(random()) % numCores;
+    uint32_t numCreated = 0;
+    // The first pass spreads the threads evenly over all the cores; the second
+    // pass places whatever did not fit on cores that still have room.
+    for (int pass = 0; pass < 2 && numCreated < numThreads; pass++) {
+        for (uint32_t i = 0; i < numCores && numCreated < numThreads; i++) {
+            uint32_t coreId = coreList->get((start + i) % numCores);
+            uint32_t remaining = numThreads - numCreated;
+            uint32_t share = (pass == 0)
+                                 ? (remaining + numCores - i - 1) /
+                                       (numCores - i)
+                                 : remaining;
+            int failureCount = 0;
+            numCreated += launchOnCore(coreId, share, invocation,
+                                       ids + numCreated, &failureCount);
+            if (failureCount)
+                PerfStats::threadStats.numContendedCreations++;
+            PerfStats::threadStats.record(
+                &PerfStats::threadStats.creationRetries,
+                static_cast<uint64_t>(failureCount));
+        }
+    }
+    coreList->free();
+    PerfStats::threadStats.numThreadsCreated += numCreated;
+    return numCreated;
+}
+
+/**
+ * Spawn numThreads new threads, all running the same function with copies of
+ * the same arguments. See createThreadsWithClass for details.
+ *
+ * \ingroup api
+ */
+template <typename _Callable, typename... _Args>
+uint32_t
+createThreads(uint32_t numThreads, ThreadId* ids, _Callable&& __f,
+              _Args&&... __args) {
+    return createThreadsWithClass(0, numThreads, ids, __f, __args...);
+}
+
 /**
  * Block the current thread until the condition variable is notified.
  *
@@ -660,10 +1664,17 @@ ConditionVariable::wait(LockType& lock) {
 #if TIME_TRACE
     TimeTrace::record("Wait on Core %d", core.kernelThreadId);
 #endif
-    blockedThreads.push_back(
-        ThreadId(core.loadedContext, core.loadedContext->generation));
+    ThreadContext* self = core.loadedContext;
+    blockedThreadsLock.lock();
+    blockedThreads.push(self);
+    blockedThreadsLock.unlock();
     lock.unlock();
     dispatch();
+    // Leave the queue after a spurious wakeup, so that a later notifyOne()
+    // is not spent on this thread.
+    blockedThreadsLock.lock();
+    blockedThreads.remove(self);
+    blockedThreadsLock.unlock();
 #if TIME_TRACE
     TimeTrace::record("About to acquire lock after waking up");
 #endif
@@ -685,12 +1696,36 @@ ConditionVariable::wait(LockType& lock) {
 template <typename LockType>
 void
 ConditionVariable::waitFor(LockType& lock, uint64_t ns) {
-    blockedThreads.push_back(
-        ThreadId(core.loadedContext, core.loadedContext->generation));
-    core.loadedContext->wakeupTimeInCycles =
-        Cycles::rdtsc() + Cycles::fromNanoseconds(ns);
+    waitUntil(lock, Cycles::rdtsc() + Cycles::fromNanoseconds(ns));
+}
+
+/**
+ * Block the current thread until the condition variable is notified or the
+ * cycle counter reaches wakeupTimeInCycles.
+ *
+ * \param lock
+ *     The mutex associated with this condition variable; must be held by
+ *     caller before calling wait. This function releases the mutex before
+ *     blocking, and re-acquires it before returning to the user.
+ * \param wakeupTimeInCycles
+ *     The value of the cycle counter at which this thread should return in
+ *     the absence of a signal.
+ */
+template <typename LockType>
+void
+ConditionVariable::waitUntil(LockType& lock, uint64_t wakeupTimeInCycles) {
+    ThreadContext* self = core.loadedContext;
+    blockedThreadsLock.lock();
+    blockedThreads.push(self);
+    blockedThreadsLock.unlock();
+    self->wakeupTimeInCycles = wakeupTimeInCycles;
     lock.unlock();
     dispatch();
+    // Leave the queue after a timeout, so that a later notifyOne() is not
+    // spent on this thread.
+    blockedThreadsLock.lock();
+    blockedThreads.remove(self);
+    blockedThreadsLock.unlock();
     lock.lock();
 }
 
@@ -737,20 +1772,26 @@ struct DispatchTimeKeeper {
     // time into PerfStats.
     // This method is used in dispatch() in place of destruction followed by
     // construction to avoid leaking idle cycles.
-    void flush() {
+    // Returns the time in cycles at which the counts were flushed.
+    uint64_t flush() {
         uint64_t currentTime = Cycles::rdtsc();
-        PerfStats::threadStats.totalCycles +=
-            currentTime - lastTotalCollectionTime;
-        PerfStats::threadStats.idleCycles += currentTime - dispatchStartCycles;
+        PerfStats& stats = PerfStats::threadStats;
+        stats.beginUpdate();
+        stats.totalCycles += currentTime - lastTotalCollectionTime;
+        stats.idleCycles += currentTime - dispatchStartCycles;
+        stats.endUpdate();
         lastTotalCollectionTime = currentTime;
         dispatchStartCycles = currentTime;
+        return currentTime;
     }
 
     ~DispatchTimeKeeper() {
         uint64_t currentTime = Cycles::rdtsc();
-        PerfStats::threadStats.totalCycles +=
-            currentTime - lastTotalCollectionTime;
-        PerfStats::threadStats.idleCycles += currentTime - dispatchStartCycles;
+        PerfStats& stats = PerfStats::threadStats;
+        stats.beginUpdate();
+        stats.totalCycles += currentTime - lastTotalCollectionTime;
+        stats.idleCycles += currentTime - dispatchStartCycles;
+        stats.endUpdate();
         lastTotalCollectionTime = currentTime;
     }
 };
@@ -13,18 +13,25 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/wait.h>
+#include <memory>
 #include <thread>
 #include "PerfUtils/Cycles.h"
 #include "gtest/gtest.h"
 
 #define private public
+#define protected public
 #include "Arachne.h"
+#include "Channel.h"
 #include "CoreArbiter/ArbiterClientShim.h"
 #include "CoreArbiter/CoreArbiterClient.h"
 #include "CoreArbiter/CoreArbiterServer.h"
 #include "CoreArbiter/Logger.h"
 #include "CoreArbiter/MockSyscall.h"
 #include "DefaultCoreManager.h"
+#include "Future.h"
+#include "Parallel.h"
+#include "TaskGroup.h"
 
 namespace Arachne {
 
@@ -292,6 +299,193 @@ sleepLockTryLockTest() {
 }
 TEST_F(ArachneTest, SleepLock_tryLock) { createThread(sleepLockTryLockTest); }
 
+static volatile int spinTestStage;
+static Arachne::SleepLock adaptiveLock;
+
+static void
+busyRemoteHolder() {
+    adaptiveLock.lock();
+    spinTestStage = 1;
+    // Keep running, without yielding, until the other thread starts to
+    // acquire the lock.
+    while (spinTestStage != 2) {
+    }
+    adaptiveLock.unlock();
+}
+
+static void
+spinningLocker() {
+    while (spinTestStage != 1)
+        yield();
+    // Spin for up to a second, so that the holder's kernel thread surely
+    // gets to run.
+    adaptiveLock.spinCycles = Cycles::fromSeconds(1.0);
+    spinTestStage = 2;
+    adaptiveLock.lock();
+    adaptiveLock.unlock();
+    flag = 1;
+}
+
+TEST_F(ArachneTest, SleepLock_spinsWhileOwnerRunsElsewhere) {
+    PerfStats before, after;
+    PerfStats::collectStats(&before);
+    spinTestStage = 0;
+    flag = 0;
+    createThreadOnCore(1, busyRemoteHolder);
+    createThreadOnCore(0, spinningLocker);
+    limitedTimeWait([]() -> bool { return flag; });
+    PerfStats::collectStats(&after);
+    EXPECT_LT(before.numSleepLockSpinAcquisitions,
+              after.numSleepLockSpinAcquisitions);
+    EXPECT_EQ(before.numSleepLockParks, after.numSleepLockParks);
+    flag = 0;
+    adaptiveLock.spinCycles = SleepLock::INITIAL_SPIN_CYCLES;
+}
+
+static void
+yieldingLocalHolder() {
+    adaptiveLock.lock();
+    spinTestStage = 1;
+    while (spinTestStage != 2)
+        yield();
+    adaptiveLock.unlock();
+}
+
+static void
+parkingLocker() {
+    while (spinTestStage != 1)
+        yield();
+    PerfStats before, after;
+    PerfStats::collectStats(&before);
+    spinTestStage = 2;
+    // The owner lives on this core, so spinning could not help.
+    adaptiveLock.lock();
+    PerfStats::collectStats(&after);
+    adaptiveLock.unlock();
+    EXPECT_EQ(before.numSleepLockParks + 1, after.numSleepLockParks);
+    EXPECT_EQ(before.numSleepLockSpinAcquisitions,
+              after.numSleepLockSpinAcquisitions);
+    flag = 1;
+}
+
+TEST_F(ArachneTest, SleepLock_parksWhenOwnerOnSameCore) {
+    spinTestStage = 0;
+    flag = 0;
+    createThreadOnCore(0, yieldingLocalHolder);
+    createThreadOnCore(0, parkingLocker);
+    limitedTimeWait([]() -> bool { return flag; });
+    flag = 0;
+}
+
+static Arachne::SharedSleepLock sharedLock;
+
+static void
+sharedLockTryLockTest() {
+    EXPECT_TRUE(sharedLock.try_lock_shared());
+    EXPECT_TRUE(sharedLock.try_lock_shared());
+    EXPECT_FALSE(sharedLock.try_lock());
+    sharedLock.unlock_shared();
+    EXPECT_FALSE(sharedLock.try_lock());
+    sharedLock.unlock_shared();
+    EXPECT_TRUE(sharedLock.try_lock());
+    EXPECT_FALSE(sharedLock.try_lock_shared());
+    EXPECT_FALSE(sharedLock.try_lock());
+    sharedLock.unlock();
+    flag = 1;
+}
+
+TEST_F(ArachneTest, SharedSleepLock_tryLock) {
+    flag = 0;
+    createThreadOnCore(0, sharedLockTryLockTest);
+    limitedTimeWait([]() -> bool { return flag; });
+    flag = 0;
+}
+
+static volatile int readersFinished;
+static volatile int readersFinishedBeforeWriter;
+
+static void
+batchedReader() {
+    sharedLock.lock_shared();
+    // Give the other readers in the batch a chance to enter.
+    yield();
+    readersFinished++;
+    sharedLock.unlock_shared();
+}
+
+static void
+queuedWriter() {
+    sharedLock.lock();
+    readersFinishedBeforeWriter = readersFinished;
+    sharedLock.unlock();
+}
+
+static void
+readerBatchingTest() {
+    sharedLock.lock();
+    // A reader arriving after a queued writer still joins the batch that is
+    // admitted when the current writer leaves.
+    ThreadId ids[4];
+    ids[0] = createThreadOnCore(0, batchedReader);
+    ids[1] = createThreadOnCore(0, queuedWriter);
+    ids[2] = createThreadOnCore(0, batchedReader);
+    ids[3] = createThreadOnCore(0, batchedReader);
+    while (!sharedLock.waitingReaders.contains(ids[0].context) ||
+           !sharedLock.waitingWriters.contains(ids[1].context) ||
+           !sharedLock.waitingReaders.contains(ids[2].context) ||
+           !sharedLock.waitingReaders.contains(ids[3].context))
+        yield();
+    sharedLock.unlock();
+    joinAll(ids, 4);
+    EXPECT_EQ(3, readersFinishedBeforeWriter);
+    flag = 1;
+}
+
+TEST_F(ArachneTest, SharedSleepLock_batchesReaders) {
+    flag = 0;
+    readersFinished = 0;
+    readersFinishedBeforeWriter = -1;
+    createThreadOnCore(0, readerBatchingTest);
+    limitedTimeWait([]() -> bool { return flag; });
+    flag = 0;
+}
+
+static volatile int lockForResult;
+
+static void
+lockForTest() {
+    sleepLock.lock();
+    lockForResult = 0;
+    createThreadOnCore(0, []() {
+        lockForResult = sleepLock.lockFor(20000) ? 2 : -1;
+    });
+    while (lockForResult == 0)
+        yield();
+    EXPECT_EQ(-1, lockForResult);
+    // A waiter that timed out must not be handed the lock.
+    sleepLock.unlock();
+    EXPECT_TRUE(sleepLock.try_lock());
+
+    lockForResult = 0;
+    createThreadOnCore(0, []() {
+        lockForResult = sleepLock.lockFor(1000000000) ? 2 : -1;
+        sleepLock.unlock();
+    });
+    Arachne::sleep(1000);
+    sleepLock.unlock();
+    while (lockForResult == 0)
+        yield();
+    EXPECT_EQ(2, lockForResult);
+}
+
+TEST_F(ArachneTest, SleepLock_lockFor) {
+    lockForResult = 0;
+    ThreadId id = createThreadOnCore(0, lockForTest);
+    limitedTimeWait([id]() -> bool {
+        return id.context->generation != id.generation;
+    });
+}
+
 // Helper functions for thread creation tests.
 static volatile int threadCreationIndicator = 0;
 
@@ -374,9 +568,127 @@ TEST_F(ArachneTest, createThread_maxThreadsExceeded) {
     EXPECT_EQ(Arachne::NullThread, createThreadOnCore(0, clearFlag));
 
     // Clean up the threads
-    while (Arachne::occupiedAndCount[0]->load().numOccupied > 0)
+    while (numOccupiedContexts(occupiedAndCount[0]) > 0)
+        threadCreationIndicator = 1;
+    threadCreationIndicator = 0;
+}
+
+TEST_F(ArachneTest, createThread_fillsEveryContextGroup) {
+    for (int i = 0; i < Arachne::maxThreadsPerCore; i++) {
+        EXPECT_EQ(i, firstContextInGroup(contextGroupOf(i)) + indexInGroup(i));
+        EXPECT_LT(indexInGroup(i), contextGroupSize(contextGroupOf(i)));
+    }
+    for (int i = 0; i < Arachne::maxThreadsPerCore; i++)
+        EXPECT_NE(Arachne::NullThread, createThreadOnCore(0, clearFlag));
+    EXPECT_EQ(static_cast<uint32_t>(Arachne::maxThreadsPerCore),
+              numOccupiedContexts(occupiedAndCount[0]));
+    for (int group = 0; group < numContextGroups; group++) {
+        MaskAndCount slotMap = occupiedAndCount[0][group].load();
+        EXPECT_EQ(static_cast<uint32_t>(contextGroupSize(group)),
+                  slotMap.numOccupied);
+        EXPECT_EQ(static_cast<uint32_t>(contextGroupSize(group)),
+                  static_cast<uint32_t>(__builtin_popcountl(slotMap.occupied)));
+    }
+
+    // Clean up the threads
+    while (numOccupiedContexts(occupiedAndCount[0]) > 0)
+        threadCreationIndicator = 1;
+    threadCreationIndicator = 0;
+}
+
+static void
+countCompletion() {
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, createThreadOnCoreOrQueue_handsOffExitingContext) {
+    pendingThreadQueueDepth = 1;
+    completionCounter = 0;
+    threadCreationIndicator = 0;
+    for (int i = 0; i < Arachne::maxThreadsPerCore; i++)
+        EXPECT_TRUE(createThreadOnCoreOrQueue(0, clearFlag));
+
+    // The core is full, so the next thread waits in its queue, which has
+    // room for only one.
+    EXPECT_TRUE(createThreadOnCoreOrQueue(0, countCompletion));
+    EXPECT_FALSE(createThreadOnCoreOrQueue(0, countCompletion));
+    EXPECT_EQ(0, completionCounter);
+
+    // It runs once a thread exits.
+    threadCreationIndicator = 1;
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+
+    // Clean up the threads
+    while (numOccupiedContexts(occupiedAndCount[0]) > 0)
         threadCreationIndicator = 1;
     threadCreationIndicator = 0;
+    pendingThreadQueueDepth = 0;
+}
+
+static ThreadContext* exitingContext;
+static ThreadContext* handedOffContext;
+
+static void
+recordExitingContext() {
+    exitingContext = core.loadedContext;
+}
+
+static void
+recordHandedOffContext() {
+    handedOffContext = core.loadedContext;
+}
+
+TEST_F(ArachneTest, createThreadOnCoreOrQueue_runsHandedOffThreadDirectly) {
+    pendingThreadQueueDepth = 2;
+    exitingContext = NULL;
+    handedOffContext = NULL;
+    // Make the core look full but for one context.
+    for (int group = 0; group < numContextGroups; group++) {
+        int size = contextGroupSize(group) - (group == 0 ? 1 : 0);
+        MaskAndCount full;
+        full.numOccupied = static_cast<uint8_t>(size);
+        full.occupied = (((1UL << size) - 1) << (group == 0 ? 1 : 0)) &
+                        0x00FFFFFFFFFFFFFF;
+        occupiedAndCount[0][group] = full;
+    }
+    // The threads queued while the last context is taken run one after the
+    // other in its context once its thread exits.
+    threadCreationIndicator = 0;
+    EXPECT_NE(NullThread, createThreadOnCore(0, clearFlag));
+    EXPECT_TRUE(createThreadOnCoreOrQueue(0, recordExitingContext));
+    EXPECT_TRUE(createThreadOnCoreOrQueue(0, recordHandedOffContext));
+    threadCreationIndicator = 1;
+    limitedTimeWait([]() -> bool { return handedOffContext != NULL; });
+    EXPECT_EQ(allThreadContexts[0][0], exitingContext);
+    EXPECT_EQ(allThreadContexts[0][0], handedOffContext);
+
+    for (int group = 0; group < numContextGroups; group++)
+        occupiedAndCount[0][group] = {0, 0};
+    pendingThreadQueueDepth = 0;
+}
+
+TEST_F(ArachneTest, createThreadOnCoreOrQueue_startsInFreedContext) {
+    pendingThreadQueueDepth = 1;
+    completionCounter = 0;
+    // Make the core look full.
+    for (int group = 0; group < numContextGroups; group++) {
+        MaskAndCount full;
+        full.numOccupied = static_cast<uint8_t>(contextGroupSize(group));
+        full.occupied = ((1UL << full.numOccupied) - 1) & 0x00FFFFFFFFFFFFFF;
+        occupiedAndCount[0][group] = full;
+    }
+    EXPECT_TRUE(createThreadOnCoreOrQueue(0, countCompletion));
+    EXPECT_EQ(0, completionCounter);
+
+    // Contexts that become free without a thread exiting, as when threads
+    // are stolen, are found by the dispatch loop.
+    for (int group = 0; group < numContextGroups; group++)
+        occupiedAndCount[0][group] = {0, 0};
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    limitedTimeWait([]() -> bool {
+        return numOccupiedContexts(occupiedAndCount[0]) == 0;
+    });
+    pendingThreadQueueDepth = 0;
 }
 
 TEST_F(ArachneTest, createThread_pickLeastLoaded) {
@@ -406,6 +718,82 @@ TEST_F(ArachneTest, createThread_pickLeastLoaded) {
     *occupiedAndCount[core1] = {0, 0};
 }
 
+static volatile int childCoreId;
+
+static void
+recordChildCore() {
+    childCoreId = core.kernelThreadId;
+}
+
+static void
+createChildAndJoin() {
+    join(createThread(recordChildCore));
+}
+
+TEST_F(ArachneTest, createThread_localPlacement) {
+    int parentCore = coreManager->getCores(0)->get(1);
+    int otherCore = coreManager->getCores(0)->get(0);
+    localPlacementThreshold = 2;
+    childCoreId = -1;
+    createThreadOnCore(parentCore, createChildAndJoin);
+    limitedTimeWait([]() -> bool { return childCoreId != -1; });
+    EXPECT_EQ(parentCore, childCoreId);
+
+    // A parent core at the threshold falls back to the two random choices.
+    localPlacementThreshold = 1;
+    childCoreId = -1;
+    mockRandomValues.push_back(0);
+    mockRandomValues.push_back(1);
+    createThreadOnCore(parentCore, createChildAndJoin);
+    limitedTimeWait([]() -> bool { return childCoreId != -1; });
+    EXPECT_EQ(otherCore, childCoreId);
+    localPlacementThreshold = 0;
+}
+
+struct Accumulator {
+    void
+    add(int value, int& total) {
+        total += value + base;
+        flag = 1;
+    }
+    int base;
+};
+
+TEST_F(ArachneTest, createThread_invocation) {
+    // A lambda without captures takes no space, so six words of arguments
+    // still fit in the context.
+    auto sum = [](uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e,
+                  uint64_t f) {
+        flag = static_cast<int>(a + b + c + d + e + f);
+    };
+    typedef ThreadInvocationFor<decltype(sum), uint64_t, uint64_t, uint64_t,
+                                uint64_t, uint64_t, uint64_t>
+        SixArguments;
+    EXPECT_GE(CACHE_LINE_SIZE - 8U, sizeof(SixArguments));
+    uint64_t v[6] = {1, 2, 3, 4, 5, 6};
+    flag = 0;
+    createThreadOnCore(0, sum, v[0], v[1], v[2], v[3], v[4], v[5]);
+    limitedTimeWait([]() -> bool { return flag == 21; });
+    EXPECT_EQ(21, flag);
+
+    // Member functions are invoked on their first argument, and arguments
+    // wrapped with std::ref are passed by reference.
+    Accumulator accumulator = {10};
+    int total = 0;
+    flag = 0;
+    createThreadOnCore(0, &Accumulator::add, &accumulator, 5, std::ref(total));
+    limitedTimeWait([]() -> bool { return flag == 1; });
+    EXPECT_EQ(15, total);
+
+    // The arguments are destroyed once the main function returns.
+    std::shared_ptr<int> shared(new int(0));
+    createThreadOnCore(0, [](std::shared_ptr<int> value) { ++*value; },
+                       shared);
+    limitedTimeWait([&shared]() -> bool { return shared.use_count() == 1; });
+    EXPECT_EQ(1, *shared);
+    EXPECT_EQ(1, shared.use_count());
+}
+
 TEST_F(ArachneTest, alignedAlloc) {
     void* ptr = alignedAlloc(7);
     EXPECT_EQ(0U, reinterpret_cast<uint64_t>(ptr) & (CACHE_LINE_SIZE - 1));
@@ -415,6 +803,558 @@ TEST_F(ArachneTest, alignedAlloc) {
     free(ptr);
 }
 
+struct LargeArgument {
+    char data[200];
+};
+
+static void
+checkLargeArgument(LargeArgument argument, int value) {
+    for (size_t i = 0; i < sizeof(argument.data); i++)
+        EXPECT_EQ(static_cast<char>(i), argument.data[i]);
+    flag = value;
+}
+
+TEST_F(ArachneTest, createThread_largeArguments) {
+    LargeArgument argument;
+    for (size_t i = 0; i < sizeof(argument.data); i++)
+        argument.data[i] = static_cast<char>(i);
+    flag = 0;
+    ThreadId id = createThreadOnCore(0, checkLargeArgument, argument, 3);
+    EXPECT_NE(Arachne::NullThread, id);
+    limitedTimeWait([]() -> bool { return flag == 3; });
+    limitedTimeWait(
+        []() -> bool { return occupiedAndCount[0]->load().numOccupied == 0; });
+
+    // The context is reused by an ordinary thread afterwards.
+    createThreadOnCore(0, setFlagForCreation, 4);
+    threadCreationIndicator = 1;
+    limitedTimeWait([]() -> bool { return threadCreationIndicator == 4; });
+    threadCreationIndicator = 0;
+    flag = 0;
+}
+
+TEST_F(ArachneTest, createThreadsOnCore) {
+    ThreadId ids[maxThreadsPerCore + 1];
+    *occupiedAndCount[0] = {0b101, 2};
+    threadCreationIndicator = 0;
+    EXPECT_EQ(3U, createThreadsOnCore(0, 3, ids, clearFlag));
+    EXPECT_EQ(5U, Arachne::occupiedAndCount[0]->load().numOccupied);
+    EXPECT_EQ(0b11111U, Arachne::occupiedAndCount[0]->load().occupied);
+    EXPECT_EQ(allThreadContexts[0][1], ids[0].context);
+    EXPECT_EQ(allThreadContexts[0][3], ids[1].context);
+    EXPECT_EQ(allThreadContexts[0][4], ids[2].context);
+
+    // Only the remaining free contexts are handed out.
+    EXPECT_EQ(static_cast<uint32_t>(maxThreadsPerCore - 5),
+              createThreadsOnCore(0, maxThreadsPerCore + 1, ids, clearFlag));
+    EXPECT_EQ(Arachne::NullThread, ids[maxThreadsPerCore - 5]);
+    EXPECT_EQ(Arachne::NullThread, ids[maxThreadsPerCore]);
+
+    // Clean up the threads, including the two fake ones.
+    while (numOccupiedContexts(occupiedAndCount[0]) > 2)
+        threadCreationIndicator = 1;
+    threadCreationIndicator = 0;
+    *occupiedAndCount[0] = {0, 0};
+}
+
+TEST_F(ArachneTest, createThreads_spreadAcrossCores) {
+    ThreadId ids[7];
+    threadCreationIndicator = 0;
+    EXPECT_EQ(6U, createThreads(6, ids, clearFlag));
+    EXPECT_EQ(2U, Arachne::occupiedAndCount[0]->load().numOccupied);
+    EXPECT_EQ(2U, Arachne::occupiedAndCount[1]->load().numOccupied);
+    EXPECT_EQ(2U, Arachne::occupiedAndCount[2]->load().numOccupied);
+
+    // Clean up the threads
+    while (Arachne::occupiedAndCount[0]->load().numOccupied +
+               Arachne::occupiedAndCount[1]->load().numOccupied +
+               Arachne::occupiedAndCount[2]->load().numOccupied >
+           0)
+        threadCreationIndicator = 1;
+    threadCreationIndicator = 0;
+}
+
+static void
+fanOutJoiner() {
+    ThreadId ids[10];
+    EXPECT_EQ(10U, createThreads(10, ids, countCompletion));
+    joinAll(ids, 10);
+    EXPECT_EQ(10, completionCounter);
+    flag = 1;
+}
+
+TEST_F(ArachneTest, joinAll) {
+    completionCounter = 0;
+    flag = 0;
+    createThread(fanOutJoiner);
+    limitedTimeWait([]() -> bool { return flag; });
+    flag = 0;
+}
+
+TEST_F(ArachneTest, allocateStack) {
+    void* stack = allocateStack(3 * PAGE_SIZE + 1);
+    EXPECT_EQ(0U, reinterpret_cast<uint64_t>(stack) & (PAGE_SIZE - 1));
+    memset(stack, 1, 4 * PAGE_SIZE);
+    trimStack(stack, reinterpret_cast<char*>(stack) + 4 * PAGE_SIZE);
+    *reinterpret_cast<uint64_t*>(stack) = StackCanary;
+    releaseStack(stack, 3 * PAGE_SIZE + 1);
+}
+
+TEST_F(ArachneTest, createThread_allocatesStackLazily) {
+    EXPECT_TRUE(allThreadContexts[0][0]->stack != NULL);
+    EXPECT_TRUE(allThreadContexts[0][1]->stack == NULL);
+    EXPECT_TRUE(allThreadContexts[1][1]->stack == NULL);
+    threadCreationIndicator = 0;
+    createThreadOnCore(0, clearFlag);
+    createThreadOnCore(0, clearFlag);
+    EXPECT_TRUE(allThreadContexts[0][1]->stack != NULL);
+    EXPECT_TRUE(allThreadContexts[1][1]->stack == NULL);
+
+    // Clean up the threads
+    while (Arachne::occupiedAndCount[0]->load().numOccupied > 0)
+        threadCreationIndicator = 1;
+    threadCreationIndicator = 0;
+}
+
+static void
+deepStackUser() {
+    char buffer[16 * PAGE_SIZE];
+    memset(buffer, 'a', sizeof(buffer));
+    EXPECT_EQ('a', buffer[sizeof(buffer) - 1]);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, schedulerMainLoop_trimsStack) {
+    int originalHighWaterMark = stackPoolHighWaterMark;
+    stackPoolHighWaterMark = 0;
+    completionCounter = 0;
+    // Both threads land in the same context, so the second one runs on the
+    // stack that was trimmed when the first one exited.
+    createThreadOnCore(0, deepStackUser);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    limitedTimeWait(
+        []() -> bool { return occupiedAndCount[0]->load().numOccupied == 0; });
+    createThreadOnCore(0, deepStackUser);
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    limitedTimeWait(
+        []() -> bool { return occupiedAndCount[0]->load().numOccupied == 0; });
+    stackPoolHighWaterMark = originalHighWaterMark;
+}
+
+extern std::vector<std::atomic<int>*> stealRequests;
+void handleStealRequest();
+
+static std::atomic<int> numThreadsRanElsewhere;
+
+static void
+yieldThenRecordCore() {
+    yield();
+    // Read the core through the context, since core may not be reloaded from
+    // thread-local storage after a migration.
+    if (getThreadId().context->coreId != 0)
+        numThreadsRanElsewhere++;
+    completionCounter++;
+}
+
+static void
+busyVictim() {
+    for (int i = 0; i < 10; i++)
+        createThreadOnCore(0, yieldThenRecordCore);
+    // Keep core 0 busy until an idle core asks it for work.
+    limitedTimeWait([]() -> bool { return stealRequests[0]->load() >= 0; });
+}
+
+TEST_F(ArachneTest, dispatch_workStealing) {
+    enableWorkStealing = true;
+    completionCounter = 0;
+    numThreadsRanElsewhere = 0;
+    createThreadOnCore(0, busyVictim);
+    limitedTimeWait([]() -> bool { return completionCounter == 10; });
+    enableWorkStealing = false;
+    EXPECT_LT(0, numThreadsRanElsewhere);
+
+    PerfStats stats;
+    PerfStats::collectStats(&stats);
+    EXPECT_LT(0U, stats.numThreadsStolen);
+}
+
+TEST(LogLinearHistogramTest, bucketOf) {
+    for (uint64_t value = 0; value < 8; value++) {
+        EXPECT_EQ(static_cast<int>(value),
+                  LogLinearHistogram::bucketOf(value));
+        EXPECT_EQ(value, LogLinearHistogram::lowerBound(
+                             LogLinearHistogram::bucketOf(value)));
+    }
+    uint64_t values[] = {8, 9, 15, 16, 17, 1000, 123456789, ~0UL};
+    for (uint64_t value : values) {
+        int bucket = LogLinearHistogram::bucketOf(value);
+        EXPECT_LE(LogLinearHistogram::lowerBound(bucket), value);
+        if (bucket + 1 < LogLinearHistogram::NUM_BUCKETS) {
+            EXPECT_LT(value, LogLinearHistogram::lowerBound(bucket + 1));
+        }
+        // Buckets are at most 1/8 of their lower bound wide.
+        EXPECT_LE(value - LogLinearHistogram::lowerBound(bucket), value / 8);
+    }
+    EXPECT_EQ(LogLinearHistogram::NUM_BUCKETS - 1,
+              LogLinearHistogram::bucketOf(~0UL));
+}
+
+TEST(LogLinearHistogramTest, percentile) {
+    LogLinearHistogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    EXPECT_EQ(0U, histogram.percentile(0.5));
+    for (uint64_t i = 1; i <= 100; i++)
+        histogram.record(i);
+    histogram.record(1000000);
+    EXPECT_EQ(101U, histogram.count);
+    EXPECT_EQ(1U, histogram.percentile(0.0));
+    EXPECT_EQ(48U, histogram.percentile(0.5));
+    EXPECT_EQ(LogLinearHistogram::lowerBound(
+                  LogLinearHistogram::bucketOf(1000000)),
+              histogram.percentile(1.0));
+
+    LogLinearHistogram other;
+    memset(&other, 0, sizeof(other));
+    other.record(7);
+    other.add(histogram);
+    EXPECT_EQ(102U, other.count);
+    EXPECT_EQ(histogram.sum + 7, other.sum);
+}
+
+TEST_F(ArachneTest, PerfStats_histograms) {
+    PerfStats before, after;
+    PerfStats::collectStats(&before);
+    completionCounter = 0;
+    for (int i = 0; i < 4; i++)
+        createThreadOnCore(0, countCompletion);
+    limitedTimeWait([]() -> bool { return completionCounter == 4; });
+    limitedTimeWait([]() -> bool {
+        return Arachne::occupiedAndCount[0]->load().numOccupied == 0;
+    });
+    PerfStats::collectStats(&after);
+    EXPECT_LE(before.threadLifetimeCycles.count + 4,
+              after.threadLifetimeCycles.count);
+    EXPECT_LE(before.creationRetries.count + 4, after.creationRetries.count);
+    EXPECT_LT(before.dispatchLatencyCycles.count,
+              after.dispatchLatencyCycles.count);
+}
+
+TEST_F(ArachneTest, PerfStats_collectCoreStats) {
+    std::vector<PerfStats> perThread;
+    PerfStats::collectCoreStats(&perThread);
+    // Every kernel thread running a core has registered its statistics.
+    EXPECT_LE(numActiveCores.load(), perThread.size());
+    PerfStats total;
+    PerfStats::collectStats(&total);
+    uint64_t numThreadsCreated = 0;
+    for (PerfStats& stats : perThread) {
+        EXPECT_EQ(0U, stats.updateSequence & 1);
+        numThreadsCreated += stats.numThreadsCreated;
+    }
+    EXPECT_LE(numThreadsCreated, total.numThreadsCreated);
+}
+
+static void
+donateWithPinnedContext() {
+    // Neither thread has started yet; the second one is pinned to this core.
+    ThreadId first = createThreadOnCore(0, countCompletion);
+    ThreadId second = createThreadOnCore(0, countCompletion);
+    uint64_t originalPinnedContexts = *core.localPinnedContexts;
+    *core.localPinnedContexts |= 1L << second.context->idInCore;
+    *stealRequests[0] = 1;
+    handleStealRequest();
+    *core.localPinnedContexts = originalPinnedContexts;
+
+    EXPECT_EQ(-1, stealRequests[0]->load());
+    EXPECT_EQ(1U, first.context->coreId);
+    EXPECT_EQ(0U, second.context->coreId);
+    EXPECT_EQ(2U, occupiedAndCount[0]->load().numOccupied);
+    flag = 1;
+}
+
+TEST_F(ArachneTest, handleStealRequest_respectsPinnedContexts) {
+    completionCounter = 0;
+    flag = 0;
+    createThreadOnCore(0, donateWithPinnedContext);
+    limitedTimeWait([]() -> bool { return flag; });
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    flag = 0;
+}
+
+extern uint64_t parkAfterIdleNs;
+extern volatile bool ioRingsInUse;
+
+TEST_F(ArachneTest, parkCoreIfIdle) {
+    PerfStats before;
+    PerfStats::collectStats(&before);
+    parkAfterIdleNs = 1000;
+    limitedTimeWait([&before]() -> bool {
+        PerfStats stats;
+        PerfStats::collectStats(&stats);
+        return stats.numCoreParks > before.numCoreParks &&
+               parkedFlags[1]->load() != 0;
+    });
+    EXPECT_NE(0U, parkedFlags[1]->load());
+
+    // Creating a thread on a parked core wakes it right away.
+    completionCounter = 0;
+    createThreadOnCore(1, countCompletion);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+
+    parkAfterIdleNs = 0;
+    for (size_t i = 0; i < parkedFlags.size(); i++)
+        unparkCore(static_cast<int>(i));
+}
+
+static void
+callUntilFlagSet() {
+    int result = blockingCall([]() -> int {
+        while (!flag)
+            usleep(100);
+        return 42;
+    });
+    EXPECT_EQ(42, result);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, blockingCall) {
+    PerfStats before;
+    PerfStats::collectStats(&before);
+    completionCounter = 0;
+    flag = 0;
+    // The flag is set by a thread on the same core, so the core must keep
+    // running threads while the call blocks.
+    createThreadOnCore(0, callUntilFlagSet);
+    createThreadOnCore(0, []() { flag = 1; });
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+    flag = 0;
+
+    PerfStats after;
+    PerfStats::collectStats(&after);
+    EXPECT_EQ(before.numBlockingCalls + 1, after.numBlockingCalls);
+    EXPECT_EQ(before.blockingCallCycles.count + 1,
+              after.blockingCallCycles.count);
+    EXPECT_LE(1U, after.blockingCallThreads);
+    EXPECT_EQ(0U, after.blockingCallQueueDepth);
+
+    // Outside Arachne the call runs directly.
+    EXPECT_EQ(7, blockingCall([]() { return 7; }));
+}
+
+static int ioPipe[2];
+
+static void
+readFromPipe() {
+    char buffer[6] = {0};
+    EXPECT_EQ(6, ioRead(ioPipe[0], buffer, sizeof(buffer)));
+    EXPECT_STREQ("hello", buffer);
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, ioReadAndWrite) {
+    ASSERT_EQ(0, pipe(ioPipe));
+    PerfStats before;
+    PerfStats::collectStats(&before);
+    completionCounter = 0;
+    // The reader waits on an empty pipe, so the core must keep running
+    // threads until the writer fills it.
+    createThreadOnCore(0, readFromPipe);
+    createThreadOnCore(0, []() {
+        EXPECT_EQ(6, ioWrite(ioPipe[1], "hello", 6));
+        completionCounter++;
+    });
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    EXPECT_EQ(2, completionCounter);
+
+    PerfStats after;
+    PerfStats::collectStats(&after);
+    if (ioRingsInUse) {
+        EXPECT_LE(before.numIoCompletions + 2, after.numIoCompletions);
+    }
+
+    // Errors are reported through errno, and outside Arachne the calls are
+    // ordinary system calls.
+    char buffer[1];
+    EXPECT_EQ(-1, ioRead(-1, buffer, sizeof(buffer)));
+    EXPECT_EQ(EBADF, errno);
+    EXPECT_EQ(1, ioWrite(ioPipe[1], "x", 1));
+    EXPECT_EQ(1, ioRead(ioPipe[0], buffer, sizeof(buffer)));
+    EXPECT_EQ('x', buffer[0]);
+    close(ioPipe[0]);
+    close(ioPipe[1]);
+}
+
+static void
+sleepUntilTold() {
+    completionCounter = 1;
+    while (completionCounter == 1)
+        Arachne::sleep(1000000);
+}
+
+TEST_F(ArachneTest, tracing) {
+    completionCounter = 0;
+    startTracing();
+    ThreadId id = createThreadOnCore(0, sleepUntilTold);
+    std::vector<TraceEvent> events;
+    limitedTimeWait([id, &events]() -> bool {
+        collectTraceEvents(&events);
+        for (TraceEvent& event : events)
+            if (event.type == TRACE_BLOCK && event.context == id.context)
+                return true;
+        return false;
+    });
+    completionCounter = 2;
+    signal(id);
+    limitedTimeWait(
+        [id]() -> bool { return id.context->generation != id.generation; });
+    stopTracing();
+    collectTraceEvents(&events);
+    int counts[TRACE_CORE_DECREMENT + 1] = {0};
+    for (TraceEvent& event : events) {
+        if (event.context != id.context || event.generation != id.generation)
+            continue;
+        counts[event.type]++;
+        if (event.type == TRACE_CREATE) {
+            // The thread was created from outside Arachne.
+            EXPECT_EQ(NO_TRACE_CORE, event.coreId);
+            EXPECT_EQ(0, event.arg);
+        } else if (event.type != TRACE_SIGNAL) {
+            EXPECT_EQ(0, event.coreId);
+        }
+    }
+    EXPECT_EQ(1, counts[TRACE_CREATE]);
+    EXPECT_EQ(1, counts[TRACE_SIGNAL]);
+    EXPECT_LE(1, counts[TRACE_SWITCH]);
+    EXPECT_LE(1, counts[TRACE_BLOCK]);
+    EXPECT_EQ(1, counts[TRACE_EXIT]);
+    EXPECT_EQ(0, counts[TRACE_MIGRATE]);
+
+    // Nothing is recorded once tracing stops.
+    createThreadOnCore(0, []() {});
+    std::vector<TraceEvent> later;
+    collectTraceEvents(&later);
+    EXPECT_EQ(events.size(), later.size());
+
+    FILE* output = tmpfile();
+    ASSERT_TRUE(output != NULL);
+    writeTrace(output);
+    std::string json(static_cast<size_t>(ftell(output)), '\0');
+    rewind(output);
+    EXPECT_EQ(json.size(), fread(&json[0], 1, json.size(), output));
+    fclose(output);
+    EXPECT_EQ(0U, json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+    EXPECT_NE(std::string::npos, json.find("\"name\":\"core 0\""));
+    EXPECT_NE(std::string::npos, json.find("\"ph\":\"X\",\"pid\":1,\"tid\":0"));
+    EXPECT_NE(std::string::npos, json.find("\"name\":\"exit\""));
+    EXPECT_EQ(json.size() - 4, json.rfind("\n]}\n"));
+}
+
+TEST_F(ArachneTest, tracing_dumpTraceOnAbort) {
+    char path[] = "/tmp/ArachneTraceXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        // Only this thread survives in the child.
+        startTracing();
+        recordTraceEvent(TRACE_CREATE, NULL, 0, 0);
+        dumpTraceOnAbort(path);
+        abort();
+    }
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFSIGNALED(status));
+    EXPECT_EQ(SIGABRT, WTERMSIG(status));
+
+    FILE* output = fopen(path, "r");
+    ASSERT_TRUE(output != NULL);
+    char json[1 << 12];
+    size_t length = fread(json, 1, sizeof(json) - 1, output);
+    json[length] = '\0';
+    fclose(output);
+    unlink(path);
+    std::string trace(json);
+    EXPECT_EQ(0U, trace.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+    EXPECT_NE(std::string::npos,
+              trace.find("\"name\":\"outside Arachne 255\""));
+    EXPECT_NE(std::string::npos,
+              trace.find("\"ts\":0.000,\"name\":\"create\",\"args\":{"
+                         "\"core\":0}}"));
+    EXPECT_EQ(trace.size() - 4, trace.rfind("\n]}\n"));
+}
+
+void removeThreadsFromCore(CoreList* outputCores);
+uint32_t planMigration(uint32_t numThreads,
+                       const std::vector<uint32_t>& occupancy,
+                       std::vector<uint32_t>* plan);
+
+TEST_F(ArachneTest, planMigration) {
+    std::vector<uint32_t> plan;
+    EXPECT_EQ(0U, planMigration(5, {3, 0, 1}, &plan));
+    EXPECT_EQ(std::vector<uint32_t>({0, 3, 2}), plan);
+
+    // Full and exclusive cores receive nothing.
+    uint32_t max = static_cast<uint32_t>(maxThreadsPerCore);
+    EXPECT_EQ(1U, planMigration(4, {max - 1, numContextGroups * EXCLUSIVE,
+                                    max - 2},
+                                &plan));
+    EXPECT_EQ(std::vector<uint32_t>({1, 0, 2}), plan);
+
+    EXPECT_EQ(3U, planMigration(3, {}, &plan));
+    EXPECT_TRUE(plan.empty());
+}
+
+static void
+waitForFlag() {
+    while (!flag)
+        yield();
+    completionCounter++;
+}
+
+static void
+removeFourThreads() {
+    for (int i = 0; i < 4; i++)
+        createThreadOnCore(2, waitForFlag);
+    int before = occupiedAndCount[0]->load().numOccupied +
+                 occupiedAndCount[1]->load().numOccupied;
+    PerfStats statsBefore = PerfStats::threadStats;
+    CoreList outputCores(2);
+    outputCores.add(0);
+    outputCores.add(1);
+    removeThreadsFromCore(&outputCores);
+
+    EXPECT_EQ(before + 4, occupiedAndCount[0]->load().numOccupied +
+                              occupiedAndCount[1]->load().numOccupied);
+    EXPECT_EQ(1UL << core.loadedContext->idInCore,
+              core.localOccupiedAndCount->load().occupied);
+    EXPECT_EQ(statsBefore.numThreadsMigrated + 4,
+              PerfStats::threadStats.numThreadsMigrated);
+    EXPECT_EQ(statsBefore.coreRampDownCycles.count + 1,
+              PerfStats::threadStats.coreRampDownCycles.count);
+
+    // Let creations onto this core resume.
+    for (int g = 0; g < numContextGroups; g++) {
+        MaskAndCount slotMap = core.localOccupiedAndCount[g];
+        slotMap.numOccupied =
+            static_cast<uint8_t>(__builtin_popcountll(slotMap.occupied));
+        core.localOccupiedAndCount[g] = slotMap;
+    }
+    flag = 1;
+}
+
+TEST_F(ArachneTest, removeThreadsFromCore) {
+    completionCounter = 0;
+    flag = 0;
+    createThreadOnCore(2, removeFourThreads);
+    limitedTimeWait([]() -> bool { return completionCounter == 4; });
+    EXPECT_EQ(4, completionCounter);
+    flag = 0;
+}
+
 extern std::vector<void*> kernelThreadStacks;
 
 // Helper method for schedulerMainLoop
@@ -471,17 +1411,68 @@ TEST_F(ArachneTest, yield_secondThreadGotControl) {
     keepYielding = false;
 }
 
-TEST_F(ArachneTest, yield_allThreadsRan) {
-    Arachne::minNumCores = 2;
-    Arachne::init();
+TEST_F(ArachneTest, yield_allThreadsRan) {
+    Arachne::minNumCores = 2;
+    Arachne::init();
+    keepYielding = true;
+    flag = 0;
+
+    createThreadOnCore(0, bitSetter, 0);
+    createThreadOnCore(0, bitSetter, 1);
+    createThreadOnCore(0, bitSetter, 2);
+    limitedTimeWait([]() -> bool { return flag == 7; });
+    keepYielding = false;
+}
+
+static volatile uint64_t yieldCounts[PriorityScheduler::NUM_PRIORITY_LEVELS];
+
+static void
+countingYielder(int level) {
+    while (keepYielding) {
+        yieldCounts[level]++;
+        Arachne::yield();
+    }
+}
+
+TEST_F(ArachneTest, createThreadWithPriority_invalidPriority) {
+    EXPECT_EQ(NullThread, createThreadWithPriority(-1, setFlag));
+    EXPECT_EQ(NullThread,
+              createThreadWithPriority(PriorityScheduler::NUM_PRIORITY_LEVELS,
+                                       setFlag));
+}
+
+TEST_F(ArachneTest, createThreadWithPriority_strictPriority) {
+    PriorityScheduler::useStrictPriorities(10000000000UL);
     keepYielding = true;
-    flag = 0;
+    yieldCounts[0] = yieldCounts[2] = 0;
+    createThreadOnCore(0, countingYielder, 0);
+    createThreadOnCoreWithPriority(0, 2, countingYielder, 2);
+    limitedTimeWait([]() -> bool { return yieldCounts[0] > 1000; });
+    uint64_t lowCount = yieldCounts[2];
+    limitedTimeWait([]() -> bool { return yieldCounts[0] > 20000; });
+    EXPECT_EQ(lowCount, yieldCounts[2]);
+    keepYielding = false;
+    limitedTimeWait(
+        []() -> bool { return occupiedAndCount[0]->load().numOccupied == 0; });
+    PriorityScheduler::useStrictPriorities(10000000);
+    priorityLevelsInUse = false;
+}
 
-    createThreadOnCore(0, bitSetter, 0);
-    createThreadOnCore(0, bitSetter, 1);
-    createThreadOnCore(0, bitSetter, 2);
-    limitedTimeWait([]() -> bool { return flag == 7; });
+TEST_F(ArachneTest, createThreadWithPriority_starvationLimit) {
+    PriorityScheduler::useStrictPriorities(10000);
+    keepYielding = true;
+    yieldCounts[0] = yieldCounts[2] = 0;
+    createThreadOnCore(0, countingYielder, 0);
+    createThreadOnCoreWithPriority(0, 2, countingYielder, 2);
+    limitedTimeWait([]() -> bool { return yieldCounts[0] > 1000; });
+    uint64_t lowCount = yieldCounts[2];
+    limitedTimeWait([lowCount]() -> bool { return yieldCounts[2] > lowCount; });
+    EXPECT_LT(lowCount, yieldCounts[2]);
     keepYielding = false;
+    limitedTimeWait(
+        []() -> bool { return occupiedAndCount[0]->load().numOccupied == 0; });
+    PriorityScheduler::useStrictPriorities(10000000);
+    priorityLevelsInUse = false;
 }
 
 using PerfUtils::Cycles;
@@ -517,6 +1508,51 @@ TEST_F(ArachneTest, sleep_wakeupTimeSetAndCleared) {
     flag = 0;
 }
 
+void
+deadlineSleeper() {
+    uint64_t deadline = Cycles::rdtsc() + Cycles::fromNanoseconds(5000);
+    Arachne::sleepUntil(deadline);
+    EXPECT_LE(deadline, Cycles::rdtsc());
+    flag = 1;
+}
+
+TEST_F(ArachneTest, sleepUntil_minimumDelay) {
+    flag = 0;
+    createThreadOnCore(0, deadlineSleeper);
+    limitedTimeWait([]() -> bool { return flag; });
+    flag = 0;
+}
+
+static void
+longSleeper() {
+    Arachne::sleep(60UL * 1000 * 1000 * 1000);
+    flag = 1;
+}
+
+static void
+signalLongSleeper() {
+    ThreadId id = createThreadOnCore(0, longSleeper);
+    uint8_t index = id.context->idInCore;
+    TimerWheel& timerWheel = core.groups[contextGroupOf(index)].timerWheel;
+    while (!timerWheel.contains(indexInGroup(index)))
+        yield();
+    signal(id);
+    while (!flag)
+        yield();
+    // The wakeup cancelled the timer.
+    EXPECT_FALSE(timerWheel.contains(indexInGroup(index)));
+}
+
+TEST_F(ArachneTest, sleep_signalCancelsTimer) {
+    flag = 0;
+    ThreadId id = createThreadOnCore(0, signalLongSleeper);
+    limitedTimeWait([id]() -> bool {
+        return id.context->generation != id.generation;
+    });
+    EXPECT_EQ(1, flag);
+    flag = 0;
+}
+
 volatile bool blockerHasStarted;
 
 void
@@ -551,6 +1587,29 @@ TEST_F(ArachneTest, signal) {
     publicPriorityMasks[0] = 0;
 }
 
+#if WAKEUP_LATENCY_STATS
+TEST_F(ArachneTest, signal_recordsWakeupLatency) {
+    PerfStats before, after;
+    PerfStats::collectStats(&before);
+    blockerHasStarted = false;
+    Arachne::ThreadId id = createThreadOnCore(0, blocker);
+    limitedTimeWait([]() -> bool { return blockerHasStarted; });
+    Arachne::signal(id);
+    limitedTimeWait([]() -> bool {
+        return Arachne::occupiedAndCount[0]->load().numOccupied == 0;
+    });
+    PerfStats::collectStats(&after);
+    EXPECT_LE(before.wakeupLatencyCycles.count + 1,
+              after.wakeupLatencyCycles.count);
+    EXPECT_LE(before.wakeupLatencyCyclesByClass[0].count + 1,
+              after.wakeupLatencyCyclesByClass[0].count);
+    uint64_t countByClass = 0;
+    for (int i = 0; i < PerfStats::NUM_THREAD_CLASSES; i++)
+        countByClass += after.wakeupLatencyCyclesByClass[i].count;
+    EXPECT_EQ(after.wakeupLatencyCycles.count, countByClass);
+}
+#endif
+
 // This buffer does not need protection because the threads writing to it are
 // deliberately scheduled onto the same core so only one will run at a time.
 
@@ -587,6 +1646,52 @@ TEST_F(ArachneTest, block_priorities) {
         outputBuffer);
 }
 
+static volatile int maskTestStage;
+
+static void
+blockThenSleep() {
+    maskTestStage = 1;
+    block();
+    maskTestStage = 2;
+    Arachne::sleep(10 * 1000 * 1000);
+    maskTestStage = 3;
+}
+
+static void
+checkRunnableMasks() {
+    ThreadId id = createThreadOnCore(0, blockThenSleep);
+    uint8_t index = id.context->idInCore;
+    int group = contextGroupOf(index);
+    uint64_t slotMask = contextBit(index);
+    EXPECT_EQ(slotMask, runnableMasks[0][group].load() & slotMask);
+
+    // Once blocked, the thread is no longer examined by dispatch.
+    while (maskTestStage != 1)
+        yield();
+    EXPECT_EQ(0U, core.groups[group].privateRunnableMask & slotMask);
+    EXPECT_EQ(0U, runnableMasks[0][group].load() & slotMask);
+
+    signal(id);
+    EXPECT_EQ(slotMask, runnableMasks[0][group].load() & slotMask);
+
+    // A sleeping thread waits in the timer wheel instead.
+    while (maskTestStage != 2)
+        yield();
+    EXPECT_TRUE(core.groups[group].timerWheel.contains(indexInGroup(index)));
+    while (maskTestStage != 3)
+        yield();
+    EXPECT_FALSE(core.groups[group].timerWheel.contains(indexInGroup(index)));
+    flag = 1;
+}
+
+TEST_F(ArachneTest, dispatch_runnableMasks) {
+    maskTestStage = 0;
+    flag = 0;
+    createThreadOnCore(0, checkRunnableMasks);
+    limitedTimeWait([]() -> bool { return flag; });
+    flag = 0;
+}
+
 static Arachne::ThreadId joineeId;
 
 void
@@ -637,6 +1742,60 @@ TEST_F(ArachneTest, join_DuringRun) {
     });
 }
 
+static void
+timedJoiner() {
+    ThreadId blocked = createThreadOnCore(0, block);
+    EXPECT_FALSE(joinFor(blocked, 20000));
+    signal(blocked);
+    EXPECT_TRUE(joinFor(blocked, 1000000000));
+    EXPECT_TRUE(joinFor(blocked, 0));
+    flag = 1;
+}
+
+TEST_F(ArachneTest, joinFor) {
+    flag = 0;
+    createThreadOnCore(0, timedJoiner);
+    limitedTimeWait([]() -> bool { return flag; });
+    flag = 0;
+}
+
+static void
+joinThenCreateOnFullCore() {
+    for (int i = 0; i < 100; i++) {
+        ThreadId id = createThreadOnCore(0, joinee2);
+        EXPECT_NE(NullThread, id);
+        if (id == NullThread)
+            break;
+        // The context is free again as soon as join() returns.
+        join(id);
+    }
+    flag = 1;
+}
+
+TEST_F(ArachneTest, join_thenCreateOnFullCoreSucceeds) {
+    flag = 0;
+    // Make the core look full but for one context.
+    for (int group = 0; group < numContextGroups; group++) {
+        int size = contextGroupSize(group) - (group == 0 ? 1 : 0);
+        MaskAndCount full;
+        full.numOccupied = static_cast<uint8_t>(size);
+        full.occupied = (((1UL << size) - 1) << (group == 0 ? 1 : 0)) &
+                        0x00FFFFFFFFFFFFFF;
+        occupiedAndCount[0][group] = full;
+    }
+    createThreadOnCore(1, joinThenCreateOnFullCore);
+    limitedTimeWait([]() -> bool { return flag; });
+    // A joiner clears its flag when the thread it waited for exits.
+    EXPECT_FALSE(allThreadContexts[0][0]->joinerWaiting);
+
+    for (int group = 0; group < numContextGroups; group++)
+        occupiedAndCount[0][group] = {0, 0};
+    limitedTimeWait([]() -> bool {
+        return numOccupiedContexts(occupiedAndCount[1]) == 0;
+    });
+    flag = 0;
+}
+
 extern int stackSize;
 TEST_F(ArachneTest, parseOptions_noOptions) {
     // Since Google Test requires all tests by the same name to either use or
@@ -837,6 +1996,355 @@ TEST_F(ArachneTest, ConditionVariable_waitFor) {
     EXPECT_EQ(0, numWaitedOn);
 }
 
+static Arachne::SpinLock timeoutMutex;
+static Arachne::ConditionVariable timeoutCV;
+
+static void
+timedOutWaiter() {
+    timeoutMutex.lock();
+    timeoutCV.waitFor(timeoutMutex, 1000);
+    // The waiter leaves the queue, so that a later notifyOne() reaches a
+    // thread that is still waiting.
+    EXPECT_TRUE(timeoutCV.blockedThreads.empty());
+    timeoutMutex.unlock();
+    flag = 1;
+}
+
+TEST_F(ArachneTest, ConditionVariable_waitFor_leavesQueueOnTimeout) {
+    flag = 0;
+    createThreadOnCore(0, timedOutWaiter);
+    limitedTimeWait([]() -> bool { return flag; });
+    flag = 0;
+}
+
+static Arachne::SleepLock contendedTimeoutLock;
+
+static void
+contendedTimedOutWaiter() {
+    PerfStats before, after;
+    contendedTimeoutLock.lock();
+    PerfStats::collectStats(&before);
+    spinTestStage = 1;
+    timeoutCV.waitFor(contendedTimeoutLock, 100000);
+    PerfStats::collectStats(&after);
+    // The waiter timed out while the lock was held by a thread on this core,
+    // so it parked on the lock after leaving the condition variable.
+    EXPECT_EQ(before.numSleepLockParks + 1, after.numSleepLockParks);
+    EXPECT_TRUE(timeoutCV.blockedThreads.empty());
+    contendedTimeoutLock.unlock();
+    flag = 1;
+}
+
+static void
+contendedTimeoutHolder() {
+    while (spinTestStage != 1)
+        yield();
+    contendedTimeoutLock.lock();
+    uint64_t releaseTime = Cycles::rdtsc() + Cycles::fromSeconds(0.001);
+    while (Cycles::rdtsc() < releaseTime)
+        yield();
+    contendedTimeoutLock.unlock();
+}
+
+TEST_F(ArachneTest, ConditionVariable_waitFor_timesOutOntoContendedLock) {
+    spinTestStage = 0;
+    flag = 0;
+    createThreadOnCore(0, contendedTimedOutWaiter);
+    createThreadOnCore(0, contendedTimeoutHolder);
+    limitedTimeWait([]() -> bool { return flag; });
+    flag = 0;
+}
+
+TEST_F(ArachneTest, WaitQueue_pushPopRemove) {
+    ThreadContext a(0, 0), b(0, 1), c(0, 2);
+    WaitQueue queue;
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(NULL, queue.pop());
+    queue.push(&a);
+    queue.push(&b);
+    queue.push(&c);
+    EXPECT_TRUE(queue.contains(&b));
+    EXPECT_EQ(&a, queue.front());
+
+    EXPECT_TRUE(queue.remove(&b));
+    EXPECT_FALSE(queue.remove(&b));
+    EXPECT_FALSE(queue.contains(&b));
+    EXPECT_EQ(&a, queue.pop());
+    EXPECT_EQ(&c, queue.pop());
+    EXPECT_TRUE(queue.empty());
+
+    // Removing the only element empties the queue at both ends.
+    queue.push(&b);
+    EXPECT_TRUE(queue.remove(&b));
+    EXPECT_TRUE(queue.empty());
+    queue.push(&c);
+    EXPECT_EQ(&c, queue.front());
+    EXPECT_EQ(&c, queue.pop());
+}
+
+template <typename ChannelType>
+static void
+checkTryOperations() {
+    // The capacity is rounded up to 4.
+    ChannelType channel(3);
+    int items[] = {1, 2, 3, 4, 5};
+    EXPECT_TRUE(channel.trySend(items[0]));
+    EXPECT_EQ(3U, channel.trySendBatch(items + 1, 4));
+    EXPECT_FALSE(channel.trySend(items[4]));
+
+    int received[5] = {0};
+    EXPECT_EQ(3U, channel.tryReceiveBatch(received, 3));
+    EXPECT_EQ(3, received[2]);
+    // Wrap around the end of the ring.
+    EXPECT_EQ(2U, channel.trySendBatch(items + 3, 2));
+    EXPECT_EQ(3U, channel.tryReceiveBatch(received, 5));
+    EXPECT_EQ(4, received[0]);
+    EXPECT_EQ(4, received[1]);
+    EXPECT_EQ(5, received[2]);
+    EXPECT_FALSE(channel.tryReceive(received));
+
+    channel.close();
+    EXPECT_FALSE(channel.trySend(items[0]));
+    EXPECT_FALSE(channel.receive(received));
+}
+
+TEST_F(ArachneTest, Channel_tryOperations) {
+    checkTryOperations<SpscChannel<int>>();
+    checkTryOperations<MpmcChannel<int>>();
+}
+
+static SpscChannel<int>* spscChannel;
+
+TEST_F(ArachneTest, SpscChannel_blocksWhenFullOrEmpty) {
+    // Both ends run on the same core, so each must block for the other to
+    // make progress.
+    SpscChannel<int> channel(2);
+    spscChannel = &channel;
+    completionCounter = 0;
+    createThreadOnCore(0, []() {
+        int items[100];
+        for (int i = 0; i < 100; i++)
+            items[i] = i;
+        EXPECT_EQ(100U, spscChannel->sendBatch(items, 100));
+        spscChannel->close();
+        completionCounter++;
+    });
+    createThreadOnCore(0, []() {
+        int expected = 0;
+        int item;
+        while (spscChannel->receive(&item))
+            EXPECT_EQ(expected++, item);
+        EXPECT_EQ(100, expected);
+        completionCounter++;
+    });
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    EXPECT_EQ(2, completionCounter);
+}
+
+static MpmcChannel<uint64_t>* mpmcChannel;
+static std::atomic<uint64_t> channelSum;
+static std::atomic<int> numChannelSenders;
+
+static void
+sendToChannel(uint64_t first, uint64_t count) {
+    for (uint64_t i = first; i < first + count; i++)
+        EXPECT_TRUE(mpmcChannel->send(i));
+    if (--numChannelSenders == 0)
+        mpmcChannel->close();
+}
+
+static void
+receiveFromChannel() {
+    uint64_t items[4];
+    size_t count;
+    while ((count = mpmcChannel->receiveBatch(items, 4)) != 0)
+        for (size_t i = 0; i < count; i++)
+            channelSum += items[i];
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, MpmcChannel_manySendersAndReceivers) {
+    MpmcChannel<uint64_t> channel(8);
+    mpmcChannel = &channel;
+    channelSum = 0;
+    numChannelSenders = 2;
+    completionCounter = 0;
+    createThreadOnCore(0, receiveFromChannel);
+    createThreadOnCore(1, receiveFromChannel);
+    createThreadOnCore(0, sendToChannel, 0UL, 1000UL);
+    createThreadOnCore(1, sendToChannel, 1000UL, 1000UL);
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    EXPECT_EQ(2, completionCounter);
+    EXPECT_EQ(1999UL * 2000 / 2, channelSum.load());
+}
+
+static std::atomic<uint64_t> channelSent;
+static std::atomic<bool> channelClosed;
+
+TEST_F(ArachneTest, MpmcChannel_closeDuringTrySend) {
+    // Every item accepted by trySend before close() can still be received.
+    MpmcChannel<uint64_t> channel(8);
+    mpmcChannel = &channel;
+    channelSum = 0;
+    channelSent = 0;
+    channelClosed = false;
+    completionCounter = 0;
+    createThreadOnCore(0, receiveFromChannel);
+    createThreadOnCore(1, []() {
+        while (!channelClosed) {
+            if (mpmcChannel->trySend(1))
+                channelSent++;
+            yield();
+        }
+        completionCounter++;
+    });
+    createThreadOnCore(2, []() {
+        sleep(1000 * 1000);
+        mpmcChannel->close();
+        channelClosed = true;
+    });
+    limitedTimeWait([]() -> bool { return completionCounter == 2; });
+    EXPECT_EQ(2, completionCounter);
+    EXPECT_EQ(channelSent.load(), channelSum.load());
+}
+
+static void
+fulfillPromise(Promise<std::string>& promise) {
+    promise.setValue("done");
+}
+
+static void
+futureWaiter() {
+    Promise<std::string> promise;
+    Future<std::string> future = promise.getFuture();
+    EXPECT_TRUE(future.valid());
+    EXPECT_FALSE(future.waitFor(1000));
+    createThread(fulfillPromise, std::ref(promise));
+    EXPECT_EQ("done", future.get());
+    EXPECT_FALSE(future.valid());
+
+    // The state outlives whichever end is destroyed first.
+    Future<void> signaled;
+    {
+        Promise<void> done;
+        signaled = done.getFuture();
+        done.setValue();
+    }
+    EXPECT_TRUE(signaled.isReady());
+    signaled.get();
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, Future_getAndWaitFor) {
+    completionCounter = 0;
+    createThread(futureWaiter);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+}
+
+static void
+scatterGather() {
+    TaskGroup<int> group(4);
+    for (int i = 0; i < 3; i++)
+        EXPECT_EQ(i, group.spawn([](int value) { return value * value; }, i));
+    group.waitAll();
+    EXPECT_EQ(0, group.get(0));
+    EXPECT_EQ(1, group.get(1));
+    EXPECT_EQ(4, group.get(2));
+
+    // Every task is reported once by waitAny, in completion order; the last
+    // task finishes last because it waits for the flag.
+    flag = 0;
+    EXPECT_EQ(3, group.spawn([]() {
+        while (!flag)
+            yield();
+        return 9;
+    }));
+    EXPECT_EQ(-1, group.spawn([]() { return 0; }));
+    bool reported[4] = {false};
+    for (int i = 0; i < 3; i++) {
+        int index = group.waitAny();
+        ASSERT_LE(0, index);
+        ASSERT_GT(3, index);
+        EXPECT_FALSE(reported[index]);
+        reported[index] = true;
+    }
+    flag = 1;
+    EXPECT_EQ(3, group.waitAny());
+    EXPECT_EQ(9, group.get(3));
+    EXPECT_EQ(-1, group.waitAny());
+    flag = 0;
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, TaskGroup_waitAllAndWaitAny) {
+    completionCounter = 0;
+    createThread(scatterGather);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+}
+
+static void
+runParallelLoops() {
+    std::vector<std::atomic<int>> visits(1000);
+    std::atomic<int> cores[8];
+    for (auto& count : cores)
+        count = 0;
+    parallelFor(0, 1000, 10, [&visits, &cores](uint64_t i) {
+        visits[i]++;
+        cores[core.kernelThreadId]++;
+    });
+    for (auto& count : visits)
+        EXPECT_EQ(1, count.load());
+    // Both cores took part.
+    EXPECT_LT(0, cores[0].load());
+    EXPECT_LT(0, cores[1].load());
+
+    auto identity = [](uint64_t i) { return i; };
+    auto add = [](uint64_t a, uint64_t b) { return a + b; };
+    EXPECT_EQ(1004UL * 1005 / 2 - 10,
+              parallelReduce(5, 1005, 1, 0UL, identity, add));
+    // An empty loop yields the identity, and a single chunk runs inline.
+    EXPECT_EQ(7UL, parallelReduce(3, 3, 1, 7UL, identity, add));
+    EXPECT_EQ(3UL, parallelReduce(1, 3, 100, 0UL, identity, add));
+
+    // Results may be of any copyable type, bool included.
+    auto isMultipleOf7 = [](uint64_t i) { return i % 7 == 0; };
+    auto logicalOr = [](bool a, bool b) { return a || b; };
+    auto logicalAnd = [](bool a, bool b) { return a && b; };
+    EXPECT_TRUE(parallelReduce(1, 1000, 1, false, isMultipleOf7, logicalOr));
+    EXPECT_FALSE(parallelReduce(1, 1000, 1, true, isMultipleOf7, logicalAnd));
+    EXPECT_FALSE(parallelReduce(1, 7, 1, false, isMultipleOf7, logicalOr));
+    completionCounter++;
+}
+
+TEST_F(ArachneTest, parallelForAndReduce) {
+    completionCounter = 0;
+    createThreadOnCore(0, runParallelLoops);
+    limitedTimeWait([]() -> bool { return completionCounter == 1; });
+    EXPECT_EQ(1, completionCounter);
+}
+
+TEST_F(ArachneTest, planParallelLoop) {
+    std::vector<int> coreIds;
+    EXPECT_EQ(1U, planParallelLoop(5, 10, &coreIds));
+    EXPECT_TRUE(coreIds.empty());
+    // No more chunks than cores, each on a different core.
+    uint32_t numCores = numActiveCores;
+    EXPECT_EQ(numCores, planParallelLoop(100, 10, &coreIds));
+    EXPECT_EQ(numCores - 1, coreIds.size());
+
+    // While cores can be added, there are enough chunks for all of them.
+    disableLoadEstimation = false;
+    EXPECT_EQ(maxNumCores, planParallelLoop(100, 10, &coreIds));
+    EXPECT_EQ(maxNumCores - 1, coreIds.size());
+    disableLoadEstimation = true;
+
+    EXPECT_EQ(100U, chunkBegin(100, 200, 3, 0));
+    EXPECT_EQ(233U, chunkBegin(100, 200, 3, 2));
+    EXPECT_EQ(300U, chunkBegin(100, 200, 3, 3));
+}
+
 TEST_F(ArachneTest, setErrorStream) {
     char* str;
     size_t size;
@@ -849,6 +2357,67 @@ TEST_F(ArachneTest, setErrorStream) {
     free(str);
 }
 
+TEST_F(ArachneTest, Logger_bufferedMessagesAreFormatted) {
+    char* str;
+    size_t size;
+    FILE* newStream = open_memstream(&str, &size);
+    setErrorStream(newStream);
+    const char* name = "ring";
+    void* pointer = &size;
+    ARACHNE_LOG(NOTICE, "%d %s %5.2f %lu %c %x %*d %.*s %p %% %zu %lld\n", -7,
+                name, 3.14159, 1UL << 40, 'z', 255, 4, 3, 2, name, pointer,
+                size, -1LL);
+    char expected[200];
+    snprintf(expected, sizeof(expected),
+             "%d %s %5.2f %lu %c %x %*d %.*s %p %% %zu %lld\n", -7, name,
+             3.14159, 1UL << 40, 'z', 255, 4, 3, 2, name, pointer, size,
+             -1LL);
+    setErrorStream(stderr);
+    EXPECT_EQ(std::string(expected), std::string(str));
+    fclose(newStream);
+    free(str);
+}
+
+TEST_F(ArachneTest, Logger_errorIsWrittenInOrder) {
+    char* str;
+    size_t size;
+    FILE* newStream = open_memstream(&str, &size);
+    setErrorStream(newStream);
+    ARACHNE_LOG(WARNING, "first %d\n", 1);
+    // Errors are written before log returns, after earlier messages.
+    ARACHNE_LOG(ERROR, "second %d\n", 2);
+    EXPECT_EQ("first 1\nsecond 2\n", std::string(str));
+    setErrorStream(stderr);
+    fclose(newStream);
+    free(str);
+}
+
+TEST_F(ArachneTest, Logger_disabledLevelSkipsArguments) {
+    int evaluations = 0;
+    ARACHNE_LOG(VERBOSE, "%d\n", evaluations++);
+    ARACHNE_LOG(DEBUG, "%d\n", evaluations++);
+    EXPECT_EQ(0, evaluations);
+}
+
+TEST_F(ArachneTest, Logger_dropsWhenRingIsFull) {
+    char* str;
+    size_t size;
+    FILE* newStream = open_memstream(&str, &size);
+    setErrorStream(newStream);
+    uint64_t dropped = Logger::getNumDroppedMessages();
+    {
+        // Keep the drain thread from emptying the ring.
+        std::lock_guard<std::mutex> guard(Logger::mutex);
+        for (int i = 0; i < 10000; i++)
+            ARACHNE_LOG(NOTICE, "message %d\n", i);
+    }
+    EXPECT_LT(dropped, Logger::getNumDroppedMessages());
+    setErrorStream(stderr);
+    EXPECT_EQ(0, strncmp("message 0\nmessage 1\n", str, 20));
+    fclose(newStream);
+    free(str);
+}
+
 TEST_F(ArachneTest, incrementCoreCount) {
     void incrementCoreCount();
     shutDown();
@@ -870,11 +2439,116 @@ TEST_F(ArachneTest, incrementCoreCount) {
     limitedTimeWait([]() -> bool { return numActiveCores > 3; });
     EXPECT_TRUE(
         canThreadBeCreatedOnCore(0, coreManager, coreManager->sharedCores[3]));
+    // Switching back to stderr writes out any buffered messages first.
+    setErrorStream(stderr);
     fflush(newStream);
     EXPECT_EQ("Attempting to increase number of cores 3 --> 4\n",
               std::string(str));
     free(str);
 }
+
+TEST_F(ArachneTest, incrementCoreCount_severalCores) {
+    void incrementCoreCount(uint32_t numCores);
+    shutDown();
+    waitForTermination();
+    maxNumCores = 5;
+    Arachne::init();
+    std::vector<uint32_t> coreRequest({3, 0, 0, 0, 0, 0, 0, 0});
+    coreArbiter->setRequestedCores(coreRequest);
+    limitedTimeWait([]() -> bool { return numActiveCores == 3; });
+    // Asking for more than maxNumCores allows adds only what fits.
+    incrementCoreCount(4);
+    limitedTimeWait([]() -> bool { return numActiveCores == 5; });
+    limitedTimeWait([]() -> bool { return !coreChangeActive; });
+    EXPECT_EQ(5U, numActiveCores.load());
+}
+
+extern uint32_t numActiveWarmSpares;
+extern std::vector<int> parkedWarmSpares;
+extern std::function<void(uint32_t)> requestCoresForIncrease;
+
+TEST_F(ArachneTest, incrementCoreCount_startsWarmSpare) {
+    void incrementCoreCount();
+    void decrementCoreCount();
+    shutDown();
+    waitForTermination();
+    numWarmSpareCores = 1;
+    Arachne::init();
+    std::vector<uint32_t> coreRequest({2, 0, 0, 0, 0, 0, 0, 0});
+    coreArbiter->setRequestedCores(coreRequest);
+    limitedTimeWait([]() -> bool {
+        return numActiveCores == 2 && parkedWarmSpares.size() == 1;
+    });
+    // The warm spare comes after the kernel threads that wait for cores from
+    // the arbiter.
+    EXPECT_EQ(static_cast<int>(maxNumCores), parkedWarmSpares[0]);
+
+    // Hold back the arbiter's grant, so that the warm spare still runs when
+    // the decrease comes.
+    static uint32_t requestedCores = 0;
+    requestCoresForIncrease = [](uint32_t numCores) {
+        requestedCores = numCores;
+    };
+    incrementCoreCount();
+    limitedTimeWait(
+        []() -> bool { return numActiveCores == 3 && !coreChangeActive; });
+    EXPECT_EQ(3U, requestedCores);
+    EXPECT_EQ(1U, numActiveWarmSpares);
+
+    // The warm spare is the first core to go.
+    decrementCoreCount();
+    limitedTimeWait([]() -> bool {
+        return numActiveCores == 2 && !coreChangeActive &&
+               parkedWarmSpares.size() == 1;
+    });
+    EXPECT_EQ(0U, numActiveWarmSpares);
+    EXPECT_EQ(2U, numActiveCores.load());
+    requestCoresForIncrease = nullptr;
+    numWarmSpareCores = 0;
+}
+
+TEST_F(ArachneTest, incrementCoreCount_warmSparesKeepAllArbiterCores) {
+    void incrementCoreCount(uint32_t numCores);
+    shutDown();
+    waitForTermination();
+    numWarmSpareCores = 1;
+    Arachne::init();
+    std::vector<uint32_t> coreRequest({2, 0, 0, 0, 0, 0, 0, 0});
+    coreArbiter->setRequestedCores(coreRequest);
+    limitedTimeWait([]() -> bool {
+        return numActiveCores == 2 && parkedWarmSpares.size() == 1;
+    });
+    // Every one of the maxNumCores kernel threads can still get a core from
+    // the arbiter, and the warm spare gives way to the last of them.
+    incrementCoreCount(2);
+    limitedTimeWait([]() -> bool {
+        return numActiveCores == 3 && numActiveWarmSpares == 0 &&
+               !coreChangeActive && parkedWarmSpares.size() == 1;
+    });
+    EXPECT_EQ(3U, numActiveCores.load());
+    EXPECT_EQ(0U, numActiveWarmSpares);
+    numWarmSpareCores = 0;
+}
+
+TEST_F(ArachneTest, incrementCoreCount_arbiterCoreReplacesWarmSpare) {
+    void incrementCoreCount();
+    shutDown();
+    waitForTermination();
+    maxNumCores = 4;
+    numWarmSpareCores = 1;
+    Arachne::init();
+    std::vector<uint32_t> coreRequest({2, 0, 0, 0, 0, 0, 0, 0});
+    coreArbiter->setRequestedCores(coreRequest);
+    limitedTimeWait([]() -> bool {
+        return numActiveCores == 2 && parkedWarmSpares.size() == 1;
+    });
+    incrementCoreCount();
+    limitedTimeWait([]() -> bool {
+        return numActiveCores == 3 && numActiveWarmSpares == 0 &&
+               !coreChangeActive && parkedWarmSpares.size() == 1;
+    });
+    numWarmSpareCores = 0;
+}
 //
 TEST_F(ArachneTest, decrementCoreCount) {
     void decrementCoreCount();
@@ -894,6 +2568,7 @@ TEST_F(ArachneTest, decrementCoreCount) {
     limitedTimeWait(
         []() -> bool { return numActiveCores < 2 && !coreChangeActive; });
     EXPECT_EQ(coreManager->sharedCores.size(), 1U);
+    setErrorStream(stderr);
     fflush(newStream);
     EXPECT_EQ(
         "Attempting to decrease number of cores 3 --> 2\n"
@@ -921,13 +2596,21 @@ TEST_F(ArachneTest, createExclusiveThread) {
     limitedTimeWait([&coreManager]() -> bool {
         return Arachne::occupiedAndCount[coreManager->exclusiveCores[0]]
                    ->load()
-                   .numOccupied == 56;
+                   .numOccupied == contextGroupSize(0);
     });
+    int exclusiveCore = coreManager->exclusiveCores[0];
+    EXPECT_EQ(contextGroupSize(0),
+              Arachne::occupiedAndCount[exclusiveCore]->load().numOccupied);
 
     // Check that the core is no longer available in the default scheduling
-    // class.
-    EXPECT_FALSE(canThreadBeCreatedOnCore(0, coreManager,
-                                          coreManager->exclusiveCores[0]));
+    // class, and that its other context groups are blocked too.
+    EXPECT_FALSE(canThreadBeCreatedOnCore(0, coreManager, exclusiveCore));
+    for (int group = 1; group < numContextGroups; group++)
+        EXPECT_EQ(Arachne::EXCLUSIVE,
+                  Arachne::occupiedAndCount[exclusiveCore][group]
+                      .load()
+                      .numOccupied);
+    EXPECT_EQ(NullThread, createThreadOnCore(exclusiveCore, doNothing));
     shouldExit.store(1);
 }
 
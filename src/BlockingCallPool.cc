@@ -0,0 +1,110 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "BlockingCallPool.h"
+
+namespace Arachne {
+
+/**
+ * Construct a pool; no threads are started until the first call.
+ *
+ * \param maxThreads
+ *     The largest number of kernel threads the pool may start, and so the
+ *     largest number of calls that run at once.
+ */
+BlockingCallPool::BlockingCallPool(uint32_t maxThreads)
+    : maxThreads(maxThreads),
+      mutex(),
+      requestQueued(),
+      requests(),
+      threads(),
+      numIdleThreads(0),
+      stopping(false),
+      stats(true) {}
+
+/**
+ * Stop and join all the pool threads. No call may be in progress.
+ */
+BlockingCallPool::~BlockingCallPool() {
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        stopping = true;
+    }
+    requestQueued.notify_all();
+    for (std::thread& thread : threads)
+        thread.join();
+    PerfStats::deregisterStats(&stats);
+}
+
+/**
+ * Run a call on a pool thread and block the calling Arachne thread until it
+ * has returned.
+ *
+ * \param call
+ *     The call to run; it must not throw.
+ */
+void
+BlockingCallPool::run(const std::function<void()>& call) {
+    Request request;
+    request.call = &call;
+    request.caller = getThreadId();
+    request.done = false;
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        requests.push_back(&request);
+        if (requests.size() > numIdleThreads && threads.size() < maxThreads)
+            threads.emplace_back(&BlockingCallPool::threadMain, this);
+        stats.beginUpdate();
+        stats.blockingCallThreads = threads.size();
+        stats.blockingCallQueueDepth = requests.size();
+        stats.endUpdate();
+    }
+    requestQueued.notify_one();
+
+    // A signal that arrives before block() makes it return at once, so the
+    // wakeup cannot be lost.
+    while (!request.done.load())
+        block();
+}
+
+/**
+ * The main loop of each pool thread.
+ */
+void
+BlockingCallPool::threadMain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        numIdleThreads++;
+        while (requests.empty() && !stopping)
+            requestQueued.wait(lock);
+        numIdleThreads--;
+        if (requests.empty())
+            return;
+        Request* request = requests.front();
+        requests.pop_front();
+        stats.blockingCallQueueDepth = requests.size();
+        lock.unlock();
+
+        (*request->call)();
+        // The caller may return, destroying the request, as soon as done is
+        // set.
+        ThreadId caller = request->caller;
+        request->done.store(true);
+        signal(caller);
+        lock.lock();
+    }
+}
+
+}  // namespace Arachne
@@ -0,0 +1,108 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BLOCKINGCALLPOOL_H_
+#define BLOCKINGCALLPOOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Arachne.h"
+
+namespace Arachne {
+
+/**
+ * A pool of kernel threads, outside of Arachne's cores, that run calls which
+ * may block in the kernel on behalf of Arachne threads. The calling Arachne
+ * thread blocks in dispatch() until its call has finished, so the other
+ * threads on its core keep running.
+ *
+ * Threads are started on demand, whenever a call is queued while no pool
+ * thread is idle, up to a fixed limit; they stay until the pool is
+ * destroyed.
+ */
+class BlockingCallPool {
+  public:
+    explicit BlockingCallPool(uint32_t maxThreads);
+    ~BlockingCallPool();
+    void run(const std::function<void()>& call);
+
+  private:
+    /**
+     * A call waiting for or being run by a pool thread. It lives on the
+     * stack of the Arachne thread that made the call.
+     */
+    struct Request {
+        /// The call to run.
+        const std::function<void()>* call;
+
+        /// The Arachne thread to signal once the call has returned.
+        ThreadId caller;
+
+        /// Set by the pool thread once the call has returned.
+        std::atomic<bool> done;
+    };
+
+    void threadMain();
+
+    /**
+     * The largest number of threads the pool will start.
+     */
+    const uint32_t maxThreads;
+
+    /**
+     * Protects all the members below.
+     */
+    std::mutex mutex;
+
+    /**
+     * Signaled when a request is queued or the pool is being destroyed.
+     */
+    std::condition_variable requestQueued;
+
+    /**
+     * Requests that no pool thread has taken yet, oldest first.
+     */
+    std::deque<Request*> requests;
+
+    /**
+     * The pool threads started so far.
+     */
+    std::vector<std::thread> threads;
+
+    /**
+     * The number of pool threads waiting for a request.
+     */
+    uint32_t numIdleThreads;
+
+    /**
+     * Set when the pool is destroyed, to make its threads exit.
+     */
+    bool stopping;
+
+    /**
+     * Reports the number of pool threads and queued requests through
+     * PerfStats::collectStats. Updated with mutex held.
+     */
+    PerfStats stats;
+
+    DISALLOW_COPY_AND_ASSIGN(BlockingCallPool)
+};
+
+}  // namespace Arachne
+#endif  // BLOCKINGCALLPOOL_H_
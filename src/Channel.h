@@ -0,0 +1,524 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CHANNEL_H_
+#define CHANNEL_H_
+
+#include <atomic>
+#include <mutex>
+#include "Arachne.h"
+
+namespace Arachne {
+
+/**
+ * Return the smallest power of two that is at least n, and at least 2.
+ */
+inline size_t
+channelCapacity(size_t n) {
+    size_t capacity = 2;
+    while (capacity < n)
+        capacity <<= 1;
+    return capacity;
+}
+
+/**
+ * A bounded lock-free ring for a single producer and a single consumer.
+ * Each side keeps its index, and a cached copy of the other side's, on its
+ * own cache line, so the two only exchange cache lines when the cached copy
+ * says the ring is full or empty.
+ *
+ * \tparam T
+ *     The type of the items; it must be default-constructible and
+ *     copy-assignable.
+ */
+template <typename T>
+class SpscRing {
+  public:
+    explicit SpscRing(size_t minCapacity)
+        : mask(channelCapacity(minCapacity) - 1),
+          items(new T[mask + 1]),
+          producer(),
+          consumer() {}
+    ~SpscRing() { delete[] items; }
+
+    /**
+     * Append up to count items, stopping when the ring is full.
+     *
+     * \return
+     *     The number of items appended.
+     */
+    size_t
+    push(const T* batch, size_t count) {
+        size_t tail = producer.index.load(std::memory_order_relaxed);
+        if (tail + count - producer.cachedOther > mask + 1)
+            producer.cachedOther =
+                consumer.index.load(std::memory_order_acquire);
+        size_t room = mask + 1 - (tail - producer.cachedOther);
+        if (count > room)
+            count = room;
+        for (size_t i = 0; i < count; i++)
+            items[(tail + i) & mask] = batch[i];
+        producer.index.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * Remove up to count items, stopping when the ring is empty.
+     *
+     * \return
+     *     The number of items removed.
+     */
+    size_t
+    pop(T* batch, size_t count) {
+        size_t head = consumer.index.load(std::memory_order_relaxed);
+        if (consumer.cachedOther - head < count)
+            consumer.cachedOther =
+                producer.index.load(std::memory_order_acquire);
+        size_t available = consumer.cachedOther - head;
+        if (count > available)
+            count = available;
+        for (size_t i = 0; i < count; i++)
+            batch[i] = items[(head + i) & mask];
+        consumer.index.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+  private:
+    /**
+     * The state owned by one side of the ring.
+     */
+    struct alignas(CACHE_LINE_SIZE) Side {
+        Side() : index(0), cachedOther(0) {}
+
+        /// The number of items this side has pushed or popped.
+        std::atomic<size_t> index;
+
+        /// The last value read of the other side's index.
+        size_t cachedOther;
+    };
+
+    /// The number of items the ring holds, minus one.
+    const size_t mask;
+
+    /// Storage for the items.
+    T* const items;
+
+    Side producer;
+    Side consumer;
+    DISALLOW_COPY_AND_ASSIGN(SpscRing);
+};
+
+/**
+ * A bounded lock-free ring for any number of producers and consumers, in
+ * which each slot carries a sequence number that tells producers and
+ * consumers whose turn it is. Slots are padded to a cache line, so that
+ * operations on neighbouring slots do not contend.
+ *
+ * \tparam T
+ *     The type of the items; it must be default-constructible and
+ *     copy-assignable.
+ */
+template <typename T>
+class MpmcRing {
+  public:
+    explicit MpmcRing(size_t minCapacity)
+        : mask(channelCapacity(minCapacity) - 1),
+          slots(static_cast<Slot*>(alignedAlloc(sizeof(Slot) * (mask + 1)))),
+          tail(),
+          head() {
+        for (size_t i = 0; i <= mask; i++)
+            new (&slots[i]) Slot(i);
+    }
+
+    ~MpmcRing() {
+        for (size_t i = 0; i <= mask; i++)
+            slots[i].~Slot();
+        free(slots);
+    }
+
+    /**
+     * Append up to count items, stopping when the ring is full.
+     *
+     * \return
+     *     The number of items appended.
+     */
+    size_t
+    push(const T* batch, size_t count) {
+        size_t i = 0;
+        while (i < count) {
+            size_t position = tail.index.load(std::memory_order_relaxed);
+            Slot& slot = slots[position & mask];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == position) {
+                if (!tail.index.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed))
+                    continue;
+                slot.item = batch[i++];
+                slot.sequence.store(position + 1, std::memory_order_release);
+            } else if (sequence < position) {
+                // The slot still holds the item from the previous lap.
+                break;
+            }
+        }
+        return i;
+    }
+
+    /**
+     * Remove up to count items, stopping when the ring is empty.
+     *
+     * \return
+     *     The number of items removed.
+     */
+    size_t
+    pop(T* batch, size_t count) {
+        size_t i = 0;
+        while (i < count) {
+            size_t position = head.index.load(std::memory_order_relaxed);
+            Slot& slot = slots[position & mask];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == position + 1) {
+                if (!head.index.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed))
+                    continue;
+                batch[i++] = slot.item;
+                slot.sequence.store(position + mask + 1,
+                                    std::memory_order_release);
+            } else if (sequence < position + 1) {
+                // The slot has not been filled yet on this lap.
+                break;
+            }
+        }
+        return i;
+    }
+
+  private:
+    struct alignas(CACHE_LINE_SIZE) Slot {
+        explicit Slot(size_t sequence) : sequence(sequence), item() {}
+
+        /// Equal to the position of the next push that may fill the slot,
+        /// or to that position plus one once the push has filled it.
+        std::atomic<size_t> sequence;
+
+        T item;
+    };
+
+    /**
+     * A position counter on its own cache line.
+     */
+    struct alignas(CACHE_LINE_SIZE) Index {
+        Index() : index(0) {}
+        std::atomic<size_t> index;
+    };
+
+    /// The number of slots, minus one.
+    const size_t mask;
+
+    /// The slots of the ring.
+    Slot* const slots;
+
+    /// The position of the next push, and of the next pop.
+    Index tail;
+    Index head;
+    DISALLOW_COPY_AND_ASSIGN(MpmcRing);
+};
+
+/**
+ * A bounded queue for passing items between Arachne threads, such as the
+ * stages of a pipeline. Sends and receives that find room or an item never
+ * take a lock; a thread only blocks when the channel is full or empty, and
+ * the other side only pays for a signal() when some thread is blocked.
+ * Batch operations move several items for the cost of one.
+ *
+ * Use SpscChannel when each channel end has a single thread, and
+ * MpmcChannel otherwise. The blocking operations may only be invoked from
+ * Arachne threads; the try operations may be invoked from any thread.
+ *
+ * \tparam T
+ *     The type of the items; it must be default-constructible and
+ *     copy-assignable.
+ * \tparam Ring
+ *     SpscRing<T> or MpmcRing<T>.
+ */
+template <typename T, typename Ring>
+class Channel {
+  public:
+    /**
+     * Construct an open, empty channel.
+     *
+     * \param capacity
+     *     The number of items the channel can hold; rounded up to a power of
+     *     two.
+     */
+    explicit Channel(size_t capacity)
+        : ring(capacity),
+          closed(false),
+          drained(false),
+          numSendsInProgress(0),
+          numWaitingSenders(0),
+          numWaitingReceivers(0),
+          waitLock("channel", false),
+          notEmpty(),
+          notFull() {}
+
+    /**
+     * Append an item unless the channel is full or closed.
+     *
+     * \return
+     *     True if the item was sent.
+     */
+    bool
+    trySend(const T& item) {
+        return trySendBatch(&item, 1) == 1;
+    }
+
+    /**
+     * Append as many of the given items as there is room for, unless the
+     * channel is closed.
+     *
+     * \return
+     *     The number of items sent.
+     */
+    size_t
+    trySendBatch(const T* items, size_t count) {
+        // close() waits for numSendsInProgress to drop to 0 after setting
+        // closed, so either it sees this send or this send sees closed.
+        numSendsInProgress.fetch_add(1);
+        size_t sent = 0;
+        if (!closed.load())
+            sent = ring.push(items, count);
+        numSendsInProgress.fetch_sub(1, std::memory_order_release);
+        if (sent != 0)
+            wake(numWaitingReceivers, &notEmpty, sent);
+        return sent;
+    }
+
+    /**
+     * Append an item, blocking the current thread while the channel is full.
+     *
+     * \return
+     *     True if the item was sent, or false if the channel was closed.
+     */
+    bool
+    send(const T& item) {
+        return sendBatch(&item, 1) == 1;
+    }
+
+    /**
+     * Append the given items, blocking the current thread whenever the
+     * channel is full.
+     *
+     * \return
+     *     The number of items sent, which is less than count only if the
+     *     channel was closed.
+     */
+    size_t
+    sendBatch(const T* items, size_t count) {
+        size_t sent = trySendBatch(items, count);
+        if (sent == count)
+            return sent;
+        std::unique_lock<SpinLock> guard(waitLock);
+        numWaitingSenders++;
+        // Receivers check numWaitingSenders after freeing room, so either
+        // they see it or the retry below sees the room.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (sent < count && !closed) {
+            size_t more = ring.push(items + sent, count - sent);
+            if (more != 0) {
+                notifyLocked(numWaitingReceivers, &notEmpty, more);
+                sent += more;
+            } else {
+                notFull.wait(guard);
+            }
+        }
+        numWaitingSenders--;
+        return sent;
+    }
+
+    /**
+     * Remove an item unless the channel is empty.
+     *
+     * \param[out] item
+     *     Set to the item removed.
+     * \return
+     *     True if an item was received.
+     */
+    bool
+    tryReceive(T* item) {
+        return tryReceiveBatch(item, 1) == 1;
+    }
+
+    /**
+     * Remove up to maxCount items without blocking.
+     *
+     * \param[out] items
+     *     Filled in with the items removed.
+     * \param maxCount
+     *     The number of elements of items.
+     * \return
+     *     The number of items received.
+     */
+    size_t
+    tryReceiveBatch(T* items, size_t maxCount) {
+        size_t received = ring.pop(items, maxCount);
+        if (received != 0)
+            wake(numWaitingSenders, &notFull, received);
+        return received;
+    }
+
+    /**
+     * Remove an item, blocking the current thread while the channel is
+     * empty.
+     *
+     * \param[out] item
+     *     Set to the item removed.
+     * \return
+     *     True if an item was received, or false if the channel is closed and
+     *     every item sent has been received.
+     */
+    bool
+    receive(T* item) {
+        return receiveBatch(item, 1) == 1;
+    }
+
+    /**
+     * Remove up to maxCount items, blocking the current thread until at
+     * least one is available.
+     *
+     * \param[out] items
+     *     Filled in with the items removed.
+     * \param maxCount
+     *     The number of elements of items.
+     * \return
+     *     The number of items received, or 0 if the channel is closed and
+     *     every item sent has been received.
+     */
+    size_t
+    receiveBatch(T* items, size_t maxCount) {
+        size_t received = tryReceiveBatch(items, maxCount);
+        if (received != 0)
+            return received;
+        std::unique_lock<SpinLock> guard(waitLock);
+        numWaitingReceivers++;
+        // Senders check numWaitingReceivers after adding items; see
+        // sendBatch.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (;;) {
+            received = ring.pop(items, maxCount);
+            if (received != 0) {
+                notifyLocked(numWaitingSenders, &notFull, received);
+                break;
+            }
+            if (drained)
+                break;
+            notEmpty.wait(guard);
+        }
+        numWaitingReceivers--;
+        return received;
+    }
+
+    /**
+     * Refuse further items and wake every blocked thread. Items already in
+     * the channel can still be received.
+     */
+    void
+    close() {
+        closed = true;
+        // Sends that checked closed before it was set may still be pushing;
+        // receivers must not report the end of the channel before their
+        // items are visible. Pushes never block, so this wait is short.
+        while (numSendsInProgress.load(std::memory_order_acquire) != 0) {
+        }
+        std::lock_guard<SpinLock> guard(waitLock);
+        drained = true;
+        notEmpty.notifyAll();
+        notFull.notifyAll();
+    }
+
+  private:
+    /**
+     * Wake up to count threads blocked on condition, if any are waiting. This
+     * is called after each transfer, and takes no lock unless a thread is
+     * blocked, which only happens when the channel was full or empty.
+     */
+    void
+    wake(const std::atomic<uint32_t>& numWaiting, ConditionVariable* condition,
+         size_t count) {
+        // Pairs with the fence in sendBatch and receiveBatch.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (numWaiting.load(std::memory_order_relaxed) == 0)
+            return;
+        std::lock_guard<SpinLock> guard(waitLock);
+        notifyLocked(numWaiting, condition, count);
+    }
+
+    /**
+     * Wake up to count threads blocked on condition; waitLock must be held.
+     */
+    void
+    notifyLocked(const std::atomic<uint32_t>& numWaiting,
+                 ConditionVariable* condition, size_t count) {
+        if (numWaiting.load(std::memory_order_relaxed) == 0)
+            return;
+        if (count == 1)
+            condition->notifyOne();
+        else
+            condition->notifyAll();
+    }
+
+    /// Holds the items in transit.
+    Ring ring;
+
+    /// Set by close(); no send adds items once it is set.
+    std::atomic<bool> closed;
+
+    /// Set by close() once every send that started before closed was set
+    /// has finished, so that an empty channel will stay empty; changed only
+    /// with waitLock held.
+    bool drained;
+
+    /// The number of calls to trySendBatch between their increment and
+    /// decrement of this count.
+    std::atomic<uint32_t> numSendsInProgress;
+
+    /// The number of threads that found the channel full or empty and are
+    /// about to block, or blocked; changed only with waitLock held.
+    std::atomic<uint32_t> numWaitingSenders;
+    std::atomic<uint32_t> numWaitingReceivers;
+
+    /// Protects notEmpty and notFull.
+    SpinLock waitLock;
+
+    /// Receivers blocked until the channel has items.
+    ConditionVariable notEmpty;
+
+    /// Senders blocked until the channel has room.
+    ConditionVariable notFull;
+    DISALLOW_COPY_AND_ASSIGN(Channel);
+};
+
+/**
+ * A Channel for a single sending thread and a single receiving thread.
+ */
+template <typename T>
+using SpscChannel = Channel<T, SpscRing<T>>;
+
+/**
+ * A Channel for any number of sending and receiving threads.
+ */
+template <typename T>
+using MpmcChannel = Channel<T, MpmcRing<T>>;
+
+}  // namespace Arachne
+#endif  // CHANNEL_H_
@@ -12,6 +12,9 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <math.h>
+#include <algorithm>
+
 #include "CoreLoadEstimator.h"
 
 namespace Arachne {
@@ -23,8 +26,11 @@ CoreLoadEstimator::CoreLoadEstimator(int maxNumCores)
 CoreLoadEstimator::~CoreLoadEstimator() { delete[] utilizationThresholds; }
 
 /**
- * Returns -1,0,1 to suggest whether the core count should decrease,
- * stay the same, or increase respectively.
+ * Returns the number of cores that should be added, which is negative if
+ * cores should be removed and 0 if the core count should stay the same. The
+ * LOAD_FACTOR and UTILIZATION strategies only ever suggest changes of one
+ * core; the LATENCY strategy may ask for several cores at once, as may any
+ * strategy while threads wait in pending queues.
  */
 int
 CoreLoadEstimator::estimate(int curActiveCores) {
@@ -54,8 +60,32 @@ CoreLoadEstimator::estimate(int curActiveCores) {
         currentStats.weightedLoadedCycles - previousStats.weightedLoadedCycles;
     double averageLoadFactor = static_cast<double>(weightedLoadedCycles) /
                                static_cast<double>(totalCycles);
+
+    // Wakeup latencies recorded during this measurement period.
+    LogLinearHistogram latencies = currentStats.wakeupLatencyCycles;
+    latencies.subtract(previousStats.wakeupLatencyCycles);
     previousStats = currentStats;
 
+    // Threads waiting in pending queues for a free context mean that the
+    // cores are full, whatever their load, so under every strategy ask for
+    // enough cores to hold them, and never give cores up while any wait.
+    if (currentStats.numPendingThreads != 0) {
+        if (curActiveCores >= maxNumCores)
+            return 0;
+        int wantedCores = static_cast<int>(
+            (currentStats.numPendingThreads + maxThreadsPerCore - 1) /
+            maxThreadsPerCore);
+        int increment = std::min(wantedCores, maxNumCores - curActiveCores);
+        for (int i = 0; i < increment; i++)
+            utilizationThresholds[curActiveCores + i] = totalUtilizedCores;
+        ARACHNE_LOG(NOTICE,
+                    "Recommending increase core count by %d: curActiveCores "
+                    "= %d, numPendingThreads = %lu\n",
+                    increment, curActiveCores,
+                    currentStats.numPendingThreads);
+        return increment;
+    }
+
     if (estimationStrategy == LOAD_FACTOR) {
         // We should not ramp down if we have high occupancy of slots.
         double averageSlotUtilization =
@@ -106,27 +136,10 @@ CoreLoadEstimator::estimate(int curActiveCores) {
         }
         return 0;
     } else if (estimationStrategy == UTILIZATION) {
-        ARACHNE_LOG(DEBUG,
-                    "curActiveCores = %d, totalUtilizedCores = %lf, "
-                    "maxUtilization = %lf\n",
-                    curActiveCores, totalUtilizedCores, maxUtilization);
-
-        if (totalUtilizedCores > maxUtilization * curActiveCores) {
-            ARACHNE_LOG(NOTICE,
-                        "Recommending increase core count: curActiveCores = "
-                        "%d, totalUtilizedCores = %lf, maxUtilization = %lf\n",
-                        curActiveCores, totalUtilizedCores, maxUtilization);
-            return 1;
-        }
-        if (totalUtilizedCores < maxUtilization * (curActiveCores - 1) -
-                                     idleCoreFractionHysteresis) {
-            ARACHNE_LOG(NOTICE,
-                        "Recommending decrease core count: curActiveCores = "
-                        "%d, totalUtilizedCores = %lf, maxUtilization = %lf\n",
-                        curActiveCores, totalUtilizedCores, maxUtilization);
-            return -1;
-        }
-        return 0;
+        return estimateFromUtilization(curActiveCores, totalUtilizedCores);
+    } else if (estimationStrategy == LATENCY) {
+        return estimateFromLatency(curActiveCores, totalUtilizedCores,
+                                   latencies);
     }
     // We have an unknown estimation strategy, so we do nothing.
     ARACHNE_LOG(ERROR,
@@ -135,6 +148,131 @@ CoreLoadEstimator::estimate(int curActiveCores) {
     return 0;
 }
 
+/**
+ * Suggest a change of at most one core that keeps the utilization of the
+ * cores below maxUtilization.
+ *
+ * \param curActiveCores
+ *     The number of cores currently in use.
+ * \param totalUtilizedCores
+ *     The number of cores' worth of time spent running threads during the
+ *     last measurement period.
+ */
+int
+CoreLoadEstimator::estimateFromUtilization(int curActiveCores,
+                                           double totalUtilizedCores) {
+    ARACHNE_LOG(DEBUG,
+                "curActiveCores = %d, totalUtilizedCores = %lf, "
+                "maxUtilization = %lf\n",
+                curActiveCores, totalUtilizedCores, maxUtilization);
+
+    if (totalUtilizedCores > maxUtilization * curActiveCores) {
+        ARACHNE_LOG(NOTICE,
+                    "Recommending increase core count: curActiveCores = "
+                    "%d, totalUtilizedCores = %lf, maxUtilization = %lf\n",
+                    curActiveCores, totalUtilizedCores, maxUtilization);
+        return 1;
+    }
+    if (totalUtilizedCores < maxUtilization * (curActiveCores - 1) -
+                                 idleCoreFractionHysteresis) {
+        ARACHNE_LOG(NOTICE,
+                    "Recommending decrease core count: curActiveCores = "
+                    "%d, totalUtilizedCores = %lf, maxUtilization = %lf\n",
+                    curActiveCores, totalUtilizedCores, maxUtilization);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Suggest a change in the number of cores that keeps the 99th percentile of
+ * the time runnable threads wait for a core below latencyTargetNs. Cores are
+ * added in proportion to how far the smoothed latency exceeds the target, and
+ * removed one at a time once the latency is well below the target and the
+ * remaining cores could absorb the work. Periods without any wakeups carry no
+ * latency information, so the utilization rule decides for them.
+ *
+ * \param curActiveCores
+ *     The number of cores currently in use.
+ * \param totalUtilizedCores
+ *     The number of cores' worth of time spent running threads during the
+ *     last measurement period.
+ * \param latencies
+ *     The wakeup latencies, in cycles, recorded during the last measurement
+ *     period.
+ */
+int
+CoreLoadEstimator::estimateFromLatency(int curActiveCores,
+                                       double totalUtilizedCores,
+                                       const LogLinearHistogram& latencies) {
+    if (latencies.count == 0) {
+        ramping = false;
+        return estimateFromUtilization(curActiveCores, totalUtilizedCores);
+    }
+    double latencyNs = static_cast<double>(
+        Cycles::toNanoseconds(latencies.percentile(0.99)));
+    if (smoothedLatencyNs < 0)
+        smoothedLatencyNs = latencyNs;
+    else
+        smoothedLatencyNs = latencySmoothing * latencyNs +
+                            (1 - latencySmoothing) * smoothedLatencyNs;
+    double target = static_cast<double>(latencyTargetNs);
+
+    ARACHNE_LOG(DEBUG,
+                "curActiveCores = %d, totalUtilizedCores = %lf, "
+                "latencyNs = %lf, smoothedLatencyNs = %lf, "
+                "latencyTargetNs = %lu\n",
+                curActiveCores, totalUtilizedCores, latencyNs,
+                smoothedLatencyNs, latencyTargetNs);
+
+    if (smoothedLatencyNs > target) {
+        ramping = curActiveCores < maxNumCores;
+        if (!ramping)
+            return 0;
+        // Queueing delay falls roughly in proportion to the number of cores
+        // serving the queue, so scale the core count by the overshoot.
+        int wantedCores = static_cast<int>(
+            ceil(curActiveCores * smoothedLatencyNs / target));
+        int increment = std::min(std::max(wantedCores - curActiveCores, 1),
+                                 maxNumCores - curActiveCores);
+        ARACHNE_LOG(NOTICE,
+                    "Recommending increase core count by %d: curActiveCores "
+                    "= %d, smoothedLatencyNs = %lf, latencyTargetNs = %lu\n",
+                    increment, curActiveCores, smoothedLatencyNs,
+                    latencyTargetNs);
+        return increment;
+    }
+    ramping = false;
+    if (smoothedLatencyNs < target * (1 - latencyHysteresis) &&
+        totalUtilizedCores < maxUtilization * (curActiveCores - 1) -
+                                 idleCoreFractionHysteresis) {
+        ARACHNE_LOG(NOTICE,
+                    "Recommending decrease core count: curActiveCores = %d, "
+                    "totalUtilizedCores = %lf, smoothedLatencyNs = %lf, "
+                    "latencyTargetNs = %lu\n",
+                    curActiveCores, totalUtilizedCores, smoothedLatencyNs,
+                    latencyTargetNs);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Return how long the caller should wait before the next call to estimate.
+ * This is shortened while the LATENCY strategy is ramping up, so that bursts
+ * are absorbed quickly, and is otherwise the period passed in.
+ *
+ * \param measurementPeriod
+ *     The usual time between estimates, in nanoseconds.
+ */
+uint64_t
+CoreLoadEstimator::getMeasurementPeriod(uint64_t measurementPeriod) {
+    Lock guard(lock);
+    if (estimationStrategy == LATENCY && ramping)
+        return measurementPeriod / RAMP_PERIOD_DIVISOR;
+    return measurementPeriod;
+}
+
 /**
  * Invoking this function will set the load factor threshold and also
  * change the load estimation strategy to use load factor.
@@ -156,4 +294,68 @@ CoreLoadEstimator::setMaxUtilization(double maxUtilization) {
     this->maxUtilization = maxUtilization;
     this->estimationStrategy = UTILIZATION;
 }
+/**
+ * Invoking this function will set the 99th percentile wakeup latency that
+ * the number of cores is adjusted to meet, in nanoseconds, and also change
+ * the load estimation strategy to use latency. Latencies are only measured
+ * when Arachne is built with WAKEUP_LATENCY_STATS; otherwise this strategy
+ * behaves like the utilization strategy.
+ */
+void
+CoreLoadEstimator::setLatencyTarget(uint64_t latencyTargetNs) {
+    Lock guard(lock);
+#if !WAKEUP_LATENCY_STATS
+    ARACHNE_LOG(WARNING,
+                "Arachne was built without WAKEUP_LATENCY_STATS; core "
+                "estimation will be based on utilization only.\n");
+#endif
+    this->latencyTargetNs = latencyTargetNs;
+    this->estimationStrategy = LATENCY;
+    this->smoothedLatencyNs = -1;
+    this->ramping = false;
+}
+
+/**
+ * Set the fraction of the latency target by which the smoothed latency must
+ * drop below the target before the LATENCY strategy removes a core.
+ */
+void
+CoreLoadEstimator::setLatencyHysteresis(double latencyHysteresis) {
+    Lock guard(lock);
+    this->latencyHysteresis = latencyHysteresis;
+}
+
+/**
+ * Set the weight, between 0 and 1, that the LATENCY strategy gives to each
+ * new measurement in its moving average of the latency.
+ */
+void
+CoreLoadEstimator::setLatencySmoothing(double latencySmoothing) {
+    Lock guard(lock);
+    this->latencySmoothing = latencySmoothing;
+}
+
+/**
+ * Track how often, and by how many cores, estimate asks for more cores, and
+ * return the number of warm spare cores that may run at once accordingly:
+ * bursts that recur within about BURST_HORIZON_PERIODS measurement periods
+ * may start as many warm spares as they added cores, while after a quiet
+ * spell only one starts.
+ *
+ * \param estimate
+ *     The latest value returned by estimate.
+ * \param numWarmSpareCores
+ *     The number of warm spare cores, which the result never exceeds.
+ */
+uint32_t
+CoreLoadEstimator::adaptWarmSpareBudget(int estimate,
+                                        uint32_t numWarmSpareCores) {
+    Lock guard(lock);
+    double coresAdded = estimate > 0 ? estimate : 0;
+    smoothedCoresAdded = coresAdded / BURST_HORIZON_PERIODS +
+                         (1 - 1.0 / BURST_HORIZON_PERIODS) * smoothedCoresAdded;
+    uint32_t budget = static_cast<uint32_t>(
+        lround(smoothedCoresAdded * BURST_HORIZON_PERIODS));
+    return std::min(numWarmSpareCores, std::max(1U, budget));
+}
 }  // namespace Arachne
@@ -23,25 +23,35 @@
 namespace Arachne {
 
 /**
- * Objects of this class offer recommendations about whether core count should
- * increase, decrease, or stay the same based on the current load factor and
- * utilization of cores.
+ * Objects of this class offer recommendations about how many cores to add or
+ * remove based on the current load factor, utilization of cores, or the
+ * latency with which runnable threads get to run.
  */
 class CoreLoadEstimator {
   public:
     explicit CoreLoadEstimator(int maxNumCores);
     ~CoreLoadEstimator();
     int estimate(int currentNumCores);
+    uint64_t getMeasurementPeriod(uint64_t measurementPeriod);
     void setLoadFactorThreshold(double loadFactorThreshold);
     void setMaxUtilization(double maxUtilization);
+    void setLatencyTarget(uint64_t latencyTargetNs);
+    void setLatencyHysteresis(double latencyHysteresis);
+    void setLatencySmoothing(double latencySmoothing);
+    uint32_t adaptWarmSpareBudget(int estimate, uint32_t numWarmSpareCores);
 
   private:
+    int estimateFromUtilization(int curActiveCores, double totalUtilizedCores);
+    int estimateFromLatency(int curActiveCores, double totalUtilizedCores,
+                            const LogLinearHistogram& latencies);
+
     /**
      * Strategy used by the coreLoadEstimator to estimate load.
      */
     enum EstimationStrategy {
         LOAD_FACTOR = 1,
-        UTILIZATION = 2
+        UTILIZATION = 2,
+        LATENCY = 3
     } estimationStrategy = LOAD_FACTOR;
 
     typedef std::lock_guard<SpinLock> Lock;
@@ -87,6 +97,55 @@ class CoreLoadEstimator {
      */
     double slotOccupancyThreshold = 0.5;
 
+    /*
+     * Under the LATENCY strategy, we will attempt to increase the number of
+     * cores if the smoothed 99th percentile of the time between a thread
+     * being signaled and running exceeds this many nanoseconds.
+     */
+    uint64_t latencyTargetNs = 50 * 1000;
+
+    /*
+     * Under the LATENCY strategy, we only ramp down once the smoothed
+     * latency is below latencyTargetNs * (1 - latencyHysteresis).
+     */
+    double latencyHysteresis = 0.5;
+
+    /*
+     * Weight of the latest measurement in smoothedLatencyNs; 1 disables
+     * smoothing, and smaller values react more slowly to bursts.
+     */
+    double latencySmoothing = 0.5;
+
+    /*
+     * Exponentially weighted moving average of the 99th percentile wakeup
+     * latency in nanoseconds, or negative before the first measurement.
+     */
+    double smoothedLatencyNs = -1;
+
+    /*
+     * Set while the LATENCY strategy is adding cores, so that the next
+     * measurement comes sooner.
+     */
+    bool ramping = false;
+
+    /*
+     * While ramping, measurement periods are shortened by this factor.
+     */
+    static const int RAMP_PERIOD_DIVISOR = 4;
+
+    /*
+     * Exponentially weighted moving average of the number of cores that
+     * estimate asked to add per measurement period; see adaptWarmSpareBudget.
+     */
+    double smoothedCoresAdded = 0;
+
+    /*
+     * The number of measurement periods over which adaptWarmSpareBudget
+     * remembers bursts; it also sets the weight of each new period in
+     * smoothedCoresAdded.
+     */
+    static const int BURST_HORIZON_PERIODS = 8;
+
     /*
      * Store the maximum cores the application is willing to use so that we
      * never recommend increasing the number of cores beyond this number.
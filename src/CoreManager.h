@@ -134,7 +134,9 @@ class CoreManager {
 
     /**
      * Invoked by Arachne::createThread to get cores available for a particular
-     * threadClass.
+     * threadClass. Callers read the list without locking, so a list that can
+     * change after it is returned must be replaced instead, and the old one
+     * passed to retireCoreList.
      */
     virtual CoreList* getCores(int threadClass) = 0;
 
@@ -14,6 +14,7 @@
  */
 
 #include "DefaultCoreManager.h"
+#include <string.h>
 #include <atomic>
 #include "Arachne.h"
 
@@ -23,6 +24,7 @@ void removeThreadsFromCore(CoreList* outputCores);
 void releaseCore(CoreList* outputCores);
 void decrementCoreCount();
 void incrementCoreCount();
+void incrementCoreCount(uint32_t numCores);
 extern std::vector<uint64_t*> lastTotalCollectionTime;
 
 DefaultCoreManager::DefaultCoreManager(int minNumCores, int maxNumCores,
@@ -32,9 +34,22 @@ DefaultCoreManager::DefaultCoreManager(int minNumCores, int maxNumCores,
       loadEstimator(maxNumCores),
       lock(false),
       sharedCores(maxNumCores),
+      sharedCoresSnapshot(new CoreList(maxNumCores)),
+      exclusiveCoreLists(),
       exclusiveCores(maxNumCores),
       coreAdjustmentShouldRun(estimateLoad),
-      coreAdjustmentThreadStarted(false) {}
+      coreAdjustmentThreadStarted(false) {
+    for (int coreId = 0; coreId < maxNumCores; coreId++) {
+        exclusiveCoreLists.push_back(new CoreList(1));
+        exclusiveCoreLists.back()->add(coreId);
+    }
+}
+
+DefaultCoreManager::~DefaultCoreManager() {
+    delete sharedCoresSnapshot.load();
+    for (CoreList* list : exclusiveCoreLists)
+        delete list;
+}
 
 /**
  * Add the given core to the pool of threads for general scheduling.
@@ -43,6 +58,7 @@ void
 DefaultCoreManager::coreAvailable(int myCoreId) {
     Lock guard(lock);
     sharedCores.add(myCoreId);
+    sharedCoresChanged();
     if (!coreAdjustmentThreadStarted && coreAdjustmentShouldRun) {
         if (Arachne::createThread(&DefaultCoreManager::adjustCores, this) ==
             Arachne::NullThread) {
@@ -65,25 +81,25 @@ DefaultCoreManager::coreUnavailable() {
     }
     int freeCoreId = sharedCores[sharedCores.size() - 1];
     sharedCores.remove(sharedCores.size() - 1);
+    sharedCoresChanged();
     return freeCoreId;
 }
 
 /**
  * Invoked by Arachne::createThread to get cores available for scheduling of
  * short-lived tasks. Returns NULL if an invalid threadClass is passed in.
+ * The lists returned never change, and need no locking or allocation.
  */
 CoreList*
 DefaultCoreManager::getCores(int threadClass) {
     switch (threadClass) {
         case DEFAULT:
-            return &sharedCores;
+            return sharedCoresSnapshot.load(std::memory_order_acquire);
         case EXCLUSIVE:
             int coreId = getExclusiveCore();
             if (coreId < 0)
                 break;
-            CoreList* retVal = new CoreList(1, /*mustFree=*/true);
-            retVal->add(coreId);
-            return retVal;
+            return exclusiveCoreLists[coreId];
     }
     return NULL;
 }
@@ -97,6 +113,41 @@ DefaultCoreManager::getMigrationTargets() {
     return &sharedCores;
 }
 
+/**
+ * Invoked with lock held after every change to sharedCores; publishes a new
+ * snapshot of it. Subclasses that maintain their own views of the shared
+ * cores extend this.
+ */
+void
+DefaultCoreManager::sharedCoresChanged() {
+    publish(&sharedCoresSnapshot, sharedCores);
+}
+
+/**
+ * Replace the CoreList in snapshot with an immutable copy of cores, unless
+ * it already holds the same cores. The old list is deleted once no thread
+ * can still be reading it.
+ *
+ * \param snapshot
+ *     Holds the list that getCores returns for some thread class.
+ * \param cores
+ *     The cores that the new list should contain, in order.
+ */
+void
+DefaultCoreManager::publish(std::atomic<CoreList*>* snapshot,
+                            const CoreList& cores) {
+    CoreList* oldList = snapshot->load();
+    if (oldList->numFilled == cores.numFilled &&
+        memcmp(oldList->cores, cores.cores,
+               cores.numFilled * sizeof(cores.cores[0])) == 0)
+        return;
+    CoreList* newList = new CoreList(cores.capacity);
+    for (uint32_t i = 0; i < cores.numFilled; i++)
+        newList->add(cores.cores[i]);
+    snapshot->store(newList, std::memory_order_release);
+    retireCoreList(oldList);
+}
+
 /**
  * After this function returns, load estimations that have already begun
  * will complete, but no future load estimations will occur.
@@ -117,7 +168,8 @@ DefaultCoreManager::getEstimator() {
 int
 DefaultCoreManager::getExclusiveCore() {
     Lock guard(lock);
-    // Look for an existing idle exclusive core
+    // Look for an existing idle exclusive core. Exclusive threads live in
+    // the first context group; the others stay blocked.
     for (uint32_t i = 0; i < exclusiveCores.size(); i++) {
         if (occupiedAndCount[exclusiveCores[i]]->load().occupied == 0) {
             // Enable scheduling on this core again
@@ -134,6 +186,7 @@ DefaultCoreManager::getExclusiveCore() {
     int newExclusiveCore = sharedCores[0];
     exclusiveCores.add(newExclusiveCore);
     sharedCores.remove(0);
+    sharedCoresChanged();
 
     ThreadId migrationThread = createThreadOnCore(
         newExclusiveCore, removeThreadsFromCore, &sharedCores);
@@ -141,16 +194,24 @@ DefaultCoreManager::getExclusiveCore() {
     if (core.kernelThreadId == -1) {
         // Polling for completion is a short-term hack until we figure out a
         // good story for joining Arachne threads from non-Arachne threads.
-        while (Arachne::occupiedAndCount[newExclusiveCore]->load().occupied)
-            usleep(10);
+        for (int group = 0; group < numContextGroups; group++) {
+            while (Arachne::occupiedAndCount[newExclusiveCore][group]
+                       .load()
+                       .occupied)
+                usleep(10);
+        }
     } else {
         Arachne::join(migrationThread);
     }
 
     // Prepare this core for scheduling exclusively.
     // By setting numOccupied to one less than the maximium number of threads
-    // per core, we ensure that only one thread gets scheduled onto this core.
-    *occupiedAndCount[newExclusiveCore] = {0, maxThreadsPerCore - 1};
+    // in the first context group, and leaving the other groups blocked, we
+    // ensure that only one thread gets scheduled onto this core.
+    for (int group = 1; group < numContextGroups; group++)
+        occupiedAndCount[newExclusiveCore][group] = {0, Arachne::EXCLUSIVE};
+    *occupiedAndCount[newExclusiveCore] = {
+        0, static_cast<uint8_t>(contextGroupSize(0) - 1)};
     return newExclusiveCore;
 }
 
@@ -162,12 +223,14 @@ DefaultCoreManager::getExclusiveCore() {
 void
 DefaultCoreManager::adjustCores() {
     while (coreAdjustmentShouldRun.load()) {
-        Arachne::sleep(measurementPeriod);
+        Arachne::sleep(loadEstimator.getMeasurementPeriod(measurementPeriod));
         Lock guard(lock);
         int estimate = loadEstimator.estimate(sharedCores.size());
+        warmSpareBudget =
+            loadEstimator.adaptWarmSpareBudget(estimate, numWarmSpareCores);
         if (estimate == 0)
             continue;
-        if (estimate == -1) {
+        if (estimate < 0) {
             if (sharedCores.size() > 1)
                 decrementCoreCount();
             continue;
@@ -181,23 +244,26 @@ DefaultCoreManager::adjustCores() {
         for (uint32_t i = 0; i < exclusiveCores.size(); i++) {
             int coreId = exclusiveCores[i];
             MaskAndCount slotMap = *occupiedAndCount[coreId];
-            if (slotMap.numOccupied == maxThreadsPerCore - 1) {
+            if (slotMap.numOccupied == contextGroupSize(0) - 1) {
                 // Attempt to reclaim this core with a CAS. Only move back
                 // to sharedCores if we succeed.
                 MaskAndCount oldSlotMap = slotMap;
-                slotMap.numOccupied = maxThreadsPerCore;
+                slotMap.numOccupied =
+                    static_cast<uint8_t>(contextGroupSize(0));
                 if (occupiedAndCount[coreId]->compare_exchange_strong(
                         oldSlotMap, slotMap)) {
                     exclusiveCores.remove(i);
                     *lastTotalCollectionTime[coreId] = 0;
-                    *occupiedAndCount[coreId] = {0, 0};
+                    for (int group = 0; group < numContextGroups; group++)
+                        occupiedAndCount[coreId][group] = {0, 0};
                     sharedCores.add(coreId);
+                    sharedCoresChanged();
                     continue;
                 }
             }
         }
         // Then try to incrementCoreCount the traditional way.
-        incrementCoreCount();
+        incrementCoreCount(static_cast<uint32_t>(estimate));
     }
 }
 }  // namespace Arachne
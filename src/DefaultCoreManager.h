@@ -16,7 +16,9 @@
 #ifndef DEFAULTCOREMANAGER_H_
 #define DEFAULTCOREMANAGER_H_
 
+#include <atomic>
 #include <mutex>
+#include <vector>
 #include "CoreLoadEstimator.h"
 #include "CoreManager.h"
 #include "SpinLock.h"
@@ -33,6 +35,7 @@ class DefaultCoreManager : public CoreManager {
   public:
     DefaultCoreManager(int minNumCores, int maxNumCores,
                        bool estimateLoad = true);
+    virtual ~DefaultCoreManager();
     virtual void coreAvailable(int myCoreId);
     virtual int coreUnavailable();
     virtual CoreList* getCores(int threadClass);
@@ -48,6 +51,12 @@ class DefaultCoreManager : public CoreManager {
   private:
     int getExclusiveCore();
     void adjustCores();
+
+  protected:
+    virtual void sharedCoresChanged();
+    static void publish(std::atomic<CoreList*>* snapshot,
+                        const CoreList& cores);
+
     /**
      * The minimum number of cores that the application needs to run
      * effectively.
@@ -70,10 +79,24 @@ class DefaultCoreManager : public CoreManager {
     SpinLock lock;
 
     /**
-     * Cores that are available for general scheduling.
+     * Cores that are available for general scheduling. This list is changed
+     * in place, so it is only handed out as migration targets; thread
+     * creation uses sharedCoresSnapshot.
      */
     CoreList sharedCores;
 
+    /**
+     * An immutable copy of sharedCores, replaced after every change to it
+     * and returned by getCores(DEFAULT).
+     */
+    std::atomic<CoreList*> sharedCoresSnapshot;
+
+    /**
+     * exclusiveCoreLists[c] holds just core c, and is returned by
+     * getCores(EXCLUSIVE) when c becomes exclusive.
+     */
+    std::vector<CoreList*> exclusiveCoreLists;
+
     /**
      * Cores that are currently hosting exclusive threads.
      */
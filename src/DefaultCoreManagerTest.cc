@@ -42,6 +42,8 @@ extern int* virtualCoreTable;
 extern std::string coreArbiterSocketPath;
 extern CoreArbiterClient* coreArbiter;
 
+extern std::vector<std::pair<CoreList*, uint64_t>> retiredCoreLists;
+
 static void limitedTimeWait(std::function<bool()> condition,
                             int numIterations = 1000);
 
@@ -141,13 +143,44 @@ TEST_F(DefaultCoreManagerTest, DefaultCoreManager_getCoresDefault) {
     DefaultCoreManager coreManager(1, 4, /*estimateLoad=*/false);
     CoreList* coreList = coreManager.getCores(DefaultCoreManager::DEFAULT);
     EXPECT_EQ(coreList->size(), 0U);
+    coreList->free();
     coreManager.coreAvailable(5);
+    coreList = coreManager.getCores(DefaultCoreManager::DEFAULT);
     EXPECT_EQ(coreList->size(), 1U);
+    coreList->free();
     coreManager.coreAvailable(7);
+    coreList = coreManager.getCores(DefaultCoreManager::DEFAULT);
     EXPECT_EQ(coreList->size(), 2U);
     coreList->free();
 }
 
+TEST_F(DefaultCoreManagerTest, DefaultCoreManager_getCoresSnapshot) {
+    DefaultCoreManager coreManager(1, 4, /*estimateLoad=*/false);
+    coreManager.coreAvailable(5);
+    numExternalCoreListReaders++;
+    CoreList* coreList = coreManager.getCores(DefaultCoreManager::DEFAULT);
+
+    // A list that has been handed out never changes, and survives until no
+    // reader can hold it.
+    coreManager.coreAvailable(7);
+    ASSERT_EQ(coreList->size(), 1U);
+    EXPECT_EQ(coreList->get(0), 5);
+    EXPECT_NE(coreManager.getCores(DefaultCoreManager::DEFAULT), coreList);
+    EXPECT_EQ(coreManager.getCores(DefaultCoreManager::DEFAULT)->size(), 2U);
+    EXPECT_EQ(coreList, retiredCoreLists.back().first);
+
+    numExternalCoreListReaders--;
+    limitedTimeWait([coreList]() -> bool {
+        reclaimCoreLists();
+        for (auto& retired : retiredCoreLists)
+            if (retired.first == coreList)
+                return false;
+        return true;
+    });
+    for (auto& retired : retiredCoreLists)
+        EXPECT_NE(coreList, retired.first);
+}
+
 TEST_F(DefaultCoreManagerTest, DefaultCoreManager_getCoresExclusive) {
     DefaultCoreManager* coreManager =
         reinterpret_cast<DefaultCoreManager*>(Arachne::getCoreManagerForTest());
@@ -158,4 +191,107 @@ TEST_F(DefaultCoreManagerTest, DefaultCoreManager_getCoresExclusive) {
     coreList->free();
 }
 
+// Build a histogram holding numValues copies of the given latency.
+static LogLinearHistogram
+latencyHistogram(uint64_t latencyNs, int numValues) {
+    LogLinearHistogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    for (int i = 0; i < numValues; i++)
+        histogram.record(Cycles::fromNanoseconds(latencyNs));
+    return histogram;
+}
+
+TEST(CoreLoadEstimatorTest, estimateFromLatency_addsSeveralCores) {
+    CoreLoadEstimator estimator(8);
+    estimator.setLatencyTarget(1000);
+    estimator.setLatencySmoothing(1.0);
+    // Four times over the target calls for about four times the cores.
+    int estimate =
+        estimator.estimateFromLatency(2, 1.0, latencyHistogram(4000, 100));
+    EXPECT_LE(5, estimate);
+    EXPECT_GE(6, estimate);
+    EXPECT_TRUE(estimator.ramping);
+    EXPECT_EQ(50U * 1000 * 1000 / CoreLoadEstimator::RAMP_PERIOD_DIVISOR,
+              estimator.getMeasurementPeriod(50 * 1000 * 1000));
+
+    // Never beyond maxNumCores.
+    EXPECT_EQ(1, estimator.estimateFromLatency(7, 1.0,
+                                               latencyHistogram(4000, 100)));
+    EXPECT_EQ(0, estimator.estimateFromLatency(8, 1.0,
+                                               latencyHistogram(4000, 100)));
+    EXPECT_FALSE(estimator.ramping);
+    EXPECT_EQ(50U * 1000 * 1000,
+              estimator.getMeasurementPeriod(50 * 1000 * 1000));
+}
+
+TEST(CoreLoadEstimatorTest, estimate_pendingThreadsAddCores) {
+    CoreLoadEstimator estimator(8);
+    PerfStats::threadStats.numPendingThreads = maxThreadsPerCore + 1;
+    // The first estimate only records a baseline.
+    EXPECT_EQ(0, estimator.estimate(2));
+    // Enough cores for every pending thread, but never beyond maxNumCores,
+    // and never fewer cores while threads are pending.
+    EXPECT_EQ(2, estimator.estimate(2));
+    EXPECT_EQ(1, estimator.estimate(7));
+    EXPECT_EQ(0, estimator.estimate(8));
+    PerfStats::threadStats.numPendingThreads = 0;
+}
+
+TEST(CoreLoadEstimatorTest, adaptWarmSpareBudget) {
+    CoreLoadEstimator estimator(8);
+    // After a quiet spell, one warm spare may start.
+    EXPECT_EQ(1U, estimator.adaptWarmSpareBudget(0, 4));
+    EXPECT_EQ(0U, estimator.adaptWarmSpareBudget(0, 0));
+    // A burst allows as many as it added, within the number of warm spares.
+    EXPECT_EQ(3U, estimator.adaptWarmSpareBudget(3, 4));
+    EXPECT_EQ(2U, estimator.adaptWarmSpareBudget(-1, 2));
+    // Bursts that come back soon add up; the budget then decays.
+    EXPECT_EQ(4U, estimator.adaptWarmSpareBudget(2, 8));
+    int numPeriods = 0;
+    while (estimator.adaptWarmSpareBudget(0, 8) > 1)
+        numPeriods++;
+    EXPECT_EQ(7, numPeriods);
+}
+
+TEST(CoreLoadEstimatorTest, estimateFromLatency_hysteresis) {
+    CoreLoadEstimator estimator(8);
+    estimator.setLatencyTarget(1000);
+    estimator.setLatencySmoothing(1.0);
+    estimator.setLatencyHysteresis(0.5);
+    // Under the target, but not far enough under it to give up a core.
+    EXPECT_EQ(0, estimator.estimateFromLatency(4, 0.5,
+                                               latencyHistogram(800, 100)));
+    EXPECT_EQ(-1, estimator.estimateFromLatency(4, 0.5,
+                                                latencyHistogram(200, 100)));
+    // Far under the target, but the remaining cores could not keep up.
+    EXPECT_EQ(0, estimator.estimateFromLatency(4, 3.5,
+                                               latencyHistogram(200, 100)));
+}
+
+TEST(CoreLoadEstimatorTest, estimateFromLatency_smoothing) {
+    CoreLoadEstimator estimator(8);
+    estimator.setLatencyTarget(1000);
+    estimator.setLatencySmoothing(0.25);
+    EXPECT_EQ(0, estimator.estimateFromLatency(2, 1.0,
+                                               latencyHistogram(900, 100)));
+    double firstLatencyNs = estimator.smoothedLatencyNs;
+    // A single slow period is not enough to move the average past the
+    // target.
+    EXPECT_EQ(0, estimator.estimateFromLatency(2, 1.0,
+                                               latencyHistogram(1200, 100)));
+    EXPECT_LT(firstLatencyNs, estimator.smoothedLatencyNs);
+    EXPECT_GT(1000, estimator.smoothedLatencyNs);
+}
+
+TEST(CoreLoadEstimatorTest, estimateFromLatency_noWakeups) {
+    CoreLoadEstimator estimator(8);
+    estimator.setLatencyTarget(1000);
+    // Without latency samples the decision falls back to utilization.
+    EXPECT_EQ(1, estimator.estimateFromLatency(2, 1.9,
+                                               latencyHistogram(0, 0)));
+    EXPECT_EQ(-1, estimator.estimateFromLatency(4, 0.5,
+                                                latencyHistogram(0, 0)));
+    EXPECT_GT(0, estimator.smoothedLatencyNs);
+}
+
 }  // namespace Arachne
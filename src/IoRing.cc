@@ -0,0 +1,185 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "IoRing.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace Arachne {
+
+IoRing::IoRing()
+    : fd(-1),
+      sqRing(MAP_FAILED),
+      sqRingSize(0),
+      cqRing(MAP_FAILED),
+      cqRingSize(0),
+      sqes(NULL),
+      sqesSize(0),
+      sqHead(NULL),
+      sqTail(NULL),
+      sqMask(0),
+      sqEntries(0),
+      sqArray(NULL),
+      cqHead(NULL),
+      cqTail(NULL),
+      cqMask(0),
+      cqes(NULL),
+      numUnsubmitted(0),
+      numInFlight(0) {}
+
+/**
+ * Set up an io_uring and map its queues.
+ *
+ * \param entries
+ *     The number of entries in the submission queue; rounded up to a power
+ *     of two by the kernel.
+ * \return
+ *     The new ring, or NULL if the kernel does not support io_uring or the
+ *     ring could not be set up.
+ */
+IoRing*
+IoRing::create(uint32_t entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0)
+        return NULL;
+
+    IoRing* ring = new IoRing();
+    ring->fd = fd;
+    ring->sqRingSize =
+        params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cqRingSize =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        ring->sqRingSize = ring->cqRingSize =
+            std::max(ring->sqRingSize, ring->cqRingSize);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        delete ring;
+        return NULL;
+    }
+    if (singleMmap) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            delete ring;
+            return NULL;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        delete ring;
+        return NULL;
+    }
+    ring->sqes = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(ring->sqRing);
+    ring->sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+    ring->sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+    ring->sqMask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(ring->cqRing);
+    ring->cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+    ring->cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+    ring->cqMask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return ring;
+}
+
+IoRing::~IoRing() {
+    if (sqes != NULL)
+        munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+ * Queue an operation; it is started by the next call to submit().
+ *
+ * \param opcode
+ *     The IORING_OP_* code of the operation.
+ * \param fd
+ *     The file descriptor to operate on.
+ * \param addr
+ *     The address of the buffer, or the operation-specific pointer.
+ * \param len
+ *     The length of the buffer.
+ * \param offset
+ *     The file offset, or the operation-specific value.
+ * \param userData
+ *     Passed to the handler of reap() with the operation's result.
+ * \return
+ *     False if the submission queue is full, in which case nothing is
+ *     queued.
+ */
+bool
+IoRing::prepare(uint8_t opcode, int fd, uint64_t addr, uint32_t len,
+                uint64_t offset, uint64_t userData) {
+    uint32_t tail = *sqTail;
+    uint32_t head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (tail - head >= sqEntries)
+        return false;
+    uint32_t index = tail & sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    numUnsubmitted++;
+    numInFlight++;
+    return true;
+}
+
+/**
+ * Hand the operations queued by prepare() to the kernel with a single
+ * system call.
+ *
+ * \return
+ *     The number of operations submitted, or a negated errno.
+ */
+int
+IoRing::submit() {
+    if (numUnsubmitted == 0)
+        return 0;
+    int submitted = static_cast<int>(
+        syscall(__NR_io_uring_enter, fd, numUnsubmitted, 0, 0, NULL, 0));
+    if (submitted < 0)
+        return -errno;
+    numUnsubmitted -= static_cast<uint32_t>(submitted);
+    return submitted;
+}
+
+}  // namespace Arachne
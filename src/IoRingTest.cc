@@ -0,0 +1,107 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+#include "gtest/gtest.h"
+
+#include "IoRing.h"
+
+namespace Arachne {
+
+/**
+ * Reap completions from ring until it has none in flight, appending each
+ * (userData, result) pair to completions.
+ */
+static void
+reapAll(IoRing* ring, std::vector<std::pair<uint64_t, int32_t>>* completions) {
+    while (ring->inFlight() != 0)
+        ring->reap([completions](uint64_t userData, int32_t result) {
+            completions->push_back(std::make_pair(userData, result));
+        });
+}
+
+TEST(IoRingTest, readAndWrite) {
+    IoRing* ring = IoRing::create(4);
+    if (ring == NULL) {
+        printf("io_uring is not supported; skipping IoRingTest\n");
+        return;
+    }
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    char message[] = "hello";
+    char buffer[sizeof(message)] = {0};
+
+    EXPECT_TRUE(ring->prepare(IORING_OP_WRITE, fds[1],
+                              reinterpret_cast<uint64_t>(message),
+                              sizeof(message), ~0UL, 1));
+    EXPECT_TRUE(ring->hasUnsubmitted());
+    EXPECT_EQ(1U, ring->inFlight());
+    EXPECT_EQ(1, ring->submit());
+    EXPECT_FALSE(ring->hasUnsubmitted());
+    std::vector<std::pair<uint64_t, int32_t>> completions;
+    reapAll(ring, &completions);
+    ASSERT_EQ(1U, completions.size());
+    EXPECT_EQ(1U, completions[0].first);
+    EXPECT_EQ(static_cast<int32_t>(sizeof(message)), completions[0].second);
+
+    completions.clear();
+    EXPECT_TRUE(ring->prepare(IORING_OP_READ, fds[0],
+                              reinterpret_cast<uint64_t>(buffer),
+                              sizeof(buffer), ~0UL, 2));
+    // Operations on a bad file descriptor complete with a negated errno.
+    EXPECT_TRUE(ring->prepare(IORING_OP_READ, -1,
+                              reinterpret_cast<uint64_t>(buffer),
+                              sizeof(buffer), ~0UL, 3));
+    EXPECT_EQ(2, ring->submit());
+    reapAll(ring, &completions);
+    ASSERT_EQ(2U, completions.size());
+    for (auto& completion : completions) {
+        if (completion.first == 2) {
+            EXPECT_EQ(static_cast<int32_t>(sizeof(message)),
+                      completion.second);
+        } else {
+            EXPECT_EQ(3U, completion.first);
+            EXPECT_EQ(-EBADF, completion.second);
+        }
+    }
+    EXPECT_STREQ(message, buffer);
+
+    close(fds[0]);
+    close(fds[1]);
+    delete ring;
+}
+
+TEST(IoRingTest, prepare_queueFull) {
+    IoRing* ring = IoRing::create(2);
+    if (ring == NULL)
+        return;
+    EXPECT_TRUE(ring->prepare(IORING_OP_NOP, -1, 0, 0, 0, 1));
+    EXPECT_TRUE(ring->prepare(IORING_OP_NOP, -1, 0, 0, 0, 2));
+    EXPECT_FALSE(ring->prepare(IORING_OP_NOP, -1, 0, 0, 0, 3));
+    EXPECT_EQ(2U, ring->inFlight());
+
+    // Submitting frees the entries of the submission queue.
+    EXPECT_EQ(2, ring->submit());
+    EXPECT_TRUE(ring->prepare(IORING_OP_NOP, -1, 0, 0, 0, 3));
+    EXPECT_EQ(1, ring->submit());
+    std::vector<std::pair<uint64_t, int32_t>> completions;
+    reapAll(ring, &completions);
+    EXPECT_EQ(3U, completions.size());
+    delete ring;
+}
+
+}  // namespace Arachne
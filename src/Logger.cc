@@ -15,6 +15,9 @@
 
 #include "Logger.h"
 #include <execinfo.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include "Arachne.h"
 
 namespace Arachne {
@@ -22,6 +25,529 @@ namespace Arachne {
 extern FILE* errorStream;
 LogLevel Logger::displayMinLevel = NOTICE;
 std::mutex Logger::mutex;
+std::atomic<bool> Logger::asynchronous(false);
+std::thread Logger::drainThread;
+std::atomic<uint64_t> Logger::numDroppedMessages(0);
+
+/**
+ * A single-producer, single-consumer byte ring holding the binary log
+ * records of one kernel thread. The producer is the kernel thread that
+ * currently owns the ring; the consumer is whoever holds Logger::mutex.
+ */
+struct Logger::Ring {
+    /// Capacity in bytes; a power of two.
+    static const uint64_t SIZE = 1 << 16;
+
+    /// Total number of bytes ever written; only the producer modifies it.
+    std::atomic<uint64_t> head;
+
+    /// Total number of bytes ever consumed; only the consumer modifies it.
+    std::atomic<uint64_t> tail;
+
+    /// True while a kernel thread is using this ring; rings are recycled
+    /// when their owner exits rather than freed.
+    std::atomic<bool> inUse;
+
+    char buffer[SIZE];
+
+    Ring() : head(0), tail(0), inUse(true) {}
+};
+
+namespace {
+
+/// Largest number of rings, and therefore of kernel threads that can
+/// log asynchronously at once. Others fall back to synchronous writes.
+const int MAX_RINGS = 256;
+
+/// All rings ever created; slots are never cleared.
+std::atomic<Logger::Ring*> rings[MAX_RINGS];
+
+/// Number of slots of rings that have been claimed.
+std::atomic<int> numRings(0);
+
+/// Largest encoded record, including its header. Longer string arguments
+/// are truncated to fit.
+const uint32_t MAX_RECORD_SIZE = 1024;
+
+/// Prefix of every record in a Ring. A length of zero marks the unused
+/// space at the end of the buffer before the ring wraps.
+struct RecordHeader {
+    uint32_t length;
+    LogLevel level;
+    const char* format;
+};
+
+/// How an argument of a printf conversion is stored in a record.
+enum ArgumentType {
+    NO_ARGUMENT,
+    INT_ARGUMENT,
+    LONG_ARGUMENT,
+    LONG_LONG_ARGUMENT,
+    SIZE_ARGUMENT,
+    PTRDIFF_ARGUMENT,
+    INTMAX_ARGUMENT,
+    DOUBLE_ARGUMENT,
+    LONG_DOUBLE_ARGUMENT,
+    STRING_ARGUMENT,
+    POINTER_ARGUMENT
+};
+
+/// One conversion specification in a format string.
+struct Conversion {
+    const char* start;
+    const char* end;
+    bool starWidth;
+    bool starPrecision;
+    ArgumentType type;
+};
+
+/**
+ * Find the next conversion specification in a format string.
+ *
+ * \param format
+ *     The remainder of the format string to search.
+ * \param conversion
+ *     Filled in with the conversion found.
+ * \return
+ *     False if there are no more conversions.
+ */
+bool
+nextConversion(const char* format, Conversion* conversion) {
+    const char* p = format;
+    while (true) {
+        p = strchr(p, '%');
+        if (p == NULL)
+            return false;
+        if (p[1] != '%')
+            break;
+        p += 2;
+    }
+    conversion->start = p++;
+    conversion->starWidth = conversion->starPrecision = false;
+    while (*p && strchr("-+ #0'", *p))
+        p++;
+    if (*p == '*') {
+        conversion->starWidth = true;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            conversion->starPrecision = true;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    int longs = 0;
+    char modifier = 0;
+    while (*p && strchr("hlLqjzt", *p)) {
+        if (*p == 'l')
+            longs++;
+        modifier = *p++;
+    }
+    switch (*p) {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+        case 'c':
+            if (longs >= 2 || modifier == 'q')
+                conversion->type = LONG_LONG_ARGUMENT;
+            else if (longs == 1)
+                conversion->type = LONG_ARGUMENT;
+            else if (modifier == 'z')
+                conversion->type = SIZE_ARGUMENT;
+            else if (modifier == 't')
+                conversion->type = PTRDIFF_ARGUMENT;
+            else if (modifier == 'j')
+                conversion->type = INTMAX_ARGUMENT;
+            else
+                conversion->type = INT_ARGUMENT;
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            conversion->type =
+                modifier == 'L' ? LONG_DOUBLE_ARGUMENT : DOUBLE_ARGUMENT;
+            break;
+        case 's':
+            conversion->type = STRING_ARGUMENT;
+            break;
+        case 'p':
+            conversion->type = POINTER_ARGUMENT;
+            break;
+        default:
+            conversion->type = NO_ARGUMENT;
+            break;
+    }
+    conversion->end = *p ? p + 1 : p;
+    return true;
+}
+
+/// Room that must be left in a record before encoding another conversion:
+/// two star arguments plus the largest fixed-size value.
+const uint32_t MAX_CONVERSION_SIZE = 2 * sizeof(int) + sizeof(long double);
+
+/**
+ * Append a value to a record under construction.
+ */
+template <typename T>
+void
+put(char* record, uint32_t* length, T value) {
+    memcpy(record + *length, &value, sizeof(T));
+    *length += static_cast<uint32_t>(sizeof(T));
+}
+
+/**
+ * Read the next value from a record written with put().
+ */
+template <typename T>
+T
+get(const char** cursor) {
+    T value;
+    memcpy(&value, *cursor, sizeof(T));
+    *cursor += sizeof(T);
+    return value;
+}
+
+/**
+ * Encode the arguments of a message in binary, in the order in which they
+ * appear in the format string.
+ *
+ * \param record
+ *     A buffer of MAX_RECORD_SIZE bytes, already holding the header.
+ * \param format
+ *     The format string of the message.
+ * \param args
+ *     The arguments of the message.
+ * \return
+ *     The length of the record, rounded up to a multiple of 8 bytes.
+ */
+uint32_t
+encodeArguments(char* record, const char* format, va_list args) {
+    uint32_t length = sizeof(RecordHeader);
+    Conversion conversion;
+    for (const char* p = format; nextConversion(p, &conversion);
+         p = conversion.end) {
+        // Drop the remaining arguments of oversized messages.
+        if (length + MAX_CONVERSION_SIZE > MAX_RECORD_SIZE)
+            break;
+        if (conversion.starWidth)
+            put(record, &length, va_arg(args, int));
+        if (conversion.starPrecision)
+            put(record, &length, va_arg(args, int));
+        switch (conversion.type) {
+            case INT_ARGUMENT:
+                put(record, &length, va_arg(args, int));
+                break;
+            case LONG_ARGUMENT:
+                put(record, &length, va_arg(args, long));
+                break;
+            case LONG_LONG_ARGUMENT:
+                put(record, &length, va_arg(args, long long));
+                break;
+            case SIZE_ARGUMENT:
+                put(record, &length, va_arg(args, size_t));
+                break;
+            case PTRDIFF_ARGUMENT:
+                put(record, &length, va_arg(args, ptrdiff_t));
+                break;
+            case INTMAX_ARGUMENT:
+                put(record, &length, va_arg(args, intmax_t));
+                break;
+            case DOUBLE_ARGUMENT:
+                put(record, &length, va_arg(args, double));
+                break;
+            case LONG_DOUBLE_ARGUMENT:
+                put(record, &length, va_arg(args, long double));
+                break;
+            case POINTER_ARGUMENT:
+                put(record, &length, va_arg(args, void*));
+                break;
+            case STRING_ARGUMENT: {
+                const char* string = va_arg(args, const char*);
+                if (string == NULL)
+                    string = "(null)";
+                // Strings are copied, truncated to the space that is left.
+                uint32_t space = MAX_RECORD_SIZE - length;
+                uint32_t size =
+                    static_cast<uint32_t>(strnlen(string, space - 1));
+                memcpy(record + length, string, size);
+                record[length + size] = '\0';
+                length += size + 1;
+                break;
+            }
+            case NO_ARGUMENT:
+                break;
+        }
+    }
+    return (length + 7) & ~7U;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+/**
+ * Format one conversion, passing through the optional star arguments.
+ */
+template <typename T>
+void
+printConversion(FILE* stream, const char* spec, const Conversion& conversion,
+                int width, int precision, T value) {
+    if (conversion.starWidth && conversion.starPrecision)
+        fprintf(stream, spec, width, precision, value);
+    else if (conversion.starWidth)
+        fprintf(stream, spec, width, value);
+    else if (conversion.starPrecision)
+        fprintf(stream, spec, precision, value);
+    else
+        fprintf(stream, spec, value);
+}
+
+/**
+ * Format a record written by Logger::log and write it to a stream.
+ *
+ * \param stream
+ *     Where to write the message.
+ * \param record
+ *     Start of the record, including its header.
+ */
+void
+printRecord(FILE* stream, const char* record) {
+    RecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    const char* end = record + header.length;
+    const char* cursor = record + sizeof(RecordHeader);
+    const char* format = header.format;
+    Conversion conversion;
+    char spec[64];
+    while (nextConversion(format, &conversion)) {
+        // Text before the conversion, including escaped percent signs.
+        for (const char* p = format; p < conversion.start; p++) {
+            fputc(*p, stream);
+            if (p[0] == '%' && p[1] == '%')
+                p++;
+        }
+        format = conversion.end;
+        size_t specLength =
+            static_cast<size_t>(conversion.end - conversion.start);
+        if (specLength >= sizeof(spec) || conversion.type == NO_ARGUMENT) {
+            fwrite(conversion.start, 1, specLength, stream);
+            continue;
+        }
+        memcpy(spec, conversion.start, specLength);
+        spec[specLength] = '\0';
+
+        // Truncated records end early; print what is there.
+        int width = 0, precision = 0;
+        if (conversion.starWidth && cursor + sizeof(int) <= end)
+            width = get<int>(&cursor);
+        if (conversion.starPrecision && cursor + sizeof(int) <= end)
+            precision = get<int>(&cursor);
+        if (cursor >= end)
+            break;
+        switch (conversion.type) {
+            case INT_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                get<int>(&cursor));
+                break;
+            case LONG_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                get<long>(&cursor));
+                break;
+            case LONG_LONG_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                get<long long>(&cursor));
+                break;
+            case SIZE_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                get<size_t>(&cursor));
+                break;
+            case PTRDIFF_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                get<ptrdiff_t>(&cursor));
+                break;
+            case INTMAX_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                get<intmax_t>(&cursor));
+                break;
+            case DOUBLE_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                get<double>(&cursor));
+                break;
+            case LONG_DOUBLE_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                get<long double>(&cursor));
+                break;
+            case POINTER_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                get<void*>(&cursor));
+                break;
+            case STRING_ARGUMENT:
+                printConversion(stream, spec, conversion, width, precision,
+                                cursor);
+                cursor += strlen(cursor) + 1;
+                break;
+            case NO_ARGUMENT:
+                break;
+        }
+    }
+    for (const char* p = format; *p; p++) {
+        fputc(*p, stream);
+        if (p[0] == '%' && p[1] == '%')
+            p++;
+    }
+}
+#pragma GCC diagnostic pop
+
+/**
+ * Gives each kernel thread its own Ring and returns it for reuse when the
+ * thread exits.
+ */
+struct RingHandle {
+    Logger::Ring* ring = NULL;
+    ~RingHandle();
+};
+
+thread_local RingHandle ringHandle;
+
+}  // namespace
+
+RingHandle::~RingHandle() {
+    if (ring)
+        ring->inUse.store(false, std::memory_order_release);
+}
+
+/**
+ * Return the ring of the calling kernel thread, creating or recycling one on
+ * its first message.
+ *
+ * \return
+ *     The ring, or NULL if too many threads are logging already.
+ */
+Logger::Ring*
+Logger::getRing() {
+    if (ringHandle.ring)
+        return ringHandle.ring;
+    int count = numRings.load(std::memory_order_acquire);
+    for (int i = 0; i < count; i++) {
+        Ring* ring = rings[i].load(std::memory_order_acquire);
+        bool inUse = false;
+        if (ring && ring->inUse.compare_exchange_strong(inUse, true)) {
+            ringHandle.ring = ring;
+            return ring;
+        }
+    }
+    int index = numRings.fetch_add(1);
+    if (index >= MAX_RINGS)
+        return NULL;
+    Ring* ring = new Ring;
+    rings[index].store(ring, std::memory_order_release);
+    ringHandle.ring = ring;
+    return ring;
+}
+
+/**
+ * Format and write all buffered messages. The caller must hold mutex.
+ */
+void
+Logger::drainRings() {
+    int count = std::min(numRings.load(std::memory_order_acquire), MAX_RINGS);
+    for (int i = 0; i < count; i++) {
+        Ring* ring = rings[i].load(std::memory_order_acquire);
+        if (ring == NULL)
+            continue;
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        while (tail != head) {
+            uint64_t offset = tail & (Ring::SIZE - 1);
+            uint32_t length;
+            memcpy(&length, ring->buffer + offset, sizeof(length));
+            if (length == 0) {
+                tail += Ring::SIZE - offset;
+                continue;
+            }
+            printRecord(errorStream, ring->buffer + offset);
+            tail += length;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+}
+
+/**
+ * The body of the drain thread: write buffered messages until
+ * stopDrainThread() is called.
+ */
+void
+Logger::drainThreadMain() {
+    while (asynchronous.load(std::memory_order_acquire)) {
+        {
+            Lock lock(mutex);
+            drainRings();
+            fflush(errorStream);
+        }
+        usleep(1000);
+    }
+}
+
+/**
+ * Start buffering messages below ERROR and writing them from a background
+ * thread. This is called by Arachne::init().
+ */
+void
+Logger::startDrainThread() {
+    Lock lock(mutex);
+    if (asynchronous)
+        return;
+    asynchronous = true;
+    drainThread = std::thread(drainThreadMain);
+}
+
+/**
+ * Stop the drain thread after it has written all buffered messages; later
+ * messages are written synchronously. This is called by
+ * Arachne::waitForTermination().
+ */
+void
+Logger::stopDrainThread() {
+    {
+        Lock lock(mutex);
+        if (!asynchronous)
+            return;
+        asynchronous = false;
+    }
+    drainThread.join();
+    flush();
+}
+
+/**
+ * Write all messages buffered so far, for instance before changing
+ * errorStream.
+ */
+void
+Logger::flush() {
+    Lock lock(mutex);
+    drainRings();
+    fflush(errorStream);
+}
+
+/**
+ * Return the number of messages that were discarded because the ring of the
+ * logging thread was full.
+ */
+uint64_t
+Logger::getNumDroppedMessages() {
+    return numDroppedMessages.load();
+}
 
 void
 Logger::log(LogLevel level, const char* fmt, ...) {
@@ -29,8 +555,39 @@ Logger::log(LogLevel level, const char* fmt, ...) {
         return;
     }
 
-    Lock lock(mutex);
     va_list args;
+    Ring* ring;
+    if (level < ERROR && asynchronous.load(std::memory_order_relaxed) &&
+        (ring = getRing()) != NULL) {
+        char record[MAX_RECORD_SIZE];
+        va_start(args, fmt);
+        uint32_t length = encodeArguments(record, fmt, args);
+        va_end(args);
+        RecordHeader header = {length, level, fmt};
+        memcpy(record, &header, sizeof(header));
+
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        uint64_t offset = head & (Ring::SIZE - 1);
+        // Records do not wrap; skip the end of the buffer if need be.
+        uint64_t skip = Ring::SIZE - offset < length ? Ring::SIZE - offset : 0;
+        if (head + skip + length - tail > Ring::SIZE) {
+            numDroppedMessages++;
+            return;
+        }
+        if (skip) {
+            memset(ring->buffer + offset, 0, sizeof(uint32_t));
+            head += skip;
+            offset = 0;
+        }
+        memcpy(ring->buffer + offset, record, length);
+        ring->head.store(head + length, std::memory_order_release);
+        return;
+    }
+
+    Lock lock(mutex);
+    // Keep messages in order with those that are still buffered.
+    drainRings();
     va_start(args, fmt);
     vfprintf(errorStream, fmt, args);
     fflush(errorStream);
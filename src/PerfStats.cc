@@ -13,6 +13,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <algorithm>
 
@@ -21,7 +22,8 @@
 namespace Arachne {
 
 SpinLock PerfStats::mutex(false);
-std::vector<PerfStats*> PerfStats::registeredStats;
+std::atomic<PerfStats*> PerfStats::registeredStats[MAX_REGISTERED_STATS];
+std::atomic<int> PerfStats::numActiveCollectors(0);
 thread_local PerfStats PerfStats::threadStats(true);
 
 // This constructor will automatically register a PerfStats structure
@@ -49,21 +51,30 @@ PerfStats::registerStats(PerfStats* stats) {
 
     // First see if this structure is already registered; if so,
     // there is nothing for us to do.
-    for (PerfStats* registered : registeredStats) {
-        if (registered == stats) {
+    int freeSlot = -1;
+    for (int i = 0; i < MAX_REGISTERED_STATS; i++) {
+        PerfStats* registered = registeredStats[i].load();
+        if (registered == stats)
             return;
-        }
+        if (registered == NULL && freeSlot < 0)
+            freeSlot = i;
+    }
+    if (freeSlot < 0) {
+        ARACHNE_LOG(ERROR, "Too many PerfStats registered; at most %d\n",
+                    MAX_REGISTERED_STATS);
+        abort();
     }
 
     // This is a new structure; add it to our list, and reset its contents.
     memset(stats, 0, sizeof(*stats));
-    registeredStats.push_back(stats);
+    registeredStats[freeSlot].store(stats);
 }
 
 /**
  * This method can be called to deregister a PerfStats structure that has been
  * registered using registerStats. It is a no-op if the stat is already
- * deregistered.
+ * deregistered. When it returns, no collectStats call is still reading the
+ * structure, so it may be freed.
  *
  * \param stats
  *      PerfStats structure to drop from usage by collectStats.
@@ -71,15 +82,133 @@ PerfStats::registerStats(PerfStats* stats) {
 void
 PerfStats::deregisterStats(PerfStats* stats) {
     std::lock_guard<SpinLock> lock(mutex);
-    registeredStats.erase(
-        std::remove(registeredStats.begin(), registeredStats.end(), stats),
-        registeredStats.end());
+    for (int i = 0; i < MAX_REGISTERED_STATS; i++) {
+        if (registeredStats[i].load() == stats)
+            registeredStats[i].store(NULL);
+    }
+    // Collectors that started before the store above may still hold the
+    // pointer; later ones cannot see it.
+    while (numActiveCollectors.load() != 0) {
+    }
+}
+
+/**
+ * Take a consistent copy of a PerfStats structure that may be updated
+ * concurrently by its owning thread. The owner is never delayed; instead
+ * this method retries if it overlapped an update.
+ *
+ * \param stats
+ *      The structure to copy.
+ * \param[out] copy
+ *      Filled in with the contents of stats.
+ */
+void
+PerfStats::snapshot(const PerfStats* stats, PerfStats* copy) {
+    while (true) {
+        uint64_t before =
+            __atomic_load_n(&stats->updateSequence, __ATOMIC_ACQUIRE);
+        memcpy(copy, stats, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t after =
+            __atomic_load_n(&stats->updateSequence, __ATOMIC_RELAXED);
+        if (before == after && (before & 1) == 0)
+            return;
+    }
+}
+
+/**
+ * Add the counts from another histogram to this one.
+ */
+void
+LogLinearHistogram::add(const LogLinearHistogram& other) {
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        buckets[i] += other.buckets[i];
+    count += other.count;
+    sum += other.sum;
+}
+
+/**
+ * Remove the counts of an earlier copy of this histogram, leaving only the
+ * values recorded since that copy was taken.
+ */
+void
+LogLinearHistogram::subtract(const LogLinearHistogram& other) {
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        buckets[i] -= other.buckets[i];
+    count -= other.count;
+    sum -= other.sum;
+}
+
+/**
+ * Return an estimate of a percentile of the recorded values.
+ *
+ * \param fraction
+ *      The percentile to compute, between 0 and 1; for example, 0.99 for
+ *      the 99th percentile.
+ * \return
+ *      The lower bound of the bucket holding the value at that rank, or 0 if
+ *      nothing has been recorded.
+ */
+uint64_t
+LogLinearHistogram::percentile(double fraction) const {
+    if (count == 0)
+        return 0;
+    uint64_t rank =
+        static_cast<uint64_t>(fraction * static_cast<double>(count - 1));
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank)
+            return lowerBound(i);
+    }
+    return lowerBound(NUM_BUCKETS - 1);
+}
+
+/**
+ * Add the statistics from one PerfStats structure into an aggregate.
+ */
+static void
+accumulate(PerfStats* total, const PerfStats* stats) {
+    // Note: the order of the statements below should match the
+    // declaration order in PerfStats.h.
+    total->idleCycles += stats->idleCycles;
+    total->totalCycles += stats->totalCycles;
+    total->weightedLoadedCycles += stats->weightedLoadedCycles;
+    total->numThreadsCreated += stats->numThreadsCreated;
+    total->numThreadsFinished += stats->numThreadsFinished;
+    total->numCoreIncrements += stats->numCoreIncrements;
+    total->numCoreDecrements += stats->numCoreDecrements;
+    total->numContendedCreations += stats->numContendedCreations;
+    total->numThreadsStolen += stats->numThreadsStolen;
+    total->numCoreParks += stats->numCoreParks;
+    total->numThreadsMigrated += stats->numThreadsMigrated;
+    total->numPendingThreads += stats->numPendingThreads;
+    total->numBlockingCalls += stats->numBlockingCalls;
+    total->blockingCallThreads += stats->blockingCallThreads;
+    total->blockingCallQueueDepth += stats->blockingCallQueueDepth;
+    total->numIoPolls += stats->numIoPolls;
+    total->numIoCompletions += stats->numIoCompletions;
+    total->ioPollCycles += stats->ioPollCycles;
+    total->numContendedSleepLocks += stats->numContendedSleepLocks;
+    total->numSleepLockSpinAcquisitions +=
+        stats->numSleepLockSpinAcquisitions;
+    total->numSleepLockParks += stats->numSleepLockParks;
+    total->dispatchLatencyCycles.add(stats->dispatchLatencyCycles);
+    total->threadLifetimeCycles.add(stats->threadLifetimeCycles);
+    total->creationRetries.add(stats->creationRetries);
+    total->coreRampDownCycles.add(stats->coreRampDownCycles);
+    total->blockingCallCycles.add(stats->blockingCallCycles);
+    total->wakeupLatencyCycles.add(stats->wakeupLatencyCycles);
+    for (int i = 0; i < PerfStats::NUM_THREAD_CLASSES; i++)
+        total->wakeupLatencyCyclesByClass[i].add(
+            stats->wakeupLatencyCyclesByClass[i]);
 }
 
 /**
  * This method aggregates performance information from all of the
  * PerfStats structures that have been registered via the registerStats
- * method.
+ * method. It never blocks the threads that update those structures, and
+ * it does not block other collectors, so it may be called at a high rate.
  *
  * Note: this function doesn't calculate or fill memory statistics.
  *       See definition of memory stat fields (eg. logMaxBytes) for details.
@@ -90,21 +219,44 @@ PerfStats::deregisterStats(PerfStats* stats) {
  */
 void
 PerfStats::collectStats(PerfStats* total) {
-    std::lock_guard<SpinLock> lock(mutex);
     memset(total, 0, sizeof(*total));
     total->collectionTime = Cycles::rdtsc();
     total->cyclesPerSecond = Cycles::perSecond();
-    for (PerfStats* stats : registeredStats) {
-        // Note: the order of the statements below should match the
-        // declaration order in PerfStats.h.
-        total->idleCycles += stats->idleCycles;
-        total->totalCycles += stats->totalCycles;
-        total->weightedLoadedCycles += stats->weightedLoadedCycles;
-        total->numThreadsCreated += stats->numThreadsCreated;
-        total->numThreadsFinished += stats->numThreadsFinished;
-        total->numCoreIncrements += stats->numCoreIncrements;
-        total->numCoreDecrements += stats->numCoreDecrements;
-        total->numContendedCreations += stats->numContendedCreations;
+    PerfStats copy;
+    numActiveCollectors++;
+    for (int i = 0; i < MAX_REGISTERED_STATS; i++) {
+        PerfStats* stats = registeredStats[i].load();
+        if (stats == NULL)
+            continue;
+        snapshot(stats, &copy);
+        accumulate(total, &copy);
+    }
+    numActiveCollectors--;
+}
+
+/**
+ * Take a consistent copy of each registered PerfStats structure separately,
+ * for instance to report the statistics of each core.
+ *
+ * \param[out] perThread
+ *      Filled in with one entry per registered structure, each of which has
+ *      its collectionTime and cyclesPerSecond set.
+ */
+void
+PerfStats::collectCoreStats(std::vector<PerfStats>* perThread) {
+    perThread->clear();
+    uint64_t collectionTime = Cycles::rdtsc();
+    PerfStats copy;
+    numActiveCollectors++;
+    for (int i = 0; i < MAX_REGISTERED_STATS; i++) {
+        PerfStats* stats = registeredStats[i].load();
+        if (stats == NULL)
+            continue;
+        snapshot(stats, &copy);
+        copy.collectionTime = collectionTime;
+        copy.cyclesPerSecond = Cycles::perSecond();
+        perThread->push_back(copy);
     }
+    numActiveCollectors--;
 }
 }  // namespace Arachne
@@ -0,0 +1,158 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "PriorityScheduler.h"
+#include <string.h>
+#include "PerfUtils/Cycles.h"
+
+namespace Arachne {
+
+using PerfUtils::Cycles;
+
+PriorityScheduler::Policy PriorityScheduler::policy =
+    PriorityScheduler::STRICT_PRIORITY;
+uint64_t PriorityScheduler::starvationLimitNs = 10 * 1000 * 1000;
+uint32_t PriorityScheduler::weights[NUM_PRIORITY_LEVELS] = {8, 4, 2, 1};
+
+/**
+ * Put every context back into level 0 and forget the history of passes.
+ *
+ * \param nowInCycles
+ *     The current time in cycles.
+ */
+void
+PriorityScheduler::reset(uint64_t nowInCycles) {
+    memset(levelMasks, 0, sizeof(levelMasks));
+    levelMasks[0] = ~0UL;
+    for (int i = 0; i < NUM_PRIORITY_LEVELS; i++)
+        lastServedCycles[i] = nowInCycles;
+    memset(credits, 0, sizeof(credits));
+    currentLevel = 0;
+}
+
+/**
+ * Choose the level that the next pass of the dispatch loop serves.
+ *
+ * \param runnable
+ *     The contexts that may be runnable.
+ * \param nowInCycles
+ *     The current time in cycles.
+ * \return
+ *     The contexts that belong to the chosen level; the pass considers only
+ *     these.
+ */
+uint64_t
+PriorityScheduler::startPass(uint64_t runnable, uint64_t nowInCycles) {
+    return levelMasks[chooseLevel(getRunnableLevels(runnable), nowInCycles)];
+}
+
+/**
+ * Choose the level that the next pass of the dispatch loop serves, given
+ * which levels have runnable contexts. Unlike startPass, this does not
+ * consult the levels of this instance's contexts, so that one instance can
+ * choose the level for contexts whose levels are tracked elsewhere.
+ *
+ * \param runnableLevels
+ *     Bit i is set if level i has contexts that may be runnable.
+ * \param nowInCycles
+ *     The current time in cycles.
+ * \return
+ *     The chosen level.
+ */
+int
+PriorityScheduler::chooseLevel(uint32_t runnableLevels, uint64_t nowInCycles) {
+    bool levelRunnable[NUM_PRIORITY_LEVELS];
+    int chosen = -1;
+    for (int i = 0; i < NUM_PRIORITY_LEVELS; i++) {
+        levelRunnable[i] = (runnableLevels >> i) & 1;
+        // A level with nothing to run is not being starved.
+        if (!levelRunnable[i])
+            lastServedCycles[i] = nowInCycles;
+        else if (chosen < 0)
+            chosen = i;
+    }
+    if (chosen < 0) {
+        currentLevel = 0;
+        return 0;
+    }
+
+    if (policy == WEIGHTED) {
+        // Serve the runnable level with the most passes left in this round,
+        // starting a new round once they have all used up their passes.
+        chosen = -1;
+        for (int round = 0; round < 2 && chosen < 0; round++) {
+            for (int i = 0; i < NUM_PRIORITY_LEVELS; i++) {
+                if (levelRunnable[i] && credits[i] > 0 &&
+                    (chosen < 0 || credits[i] > credits[chosen]))
+                    chosen = i;
+            }
+            if (chosen < 0) {
+                for (int i = 0; i < NUM_PRIORITY_LEVELS; i++)
+                    credits[i] = weights[i] > 0 ? weights[i] : 1;
+            }
+        }
+        credits[chosen]--;
+    } else {
+        // Give one pass to the longest-starved less important level, if any.
+        uint64_t starvationLimitCycles = 0;
+        int starved = -1;
+        for (int i = chosen + 1; i < NUM_PRIORITY_LEVELS; i++) {
+            if (!levelRunnable[i])
+                continue;
+            if (starvationLimitCycles == 0)
+                starvationLimitCycles = Cycles::fromNanoseconds(
+                    starvationLimitNs);
+            if (nowInCycles - lastServedCycles[i] > starvationLimitCycles &&
+                (starved < 0 ||
+                 lastServedCycles[i] < lastServedCycles[starved]))
+                starved = i;
+        }
+        if (starved >= 0)
+            chosen = starved;
+    }
+    lastServedCycles[chosen] = nowInCycles;
+    currentLevel = chosen;
+    return chosen;
+}
+
+/**
+ * Make all cores serve the most important runnable level first.
+ *
+ * \param starvationLimitNs
+ *     A less important level with runnable contexts is given a pass once
+ *     it has waited this many nanoseconds.
+ */
+void
+PriorityScheduler::useStrictPriorities(uint64_t starvationLimitNs) {
+    PriorityScheduler::starvationLimitNs = starvationLimitNs;
+    policy = STRICT_PRIORITY;
+}
+
+/**
+ * Make all cores share their time between the levels with runnable contexts
+ * in proportion to the given weights.
+ *
+ * \param weights
+ *     An array of NUM_PRIORITY_LEVELS entries holding the number of passes
+ *     each level gets per round; a weight of 0 is treated as 1.
+ */
+void
+PriorityScheduler::useWeightedPriorities(const uint32_t* weights) {
+    for (int i = 0; i < NUM_PRIORITY_LEVELS; i++)
+        PriorityScheduler::weights[i] = weights[i];
+    policy = WEIGHTED;
+}
+
+}  // namespace Arachne
@@ -0,0 +1,128 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "PerfUtils/Cycles.h"
+#include "PriorityScheduler.h"
+
+namespace Arachne {
+
+using PerfUtils::Cycles;
+
+static const uint64_t DEFAULT_STARVATION_LIMIT_NS = 10 * 1000 * 1000;
+
+TEST(PrioritySchedulerTest, startPass_singleLevel) {
+    PriorityScheduler scheduler;
+    scheduler.reset(0);
+    EXPECT_EQ(~0UL, scheduler.startPass(0x13, 0));
+    EXPECT_EQ(0, scheduler.getCurrentLevel());
+    EXPECT_EQ(~0UL, scheduler.startPass(0, 0));
+}
+
+TEST(PrioritySchedulerTest, startPass_strictPriority) {
+    PriorityScheduler::useStrictPriorities(DEFAULT_STARVATION_LIMIT_NS);
+    PriorityScheduler scheduler;
+    scheduler.reset(0);
+    scheduler.setLevel(1, 2);
+    scheduler.setLevel(4, 2);
+    EXPECT_EQ(~0UL & ~0x12UL, scheduler.startPass(0x3, 0));
+    EXPECT_EQ(0, scheduler.getCurrentLevel());
+    EXPECT_EQ(0x12UL, scheduler.startPass(0x2, 0));
+    EXPECT_EQ(2, scheduler.getCurrentLevel());
+
+    // Moving a context back to level 0 takes it out of level 2.
+    scheduler.setLevel(1, 0);
+    EXPECT_EQ(0x10UL, scheduler.startPass(0x10, 0));
+}
+
+TEST(PrioritySchedulerTest, startPass_starvedLevelGetsOnePass) {
+    PriorityScheduler::useStrictPriorities(1000);
+    PriorityScheduler scheduler;
+    scheduler.reset(0);
+    scheduler.setLevel(1, 1);
+    scheduler.setLevel(2, 3);
+    uint64_t now = 0;
+    scheduler.startPass(0x7, now);
+    EXPECT_EQ(0, scheduler.getCurrentLevel());
+    now += 1;
+    scheduler.startPass(0x7, now);
+    EXPECT_EQ(0, scheduler.getCurrentLevel());
+
+    // Level 3 has nothing to run, so only level 1 is starving.
+    now += Cycles::fromNanoseconds(5000);
+    scheduler.startPass(0x3, now);
+    EXPECT_EQ(1, scheduler.getCurrentLevel());
+    now += 1;
+    scheduler.startPass(0x7, now);
+    EXPECT_EQ(0, scheduler.getCurrentLevel());
+
+    now += Cycles::fromNanoseconds(5000);
+    scheduler.startPass(0x5, now);
+    EXPECT_EQ(3, scheduler.getCurrentLevel());
+    now += 1;
+    scheduler.startPass(0x5, now);
+    EXPECT_EQ(0, scheduler.getCurrentLevel());
+    PriorityScheduler::useStrictPriorities(DEFAULT_STARVATION_LIMIT_NS);
+}
+
+TEST(PrioritySchedulerTest, startPass_weighted) {
+    uint32_t weights[PriorityScheduler::NUM_PRIORITY_LEVELS] = {3, 1, 0, 0};
+    PriorityScheduler::useWeightedPriorities(weights);
+    PriorityScheduler scheduler;
+    scheduler.reset(0);
+    scheduler.setLevel(1, 1);
+    scheduler.setLevel(2, 2);
+    int passes[PriorityScheduler::NUM_PRIORITY_LEVELS] = {0, 0, 0, 0};
+    for (int i = 0; i < 40; i++) {
+        scheduler.startPass(0x3, 0);
+        passes[scheduler.getCurrentLevel()]++;
+    }
+    EXPECT_EQ(30, passes[0]);
+    EXPECT_EQ(10, passes[1]);
+
+    // Levels without runnable contexts do not use up their share.
+    scheduler.startPass(0x4, 0);
+    EXPECT_EQ(2, scheduler.getCurrentLevel());
+    PriorityScheduler::useStrictPriorities(DEFAULT_STARVATION_LIMIT_NS);
+}
+
+TEST(PrioritySchedulerTest, chooseLevel_acrossGroups) {
+    PriorityScheduler::useStrictPriorities(DEFAULT_STARVATION_LIMIT_NS);
+    PriorityScheduler coreScheduler;
+    PriorityScheduler groups[2];
+    groups[0].setLevel(0, 2);
+    groups[1].setLevel(3, 1);
+    uint32_t runnableLevels = groups[0].getRunnableLevels(0x3) |
+                              groups[1].getRunnableLevels(0x8);
+    EXPECT_EQ(0x7U, runnableLevels);
+
+    // Level 0 is served in both groups before either of the others.
+    int level = coreScheduler.chooseLevel(runnableLevels, 0);
+    EXPECT_EQ(0, level);
+    EXPECT_EQ(~0x1UL, groups[0].getLevelMask(level));
+    EXPECT_EQ(~0x8UL, groups[1].getLevelMask(level));
+
+    // Without level 0, group 0 waits for group 1's level 1.
+    runnableLevels = groups[0].getRunnableLevels(0x1) |
+                     groups[1].getRunnableLevels(0x8);
+    level = coreScheduler.chooseLevel(runnableLevels, 0);
+    EXPECT_EQ(1, level);
+    EXPECT_EQ(1, coreScheduler.getCurrentLevel());
+    EXPECT_EQ(0UL, groups[0].getLevelMask(level) & 0x1);
+    EXPECT_EQ(0x8UL, groups[1].getLevelMask(level));
+}
+
+}  // namespace Arachne
@@ -0,0 +1,187 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TASKGROUP_H_
+#define TASKGROUP_H_
+
+#include <mutex>
+#include "Arachne.h"
+#include "Future.h"
+
+namespace Arachne {
+
+/**
+ * Runs a set of tasks on their own Arachne threads and collects their
+ * results, for fan-out/fan-in code such as scatter-gather requests. The
+ * results live in slots allocated once, when the group is constructed, so
+ * spawning a task allocates no memory beyond its thread. Each completion
+ * wakes the waiting thread at most once, with no join per task.
+ *
+ * A TaskGroup must be used by a single Arachne thread, which spawns the
+ * tasks and waits for them; the destructor waits for every task that is
+ * still running.
+ *
+ * \tparam T
+ *     The type returned by the tasks, or void.
+ */
+template <typename T>
+class TaskGroup {
+  public:
+    /**
+     * Construct an empty group.
+     *
+     * \param maxTasks
+     *     The largest number of tasks that can be spawned in the group.
+     */
+    explicit TaskGroup(uint32_t maxTasks)
+        : maxTasks(maxTasks),
+          results(new FutureValue<T>[maxTasks]),
+          completionOrder(new uint32_t[maxTasks]),
+          numSpawned(0),
+          numCompleted(0),
+          numReported(0),
+          lock("taskgroup", false),
+          completion() {}
+
+    ~TaskGroup() {
+        waitAll();
+        delete[] results;
+        delete[] completionOrder;
+    }
+
+    /**
+     * Run a task on a new thread, created as by createThreadOrQueue, so
+     * that the task waits for a context on a full core if
+     * pendingThreadQueueDepth allows it.
+     *
+     * \param __f
+     *     The main function for the task; its return value is the task's
+     *     result.
+     * \param __args
+     *     The arguments for __f; see createThreadWithClass for restrictions.
+     * \return
+     *     The index of the task within the group, which identifies it in
+     *     waitAny and get, or -1 if the group is full or the thread could
+     *     be neither created nor queued.
+     */
+    template <typename _Callable, typename... _Args>
+    int
+    spawn(_Callable&& __f, _Args&&... __args) {
+        if (numSpawned == maxTasks)
+            return -1;
+        uint32_t index = numSpawned;
+        if (!createThreadOrQueue(&TaskGroup::runTask<
+                                     typename std::decay<_Callable>::type,
+                                     typename std::decay<_Args>::type...>,
+                                 this, index, __f, __args...))
+            return -1;
+        numSpawned++;
+        return static_cast<int>(index);
+    }
+
+    /**
+     * Block the current thread until every spawned task has finished.
+     */
+    void
+    waitAll() {
+        std::unique_lock<SpinLock> guard(lock);
+        while (numCompleted != numSpawned)
+            completion.wait(guard);
+    }
+
+    /**
+     * Block the current thread until a task finishes that no previous call
+     * has returned, and return it. Tasks are returned in the order in which
+     * they finished.
+     *
+     * \return
+     *     The index of the task, or -1 if every spawned task has already been
+     *     returned.
+     */
+    int
+    waitAny() {
+        std::unique_lock<SpinLock> guard(lock);
+        if (numReported == numSpawned)
+            return -1;
+        while (numReported == numCompleted)
+            completion.wait(guard);
+        return static_cast<int>(completionOrder[numReported++]);
+    }
+
+    /**
+     * Return the result of a finished task, moving it out of the group; may
+     * be called once per task, after waitAll or after waitAny has returned
+     * the task.
+     *
+     * \param index
+     *     The index returned by spawn.
+     */
+    T
+    get(int index) {
+        return results[index].take();
+    }
+
+    /**
+     * Return the number of tasks spawned so far.
+     */
+    uint32_t
+    size() const {
+        return numSpawned;
+    }
+
+  private:
+    /**
+     * The main function of the thread of each task: run the task, store its
+     * result and wake the waiting thread.
+     */
+    template <typename _Callable, typename... _Args>
+    static void
+    runTask(TaskGroup* group, uint32_t index, _Callable __f,
+            _Args... __args) {
+        group->results[index].emplaceResult(__f, __args...);
+        std::lock_guard<SpinLock> guard(group->lock);
+        group->completionOrder[group->numCompleted++] = index;
+        group->completion.notifyOne();
+    }
+
+    /// The number of elements of results and completionOrder.
+    const uint32_t maxTasks;
+
+    /// The result of each task, by index.
+    FutureValue<T>* results;
+
+    /// The indices of the finished tasks, in the order in which they
+    /// finished; the first numCompleted are valid.
+    uint32_t* completionOrder;
+
+    /// The number of tasks spawned; also the index of the next one.
+    uint32_t numSpawned;
+
+    /// The number of tasks that have finished.
+    uint32_t numCompleted;
+
+    /// The number of finished tasks returned by waitAny.
+    uint32_t numReported;
+
+    /// Protects numCompleted, completionOrder and completion.
+    SpinLock lock;
+
+    /// Notified each time a task finishes.
+    ConditionVariable completion;
+    DISALLOW_COPY_AND_ASSIGN(TaskGroup);
+};
+
+}  // namespace Arachne
+#endif  // TASKGROUP_H_
@@ -0,0 +1,118 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "TimerWheel.h"
+#include <string.h>
+#include <algorithm>
+
+namespace Arachne {
+
+/**
+ * Remove all entries from the wheel and restart its clock.
+ *
+ * \param nowInCycles
+ *     The current time in cycles.
+ */
+void
+TimerWheel::reset(uint64_t nowInCycles) {
+    currentTick = nowInCycles >> TICK_SHIFT;
+    memset(buckets, 0, sizeof(buckets));
+    memset(nonEmptyBuckets, 0, sizeof(nonEmptyBuckets));
+    for (int i = 0; i < MAX_ENTRIES; i++)
+        positions[i] = NOT_PRESENT;
+}
+
+/**
+ * Move the wheel forward to the given time and remove the entries in every
+ * bucket that has been passed.
+ *
+ * \param nowInCycles
+ *     The current time in cycles. Times earlier than a previous call are
+ *     ignored.
+ * \return
+ *     The set of entries removed, as a bitmask of indices. This includes
+ *     every entry whose deadline has passed, but may also include entries
+ *     that are not yet due and must be re-inserted by the caller.
+ */
+uint64_t
+TimerWheel::advance(uint64_t nowInCycles) {
+    uint64_t newTick = nowInCycles >> TICK_SHIFT;
+    if (newTick <= currentTick)
+        return 0;
+
+    uint64_t expired = 0;
+    for (int level = 0; level < LEVELS; level++) {
+        uint64_t oldPosition = currentTick >> (6 * level);
+        uint64_t newPosition = newTick >> (6 * level);
+        // Higher levels move more slowly, so none of them moved either.
+        if (oldPosition == newPosition)
+            break;
+
+        // Compute the set of buckets for positions in
+        // (oldPosition, newPosition].
+        uint64_t passed = ~0UL;
+        uint64_t distance = newPosition - oldPosition;
+        if (distance < BUCKETS_PER_LEVEL) {
+            uint64_t run = (1UL << distance) - 1;
+            int first =
+                static_cast<int>((oldPosition + 1) & (BUCKETS_PER_LEVEL - 1));
+            passed = first ? (run << first) | (run >> (64 - first)) : run;
+        }
+        passed &= nonEmptyBuckets[level];
+        nonEmptyBuckets[level] &= ~passed;
+        while (passed) {
+            int bucket = __builtin_ctzll(passed);
+            passed &= passed - 1;
+            expired |= buckets[level][bucket];
+            buckets[level][bucket] = 0;
+        }
+    }
+    currentTick = newTick;
+
+    for (uint64_t entries = expired; entries; entries &= entries - 1)
+        positions[__builtin_ctzll(entries)] = NOT_PRESENT;
+    return expired;
+}
+
+/**
+ * Return the earliest time at which advance() may return an entry; an entry
+ * that is due no later than this time may be returned early, so this is a
+ * lower bound on the earliest deadline in the wheel.
+ *
+ * \return
+ *     The time in cycles, or ~0 if the wheel is empty.
+ */
+uint64_t
+TimerWheel::nextExpiryInCycles() {
+    uint64_t nextTick = ~0UL;
+    for (int level = 0; level < LEVELS; level++) {
+        if (!nonEmptyBuckets[level])
+            continue;
+        // Rotate the buckets so that bit d - 1 stands for the bucket that
+        // is d positions past the current one.
+        uint64_t position = currentTick >> (6 * level);
+        int first = static_cast<int>((position + 1) & (BUCKETS_PER_LEVEL - 1));
+        uint64_t rotated = first ? (nonEmptyBuckets[level] >> first) |
+                                       (nonEmptyBuckets[level] << (64 - first))
+                                 : nonEmptyBuckets[level];
+        uint64_t distance = static_cast<uint64_t>(__builtin_ctzll(rotated)) + 1;
+        nextTick = std::min(nextTick, (position + distance) << (6 * level));
+    }
+    if (nextTick > (~0UL >> TICK_SHIFT))
+        return ~0UL;
+    return nextTick << TICK_SHIFT;
+}
+
+}  // namespace Arachne
@@ -0,0 +1,179 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+#include <stdint.h>
+
+namespace Arachne {
+
+/**
+ * A hierarchical timer wheel holding the sleeping contexts of a single core.
+ * Entries are identified by their index in the core's localThreadContexts
+ * and each bucket is a bitmask of such indices, so insertion, cancellation
+ * and expiry never allocate memory.
+ *
+ * Time is measured in ticks of 2^TICK_SHIFT cycles. Level k of the wheel
+ * holds deadlines that differ from the current tick first in bits
+ * [6k, 6k + 6), so an entry is moved at most LEVELS - 1 times before it
+ * expires, and advancing the wheel touches only the buckets whose ticks have
+ * passed.
+ *
+ * The wheel does not remember deadlines; it only promises that an entry is
+ * returned by the first advance() that reaches the tick after its deadline.
+ * Entries may also be returned early (because they sat in a coarse bucket),
+ * and the caller re-inserts those using the deadline it keeps elsewhere.
+ *
+ * This class is not thread-safe and is meant to be used only by the core
+ * that owns it.
+ */
+class TimerWheel {
+  public:
+    /**
+     * log2 of the number of cycles in one tick of the wheel.
+     */
+    static const int TICK_SHIFT = 10;
+
+    /**
+     * Number of buckets in each level of the wheel.
+     */
+    static const int BUCKETS_PER_LEVEL = 64;
+
+    /**
+     * Number of levels in the wheel. Deadlines beyond the range of the top
+     * level are parked in its farthest bucket and re-inserted when they come
+     * back.
+     */
+    static const int LEVELS = 6;
+
+    /**
+     * Largest number of distinct entries the wheel can hold; entry indices
+     * must be smaller than this.
+     */
+    static const int MAX_ENTRIES = 64;
+
+    TimerWheel() { reset(0); }
+    void reset(uint64_t nowInCycles);
+    uint64_t advance(uint64_t nowInCycles);
+    uint64_t nextExpiryInCycles();
+
+    /**
+     * Arrange for the entry at index to be returned by advance() once
+     * deadlineInCycles has passed, replacing any earlier deadline for the
+     * same index.
+     *
+     * \param index
+     *     Identifies the entry; must be less than MAX_ENTRIES.
+     * \param deadlineInCycles
+     *     The time, in cycles, at which the entry expires.
+     */
+    void
+    insert(uint8_t index, uint64_t deadlineInCycles) {
+        cancel(index);
+        uint64_t tick = deadlineInCycles >> TICK_SHIFT;
+        // Deadlines that are already due fire on the next tick.
+        if (tick <= currentTick)
+            tick = currentTick + 1;
+        // The level is determined by the most significant 6-bit digit in
+        // which the deadline differs from the current tick.
+        int level = (63 - __builtin_clzll(tick ^ currentTick)) / 6;
+        uint64_t bucket;
+        if (level < LEVELS) {
+            bucket = (tick >> (6 * level)) & (BUCKETS_PER_LEVEL - 1);
+        } else {
+            // Too far in the future; use the last bucket to come around at
+            // the top level.
+            level = LEVELS - 1;
+            bucket = ((currentTick >> (6 * level)) - 1) &
+                     (BUCKETS_PER_LEVEL - 1);
+        }
+        buckets[level][bucket] |= 1UL << index;
+        nonEmptyBuckets[level] |= 1UL << bucket;
+        positions[index] = static_cast<uint16_t>(level * BUCKETS_PER_LEVEL +
+                                                 static_cast<int>(bucket));
+    }
+
+    /**
+     * Remove the entry at index from the wheel, if it is present.
+     *
+     * \param index
+     *     Identifies the entry; must be less than MAX_ENTRIES.
+     */
+    void
+    cancel(uint8_t index) {
+        uint16_t position = positions[index];
+        if (position == NOT_PRESENT)
+            return;
+        int level = position / BUCKETS_PER_LEVEL;
+        int bucket = position % BUCKETS_PER_LEVEL;
+        buckets[level][bucket] &= ~(1UL << index);
+        if (!buckets[level][bucket])
+            nonEmptyBuckets[level] &= ~(1UL << bucket);
+        positions[index] = NOT_PRESENT;
+    }
+
+    /**
+     * Return true if the entry at index is waiting in the wheel.
+     */
+    bool
+    contains(uint8_t index) {
+        return positions[index] != NOT_PRESENT;
+    }
+
+    /**
+     * Return true if no entries are waiting in the wheel.
+     */
+    bool
+    empty() {
+        for (int level = 0; level < LEVELS; level++)
+            if (nonEmptyBuckets[level])
+                return false;
+        return true;
+    }
+
+  private:
+    /**
+     * Value of positions[i] when entry i is not in the wheel.
+     */
+    static const uint16_t NOT_PRESENT = 0xFFFF;
+
+    /**
+     * The tick up to which advance() has expired entries.
+     */
+    uint64_t currentTick;
+
+    /**
+     * buckets[level][bucket] is the set of entries in that bucket.
+     */
+    uint64_t buckets[LEVELS][BUCKETS_PER_LEVEL];
+
+    /**
+     * Bit b of nonEmptyBuckets[level] is set iff buckets[level][b] is
+     * not empty, so that advancing over idle buckets is cheap.
+     */
+    uint64_t nonEmptyBuckets[LEVELS];
+
+    /**
+     * The bucket holding each entry, encoded as
+     * level * BUCKETS_PER_LEVEL + bucket, or NOT_PRESENT. This makes
+     * cancellation O(1).
+     */
+    uint16_t positions[MAX_ENTRIES];
+};
+
+}  // namespace Arachne
+
+#endif  // TIMERWHEEL_H_
@@ -0,0 +1,138 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+
+#include "TimerWheel.h"
+
+namespace Arachne {
+
+static const uint64_t TICK = 1UL << TimerWheel::TICK_SHIFT;
+
+/**
+ * Advance the wheel one tick at a time up to end, re-inserting early entries
+ * as dispatch() does, and return the time at which index expired.
+ */
+static uint64_t
+runUntilExpired(TimerWheel* wheel, uint64_t start, uint64_t end,
+                uint8_t index, uint64_t deadline) {
+    for (uint64_t now = start; now <= end; now += TICK) {
+        uint64_t expired = wheel->advance(now);
+        if (expired & (1UL << index)) {
+            if (deadline <= now)
+                return now;
+            wheel->insert(index, deadline);
+        }
+    }
+    return 0;
+}
+
+TEST(TimerWheelTest, insert_dueEntryFiresOnNextTick) {
+    TimerWheel wheel;
+    wheel.reset(100 * TICK);
+    wheel.insert(3, 50 * TICK);
+    EXPECT_TRUE(wheel.contains(3));
+    EXPECT_EQ(0U, wheel.advance(100 * TICK));
+    EXPECT_EQ(1UL << 3, wheel.advance(101 * TICK));
+    EXPECT_FALSE(wheel.contains(3));
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimerWheelTest, insert_replacesPreviousDeadline) {
+    TimerWheel wheel;
+    wheel.reset(0);
+    wheel.insert(5, 10 * TICK);
+    wheel.insert(5, 1000 * TICK);
+    EXPECT_EQ(0U, wheel.advance(10 * TICK));
+    EXPECT_TRUE(wheel.contains(5));
+}
+
+TEST(TimerWheelTest, cancel) {
+    TimerWheel wheel;
+    wheel.reset(0);
+    wheel.insert(1, 10 * TICK);
+    wheel.insert(2, 10 * TICK);
+    wheel.cancel(1);
+    wheel.cancel(1);
+    EXPECT_FALSE(wheel.contains(1));
+    EXPECT_EQ(1UL << 2, wheel.advance(20 * TICK));
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimerWheelTest, advance_cascadesThroughLevels) {
+    // Deadlines spanning several levels, including one that crosses a
+    // boundary between top-level buckets.
+    uint64_t start = 4000 * TICK + 17;
+    uint64_t delays[] = {1, 63, 64, 65, 4095, 4097, 300000};
+    for (uint64_t delay : delays) {
+        TimerWheel wheel;
+        wheel.reset(start);
+        uint64_t deadline = start + delay * TICK;
+        wheel.insert(7, deadline);
+        uint64_t firedAt =
+            runUntilExpired(&wheel, start, deadline + 2 * TICK, 7, deadline);
+        EXPECT_LE(deadline, firedAt) << "delay " << delay;
+        EXPECT_GE(deadline + TICK, firedAt) << "delay " << delay;
+    }
+}
+
+TEST(TimerWheelTest, advance_largeJump) {
+    TimerWheel wheel;
+    wheel.reset(0);
+    wheel.insert(0, 10 * TICK);
+    wheel.insert(1, 5000 * TICK);
+    wheel.insert(2, (1UL << 40) * TICK);
+    uint64_t expired = wheel.advance(1000000 * TICK);
+    EXPECT_EQ(3UL, expired & 3UL);
+    EXPECT_TRUE(wheel.contains(2));
+}
+
+TEST(TimerWheelTest, nextExpiryInCycles) {
+    TimerWheel wheel;
+    uint64_t start = 4000 * TICK + 17;
+    wheel.reset(start);
+    EXPECT_EQ(~0UL, wheel.nextExpiryInCycles());
+
+    // Deadlines in level 0 are exact to the tick.
+    wheel.insert(3, start + 5 * TICK);
+    EXPECT_EQ(4005 * TICK, wheel.nextExpiryInCycles());
+    EXPECT_EQ(0U, wheel.advance(4004 * TICK));
+    EXPECT_EQ(1UL << 3, wheel.advance(wheel.nextExpiryInCycles()));
+
+    // Coarser buckets give a lower bound, which is never late.
+    uint64_t deadline = start + 1000 * TICK;
+    wheel.insert(4, deadline);
+    uint64_t expiry = wheel.nextExpiryInCycles();
+    EXPECT_GE(deadline, expiry);
+    EXPECT_LT(start, expiry);
+    EXPECT_EQ(1UL << 4, wheel.advance(expiry));
+}
+
+TEST(TimerWheelTest, insert_beyondTopLevel) {
+    TimerWheel wheel;
+    wheel.reset(0);
+    uint64_t deadline = ~0UL - 1;
+    wheel.insert(9, deadline);
+    // The entry comes back early from the top level and is re-inserted.
+    uint64_t topLevelSpan = 1UL << (6 * TimerWheel::LEVELS +
+                                    TimerWheel::TICK_SHIFT);
+    uint64_t expired = wheel.advance(topLevelSpan);
+    EXPECT_EQ(1UL << 9, expired);
+    wheel.insert(9, deadline);
+    EXPECT_TRUE(wheel.contains(9));
+    EXPECT_EQ(0U, wheel.advance(topLevelSpan + TICK));
+}
+
+}  // namespace Arachne
@@ -0,0 +1,309 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "TopologyAwareCoreManager.h"
+#include <sched.h>
+#include <stdio.h>
+#include <string>
+
+namespace Arachne {
+
+/**
+ * Read the first integer in a sysfs file, such as physical_package_id or a
+ * CPU list like "0-3,8-11".
+ *
+ * \param path
+ *     The file to read.
+ * \return
+ *     The integer, or -1 if the file does not exist or does not start with
+ *     one.
+ */
+static int
+readFirstInteger(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == NULL)
+        return -1;
+    int value;
+    if (fscanf(file, "%d", &value) != 1)
+        value = -1;
+    fclose(file);
+    return value;
+}
+
+/**
+ * Replace the contents of list with the given cores. The new entries are
+ * written before the size, so that concurrent migrations see either list
+ * entries or stale core ids, as with sharedCores.
+ */
+static void
+refill(CoreList* list, const std::vector<int>& cores) {
+    for (uint32_t i = 0; i < cores.size(); i++)
+        list->cores[i] = cores[i];
+    list->numFilled = static_cast<uint16_t>(cores.size());
+}
+
+/**
+ * Construct a TopologyAwareCoreManager.
+ *
+ * \param minNumCores
+ *     The minimum number of cores that the application needs to run
+ *     effectively.
+ * \param maxNumCores
+ *     The maximum number of cores that Arachne will use.
+ * \param estimateLoad
+ *     Whether to adjust the number of cores according to load.
+ * \param sysfsCpuRoot
+ *     The directory to read the topology of each CPU from; tests substitute
+ *     their own.
+ */
+TopologyAwareCoreManager::TopologyAwareCoreManager(int minNumCores,
+                                                   int maxNumCores,
+                                                   bool estimateLoad,
+                                                   const char* sysfsCpuRoot)
+    : DefaultCoreManager(minNumCores, maxNumCores, estimateLoad),
+      sysfsCpuRoot(sysfsCpuRoot),
+      topologies(maxNumCores, CpuTopology{-1, -1, -1, -1}),
+      socketCores(),
+      socketSnapshots(MAX_SOCKETS),
+      nearSnapshots(maxNumCores),
+      preferredSocket(-1),
+      lastReleasedSocket(-1) {
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        socketCores.push_back(new CoreList(maxNumCores));
+        socketSnapshots[i] = new CoreList(maxNumCores);
+    }
+    for (int i = 0; i < maxNumCores; i++)
+        nearSnapshots[i] = new CoreList(maxNumCores);
+}
+
+TopologyAwareCoreManager::~TopologyAwareCoreManager() {
+    for (CoreList* list : socketCores)
+        delete list;
+    for (std::atomic<CoreList*>& snapshot : socketSnapshots)
+        delete snapshot.load();
+    for (std::atomic<CoreList*>& snapshot : nearSnapshots)
+        delete snapshot.load();
+}
+
+/**
+ * Learn the topology of the CPU on which the calling kernel thread runs, and
+ * add its core to the pool for general scheduling.
+ */
+void
+TopologyAwareCoreManager::coreAvailable(int myCoreId) {
+    // A core can also be handed back from another core when its release
+    // fails; it is still where it was when it was first seen.
+    CpuTopology topology = getTopology(myCoreId);
+    if (myCoreId == core.kernelThreadId) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0)
+            topology = readCpuTopology(sysfsCpuRoot, cpu);
+    }
+    coreAvailable(myCoreId, topology);
+}
+
+/**
+ * Add the given core to the pool for general scheduling, recording that it
+ * has the given topology.
+ */
+void
+TopologyAwareCoreManager::coreAvailable(int myCoreId,
+                                        const CpuTopology& topology) {
+    {
+        Lock guard(lock);
+        topologies[myCoreId] = topology;
+        if (topology.socket >= MAX_SOCKETS) {
+            ARACHNE_LOG(WARNING,
+                        "Core %d is on socket %d; treating its socket as "
+                        "unknown\n",
+                        myCoreId, topology.socket);
+            topologies[myCoreId].socket = -1;
+        }
+    }
+    DefaultCoreManager::coreAvailable(myCoreId);
+}
+
+/**
+ * Choose a core to give back to the core arbiter and return its coreId, or -1
+ * if there are no cores available for descheduling. Cores off the preferred
+ * socket go first, then cores whose hyperthread sibling is also in use, since
+ * losing those costs the least; ties go to the most recently added core.
+ */
+int
+TopologyAwareCoreManager::coreUnavailable() {
+    Lock guard(lock);
+    if (sharedCores.size() == 0)
+        return -1;
+    int victim = -1;
+    int victimScore = -1;
+    for (int i = static_cast<int>(sharedCores.size()) - 1; i >= 0; i--) {
+        const CpuTopology& topology = topologies[sharedCores[i]];
+        int score = 0;
+        if (preferredSocket >= 0 && topology.socket != preferredSocket)
+            score += 2;
+        for (uint32_t j = 0; j < sharedCores.size(); j++) {
+            if (static_cast<int>(j) != i && topology.physicalCore >= 0 &&
+                topologies[sharedCores[j]].physicalCore ==
+                    topology.physicalCore) {
+                score += 1;
+                break;
+            }
+        }
+        if (score > victimScore) {
+            victim = i;
+            victimScore = score;
+        }
+    }
+    int freeCoreId = sharedCores[victim];
+    lastReleasedSocket = topologies[freeCoreId].socket;
+    sharedCores.remove(victim);
+    sharedCoresChanged();
+    return freeCoreId;
+}
+
+/**
+ * Invoked by Arachne::createThread to get cores available for a particular
+ * threadClass. Returns NULL if an invalid threadClass is passed in.
+ */
+CoreList*
+TopologyAwareCoreManager::getCores(int threadClass) {
+    if (threadClass >= NEAR_CORE) {
+        int coreId = threadClass - NEAR_CORE;
+        if (coreId >= maxNumCores)
+            return NULL;
+        CoreList* cores = nearSnapshots[coreId].load(std::memory_order_acquire);
+        if (cores->size() > 0)
+            return cores;
+        int socket = topologies[coreId].socket;
+        if (socket >= 0) {
+            cores = socketSnapshots[socket].load(std::memory_order_acquire);
+            if (cores->size() > 0)
+                return cores;
+        }
+        return DefaultCoreManager::getCores(DEFAULT);
+    }
+    if (threadClass >= ON_SOCKET) {
+        int socket = threadClass - ON_SOCKET;
+        if (socket >= MAX_SOCKETS)
+            return NULL;
+        return socketSnapshots[socket].load(std::memory_order_acquire);
+    }
+    return DefaultCoreManager::getCores(threadClass);
+}
+
+/**
+ * Provide a set of cores for Arachne to migrate threads to when cleaning up a
+ * core for return to the CoreArbiter; cores on the same socket are preferred.
+ */
+CoreList*
+TopologyAwareCoreManager::getMigrationTargets() {
+    int socket = lastReleasedSocket;
+    if (socket >= 0 && socketCores[socket]->size() > 0)
+        return socketCores[socket];
+    return &sharedCores;
+}
+
+/**
+ * Keep the cores on the given socket for as long as possible when the number
+ * of cores shrinks.
+ *
+ * \param socket
+ *     The preferred socket, or -1 to have no preference.
+ */
+void
+TopologyAwareCoreManager::setPreferredSocket(int socket) {
+    Lock guard(lock);
+    preferredSocket = socket;
+}
+
+/**
+ * Return the topology recorded for the given core; its fields are -1 if the
+ * core has never been available.
+ */
+CpuTopology
+TopologyAwareCoreManager::getTopology(int coreId) {
+    Lock guard(lock);
+    return topologies[coreId];
+}
+
+/**
+ * Read the topology of a CPU from sysfs.
+ *
+ * \param sysfsCpuRoot
+ *     The directory containing one cpuN subdirectory per CPU, normally
+ *     /sys/devices/system/cpu.
+ * \param cpu
+ *     The id of the CPU.
+ * \return
+ *     The topology of the CPU; fields that cannot be read are -1.
+ */
+CpuTopology
+TopologyAwareCoreManager::readCpuTopology(const char* sysfsCpuRoot, int cpu) {
+    std::string cpuDir =
+        std::string(sysfsCpuRoot) + "/cpu" + std::to_string(cpu);
+    CpuTopology topology;
+    topology.cpu = cpu;
+    topology.socket =
+        readFirstInteger(cpuDir + "/topology/physical_package_id");
+    topology.physicalCore =
+        readFirstInteger(cpuDir + "/topology/thread_siblings_list");
+
+    // The last-level cache is the cache index with the highest level.
+    topology.cacheDomain = -1;
+    int highestLevel = -1;
+    for (int index = 0;; index++) {
+        std::string cacheDir =
+            cpuDir + "/cache/index" + std::to_string(index);
+        int level = readFirstInteger(cacheDir + "/level");
+        if (level < 0)
+            break;
+        if (level > highestLevel) {
+            highestLevel = level;
+            topology.cacheDomain =
+                readFirstInteger(cacheDir + "/shared_cpu_list");
+        }
+    }
+    return topology;
+}
+
+/**
+ * Rebuild the per-socket and per-cache views of sharedCores, and publish
+ * those that changed.
+ */
+void
+TopologyAwareCoreManager::sharedCoresChanged() {
+    DefaultCoreManager::sharedCoresChanged();
+    std::vector<int> cores;
+    for (int socket = 0; socket < MAX_SOCKETS; socket++) {
+        cores.clear();
+        for (uint32_t i = 0; i < sharedCores.size(); i++)
+            if (topologies[sharedCores[i]].socket == socket)
+                cores.push_back(sharedCores[i]);
+        refill(socketCores[socket], cores);
+        publish(&socketSnapshots[socket], *socketCores[socket]);
+    }
+    CoreList nearCores(maxNumCores);
+    for (int coreId = 0; coreId < maxNumCores; coreId++) {
+        cores.clear();
+        int cacheDomain = topologies[coreId].cacheDomain;
+        for (uint32_t i = 0; i < sharedCores.size() && cacheDomain >= 0; i++)
+            if (topologies[sharedCores[i]].cacheDomain == cacheDomain)
+                cores.push_back(sharedCores[i]);
+        refill(&nearCores, cores);
+        publish(&nearSnapshots[coreId], nearCores);
+    }
+}
+
+}  // namespace Arachne
@@ -0,0 +1,159 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <string>
+#include "gtest/gtest.h"
+
+#include "TopologyAwareCoreManager.h"
+
+namespace Arachne {
+
+/**
+ * Write contents to the file at path, creating its parent directories.
+ */
+static void
+writeFile(const std::string& path, const char* contents) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos;
+         slash = path.find('/', slash + 1))
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    FILE* file = fopen(path.c_str(), "w");
+    ASSERT_TRUE(file != NULL);
+    fputs(contents, file);
+    fclose(file);
+}
+
+/**
+ * Two sockets with two physical cores of two hyperthreads each; CPUs
+ * 0, 1, 4, 5 are on socket 0 and 0/4 and 1/5 are siblings.
+ */
+static const CpuTopology testTopology[] = {
+    {0, 0, 0, 0}, {1, 0, 0, 1}, {2, 1, 2, 2}, {3, 1, 2, 3},
+    {4, 0, 0, 0}, {5, 0, 0, 1}, {6, 1, 2, 2}, {7, 1, 2, 3}};
+
+TEST(TopologyAwareCoreManagerTest, readCpuTopology) {
+    char root[] = "/tmp/ArachneSysfsXXXXXX";
+    ASSERT_TRUE(mkdtemp(root) != NULL);
+    std::string cpu = std::string(root) + "/cpu3";
+    writeFile(cpu + "/topology/physical_package_id", "1\n");
+    writeFile(cpu + "/topology/thread_siblings_list", "3,7\n");
+    writeFile(cpu + "/cache/index0/level", "1\n");
+    writeFile(cpu + "/cache/index0/shared_cpu_list", "3,7\n");
+    writeFile(cpu + "/cache/index1/level", "3\n");
+    writeFile(cpu + "/cache/index1/shared_cpu_list", "2-3,6-7\n");
+    writeFile(cpu + "/cache/index2/level", "2\n");
+    writeFile(cpu + "/cache/index2/shared_cpu_list", "3,7\n");
+
+    CpuTopology topology =
+        TopologyAwareCoreManager::readCpuTopology(root, 3);
+    EXPECT_EQ(3, topology.cpu);
+    EXPECT_EQ(1, topology.socket);
+    EXPECT_EQ(2, topology.cacheDomain);
+    EXPECT_EQ(3, topology.physicalCore);
+
+    topology = TopologyAwareCoreManager::readCpuTopology(root, 4);
+    EXPECT_EQ(4, topology.cpu);
+    EXPECT_EQ(-1, topology.socket);
+    EXPECT_EQ(-1, topology.cacheDomain);
+    EXPECT_EQ(-1, topology.physicalCore);
+
+    std::string command = std::string("rm -rf ") + root;
+    EXPECT_EQ(0, system(command.c_str()));
+}
+
+TEST(TopologyAwareCoreManagerTest, getCores_onSocket) {
+    TopologyAwareCoreManager manager(1, 8, false);
+    for (int i = 0; i < 8; i++)
+        manager.coreAvailable(i, testTopology[i]);
+
+    CoreList* cores = manager.getCores(TopologyAwareCoreManager::onSocket(1));
+    ASSERT_EQ(4U, cores->size());
+    EXPECT_EQ(2, cores->get(0));
+    EXPECT_EQ(3, cores->get(1));
+    EXPECT_EQ(6, cores->get(2));
+    EXPECT_EQ(7, cores->get(3));
+
+    EXPECT_EQ(0U,
+              manager.getCores(TopologyAwareCoreManager::onSocket(2))->size());
+    EXPECT_TRUE(manager.getCores(TopologyAwareCoreManager::onSocket(
+                    TopologyAwareCoreManager::MAX_SOCKETS)) == NULL);
+    EXPECT_EQ(8U, manager.getCores(DefaultCoreManager::DEFAULT)->size());
+}
+
+TEST(TopologyAwareCoreManagerTest, getCores_nearCore) {
+    TopologyAwareCoreManager manager(1, 8, false);
+    manager.coreAvailable(0, {0, 0, 0, 0});
+    manager.coreAvailable(1, {1, 0, 1, 1});
+    manager.coreAvailable(2, {2, 1, 2, 2});
+    manager.coreAvailable(3, {3, -1, -1, -1});
+    manager.coreAvailable(4, {4, 0, 4, 4});
+    EXPECT_EQ(4, manager.coreUnavailable());
+
+    // Cores sharing a last-level cache come first.
+    CoreList* cores = manager.getCores(TopologyAwareCoreManager::nearCore(2));
+    ASSERT_EQ(1U, cores->size());
+    EXPECT_EQ(2, cores->get(0));
+
+    // Then the other cores on the same socket.
+    cores = manager.getCores(TopologyAwareCoreManager::nearCore(4));
+    ASSERT_EQ(2U, cores->size());
+    EXPECT_EQ(0, cores->get(0));
+    EXPECT_EQ(1, cores->get(1));
+
+    // And then any core.
+    cores = manager.getCores(TopologyAwareCoreManager::nearCore(3));
+    EXPECT_EQ(manager.getCores(DefaultCoreManager::DEFAULT), cores);
+    EXPECT_EQ(4U, cores->size());
+    EXPECT_TRUE(manager.getCores(TopologyAwareCoreManager::nearCore(8)) ==
+                NULL);
+}
+
+TEST(TopologyAwareCoreManagerTest, coreUnavailable_releaseOrder) {
+    TopologyAwareCoreManager manager(1, 8, false);
+    manager.setPreferredSocket(0);
+    int coreIds[] = {0, 2, 3, 1, 6, 4};
+    for (int coreId : coreIds)
+        manager.coreAvailable(coreId, testTopology[coreId]);
+
+    // Socket 1 goes first, starting with a core whose sibling is in use.
+    EXPECT_EQ(6, manager.coreUnavailable());
+    EXPECT_EQ(3, manager.coreUnavailable());
+    EXPECT_EQ(2, manager.coreUnavailable());
+    // Then socket 0, siblings first.
+    EXPECT_EQ(4, manager.coreUnavailable());
+    EXPECT_EQ(1, manager.coreUnavailable());
+    EXPECT_EQ(0, manager.coreUnavailable());
+    EXPECT_EQ(-1, manager.coreUnavailable());
+}
+
+TEST(TopologyAwareCoreManagerTest, getMigrationTargets_sameSocket) {
+    TopologyAwareCoreManager manager(1, 8, false);
+    for (int i = 0; i < 4; i++)
+        manager.coreAvailable(i, testTopology[i]);
+
+    EXPECT_EQ(3, manager.coreUnavailable());
+    CoreList* targets = manager.getMigrationTargets();
+    ASSERT_EQ(1U, targets->size());
+    EXPECT_EQ(2, targets->get(0));
+
+    EXPECT_EQ(2, manager.coreUnavailable());
+    targets = manager.getMigrationTargets();
+    ASSERT_EQ(2U, targets->size());
+    EXPECT_EQ(0, targets->get(0));
+    EXPECT_EQ(1, targets->get(1));
+}
+
+}  // namespace Arachne
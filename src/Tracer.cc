@@ -0,0 +1,601 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Tracer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include "Arachne.h"
+
+namespace Arachne {
+
+using PerfUtils::Cycles;
+
+std::atomic<bool> tracingEnabled(false);
+
+namespace {
+
+/// Number of events each ring holds; a power of two. Once a ring is full,
+/// each new event replaces the oldest one.
+const uint64_t TRACE_RING_EVENTS = 1 << 16;
+
+/// Number of rings: one per possible coreId, the last of which, at
+/// NO_TRACE_CORE, holds the events of threads that are not Arachne threads.
+const int NUM_TRACE_RINGS = NO_TRACE_CORE + 1;
+
+/**
+ * The most recent events recorded by one core. Only the core that owns a
+ * ring writes to it, so recording needs no atomic read-modify-write; readers
+ * copy the ring while it is being written and discard what may have been
+ * overwritten meanwhile.
+ */
+struct TraceRing {
+    /// Total number of events ever recorded; event i lives in slot
+    /// i % TRACE_RING_EVENTS.
+    std::atomic<uint64_t> head;
+
+    TraceEvent events[TRACE_RING_EVENTS];
+
+    TraceRing() : head(0) {}
+};
+
+/// Rings are allocated the first time their core records an event, and never
+/// freed, so that a trace can still be written after Arachne shuts down.
+std::atomic<TraceRing*> traceRings[NUM_TRACE_RINGS];
+
+/// Serializes recording into the ring at NO_TRACE_CORE, which any number of
+/// kernel threads may share.
+SpinLock externalTraceLock("externalTrace", false);
+
+/// The file written by the SIGABRT handler installed by dumpTraceOnAbort.
+char* abortTracePath = NULL;
+
+/// Size of the buffers that the trace JSON is formatted into before it is
+/// written out.
+const size_t TRACE_OUTPUT_BUFFER_SIZE = 1 << 16;
+
+/// Allocated by dumpTraceOnAbort, so that the SIGABRT handler neither
+/// allocates memory nor takes locks: the events of one ring at a time are
+/// copied to abortTraceEvents, and the JSON is formatted in abortTraceBuffer.
+TraceEvent* abortTraceEvents = NULL;
+char* abortTraceBuffer = NULL;
+
+/**
+ * Return the ring with the given index, allocating it if need be.
+ */
+TraceRing*
+getTraceRing(int index) {
+    TraceRing* ring = traceRings[index].load(std::memory_order_acquire);
+    if (likely(ring != NULL))
+        return ring;
+    TraceRing* newRing = new TraceRing;
+    if (traceRings[index].compare_exchange_strong(ring, newRing))
+        return newRing;
+    delete newRing;
+    return ring;
+}
+
+/**
+ * Copy the events of one ring to an array, oldest first, leaving out any
+ * that the ring's core may have overwritten while they were being copied.
+ * Safe to call from a signal handler.
+ *
+ * \param ring
+ *     The ring to copy.
+ * \param[out] events
+ *     Room for TRACE_RING_EVENTS events.
+ * \return
+ *     The number of events copied.
+ */
+size_t
+copyTraceRing(TraceRing* ring, TraceEvent* events) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+    size_t numEvents = 0;
+    for (uint64_t i = first; i < head; i++)
+        events[numEvents++] = ring->events[i & (TRACE_RING_EVENTS - 1)];
+
+    // The core may be writing the slot of event newHead as well.
+    uint64_t newHead = ring->head.load(std::memory_order_acquire);
+    if (newHead + 1 > first + TRACE_RING_EVENTS) {
+        size_t overwritten = static_cast<size_t>(
+            std::min(newHead + 1 - TRACE_RING_EVENTS - first, head - first));
+        numEvents -= overwritten;
+        memmove(events, events + overwritten, numEvents * sizeof(TraceEvent));
+    }
+    return numEvents;
+}
+
+/**
+ * Append the events of one ring to a vector; see the other copyTraceRing.
+ */
+void
+copyTraceRing(TraceRing* ring, std::vector<TraceEvent>* events) {
+    size_t start = events->size();
+    events->resize(start + TRACE_RING_EVENTS);
+    events->resize(start + copyTraceRing(ring, &(*events)[start]));
+}
+
+/// Names of the events of each TraceEventType, as shown in trace viewers.
+const char* const traceEventNames[] = {"switch",  "create",     "signal",
+                                       "block",   "exit",       "migrate",
+                                       "core up", "core down"};
+
+/**
+ * Writes the trace JSON, keeping track of the separators between events.
+ * The JSON is formatted in a buffer without allocating memory or taking
+ * locks, so that it can also be written from a signal handler.
+ */
+class TraceWriter {
+  public:
+    /**
+     * \param file
+     *     The stream to write to, or NULL to write to fd instead.
+     * \param fd
+     *     The file descriptor to write to if file is NULL.
+     * \param buffer
+     *     Holds the JSON until it is written out.
+     * \param bufferSize
+     *     The size of buffer in bytes.
+     * \param baseTimestamp
+     *     The time of the earliest event, in cycles.
+     */
+    TraceWriter(FILE* file, int fd, char* buffer, size_t bufferSize,
+                uint64_t baseTimestamp)
+        : file(file),
+          fd(fd),
+          buffer(buffer),
+          bufferSize(bufferSize),
+          length(0),
+          baseTimestamp(baseTimestamp),
+          first(true) {}
+
+    /// Start a new event.
+    void
+    next() {
+        put(first ? "\n" : ",\n");
+        first = false;
+    }
+
+    /// Append a character.
+    void
+    put(char c) {
+        if (length == bufferSize)
+            flush();
+        buffer[length++] = c;
+    }
+
+    /// Append a string.
+    void
+    put(const char* s) {
+        while (*s != '\0')
+            put(*s++);
+    }
+
+    /// Append a number in decimal.
+    void
+    putNumber(uint64_t value) {
+        char digits[20];
+        int numDigits = 0;
+        do {
+            digits[numDigits++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+        while (numDigits > 0)
+            put(digits[--numDigits]);
+    }
+
+    /// Append a duration in nanoseconds as microseconds, as "%.3f" would.
+    void
+    putMicros(uint64_t ns) {
+        putNumber(ns / 1000);
+        put('.');
+        put(static_cast<char>('0' + ns / 100 % 10));
+        put(static_cast<char>('0' + ns / 10 % 10));
+        put(static_cast<char>('0' + ns % 10));
+    }
+
+    /// Append the name of a thread, its context and generation, as
+    /// "%p/%u" would.
+    void
+    putThread(const ThreadContext* context, uint32_t generation) {
+        uint64_t address = reinterpret_cast<uint64_t>(context);
+        if (address == 0) {
+            put("(nil)");
+        } else {
+            put("0x");
+            int shift = 60;
+            while (shift > 0 && (address >> shift) == 0)
+                shift -= 4;
+            for (; shift >= 0; shift -= 4)
+                put("0123456789abcdef"[(address >> shift) & 0xf]);
+        }
+        put('/');
+        putNumber(generation);
+    }
+
+    /// Convert a timestamp to nanoseconds since the earliest event.
+    uint64_t
+    nanos(uint64_t timestamp) {
+        return timestamp > baseTimestamp
+                   ? Cycles::toNanoseconds(timestamp - baseTimestamp)
+                   : 0;
+    }
+
+    /// Write a slice of time during which a core ran a thread.
+    void
+    slice(int tid, const TraceEvent& start, uint64_t end) {
+        uint64_t startNs = nanos(start.timestamp);
+        uint64_t endNs = nanos(end);
+        next();
+        put("{\"ph\":\"X\",\"pid\":1,\"tid\":");
+        putNumber(static_cast<uint64_t>(tid));
+        put(",\"ts\":");
+        putMicros(startNs);
+        put(",\"dur\":");
+        putMicros(endNs > startNs ? endNs - startNs : 0);
+        put(",\"name\":\"");
+        putThread(start.context, start.generation);
+        put("\"}");
+    }
+
+    /// Write an event that happened at an instant.
+    void
+    instant(int tid, const TraceEvent& event) {
+        next();
+        put("{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":");
+        putNumber(static_cast<uint64_t>(tid));
+        put(",\"ts\":");
+        putMicros(nanos(event.timestamp));
+        put(",\"name\":\"");
+        put(traceEventNames[event.type]);
+        put("\",\"args\":{");
+        if (event.context != NULL) {
+            put("\"thread\":\"");
+            putThread(event.context, event.generation);
+            put("\",");
+        }
+        put(event.type == TRACE_CORE_INCREMENT ||
+                    event.type == TRACE_CORE_DECREMENT
+                ? "\"cores\":"
+                : "\"core\":");
+        putNumber(event.arg);
+        put("}}");
+    }
+
+    /// Write a change in the number of cores.
+    void
+    coreCount(const TraceEvent& event) {
+        next();
+        put("{\"ph\":\"C\",\"pid\":1,\"ts\":");
+        putMicros(nanos(event.timestamp));
+        put(",\"name\":\"cores\",\"args\":{\"active\":");
+        putNumber(event.arg);
+        put("}}");
+    }
+
+    /// Write out the contents of the buffer.
+    void
+    flush() {
+        if (file != NULL) {
+            fwrite(buffer, 1, length, file);
+        } else {
+            size_t written = 0;
+            while (written < length) {
+                ssize_t result = write(fd, buffer + written, length - written);
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result <= 0)
+                    break;
+                written += static_cast<size_t>(result);
+            }
+        }
+        length = 0;
+    }
+
+    FILE* file;
+    int fd;
+    char* buffer;
+    size_t bufferSize;
+    size_t length;
+    uint64_t baseTimestamp;
+    bool first;
+};
+
+/**
+ * Write the events of one ring, turning the spans between a thread starting
+ * to run and leaving its core into slices.
+ */
+void
+writeTraceRing(TraceWriter* writer, int tid, const TraceEvent* events,
+               size_t numEvents) {
+    writer->next();
+    writer->put("{\"ph\":\"M\",\"pid\":1,\"tid\":");
+    writer->putNumber(static_cast<uint64_t>(tid));
+    writer->put(",\"name\":\"thread_name\",\"args\":{\"name\":\"");
+    writer->put(tid == NO_TRACE_CORE ? "outside Arachne " : "core ");
+    writer->putNumber(static_cast<uint64_t>(tid));
+    writer->put("\"}}");
+    const TraceEvent* running = NULL;
+    for (size_t i = 0; i < numEvents; i++) {
+        const TraceEvent& event = events[i];
+        bool sameThread = running != NULL &&
+                          running->context == event.context &&
+                          running->generation == event.generation;
+        switch (event.type) {
+            case TRACE_SWITCH:
+                if (sameThread)
+                    break;
+                if (running != NULL)
+                    writer->slice(tid, *running, event.timestamp);
+                running = &event;
+                break;
+            case TRACE_BLOCK:
+            case TRACE_EXIT:
+                if (sameThread) {
+                    writer->slice(tid, *running, event.timestamp);
+                    running = NULL;
+                }
+                writer->instant(tid, event);
+                break;
+            case TRACE_CORE_INCREMENT:
+            case TRACE_CORE_DECREMENT:
+                if (running != NULL) {
+                    writer->slice(tid, *running, event.timestamp);
+                    running = NULL;
+                }
+                writer->coreCount(event);
+                writer->instant(tid, event);
+                break;
+            default:
+                writer->instant(tid, event);
+                break;
+        }
+    }
+    if (running != NULL)
+        writer->slice(tid, *running, events[numEvents - 1].timestamp);
+}
+
+/// Write what comes before the events of the rings.
+void
+writeTraceHeader(TraceWriter* writer) {
+    writer->put("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    writer->next();
+    writer->put(
+        "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\","
+        "\"args\":{\"name\":\"Arachne\"}}");
+}
+
+/**
+ * Write the trace to a file descriptor from the SIGABRT handler, using the
+ * memory allocated by dumpTraceOnAbort. Each ring is copied twice, first to
+ * find the earliest event; tracing has stopped by then, so the copies agree
+ * except for events that were being recorded meanwhile.
+ */
+void
+writeTraceOnAbort(int fd) {
+    uint64_t baseTimestamp = ~0UL;
+    for (int i = 0; i < NUM_TRACE_RINGS; i++) {
+        TraceRing* ring = traceRings[i].load(std::memory_order_acquire);
+        if (ring != NULL && copyTraceRing(ring, abortTraceEvents) != 0)
+            baseTimestamp =
+                std::min(baseTimestamp, abortTraceEvents[0].timestamp);
+    }
+
+    TraceWriter writer(NULL, fd, abortTraceBuffer, TRACE_OUTPUT_BUFFER_SIZE,
+                       baseTimestamp);
+    writeTraceHeader(&writer);
+    for (int i = 0; i < NUM_TRACE_RINGS; i++) {
+        TraceRing* ring = traceRings[i].load(std::memory_order_acquire);
+        if (ring == NULL)
+            continue;
+        size_t numEvents = copyTraceRing(ring, abortTraceEvents);
+        if (numEvents != 0)
+            writeTraceRing(&writer, i, abortTraceEvents, numEvents);
+    }
+    writer.put("\n]}\n");
+    writer.flush();
+}
+
+/**
+ * Write the trace to abortTracePath when the process aborts. Only calls that
+ * are safe in a signal handler are made.
+ */
+void
+abortHandler(int signum) {
+    tracingEnabled = false;
+    int fd = open(abortTracePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        writeTraceOnAbort(fd);
+        close(fd);
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(signum, &action, NULL);
+    raise(signum);
+}
+
+}  // namespace
+
+/**
+ * Append an event to the trace ring of the calling core; called through
+ * traceEvent.
+ */
+void
+recordTraceEvent(TraceEventType type, ThreadContext* context,
+                 uint32_t generation, uint32_t arg) {
+    TraceEvent event;
+    event.timestamp = Cycles::rdtsc();
+    event.context = context;
+    event.generation = generation;
+    event.type = type;
+    event.arg = static_cast<uint16_t>(arg);
+    int coreId = core.kernelThreadId;
+    if (coreId < 0 || coreId >= NO_TRACE_CORE) {
+        event.coreId = NO_TRACE_CORE;
+        TraceRing* ring = getTraceRing(NO_TRACE_CORE);
+        std::lock_guard<SpinLock> guard(externalTraceLock);
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        ring->events[head & (TRACE_RING_EVENTS - 1)] = event;
+        ring->head.store(head + 1, std::memory_order_release);
+        return;
+    }
+    event.coreId = static_cast<uint8_t>(coreId);
+    TraceRing* ring = getTraceRing(coreId);
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    ring->events[head & (TRACE_RING_EVENTS - 1)] = event;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+/**
+ * Begin recording context switches, thread creations, signals, blocks and
+ * exits, migrations and changes in the number of cores, discarding the events
+ * of any earlier trace. Each core keeps its most recent events in a ring of
+ * its own, which is allocated the first time it records one.
+ *
+ * \ingroup api
+ */
+void
+startTracing() {
+    for (int i = 0; i < NUM_TRACE_RINGS; i++) {
+        TraceRing* ring = traceRings[i].load(std::memory_order_acquire);
+        if (ring != NULL)
+            ring->head.store(0);
+    }
+    tracingEnabled = true;
+}
+
+/**
+ * Stop recording scheduler events; those already recorded are kept until
+ * the next call to startTracing.
+ *
+ * \ingroup api
+ */
+void
+stopTracing() {
+    tracingEnabled = false;
+}
+
+/**
+ * Copy the recorded events of every ring into a vector, in order of time.
+ * Tracing may continue meanwhile.
+ *
+ * \param[out] events
+ *     Filled in with the events.
+ */
+void
+collectTraceEvents(std::vector<TraceEvent>* events) {
+    events->clear();
+    for (int i = 0; i < NUM_TRACE_RINGS; i++) {
+        TraceRing* ring = traceRings[i].load(std::memory_order_acquire);
+        if (ring != NULL)
+            copyTraceRing(ring, events);
+    }
+    std::stable_sort(events->begin(), events->end(),
+                     [](const TraceEvent& a, const TraceEvent& b) {
+                         return a.timestamp < b.timestamp;
+                     });
+}
+
+/**
+ * Write the recorded events in the JSON format of the Chrome trace viewer,
+ * which Perfetto (ui.perfetto.dev) also reads. Each core is shown as a track
+ * with one slice per stretch of time that a thread ran on it; the other events
+ * are instants on the track of the core that recorded them, and the number of
+ * cores is a counter. Threads are named by their context and generation.
+ * Tracing may continue meanwhile.
+ *
+ * \param output
+ *     The stream to write to.
+ */
+void
+writeTrace(FILE* output) {
+    std::vector<std::vector<TraceEvent>> ringEvents(NUM_TRACE_RINGS);
+    uint64_t baseTimestamp = ~0UL;
+    for (int i = 0; i < NUM_TRACE_RINGS; i++) {
+        TraceRing* ring = traceRings[i].load(std::memory_order_acquire);
+        if (ring == NULL)
+            continue;
+        copyTraceRing(ring, &ringEvents[i]);
+        if (!ringEvents[i].empty())
+            baseTimestamp =
+                std::min(baseTimestamp, ringEvents[i].front().timestamp);
+    }
+
+    std::vector<char> buffer(TRACE_OUTPUT_BUFFER_SIZE);
+    TraceWriter writer(output, -1, &buffer[0], buffer.size(), baseTimestamp);
+    writeTraceHeader(&writer);
+    for (int i = 0; i < NUM_TRACE_RINGS; i++) {
+        if (!ringEvents[i].empty())
+            writeTraceRing(&writer, i, &ringEvents[i][0],
+                           ringEvents[i].size());
+    }
+    writer.put("\n]}\n");
+    writer.flush();
+}
+
+/**
+ * Write the recorded events to a file; see writeTrace.
+ *
+ * \param path
+ *     The file to write, which is replaced if it exists.
+ * \return
+ *     False if the file could not be written.
+ *
+ * \ingroup api
+ */
+bool
+dumpTrace(const char* path) {
+    FILE* output = fopen(path, "w");
+    if (output == NULL) {
+        ARACHNE_LOG(WARNING, "Cannot write trace to %s: %s\n", path,
+                    strerror(errno));
+        return false;
+    }
+    writeTrace(output);
+    return fclose(output) == 0;
+}
+
+/**
+ * Arrange for the recorded events to be written to a file if the process
+ * aborts, as it does after Arachne reports a fatal error. The memory that the
+ * signal handler needs is allocated here.
+ *
+ * \param path
+ *     The file to write.
+ */
+void
+dumpTraceOnAbort(const char* path) {
+    free(abortTracePath);
+    abortTracePath = strdup(path);
+    if (abortTraceEvents == NULL)
+        abortTraceEvents = new TraceEvent[TRACE_RING_EVENTS];
+    if (abortTraceBuffer == NULL)
+        abortTraceBuffer = new char[TRACE_OUTPUT_BUFFER_SIZE];
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = abortHandler;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGABRT, &action, NULL);
+}
+
+}  // namespace Arachne